@@ -0,0 +1,610 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <errno.h>
+#include <fcntl.h>
+
+// DNS resolution latency benchmark
+//
+// Runs lookups from a configurable number of threads and reports wall-clock
+// latency percentiles and throughput per concurrency level. With --compare
+// the same run is repeated without and with LD_PRELOAD=dns_override.so.
+// --startup instead times how long a command (default /bin/true) takes to
+// start and exit, without and with the library preloaded.
+
+#define MAX_LEVELS 16
+#define MAX_HOSTS 64
+
+#define API_GETADDRINFO 0
+#define API_GETHOSTBYNAME 1
+#define API_GETHOSTBYNAME_R 2
+
+static const char *api_names[] = { "getaddrinfo", "gethostbyname", "gethostbyname_r" };
+
+struct bench_options {
+    int api;
+    int iterations;          // Lookups per thread and level
+    int warmup;              // Untimed lookups per thread before each level
+    int levels[MAX_LEVELS];  // Concurrency levels (threads)
+    int level_count;
+    const char *hosts[MAX_HOSTS];
+    int host_count;
+    int json;
+    const char *output;      // JSON output file (NULL = stdout)
+    int compare;
+    const char *library;     // Library preloaded by --compare
+    int summary;             // Internal: one machine-readable line per level
+    int startup;             // Time spawning the command in hosts[] instead
+};
+
+// Results for one concurrency level
+struct level_result {
+    int threads;
+    long ops;
+    long errors;
+    double wall_s;
+    double min_us, mean_us, p50_us, p90_us, p99_us, p999_us, max_us;
+    double qps;
+};
+
+struct worker {
+    pthread_t thread;
+    const struct bench_options *opts;
+    int id;
+    pthread_barrier_t *start;
+    double *latencies_us;
+    long count;
+    long errors;
+    double begin_us, end_us; // When this thread's timed lookups started and finished
+};
+
+static struct bench_options opts;
+
+static double now_us() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+// Run one lookup; returns 0 on success
+static int do_lookup(int api, const char *host) {
+    if (api == API_GETADDRINFO) {
+        struct addrinfo hints, *result;
+        memset(&hints, 0, sizeof(hints));
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        int status = getaddrinfo(host, NULL, &hints, &result);
+        if (status == 0) freeaddrinfo(result);
+        return status;
+    }
+
+    if (api == API_GETHOSTBYNAME) {
+        return gethostbyname(host) ? 0 : -1;
+    }
+
+    struct hostent entry, *result = NULL;
+    char buf[8192];
+    int err = 0;
+    int status = gethostbyname_r(host, &entry, buf, sizeof(buf), &result, &err);
+    return (status == 0 && result) ? 0 : -1;
+}
+
+static void *worker_main(void *arg) {
+    struct worker *w = arg;
+    const struct bench_options *o = w->opts;
+    int host = w->id % o->host_count;
+
+    for (int i = 0; i < o->warmup; i++) {
+        do_lookup(o->api, o->hosts[host]);
+        host = (host + 1) % o->host_count;
+    }
+
+    pthread_barrier_wait(w->start);
+
+    w->begin_us = now_us();
+    for (int i = 0; i < o->iterations; i++) {
+        double start = now_us();
+        int status = do_lookup(o->api, o->hosts[host]);
+        double end = now_us();
+
+        w->latencies_us[w->count++] = end - start;
+        if (status != 0) w->errors++;
+        host = (host + 1) % o->host_count;
+    }
+    w->end_us = now_us();
+
+    return NULL;
+}
+
+static int compare_doubles(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+// Nearest-rank percentile over sorted samples
+static double percentile(const double *sorted, long n, double p) {
+    if (n == 0) return 0;
+    long rank = (long)(p / 100.0 * n + 0.999999);
+    if (rank < 1) rank = 1;
+    if (rank > n) rank = n;
+    return sorted[rank - 1];
+}
+
+// Fill in the latency statistics of res from its ops samples (sorted here)
+static void summarize_samples(struct level_result *res, double *all) {
+    double sum = 0;
+    for (long i = 0; i < res->ops; i++) sum += all[i];
+    qsort(all, res->ops, sizeof(double), compare_doubles);
+
+    if (res->ops > 0) {
+        res->min_us = all[0];
+        res->max_us = all[res->ops - 1];
+        res->mean_us = sum / res->ops;
+    }
+    res->p50_us = percentile(all, res->ops, 50);
+    res->p90_us = percentile(all, res->ops, 90);
+    res->p99_us = percentile(all, res->ops, 99);
+    res->p999_us = percentile(all, res->ops, 99.9);
+    res->qps = res->wall_s > 0 ? res->ops / res->wall_s : 0;
+}
+
+static int run_level(int threads, struct level_result *res) {
+    struct worker *workers = calloc(threads, sizeof(*workers));
+    double *all = malloc(sizeof(double) * threads * opts.iterations);
+    pthread_barrier_t start;
+
+    if (!workers || !all) {
+        fprintf(stderr, "Out of memory\n");
+        free(workers);
+        free(all);
+        return -1;
+    }
+
+    pthread_barrier_init(&start, NULL, threads + 1);
+    for (int t = 0; t < threads; t++) {
+        workers[t].opts = &opts;
+        workers[t].id = t;
+        workers[t].start = &start;
+        workers[t].latencies_us = all + (long)t * opts.iterations;
+        if (pthread_create(&workers[t].thread, NULL, worker_main, &workers[t]) != 0) {
+            fprintf(stderr, "pthread_create failed: %s\n", strerror(errno));
+            exit(1);
+        }
+    }
+
+    pthread_barrier_wait(&start);
+    for (int t = 0; t < threads; t++) {
+        pthread_join(workers[t].thread, NULL);
+    }
+    pthread_barrier_destroy(&start);
+
+    // Wall time spans the first thread starting to the last one finishing
+    double begin = workers[0].begin_us, end = workers[0].end_us;
+    for (int t = 1; t < threads; t++) {
+        if (workers[t].begin_us < begin) begin = workers[t].begin_us;
+        if (workers[t].end_us > end) end = workers[t].end_us;
+    }
+
+    memset(res, 0, sizeof(*res));
+    res->threads = threads;
+    for (int t = 0; t < threads; t++) {
+        res->ops += workers[t].count;
+        res->errors += workers[t].errors;
+    }
+    res->wall_s = (end - begin) / 1e6;
+    summarize_samples(res, all);
+
+    free(workers);
+    free(all);
+    return 0;
+}
+
+static void print_table_header() {
+    printf("%8s %9s %7s %10s %10s %10s %10s %10s %10s %11s\n",
+           "threads", "ops", "errors", "min(ms)", "p50(ms)", "p90(ms)",
+           "p99(ms)", "p99.9(ms)", "max(ms)", "qps");
+}
+
+static void print_table_row(const struct level_result *r) {
+    printf("%8d %9ld %7ld %10.4f %10.4f %10.4f %10.4f %10.4f %10.4f %11.1f\n",
+           r->threads, r->ops, r->errors, r->min_us / 1e3, r->p50_us / 1e3, r->p90_us / 1e3,
+           r->p99_us / 1e3, r->p999_us / 1e3, r->max_us / 1e3, r->qps);
+}
+
+static void print_json_levels(FILE *out, const struct level_result *results, int count, const char *indent) {
+    fprintf(out, "[\n");
+    for (int i = 0; i < count; i++) {
+        const struct level_result *r = &results[i];
+        fprintf(out, "%s  {\"threads\": %d, \"ops\": %ld, \"errors\": %ld, \"wall_s\": %.6f, "
+                "\"qps\": %.1f, \"latency_us\": {\"min\": %.3f, \"mean\": %.3f, \"p50\": %.3f, "
+                "\"p90\": %.3f, \"p99\": %.3f, \"p99_9\": %.3f, \"max\": %.3f}}%s\n",
+                indent, r->threads, r->ops, r->errors, r->wall_s, r->qps, r->min_us, r->mean_us,
+                r->p50_us, r->p90_us, r->p99_us, r->p999_us, r->max_us, i + 1 < count ? "," : "");
+    }
+    fprintf(out, "%s]", indent);
+}
+
+static void print_json_header(FILE *out) {
+    fprintf(out, "{\n  \"api\": \"%s\",\n  \"iterations\": %d,\n  \"warmup\": %d,\n  \"hosts\": [",
+            api_names[opts.api], opts.iterations, opts.warmup);
+    for (int i = 0; i < opts.host_count; i++) {
+        fprintf(out, "%s\"%s\"", i ? ", " : "", opts.hosts[i]);
+    }
+    fprintf(out, "],\n  \"timestamp\": %ld,\n", (long)time(NULL));
+}
+
+static FILE *open_output() {
+    if (!opts.output) return stdout;
+    FILE *out = fopen(opts.output, "w");
+    if (!out) {
+        fprintf(stderr, "Cannot write %s: %s\n", opts.output, strerror(errno));
+        exit(1);
+    }
+    return out;
+}
+
+// Build the argument list for a --compare child run
+static char **child_args(char *argv0) {
+    static char *args[64];
+    static char buf[8][32];
+    static char levels[256];
+    int n = 0;
+
+    args[n++] = argv0;
+    args[n++] = "--summary";
+    args[n++] = "-a";
+    args[n++] = (char *)api_names[opts.api];
+    snprintf(buf[0], sizeof(buf[0]), "%d", opts.iterations);
+    args[n++] = "-n";
+    args[n++] = buf[0];
+    snprintf(buf[1], sizeof(buf[1]), "%d", opts.warmup);
+    args[n++] = "-w";
+    args[n++] = buf[1];
+
+    levels[0] = '\0';
+    for (int i = 0; i < opts.level_count; i++) {
+        size_t len = strlen(levels);
+        snprintf(levels + len, sizeof(levels) - len, "%s%d", i ? "," : "", opts.levels[i]);
+    }
+    args[n++] = "-c";
+    args[n++] = levels;
+    for (int i = 0; i < opts.host_count && n < 62; i++) {
+        args[n++] = (char *)opts.hosts[i];
+    }
+    args[n] = NULL;
+    return args;
+}
+
+// Run this benchmark in a child process, with or without the library
+// preloaded, and collect its per-level results
+static int run_child(char *argv0, const char *preload, struct level_result *results) {
+    int fds[2];
+    if (pipe(fds) < 0) return -1;
+
+    pid_t pid = fork();
+    if (pid < 0) return -1;
+    if (pid == 0) {
+        dup2(fds[1], STDOUT_FILENO);
+        close(fds[0]);
+        close(fds[1]);
+        if (preload) {
+            setenv("LD_PRELOAD", preload, 1);
+        } else {
+            unsetenv("LD_PRELOAD");
+        }
+        execv("/proc/self/exe", child_args(argv0));
+        _exit(127);
+    }
+
+    close(fds[1]);
+    FILE *in = fdopen(fds[0], "r");
+    char line[512];
+    int count = 0;
+    while (in && fgets(line, sizeof(line), in)) {
+        struct level_result *r = &results[count];
+        if (count < MAX_LEVELS &&
+            sscanf(line, "RESULT %d %ld %ld %lf %lf %lf %lf %lf %lf %lf %lf %lf",
+                   &r->threads, &r->ops, &r->errors, &r->wall_s, &r->qps, &r->min_us, &r->mean_us,
+                   &r->p50_us, &r->p90_us, &r->p99_us, &r->p999_us, &r->max_us) == 12) {
+            count++;
+        }
+    }
+    if (in) fclose(in);
+
+    int status;
+    waitpid(pid, &status, 0);
+    return (WIFEXITED(status) && WEXITSTATUS(status) == 0) ? count : -1;
+}
+
+static int run_compare(char *argv0) {
+    struct level_result base[MAX_LEVELS], preloaded[MAX_LEVELS];
+    char library[4096];
+
+    if (!realpath(opts.library, library)) {
+        fprintf(stderr, "Cannot find %s: %s\n", opts.library, strerror(errno));
+        return 1;
+    }
+
+    int base_count = run_child(argv0, NULL, base);
+    int pre_count = run_child(argv0, library, preloaded);
+    if (base_count <= 0 || pre_count != base_count) {
+        fprintf(stderr, "Benchmark run failed\n");
+        return 1;
+    }
+
+    if (opts.json) {
+        FILE *out = open_output();
+        print_json_header(out);
+        fprintf(out, "  \"library\": \"%s\",\n  \"baseline\": ", library);
+        print_json_levels(out, base, base_count, "  ");
+        fprintf(out, ",\n  \"preloaded\": ");
+        print_json_levels(out, preloaded, pre_count, "  ");
+        fprintf(out, "\n}\n");
+        if (out != stdout) fclose(out);
+        return 0;
+    }
+
+    printf("DNS Benchmark: %s, %d lookups per thread\n\n", api_names[opts.api], opts.iterations);
+    printf("Without LD_PRELOAD (system resolver):\n");
+    print_table_header();
+    for (int i = 0; i < base_count; i++) print_table_row(&base[i]);
+    printf("\nWith LD_PRELOAD=%s:\n", library);
+    print_table_header();
+    for (int i = 0; i < pre_count; i++) print_table_row(&preloaded[i]);
+
+    printf("\nPreloaded vs. baseline:\n");
+    printf("%8s %12s %12s %12s\n", "threads", "p50 ratio", "p99 ratio", "qps ratio");
+    for (int i = 0; i < base_count; i++) {
+        printf("%8d %11.2fx %11.2fx %11.2fx\n", base[i].threads,
+               base[i].p50_us > 0 ? preloaded[i].p50_us / base[i].p50_us : 0,
+               base[i].p99_us > 0 ? preloaded[i].p99_us / base[i].p99_us : 0,
+               base[i].qps > 0 ? preloaded[i].qps / base[i].qps : 0);
+    }
+    return 0;
+}
+
+// Spawn the command in opts.hosts (fork, exec, exit, reap) warmup plus
+// iterations times, with preload as LD_PRELOAD (NULL = none), and record
+// each run's wall time. The command's output is discarded.
+static int run_startup(const char *preload, struct level_result *res) {
+    double *all = malloc(sizeof(double) * opts.iterations);
+    if (!all) {
+        fprintf(stderr, "Out of memory\n");
+        return -1;
+    }
+    char *args[MAX_HOSTS + 1];
+    for (int i = 0; i < opts.host_count; i++) args[i] = (char *)opts.hosts[i];
+    args[opts.host_count] = NULL;
+
+    memset(res, 0, sizeof(*res));
+    res->threads = 1;
+    double begin = 0;
+    for (int i = -opts.warmup; i < opts.iterations; i++) {
+        if (i == 0) begin = now_us();
+        double start = now_us();
+        pid_t pid = fork();
+        if (pid < 0) {
+            fprintf(stderr, "fork failed: %s\n", strerror(errno));
+            free(all);
+            return -1;
+        }
+        if (pid == 0) {
+            int null = open("/dev/null", O_WRONLY);
+            if (null >= 0) {
+                dup2(null, STDOUT_FILENO);
+                dup2(null, STDERR_FILENO);
+            }
+            if (preload) {
+                setenv("LD_PRELOAD", preload, 1);
+            } else {
+                unsetenv("LD_PRELOAD");
+            }
+            execv(args[0], args);
+            _exit(127);
+        }
+        int status;
+        waitpid(pid, &status, 0);
+        double end = now_us();
+        if (i < 0) continue;
+
+        all[res->ops++] = end - start;
+        if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) res->errors++;
+    }
+    res->wall_s = (now_us() - begin) / 1e6;
+    summarize_samples(res, all);
+    free(all);
+    return 0;
+}
+
+static int run_startup_compare() {
+    struct level_result base, preloaded;
+    char library[4096];
+
+    if (!realpath(opts.library, library)) {
+        fprintf(stderr, "Cannot find %s: %s\n", opts.library, strerror(errno));
+        return 1;
+    }
+    if (run_startup(NULL, &base) < 0 || run_startup(library, &preloaded) < 0) {
+        return 1;
+    }
+
+    if (opts.json) {
+        FILE *out = open_output();
+        fprintf(out, "{\n  \"command\": \"%s\",\n  \"iterations\": %d,\n  \"warmup\": %d,\n"
+                "  \"timestamp\": %ld,\n  \"library\": \"%s\",\n  \"baseline\": ",
+                opts.hosts[0], opts.iterations, opts.warmup, (long)time(NULL), library);
+        print_json_levels(out, &base, 1, "  ");
+        fprintf(out, ",\n  \"preloaded\": ");
+        print_json_levels(out, &preloaded, 1, "  ");
+        fprintf(out, "\n}\n");
+        if (out != stdout) fclose(out);
+        return 0;
+    }
+
+    printf("Startup Benchmark: %s, %d runs (qps = runs per second)\n\n", opts.hosts[0], opts.iterations);
+    print_table_header();
+    printf("Without LD_PRELOAD:\n");
+    print_table_row(&base);
+    printf("With LD_PRELOAD=%s:\n", library);
+    print_table_row(&preloaded);
+    printf("\nPreload cost per run: p50 %+.4f ms, mean %+.4f ms\n",
+           (preloaded.p50_us - base.p50_us) / 1e3, (preloaded.mean_us - base.mean_us) / 1e3);
+    return 0;
+}
+
+static void usage(const char *prog) {
+    printf("Usage: %s [options] [hostname...]\n", prog);
+    printf("\n");
+    printf("Options:\n");
+    printf("  -a, --api API          getaddrinfo (default), gethostbyname or gethostbyname_r\n");
+    printf("  -n, --iterations N     Lookups per thread at each level (default: 200)\n");
+    printf("  -w, --warmup N         Untimed lookups per thread before each level (default: 5)\n");
+    printf("  -c, --concurrency LIST Comma-separated thread counts (default: 1,4,16)\n");
+    printf("  -j, --json             Emit JSON instead of a table\n");
+    printf("  -o, --output FILE      Write JSON to FILE (implies --json)\n");
+    printf("      --compare          Run without and with LD_PRELOAD and compare\n");
+    printf("  -l, --library PATH     Library preloaded by --compare (default: ./dns_override.so)\n");
+    printf("      --startup          Time starting COMMAND [ARG...] (default: /bin/true)\n");
+    printf("                         without and with LD_PRELOAD instead of lookups\n");
+    printf("  -h, --help             Show this help\n");
+    printf("\n");
+    printf("Hostnames are used round-robin (default: google.com github.com cloudflare.com).\n");
+    printf("Latencies are wall-clock time measured with CLOCK_MONOTONIC.\n");
+}
+
+static void parse_levels(const char *list) {
+    char copy[256];
+    snprintf(copy, sizeof(copy), "%s", list);
+    opts.level_count = 0;
+    char *saveptr = NULL;
+    for (char *tok = strtok_r(copy, ",", &saveptr); tok && opts.level_count < MAX_LEVELS;
+         tok = strtok_r(NULL, ",", &saveptr)) {
+        int threads = atoi(tok);
+        if (threads > 0) opts.levels[opts.level_count++] = threads;
+    }
+}
+
+int main(int argc, char *argv[]) {
+    opts.api = API_GETADDRINFO;
+    opts.iterations = 200;
+    opts.warmup = 5;
+    opts.library = "./dns_override.so";
+    parse_levels("1,4,16");
+
+    for (int i = 1; i < argc; i++) {
+        const char *arg = argv[i];
+        const char *next = (i + 1 < argc) ? argv[i + 1] : NULL;
+
+        // Everything after the --startup command belongs to it
+        if (opts.startup && opts.host_count > 0) {
+            if (opts.host_count < MAX_HOSTS) opts.hosts[opts.host_count++] = arg;
+            continue;
+        }
+        if ((!strcmp(arg, "-a") || !strcmp(arg, "--api")) && next) {
+            opts.api = -1;
+            for (int a = 0; a < 3; a++) {
+                if (!strcmp(next, api_names[a])) opts.api = a;
+            }
+            if (opts.api < 0) {
+                fprintf(stderr, "Unknown API: %s\n", next);
+                return 1;
+            }
+            i++;
+        } else if ((!strcmp(arg, "-n") || !strcmp(arg, "--iterations")) && next) {
+            opts.iterations = atoi(next);
+            i++;
+        } else if ((!strcmp(arg, "-w") || !strcmp(arg, "--warmup")) && next) {
+            opts.warmup = atoi(next);
+            i++;
+        } else if ((!strcmp(arg, "-c") || !strcmp(arg, "--concurrency")) && next) {
+            parse_levels(next);
+            i++;
+        } else if (!strcmp(arg, "-j") || !strcmp(arg, "--json")) {
+            opts.json = 1;
+        } else if ((!strcmp(arg, "-o") || !strcmp(arg, "--output")) && next) {
+            opts.output = next;
+            opts.json = 1;
+            i++;
+        } else if (!strcmp(arg, "--compare")) {
+            opts.compare = 1;
+        } else if ((!strcmp(arg, "-l") || !strcmp(arg, "--library")) && next) {
+            opts.library = next;
+            i++;
+        } else if (!strcmp(arg, "--startup")) {
+            opts.startup = 1;
+        } else if (!strcmp(arg, "--summary")) {
+            opts.summary = 1;
+        } else if (!strcmp(arg, "-h") || !strcmp(arg, "--help")) {
+            usage(argv[0]);
+            return 0;
+        } else if (arg[0] == '-') {
+            fprintf(stderr, "Unknown option: %s\n", arg);
+            usage(argv[0]);
+            return 1;
+        } else if (opts.host_count < MAX_HOSTS) {
+            opts.hosts[opts.host_count++] = arg;
+        }
+    }
+
+    if (opts.startup) {
+        if (opts.host_count == 0) opts.hosts[opts.host_count++] = "/bin/true";
+        if (opts.iterations < 1) {
+            fprintf(stderr, "Need at least one iteration\n");
+            return 1;
+        }
+        return run_startup_compare();
+    }
+    if (opts.host_count == 0) {
+        opts.hosts[opts.host_count++] = "google.com";
+        opts.hosts[opts.host_count++] = "github.com";
+        opts.hosts[opts.host_count++] = "cloudflare.com";
+    }
+    if (opts.iterations < 1 || opts.level_count == 0) {
+        fprintf(stderr, "Need at least one iteration and one concurrency level\n");
+        return 1;
+    }
+
+    if (opts.compare) {
+        return run_compare(argv[0]);
+    }
+
+    struct level_result results[MAX_LEVELS];
+    if (!opts.json && !opts.summary) {
+        printf("DNS Benchmark: %s, %d lookups per thread\n\n", api_names[opts.api], opts.iterations);
+        print_table_header();
+    }
+    for (int i = 0; i < opts.level_count; i++) {
+        if (run_level(opts.levels[i], &results[i]) < 0) return 1;
+        if (opts.summary) {
+            const struct level_result *r = &results[i];
+            printf("RESULT %d %ld %ld %.9f %.1f %.3f %.3f %.3f %.3f %.3f %.3f %.3f\n",
+                   r->threads, r->ops, r->errors, r->wall_s, r->qps, r->min_us, r->mean_us,
+                   r->p50_us, r->p90_us, r->p99_us, r->p999_us, r->max_us);
+            fflush(stdout);
+        } else if (!opts.json) {
+            print_table_row(&results[i]);
+            fflush(stdout);
+        }
+    }
+
+    if (opts.json) {
+        FILE *out = open_output();
+        print_json_header(out);
+        const char *preload = getenv("LD_PRELOAD");
+        fprintf(out, "  \"preloaded\": %s,\n  \"results\": ", (preload && *preload) ? "true" : "false");
+        print_json_levels(out, results, opts.level_count, "  ");
+        fprintf(out, "\n}\n");
+        if (out != stdout) fclose(out);
+    }
+
+    return 0;
+}
@@ -18,6 +18,7 @@ show_usage() {
     echo "  set-timeout <ms>        Set query timeout in milliseconds"
     echo "  set-tcp <true|false>    Enable/disable TCP mode"
     echo "  set-debug <true|false>  Enable/disable debug output"
+    echo "  set <key> <value>       Set any configuration key (e.g., cache_size 1024)"
     echo "  enable-dns64            Enable DNS64 synthesis"
     echo "  disable-dns64           Disable DNS64 synthesis"
     echo "  set-dns64-prefix <prefix> Set DNS64 prefix (e.g., 64:ff9b::)"
@@ -30,6 +31,7 @@ show_usage() {
     echo "  load                    Load example configuration"
     echo "  edit                    Edit configuration file"
     echo "  status                  Show configuration status"
+    echo "  stats [pid...]          Show runtime statistics of preloaded processes"
     echo "  test                    Test DNS resolution"
     echo "  test-dns64              Test DNS64 synthesis"
     echo "  test-ipv4-only          Test IPv4-only domain handling"
@@ -47,6 +49,7 @@ show_usage() {
     echo "  $0 add-server 1.1.1.1:53"
     echo "  $0 preset cloudflare"
     echo "  $0 set-timeout 3000"
+    echo "  $0 set cache_size 1024"
     echo "  $0 enable-dns64"
     echo "  $0 set-dns64-prefix 2001:db8:64::"
     echo "  $0 enable-aaaa-filter"
@@ -83,6 +86,12 @@ add_server() {
     
     # Improved validation for IPv4 and IPv6 addresses
     local is_valid=0
+    local spec="$server"
+    
+    # tls:// and https:// servers: validate the address part
+    if [[ "$server" =~ ^(tls|https)://([^/#]+)(/[^#]*)?(#.+)?$ ]]; then
+        server="${BASH_REMATCH[2]}"
+    fi
     
     # Check for IPv6 with brackets: [address]:port
     if [[ "$server" =~ ^\[([0-9a-fA-F:]+)\](:([0-9]+))?$ ]]; then
@@ -104,12 +113,14 @@ add_server() {
         echo "Supported formats:"
         echo "  IPv4: 8.8.8.8 or 8.8.8.8:53"
         echo "  IPv6: 2001:4860:4860::8888 or [2001:4860:4860::8844]:53"
+        echo "  TLS:  tls://1.1.1.1#cloudflare-dns.com"
+        echo "  DoH:  https://8.8.8.8/dns-query#dns.google"
         exit 1
     fi
     
     # Add server to config
-    echo "dns_server $server" >> "$CONFIG_FILE"
-    echo "Added DNS server: $server"
+    echo "dns_server $spec" >> "$CONFIG_FILE"
+    echo "Added DNS server: $spec"
 }
 
 remove_server() {
@@ -149,7 +160,7 @@ list_servers() {
     echo ""
     echo "Other settings:"
     echo "=============="
-    grep -E "^(timeout|use_tcp|debug|enable_dns64|dns64_prefix|filter_aaaa|filter_a) " "$CONFIG_FILE" | while read -r line; do
+    grep -E "^(timeout|attempt_timeout_ms|total_timeout_ms|retries|use_tcp|tcp_idle_timeout_ms|edns_udp_size|debug|enable_dns64|dns64_prefix|filter_aaaa|filter_a|result_order|resolver|query_strategy|query_stagger_ms|query_parallelism|cache_size|cache_max_bytes|cache_min_ttl|cache_max_ttl|negative_ttl|serve_stale|prefetch_threshold|shared_cache|shared_cache_slots|cache_snapshot|cache_snapshot_interval|stats_signal|stats_dir|reload_interval|reload_on_sighup|log_level|log_sample|log_name|log_file|host|hosts_file|route) " "$CONFIG_FILE" | while read -r line; do
         echo "  $line"
     done
 }
@@ -195,9 +206,10 @@ set_dns64_prefix() {
     fi
     
     # Basic validation - check if it looks like an IPv6 prefix
-    if [[ ! "$prefix" =~ ^[0-9a-fA-F:]+::?$ ]]; then
+    if [[ ! "$prefix" =~ ^[0-9a-fA-F:]+:(/(32|40|48|56|64|96))?$ ]]; then
         echo "Error: Invalid IPv6 prefix format"
-        echo "Examples: 64:ff9b::, 2001:db8:64::, fd00:64::"
+        echo "Examples: 64:ff9b::, 2001:db8:64::, 2001:db8:122:344::/64"
+        echo "Prefix lengths (RFC 6052): 32, 40, 48, 56, 64, 96 (default 96)"
         exit 1
     fi
     
@@ -546,6 +558,56 @@ show_status() {
     fi
 }
 
+# Ask running processes for their statistics (needs stats_signal in the config)
+show_stats() {
+    local signal=$(grep "^stats_signal " "$CONFIG_FILE" 2>/dev/null | tail -1 | awk '{print $2}')
+    local dir=$(grep "^stats_dir " "$CONFIG_FILE" 2>/dev/null | tail -1 | awk '{print $2}')
+    dir="${dir:-/tmp}"
+    signal="${signal#SIG}"
+    signal="${signal^^}"
+    
+    if [[ -z "$signal" || "$signal" == "NONE" ]]; then
+        echo "Statistics export is off. Enable it with:"
+        echo "  $0 set stats_signal usr2"
+        echo "Running processes pick the change up on their next lookup."
+        return 1
+    fi
+    
+    local pids=("$@")
+    if [[ ${#pids[@]} -eq 0 ]]; then
+        # Processes that have the library mapped and installed the handler
+        # (it writes the file when it does); others would die of the signal
+        for file in "$dir"/dns_override.*.stats; do
+            [[ -f "$file" ]] || continue
+            local pid="${file##*/dns_override.}"
+            pid="${pid%.stats}"
+            if grep -q "dns_override.so" "/proc/$pid/maps" 2>/dev/null; then
+                pids+=("$pid")
+            fi
+        done
+    fi
+    if [[ ${#pids[@]} -eq 0 ]]; then
+        echo "No running process with dns_override.so has stats_signal enabled"
+        return 1
+    fi
+    
+    for pid in "${pids[@]}"; do
+        kill -s "$signal" "$pid" 2>/dev/null || echo "Cannot signal process $pid"
+    done
+    sleep 0.2
+    
+    for pid in "${pids[@]}"; do
+        local file="$dir/dns_override.$pid.stats"
+        echo "Process $pid ($(cat /proc/$pid/comm 2>/dev/null || echo exited))"
+        if [[ -f "$file" ]]; then
+            sed 's/^/  /' "$file"
+        else
+            echo "  No statistics written to $file"
+        fi
+        echo ""
+    done
+}
+
 test_dns() {
     echo "Testing DNS resolution..."
     echo "========================"
@@ -599,6 +661,9 @@ case "$1" in
     set-debug)
         set_config_value "debug" "$2"
         ;;
+    set)
+        set_config_value "$2" "$3"
+        ;;
     enable-dns64)
         enable_dns64
         ;;
@@ -635,6 +700,10 @@ case "$1" in
     status)
         show_status
         ;;
+    stats)
+        shift
+        show_stats "$@"
+        ;;
     test)
         test_dns
         ;;
@@ -0,0 +1,512 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <errno.h>
+#include <stdint.h>
+#include <signal.h>
+#include <sys/wait.h>
+
+// DNS load generator
+//
+// Drives getaddrinfo() from many threads at a target rate for a fixed time
+// and reports throughput, errors and latency percentiles. Run it with
+// LD_PRELOAD=dns_override.so against mock_dns to measure the library in
+// isolation (make perf, make stress).
+//
+// With --rate the load is open-loop: each thread works through a fixed
+// schedule, and latency is measured from the time a lookup was due rather
+// than from when it started, so a stall shows up in the percentiles instead
+// of silently slowing the offered load. Without --rate every thread issues
+// its next lookup as soon as the previous one returns.
+//
+// Lookups pick a random name out of --names names under --zone, and
+// --nx percent of them ask for names mock_dns answers with NXDOMAIN. With
+// --check every answer is compared with the addresses mock_dns derives
+// from the name (see mock_dns.c), and the run fails if any is wrong.
+//
+// --fork N forks the process N times while the threads are busy. Each child
+// looks a few names up twice, so the second lookup comes from the cache, and
+// must be done within FORK_CHILD_TIMEOUT_S: a lock the fork handlers leave
+// held or broken hangs the child instead.
+
+#define MAX_THREADS 1024
+#define MAX_GAI_ERRORS 128 // Indexed by -status; glibc codes are -1..-105
+#define FORK_CHILD_NAMES 16
+#define FORK_CHILD_TIMEOUT_S 10
+
+struct load_options {
+    int threads;
+    double rate;      // Lookups per second over all threads (0 = closed loop)
+    double duration_s;
+    int names;        // Distinct names looked up
+    const char *zone;
+    int nx_pct;       // Share of lookups for NXDOMAIN names
+    int family;       // ai_family hint
+    int check;        // Verify answers against the mock_dns scheme
+    int a_count;      // A records per name that --check expects
+    int aaaa_count;   // AAAA records per name that --check expects
+    double max_errors_pct; // Fail the run above this error rate
+    int forks;        // Children forked during the run
+    int json;
+    const char *output;
+};
+
+struct worker {
+    pthread_t thread;
+    int id;
+    pthread_barrier_t *start;
+    double *latencies_us;
+    long count;
+    long capacity;
+    long ok;
+    long nxdomain;       // EAI_NONAME for an NXDOMAIN name (expected)
+    long errors;         // Any other failure
+    long wrong;          // --check: unexpected answer or status
+    long gai_errors[MAX_GAI_ERRORS];
+    double begin_us, end_us;
+};
+
+struct load_result {
+    long ops, ok, nxdomain, errors, wrong;
+    int fork_failures;   // --fork: children that hung or got a wrong answer
+    long gai_errors[MAX_GAI_ERRORS];
+    double wall_s, qps;
+    double min_us, mean_us, p50_us, p90_us, p99_us, p999_us, max_us;
+};
+
+static struct load_options opts;
+
+static double now_us() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+static void sleep_until_us(double when) {
+    double wait = when - now_us();
+    if (wait <= 0) return;
+    struct timespec ts = { (time_t)(wait / 1e6), (long)((wait - (time_t)(wait / 1e6) * 1e6) * 1e3) };
+    nanosleep(&ts, NULL);
+}
+
+static unsigned next_random(unsigned *seed) {
+    unsigned x = *seed;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    return *seed = x;
+}
+
+// Same hash as mock_dns.c, over the lowercased name
+static uint32_t name_hash(const char *name) {
+    uint32_t h = 2166136261u;
+    for (const char *p = name; *p; p++) {
+        unsigned char c = *p;
+        if (c >= 'A' && c <= 'Z') c += 32;
+        h = (h ^ c) * 16777619u;
+    }
+    return h;
+}
+
+// Does res hold exactly the addresses mock_dns gives name, each once?
+static int answer_matches(const char *name, const struct addrinfo *res) {
+    uint32_t h = name_hash(name);
+    unsigned char seen_a[256] = { 0 }, seen_aaaa[256] = { 0 };
+    int a = 0, aaaa = 0;
+    for (const struct addrinfo *ai = res; ai; ai = ai->ai_next) {
+        if (ai->ai_family == AF_INET) {
+            const unsigned char *b = (const unsigned char *)&((const struct sockaddr_in *)ai->ai_addr)->sin_addr;
+            if (b[0] != 10 || b[1] != (h >> 16 & 0xff) || b[2] != (h >> 8 & 0xff) ||
+                b[3] < 1 || b[3] > opts.a_count || seen_a[b[3]]++) {
+                return 0;
+            }
+            a++;
+        } else if (ai->ai_family == AF_INET6) {
+            const unsigned char *b = ((const struct sockaddr_in6 *)ai->ai_addr)->sin6_addr.s6_addr;
+            static const unsigned char zero[6] = { 0 };
+            if (b[0] != 0x20 || b[1] != 0x01 || b[2] != 0x0d || b[3] != 0xb8 ||
+                (uint32_t)(b[4] << 8 | b[5]) != h >> 16 || (uint32_t)(b[6] << 8 | b[7]) != (h & 0xffff) ||
+                memcmp(b + 8, zero, 6) != 0 || b[14] != 0 || b[15] < 1 || b[15] > opts.aaaa_count ||
+                seen_aaaa[b[15]]++) {
+                return 0;
+            }
+            aaaa++;
+        } else {
+            return 0;
+        }
+    }
+    int want_a = opts.family == AF_INET6 ? 0 : opts.a_count;
+    int want_aaaa = opts.family == AF_INET ? 0 : opts.aaaa_count;
+    return a == want_a && aaaa == want_aaaa;
+}
+
+static void record_latency(struct worker *w, double us) {
+    if (w->count == w->capacity) {
+        long capacity = w->capacity ? w->capacity * 2 : 65536;
+        double *grown = realloc(w->latencies_us, sizeof(double) * capacity);
+        if (!grown) return;
+        w->latencies_us = grown;
+        w->capacity = capacity;
+    }
+    w->latencies_us[w->count++] = us;
+}
+
+static void *worker_main(void *arg) {
+    struct worker *w = arg;
+    unsigned seed = 2463534242u + w->id * 2654435761u;
+    struct addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = opts.family;
+    hints.ai_socktype = SOCK_STREAM;
+    double interval_us = opts.rate > 0 ? opts.threads * 1e6 / opts.rate : 0;
+
+    pthread_barrier_wait(w->start);
+
+    w->begin_us = now_us();
+    double end = w->begin_us + opts.duration_s * 1e6;
+    // Spread the threads' schedules over one interval
+    double due = w->begin_us + interval_us * w->id / opts.threads;
+    for (;;) {
+        double start;
+        if (interval_us > 0) {
+            if (due >= end) break;
+            sleep_until_us(due);
+            start = due;
+            due += interval_us;
+        } else {
+            start = now_us();
+            if (start >= end) break;
+        }
+
+        char name[300];
+        int nx = (int)(next_random(&seed) % 100) < opts.nx_pct;
+        snprintf(name, sizeof(name), "%s%u.%s", nx ? "nx" : "h", next_random(&seed) % opts.names, opts.zone);
+
+        struct addrinfo *res = NULL;
+        int status = getaddrinfo(name, NULL, &hints, &res);
+        record_latency(w, now_us() - start);
+
+        if (status == 0) {
+            w->ok++;
+            if (opts.check && (nx || !answer_matches(name, res))) w->wrong++;
+            freeaddrinfo(res);
+        } else if (status == EAI_NONAME && nx) {
+            w->nxdomain++;
+        } else {
+            if (opts.check && status == EAI_NONAME) w->wrong++;
+            w->errors++;
+            if (-status > 0 && -status < MAX_GAI_ERRORS) w->gai_errors[-status]++;
+        }
+    }
+    w->end_us = now_us();
+    return NULL;
+}
+
+static int compare_doubles(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+// Nearest-rank percentile over sorted samples
+static double percentile(const double *sorted, long n, double p) {
+    if (n == 0) return 0;
+    long rank = (long)(p / 100.0 * n + 0.999999);
+    if (rank < 1) rank = 1;
+    if (rank > n) rank = n;
+    return sorted[rank - 1];
+}
+
+// A forked child: exits with 1 on a wrong answer (with --check)
+static void fork_child_main() {
+    struct addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = opts.family;
+    hints.ai_socktype = SOCK_STREAM;
+    alarm(FORK_CHILD_TIMEOUT_S);
+
+    int wrong = 0;
+    for (int pass = 0; pass < 2; pass++) {
+        for (int i = 0; i < FORK_CHILD_NAMES && i < opts.names; i++) {
+            char name[300];
+            snprintf(name, sizeof(name), "h%d.%s", i, opts.zone);
+            struct addrinfo *res = NULL;
+            if (getaddrinfo(name, NULL, &hints, &res) != 0) continue; // Lost packets are not the point here
+            if (opts.check && !answer_matches(name, res)) wrong = 1;
+            freeaddrinfo(res);
+        }
+    }
+    _exit(wrong);
+}
+
+// Fork opts.forks children spread over the run. Returns how many failed.
+static int fork_children(double begin_us) {
+    int failed = 0;
+    for (int f = 0; f < opts.forks; f++) {
+        sleep_until_us(begin_us + opts.duration_s * 1e6 * (f + 1) / (opts.forks + 1));
+        pid_t pid = fork();
+        if (pid < 0) {
+            fprintf(stderr, "fork failed: %s\n", strerror(errno));
+            failed++;
+            continue;
+        }
+        if (pid == 0) fork_child_main();
+
+        int wstatus = 0;
+        while (waitpid(pid, &wstatus, 0) < 0 && errno == EINTR) {
+        }
+        if (WIFSIGNALED(wstatus) && WTERMSIG(wstatus) == SIGALRM) {
+            fprintf(stderr, "Forked child %d hung for %d s\n", f + 1, FORK_CHILD_TIMEOUT_S);
+            failed++;
+        } else if (!WIFEXITED(wstatus) || WEXITSTATUS(wstatus) != 0) {
+            fprintf(stderr, "Forked child %d got a wrong answer or died\n", f + 1);
+            failed++;
+        }
+    }
+    return failed;
+}
+
+static int run_load(struct load_result *res) {
+    struct worker *workers = calloc(opts.threads, sizeof(*workers));
+    pthread_barrier_t start;
+    if (!workers) {
+        fprintf(stderr, "Out of memory\n");
+        return -1;
+    }
+
+    pthread_barrier_init(&start, NULL, opts.threads + 1);
+    for (int t = 0; t < opts.threads; t++) {
+        workers[t].id = t;
+        workers[t].start = &start;
+        if (pthread_create(&workers[t].thread, NULL, worker_main, &workers[t]) != 0) {
+            fprintf(stderr, "pthread_create failed: %s\n", strerror(errno));
+            exit(1);
+        }
+    }
+    pthread_barrier_wait(&start);
+    int fork_failures = fork_children(now_us());
+    for (int t = 0; t < opts.threads; t++) {
+        pthread_join(workers[t].thread, NULL);
+    }
+    pthread_barrier_destroy(&start);
+
+    memset(res, 0, sizeof(*res));
+    res->fork_failures = fork_failures;
+    double begin = workers[0].begin_us, end = workers[0].end_us;
+    for (int t = 0; t < opts.threads; t++) {
+        struct worker *w = &workers[t];
+        if (w->begin_us < begin) begin = w->begin_us;
+        if (w->end_us > end) end = w->end_us;
+        res->ops += w->count;
+        res->ok += w->ok;
+        res->nxdomain += w->nxdomain;
+        res->errors += w->errors;
+        res->wrong += w->wrong;
+        for (int e = 0; e < MAX_GAI_ERRORS; e++) res->gai_errors[e] += w->gai_errors[e];
+    }
+    res->wall_s = (end - begin) / 1e6;
+    res->qps = res->wall_s > 0 ? res->ops / res->wall_s : 0;
+
+    double *all = malloc(sizeof(double) * (res->ops ? res->ops : 1));
+    if (!all) {
+        fprintf(stderr, "Out of memory\n");
+        return -1;
+    }
+    long n = 0;
+    double sum = 0;
+    for (int t = 0; t < opts.threads; t++) {
+        memcpy(all + n, workers[t].latencies_us, sizeof(double) * workers[t].count);
+        n += workers[t].count;
+        free(workers[t].latencies_us);
+    }
+    for (long i = 0; i < n; i++) sum += all[i];
+    qsort(all, n, sizeof(double), compare_doubles);
+    if (n > 0) {
+        res->min_us = all[0];
+        res->max_us = all[n - 1];
+        res->mean_us = sum / n;
+    }
+    res->p50_us = percentile(all, n, 50);
+    res->p90_us = percentile(all, n, 90);
+    res->p99_us = percentile(all, n, 99);
+    res->p999_us = percentile(all, n, 99.9);
+
+    free(all);
+    free(workers);
+    return 0;
+}
+
+static void print_table(const struct load_result *r) {
+    printf("DNS Load: %d threads, ", opts.threads);
+    if (opts.rate > 0) {
+        printf("target %.0f qps (open loop)", opts.rate);
+    } else {
+        printf("closed loop");
+    }
+    printf(", %.1f s, %d names under %s, %d%% NXDOMAIN\n\n", opts.duration_s, opts.names, opts.zone, opts.nx_pct);
+    printf("%9s %9s %9s %7s %7s %10s %10s %10s %10s %10s %11s\n",
+           "ops", "ok", "nxdomain", "errors", "wrong", "p50(ms)", "p90(ms)", "p99(ms)",
+           "p99.9(ms)", "max(ms)", "qps");
+    char wrong[24] = "-"; // Only counted with --check
+    if (opts.check) snprintf(wrong, sizeof(wrong), "%ld", r->wrong);
+    printf("%9ld %9ld %9ld %7ld %7s %10.4f %10.4f %10.4f %10.4f %10.4f %11.1f\n",
+           r->ops, r->ok, r->nxdomain, r->errors, wrong, r->p50_us / 1e3,
+           r->p90_us / 1e3, r->p99_us / 1e3, r->p999_us / 1e3, r->max_us / 1e3, r->qps);
+    for (int e = 1; e < MAX_GAI_ERRORS; e++) {
+        if (r->gai_errors[e]) printf("  %ld x %s\n", r->gai_errors[e], gai_strerror(-e));
+    }
+    if (opts.rate > 0 && r->qps < opts.rate * 0.9) {
+        printf("\nOnly %.0f of the %.0f qps target were reached\n", r->qps, opts.rate);
+    }
+}
+
+static void print_json(const struct load_result *r) {
+    FILE *out = stdout;
+    if (opts.output) {
+        out = fopen(opts.output, "w");
+        if (!out) {
+            fprintf(stderr, "Cannot write %s: %s\n", opts.output, strerror(errno));
+            exit(1);
+        }
+    }
+    const char *preload = getenv("LD_PRELOAD");
+    fprintf(out, "{\n  \"threads\": %d,\n  \"rate\": %.1f,\n  \"duration_s\": %.3f,\n  \"names\": %d,\n"
+            "  \"zone\": \"%s\",\n  \"nx_pct\": %d,\n  \"preloaded\": %s,\n  \"timestamp\": %ld,\n",
+            opts.threads, opts.rate, opts.duration_s, opts.names, opts.zone, opts.nx_pct,
+            (preload && *preload) ? "true" : "false", (long)time(NULL));
+    fprintf(out, "  \"result\": {\"ops\": %ld, \"ok\": %ld, \"nxdomain\": %ld, \"errors\": %ld, "
+            "\"wrong\": %ld, \"wall_s\": %.6f, \"qps\": %.1f, \"latency_us\": {\"min\": %.3f, "
+            "\"mean\": %.3f, \"p50\": %.3f, \"p90\": %.3f, \"p99\": %.3f, \"p99_9\": %.3f, \"max\": %.3f}}\n}\n",
+            r->ops, r->ok, r->nxdomain, r->errors, r->wrong, r->wall_s, r->qps, r->min_us, r->mean_us,
+            r->p50_us, r->p90_us, r->p99_us, r->p999_us, r->max_us);
+    if (out != stdout) fclose(out);
+}
+
+static void usage(const char *prog) {
+    printf("Usage: %s [options]\n", prog);
+    printf("\n");
+    printf("Options:\n");
+    printf("  -t, --threads N        Lookup threads (default: 4)\n");
+    printf("  -r, --rate QPS         Target lookups per second, open loop (default: 0 = closed loop)\n");
+    printf("  -d, --duration SECONDS Length of the run (default: 5)\n");
+    printf("  -N, --names N          Distinct names looked up (default: 1000)\n");
+    printf("  -z, --zone ZONE        Suffix of the names (default: load.test)\n");
+    printf("  -x, --nx PCT           Share of lookups for NXDOMAIN names (default: 0)\n");
+    printf("  -f, --family 4|6       Ask for IPv4 or IPv6 only (default: both)\n");
+    printf("  -c, --check            Verify answers against mock_dns; fail on any wrong one\n");
+    printf("  -4, --a N              A records per name for --check (default: 2)\n");
+    printf("  -6, --aaaa N           AAAA records per name for --check (default: 1)\n");
+    printf("  -e, --max-errors PCT   Fail if more than PCT%% of lookups fail (default: no limit)\n");
+    printf("  -F, --fork N           Fork N times during the run; fail if a child hangs (default: 0)\n");
+    printf("  -j, --json             Emit JSON instead of a table\n");
+    printf("  -o, --output FILE      Write JSON to FILE (implies --json)\n");
+    printf("  -h, --help             Show this help\n");
+    printf("\n");
+    printf("Names are h<N>.ZONE, and nx<N>.ZONE for the NXDOMAIN share.\n");
+    printf("Exits with 1 when --check, --max-errors or --fork fails.\n");
+}
+
+int main(int argc, char *argv[]) {
+    opts.threads = 4;
+    opts.duration_s = 5;
+    opts.names = 1000;
+    opts.zone = "load.test";
+    opts.family = AF_UNSPEC;
+    opts.a_count = 2;
+    opts.aaaa_count = 1;
+    opts.max_errors_pct = 100;
+
+    for (int i = 1; i < argc; i++) {
+        const char *arg = argv[i];
+        const char *next = (i + 1 < argc) ? argv[i + 1] : NULL;
+
+        if ((!strcmp(arg, "-t") || !strcmp(arg, "--threads")) && next) {
+            opts.threads = atoi(next);
+            i++;
+        } else if ((!strcmp(arg, "-r") || !strcmp(arg, "--rate")) && next) {
+            opts.rate = atof(next);
+            i++;
+        } else if ((!strcmp(arg, "-d") || !strcmp(arg, "--duration")) && next) {
+            opts.duration_s = atof(next);
+            i++;
+        } else if ((!strcmp(arg, "-N") || !strcmp(arg, "--names")) && next) {
+            opts.names = atoi(next);
+            i++;
+        } else if ((!strcmp(arg, "-z") || !strcmp(arg, "--zone")) && next) {
+            opts.zone = next;
+            i++;
+        } else if ((!strcmp(arg, "-x") || !strcmp(arg, "--nx")) && next) {
+            opts.nx_pct = atoi(next);
+            i++;
+        } else if ((!strcmp(arg, "-f") || !strcmp(arg, "--family")) && next) {
+            opts.family = !strcmp(next, "4") ? AF_INET : !strcmp(next, "6") ? AF_INET6 : -1;
+            if (opts.family < 0) {
+                fprintf(stderr, "Unknown family: %s\n", next);
+                return 1;
+            }
+            i++;
+        } else if (!strcmp(arg, "-c") || !strcmp(arg, "--check")) {
+            opts.check = 1;
+        } else if ((!strcmp(arg, "-4") || !strcmp(arg, "--a")) && next) {
+            opts.a_count = atoi(next);
+            i++;
+        } else if ((!strcmp(arg, "-6") || !strcmp(arg, "--aaaa")) && next) {
+            opts.aaaa_count = atoi(next);
+            i++;
+        } else if ((!strcmp(arg, "-e") || !strcmp(arg, "--max-errors")) && next) {
+            opts.max_errors_pct = atof(next);
+            i++;
+        } else if ((!strcmp(arg, "-F") || !strcmp(arg, "--fork")) && next) {
+            opts.forks = atoi(next);
+            i++;
+        } else if (!strcmp(arg, "-j") || !strcmp(arg, "--json")) {
+            opts.json = 1;
+        } else if ((!strcmp(arg, "-o") || !strcmp(arg, "--output")) && next) {
+            opts.output = next;
+            opts.json = 1;
+            i++;
+        } else if (!strcmp(arg, "-h") || !strcmp(arg, "--help")) {
+            usage(argv[0]);
+            return 0;
+        } else {
+            fprintf(stderr, "Unknown option: %s\n", arg);
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (opts.threads < 1 || opts.threads > MAX_THREADS || opts.duration_s <= 0 || opts.names < 1) {
+        fprintf(stderr, "Need 1..%d threads, a positive duration and at least one name\n", MAX_THREADS);
+        return 1;
+    }
+
+    struct load_result result;
+    if (run_load(&result) < 0) return 1;
+    if (opts.json) {
+        print_json(&result);
+    } else {
+        print_table(&result);
+    }
+
+    int failed = 0;
+    double error_pct = result.ops ? 100.0 * result.errors / result.ops : 0;
+    if (opts.check && result.wrong > 0) {
+        fprintf(stderr, "FAIL: %ld wrong answers\n", result.wrong);
+        failed = 1;
+    }
+    if (result.fork_failures > 0) {
+        fprintf(stderr, "FAIL: %d of %d forked children failed\n", result.fork_failures, opts.forks);
+        failed = 1;
+    }
+    if (error_pct > opts.max_errors_pct) {
+        fprintf(stderr, "FAIL: %.2f%% of lookups failed (limit %.2f%%)\n", error_pct, opts.max_errors_pct);
+        failed = 1;
+    }
+    return failed;
+}
@@ -2,6 +2,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <ctype.h>
 #include <dlfcn.h>
 #include <netdb.h>
 #include <sys/socket.h>
@@ -10,15 +11,108 @@
 #include <unistd.h>
 #include <resolv.h>
 #include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <signal.h>
 #include <fcntl.h>
 #include <errno.h>
 #include <sys/time.h>
+#include <poll.h>
+#include <stdatomic.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+#include <pthread.h>
+#include <sched.h>
+#include <syslog.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include "dns_override.h"
+
+// DNS over TLS and HTTPS need the OpenSSL headers at build time; libssl
+// itself is loaded at run time, only by processes that use such a server
+#if __has_include(<openssl/ssl.h>)
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+#include <openssl/x509v3.h>
+#define DNS_OVERRIDE_TLS 1
+#endif
 
 // Configuration file path
 #define DEFAULT_CONFIG_FILE "/tmp/dns_override.conf"
 #define CONFIG_ENV_VAR "DNS_OVERRIDE_CONFIG"
-#define MAX_DNS_SERVERS 8
+#define MAX_DNS_SERVERS 32 // Server slots, shared by dns_server and route lines
+#define MAX_ROUTES 16      // Including the default route
 #define DEFAULT_DNS_PORT 53
+#define DEFAULT_TLS_PORT 853   // tls:// servers (RFC 7858)
+#define DEFAULT_HTTPS_PORT 443 // https:// servers (RFC 8484)
+#define DEFAULT_DOH_PATH "/dns-query"
+
+// Transport of a configured server, from the scheme of its spec
+#define SERVER_PLAIN 0 // UDP, or TCP with use_tcp
+#define SERVER_TLS 1   // DNS over TLS
+#define SERVER_HTTPS 2 // DNS over HTTPS (HTTP/2)
+
+// Resolution backends selected with the "resolver" key
+#define RESOLVER_GLIBC 0      // Rewrite the global _res and call the glibc functions
+#define RESOLVER_REENTRANT 1  // Per-thread res_state, no global resolver state
+#define RESOLVER_NATIVE 2     // Built-in DNS wire-protocol client
+
+// How the native client spreads a query over the configured servers
+#define QUERY_SEQUENTIAL 0  // One server at a time, in order
+#define QUERY_PARALLEL 1    // Race the first query_parallelism servers at once
+#define QUERY_STAGGERED 2   // Add the next server every query_stagger_ms
+#define DEFAULT_QUERY_STAGGER_MS 100
+
+// How results are ordered before they are returned ("result_order" key)
+#define RESULT_ORDER_UPSTREAM 0    // As the resolver returned them
+#define RESULT_ORDER_RFC6724 1     // RFC 6724 destination address selection
+#define RESULT_ORDER_DNS64_FIRST 2 // Synthesized (DNS64 prefix) addresses first
+#define RESULT_ORDER_ROUND_ROBIN 3 // Rotated by one on every lookup
+#define RESULT_ORDER_RTT 4         // Fastest reported connect time first
+
+#define DEFAULT_ATTEMPT_TIMEOUT_MS 5000
+#define DEFAULT_TCP_IDLE_TIMEOUT_MS 10000
+#define DEFAULT_EDNS_UDP_SIZE 1232 // Fits a 1280-byte IPv6 MTU, so no fragments
+#define MAX_EDNS_UDP_SIZE 4096
+#define DEFAULT_RETRIES 1  // Extra passes over the server list after the first
+
+// Answer cache defaults (cache is disabled unless cache_size > 0)
+#define DEFAULT_CACHE_MIN_TTL 5
+#define DEFAULT_CACHE_MAX_TTL 3600
+#define DEFAULT_NEGATIVE_TTL 30
+#define DEFAULT_CACHE_MAX_BYTES (64 << 20)
+#define PREFETCH_RETRY_SECONDS 5 // Wait before queuing another prefetch for an entry
+#define STALE_RECHECK_SECONDS 30 // Serve a stale answer this long before retrying upstream
+#define PREFETCH_QUEUE_MAX 64    // Pending prefetches; further requests are dropped
+
+// Seconds between checks of the config file for changes
+#define DEFAULT_RELOAD_INTERVAL 1
+
+// Slots in a newly created shared cache file (see shared_cache_attach())
+#define DEFAULT_SHARED_CACHE_SLOTS 4096
+
+// Seconds between writes of the cache snapshot file (see cache_snapshot_save())
+#define DEFAULT_CACHE_SNAPSHOT_INTERVAL 60
+
+// Where the statistics dump (stats_signal) is written
+#define DEFAULT_STATS_DIR "/tmp"
+
+// Addresses kept per name in the static host table ("host", "hosts_file")
+#define MAX_HOST_ADDRS 64
+
+// Log levels selected with the "log_level" key
+#define LOG_LEVEL_ERROR 0
+#define LOG_LEVEL_WARN 1
+#define LOG_LEVEL_INFO 2
+#define LOG_LEVEL_TRACE 3
+#define MAX_LOG_NAMES 8 // "log_name" lines honoured per config file
+
+// Where log records are written ("log_file")
+#define LOG_SINK_STDERR 0
+#define LOG_SINK_FILE 1
+#define LOG_SINK_SYSLOG 2
 
 // Get configuration file path from environment or use default
 static const char* get_config_file_path() {
@@ -26,841 +120,7899 @@ static const char* get_config_file_path() {
     return env_path ? env_path : DEFAULT_CONFIG_FILE;
 }
 
+// Identity of the config file, compared to detect edits
+struct config_file_id {
+    int exists;
+    dev_t dev;
+    ino_t ino;
+    off_t size;
+    struct timespec mtime;
+};
+
+static void config_file_identity(const struct stat *st, struct config_file_id *id) {
+    id->exists = 1;
+    id->dev = st->st_dev;
+    id->ino = st->st_ino;
+    id->size = st->st_size;
+    id->mtime = st->st_mtim;
+}
+
+// ---------------------------------------------------------------------------
+// Suffix trie
+//
+// Maps domain suffixes to values. Names are walked label by label from the
+// right ("a.b.example.com" visits com, example, b, a), so the longest
+// matching suffix is found in one pass over the name. Nodes live in one
+// array and refer to each other by index; labels are stored lowercased in a
+// single string pool. Tries are built while a config file is read and
+// are never modified once the snapshot is published.
+// ---------------------------------------------------------------------------
+
+struct suffix_trie_node {
+    uint32_t label;        // Offset of the label in the pool
+    uint32_t label_len;
+    uint32_t first_child;  // Node index, 0 if none (node 0 is the root)
+    uint32_t next_sibling; // Node index, 0 if none
+    int value;             // -1 if no suffix ends here
+};
+
+struct suffix_trie {
+    struct suffix_trie_node *nodes;
+    uint32_t node_count;
+    uint32_t node_cap;
+    char *labels;
+    size_t labels_len;
+    size_t labels_cap;
+};
+
+static void suffix_trie_free(struct suffix_trie *t) {
+    free(t->nodes);
+    free(t->labels);
+    memset(t, 0, sizeof(*t));
+}
+
+static uint32_t suffix_trie_child(const struct suffix_trie *t, uint32_t node, const char *label, size_t len) {
+    for (uint32_t c = t->nodes[node].first_child; c; c = t->nodes[c].next_sibling) {
+        const struct suffix_trie_node *n = &t->nodes[c];
+        if (n->label_len == len && strncasecmp(t->labels + n->label, label, len) == 0) return c;
+    }
+    return 0;
+}
+
+// Associate value with suffix (a later insert of the same suffix wins).
+// Returns -1 if memory ran out.
+static int suffix_trie_insert(struct suffix_trie *t, const char *suffix, int value) {
+    if (!t->nodes) {
+        t->nodes = calloc(16, sizeof(*t->nodes));
+        if (!t->nodes) return -1;
+        t->node_cap = 16;
+        t->node_count = 1;
+        t->nodes[0].value = -1;
+    }
+    
+    size_t end = strlen(suffix);
+    if (end && suffix[end - 1] == '.') end--;
+    uint32_t node = 0;
+    while (end > 0) {
+        size_t start = end;
+        while (start > 0 && suffix[start - 1] != '.') start--;
+        const char *label = suffix + start;
+        size_t len = end - start;
+        
+        uint32_t child = suffix_trie_child(t, node, label, len);
+        if (!child) {
+            if (t->node_count == t->node_cap) {
+                struct suffix_trie_node *grown = realloc(t->nodes, 2 * t->node_cap * sizeof(*grown));
+                if (!grown) return -1;
+                t->nodes = grown;
+                t->node_cap *= 2;
+            }
+            if (t->labels_len + len > t->labels_cap) {
+                size_t cap = t->labels_cap ? t->labels_cap : 256;
+                while (cap < t->labels_len + len) cap *= 2;
+                char *grown = realloc(t->labels, cap);
+                if (!grown) return -1;
+                t->labels = grown;
+                t->labels_cap = cap;
+            }
+            for (size_t i = 0; i < len; i++) {
+                t->labels[t->labels_len + i] = (char)tolower((unsigned char)label[i]);
+            }
+            child = t->node_count++;
+            struct suffix_trie_node *n = &t->nodes[child];
+            n->label = (uint32_t)t->labels_len;
+            n->label_len = (uint32_t)len;
+            n->first_child = 0;
+            n->value = -1;
+            n->next_sibling = t->nodes[node].first_child;
+            t->nodes[node].first_child = child;
+            t->labels_len += len;
+        }
+        node = child;
+        end = start ? start - 1 : 0;
+    }
+    t->nodes[node].value = value;
+    return 0;
+}
+
+// Value of the longest suffix of name in the trie, or -1. With below_only a
+// suffix equal to the whole name does not count ("*.example.com" semantics).
+static int suffix_trie_match(const struct suffix_trie *t, const char *name, int below_only) {
+    if (!t->nodes) return -1;
+    
+    size_t end = strlen(name);
+    if (end && name[end - 1] == '.') end--;
+    int best = t->nodes[0].value;
+    uint32_t node = 0;
+    while (end > 0) {
+        size_t start = end;
+        while (start > 0 && name[start - 1] != '.') start--;
+        node = suffix_trie_child(t, node, name + start, end - start);
+        if (!node) break;
+        if (t->nodes[node].value >= 0 && !(below_only && start == 0)) {
+            best = t->nodes[node].value;
+        }
+        if (start == 0) break;
+        end = start - 1;
+    }
+    return best;
+}
+
+// Servers a set of names is sent to
+struct dns_route {
+    char suffix[256]; // Domain it applies to ("" for the default route)
+    int count;
+    int servers[MAX_DNS_SERVERS]; // Indices into the dns_servers[] arrays
+};
+
 // Structure to hold DNS server configuration
 struct dns_config {
     char dns_servers[MAX_DNS_SERVERS][46]; // Support both IPv4 and IPv6
     int dns_ports[MAX_DNS_SERVERS];
     int dns_families[MAX_DNS_SERVERS]; // AF_INET or AF_INET6
+    int dns_timeouts[MAX_DNS_SERVERS]; // Per-server attempt timeout in ms (0 = attempt_timeout_ms)
+    int dns_protos[MAX_DNS_SERVERS];   // SERVER_PLAIN, SERVER_TLS or SERVER_HTTPS
+    char dns_tls_names[MAX_DNS_SERVERS][256]; // Name the certificate must match ("" = the address)
+    char dns_paths[MAX_DNS_SERVERS][128];     // https:// servers: request path
+    int encrypted_servers;             // Servers with a tls:// or https:// spec
+    struct sockaddr_storage dns_addrs[MAX_DNS_SERVERS]; // Parsed form of dns_servers/dns_ports
+    socklen_t dns_addrlens[MAX_DNS_SERVERS];
     int server_count;
-    int timeout_ms;
+    struct dns_route routes[MAX_ROUTES]; // [0]: dns_server lines, then "route" lines
+    int route_count;
+    struct suffix_trie route_trie;       // Route suffix -> index into routes
+    int attempt_timeout_ms; // Time to wait for one server to answer one query
+    int total_timeout_ms;   // Budget for a whole lookup (0 = no limit beyond the attempts)
+    int retries;            // Extra passes over the server list after the first
     int use_tcp;
+    int tcp_idle_timeout_ms; // Native client: close a pooled TCP connection idle this long
+    int edns_udp_size;       // Native client: UDP payload advertised with EDNS0 (0 = no EDNS)
     int debug;
     int enable_dns64;
     char dns64_prefix[46]; // DNS64 prefix (e.g., "64:ff9b::/96")
+    unsigned char dns64_prefix_addr[16]; // Parsed dns64_prefix
+    int dns64_prefix_len;                // 32, 40, 48, 56, 64 or 96 bits
     int filter_aaaa; // Filter out AAAA records before DNS64 synthesis
     int filter_a;    // Filter out A (IPv4) records from final results
+    int result_order; // RESULT_ORDER_*
+    int resolver;    // RESOLVER_GLIBC, RESOLVER_REENTRANT or RESOLVER_NATIVE
+    int query_strategy;    // QUERY_SEQUENTIAL, QUERY_PARALLEL or QUERY_STAGGERED
+    int query_stagger_ms;  // Delay before the staggered strategy adds a server
+    int query_parallelism; // Servers raced at once (0 = all)
+    int cache_size;    // Maximum number of cached answers (0 disables the cache)
+    size_t cache_max_bytes; // Memory the answer cache may use
+    int cache_min_ttl; // Lower bound for cached answer lifetime (seconds)
+    int cache_max_ttl; // Upper bound for cached answer lifetime (seconds)
+    int negative_ttl;  // Lifetime of cached EAI_NONAME answers (seconds)
+    int serve_stale;        // Seconds an expired answer may stand in for a failed lookup
+    int prefetch_threshold; // Refresh a hit in the background below this % of its lifetime
+    int reload_interval;  // Seconds between config file checks (0 = only on SIGHUP)
+    int reload_on_sighup; // Install a SIGHUP handler that forces a reload
+    char shared_cache_path[256]; // File backing the cross-process cache ("" = off)
+    char cache_snapshot_path[256]; // Answer cache saved across runs ("" = off)
+    int cache_snapshot_interval;   // Seconds between snapshot writes (0 = only at exit)
+    int stats_signal;            // Signal that dumps the statistics (0 = none)
+    char stats_dir[256];         // Directory the statistics files go to
+    int shared_cache_slots;      // Table size used when creating that file
+    int log_level;               // LOG_LEVEL_*; "debug true" means LOG_LEVEL_TRACE
+    int log_sample;              // Log info/trace for one lookup in this many
+    char log_names[MAX_LOG_NAMES][256]; // Only log info/trace for these domains
+    int log_name_count;
+    int log_sink;                // LOG_SINK_*
+    char log_path[256];          // File for LOG_SINK_FILE
+    char hosts_file[256];        // Extra /etc/hosts-format file of pinned names ("" = none)
+    struct hosts_table *hosts;   // "host" lines and hosts_file, NULL if none
+    
+    // Snapshot bookkeeping, not read from the file
+    uint64_t generation;            // 1 for the first snapshot, +1 per reload
+    struct config_file_id file_id;  // Config file the snapshot was read from
+    struct dns_config *retired_next; // Link in the list of replaced snapshots
+    struct shared_cache_header *shared_cache; // Mapping of shared_cache_path, or NULL
+    size_t shared_cache_mapped;               // Length of that mapping
+    uint64_t answer_fingerprint;              // Identifies answers this config produces
 };
 
-static struct dns_config config = {0};
-static int config_loaded = 0;
+// Configuration snapshot used by the current thread's lookup (see
+// config_acquire()). Snapshots are immutable once published.
+static __thread const struct dns_config *cfg = NULL;
 
 // Function pointers to original functions
-static struct hostent *(*original_gethostbyname)(const char *name) = NULL;
 static int (*original_getaddrinfo)(const char *node, const char *service,
                                  const struct addrinfo *hints,
                                  struct addrinfo **res) = NULL;
+static void (*original_freeaddrinfo)(struct addrinfo *res) = NULL;
+static int (*original_getnameinfo)(const struct sockaddr *sa, socklen_t salen,
+                                   char *host, socklen_t hostlen,
+                                   char *serv, socklen_t servlen, int flags) = NULL;
 
-// Load DNS server configuration from file
-static void load_dns_config() {
-    if (config_loaded) return;
-    
-    // Set defaults
-    config.server_count = 0;
-    config.timeout_ms = 5000;
-    config.use_tcp = 0;
-    config.debug = 0;
-    config.enable_dns64 = 0;
-    config.filter_aaaa = 0;
-    config.filter_a = 0;  // Default: don't filter A records
-    strncpy(config.dns64_prefix, "64:ff9b::", sizeof(config.dns64_prefix) - 1);
-    config.dns64_prefix[sizeof(config.dns64_prefix) - 1] = '\0';
-    
-    const char* config_file = get_config_file_path();
-    FILE *file = fopen(config_file, "r");
-    if (!file) {
-        // Use default DNS servers if no config file
-        strncpy(config.dns_servers[0], "8.8.8.8", sizeof(config.dns_servers[0]) - 1);
-        config.dns_ports[0] = DEFAULT_DNS_PORT;
-        strncpy(config.dns_servers[1], "1.1.1.1", sizeof(config.dns_servers[1]) - 1);
-        config.dns_ports[1] = DEFAULT_DNS_PORT;
-        config.server_count = 2;
-        fprintf(stderr, "[DNS Override] Config file not found: %s\n", config_file);
-        fprintf(stderr, "[DNS Override] Using default DNS servers: 8.8.8.8, 1.1.1.1\n");
-        config_loaded = 1;
-        return;
-    }
-    
-    if (config.debug) {
-        fprintf(stderr, "[DNS Override] Loading configuration from: %s\n", config_file);
-    }
-    
-    char line[512];
-    while (fgets(line, sizeof(line), file)) {
-        // Skip comments and empty lines
-        if (line[0] == '#' || line[0] == '\n' || line[0] == '\r') continue;
-        
-        // Remove trailing newline
-        line[strcspn(line, "\r\n")] = 0;
+// Convert the configured server strings into socket addresses once, so the
+// lookup paths only copy them
+static void precompute_server_addresses(struct dns_config *c) {
+    for (int i = 0; i < c->server_count; i++) {
+        struct sockaddr_storage *ss = &c->dns_addrs[i];
+        memset(ss, 0, sizeof(*ss));
+        c->dns_addrlens[i] = 0;
         
-        char key[256], value[256];
-        if (sscanf(line, "%255s %255s", key, value) == 2) {
-            if (strcmp(key, "dns_server") == 0 && config.server_count < MAX_DNS_SERVERS) {
-                char server_addr[46];
-                int port = DEFAULT_DNS_PORT;
-                int family = AF_INET; // Default to IPv4
-                
-                // Check if this is an IPv6 address with port: [address]:port
-                if (value[0] == '[') {
-                    char *bracket_end = strchr(value, ']');
-                    if (bracket_end) {
-                        // Extract IPv6 address from brackets
-                        size_t addr_len = bracket_end - value - 1;
-                        if (addr_len < sizeof(server_addr)) {
-                            strncpy(server_addr, value + 1, addr_len);
-                            server_addr[addr_len] = '\0';
-                            family = AF_INET6;
-                            
-                            // Check for port after the bracket
-                            if (*(bracket_end + 1) == ':') {
-                                port = atoi(bracket_end + 2);
-                            }
-                        } else {
-                            continue; // Address too long
-                        }
-                    } else {
-                        continue; // Malformed IPv6 address
-                    }
-                } else {
-                    // IPv4 address or IPv6 without brackets
-                    char *port_str = strrchr(value, ':');
-                    
-                    // Try to determine if this is IPv6 by checking for multiple colons
-                    int colon_count = 0;
-                    for (char *p = value; *p; p++) {
-                        if (*p == ':') colon_count++;
-                    }
-                    
-                    if (colon_count > 1) {
-                        // Likely IPv6 address without port
-                        strncpy(server_addr, value, sizeof(server_addr) - 1);
-                        server_addr[sizeof(server_addr) - 1] = '\0';
-                        family = AF_INET6;
-                    } else if (port_str) {
-                        // IPv4 with port
-                        size_t addr_len = port_str - value;
-                        if (addr_len < sizeof(server_addr)) {
-                            strncpy(server_addr, value, addr_len);
-                            server_addr[addr_len] = '\0';
-                            port = atoi(port_str + 1);
-                            family = AF_INET;
-                        } else {
-                            continue; // Address too long
-                        }
-                    } else {
-                        // IPv4 without port
-                        strncpy(server_addr, value, sizeof(server_addr) - 1);
-                        server_addr[sizeof(server_addr) - 1] = '\0';
-                        family = AF_INET;
-                    }
-                }
-                
-                // Validate the address format
-                struct sockaddr_in addr4;
-                struct sockaddr_in6 addr6;
-                int valid = 0;
-                
-                if (family == AF_INET) {
-                    valid = (inet_pton(AF_INET, server_addr, &addr4.sin_addr) == 1);
-                } else {
-                    valid = (inet_pton(AF_INET6, server_addr, &addr6.sin6_addr) == 1);
-                }
-                
-                if (valid) {
-                    strncpy(config.dns_servers[config.server_count], server_addr,
-                           sizeof(config.dns_servers[config.server_count]) - 1);
-                    config.dns_servers[config.server_count][sizeof(config.dns_servers[config.server_count]) - 1] = '\0';
-                    config.dns_ports[config.server_count] = port;
-                    config.dns_families[config.server_count] = family;
-                    
-                    const char* family_str = (family == AF_INET6) ? "IPv6" : "IPv4";
-                    fprintf(stderr, "[DNS Override] Added %s DNS server: %s:%d\n", 
-                           family_str, config.dns_servers[config.server_count], port);
-                    config.server_count++;
-                } else {
-                    fprintf(stderr, "[DNS Override] Invalid DNS server address: %s\n", value);
-                }
-            } else if (strcmp(key, "timeout") == 0) {
-                config.timeout_ms = atoi(value);
-            } else if (strcmp(key, "use_tcp") == 0) {
-                config.use_tcp = (strcmp(value, "true") == 0 || strcmp(value, "1") == 0);
-            } else if (strcmp(key, "debug") == 0) {
-                config.debug = (strcmp(value, "true") == 0 || strcmp(value, "1") == 0);
-            } else if (strcmp(key, "enable_dns64") == 0) {
-                config.enable_dns64 = (strcmp(value, "true") == 0 || strcmp(value, "1") == 0);
-                if (config.enable_dns64) {
-                    fprintf(stderr, "[DNS Override] DNS64 synthesis enabled\n");
-                }
-            } else if (strcmp(key, "dns64_prefix") == 0) {
-                strncpy(config.dns64_prefix, value, sizeof(config.dns64_prefix) - 1);
-                config.dns64_prefix[sizeof(config.dns64_prefix) - 1] = '\0';
-                fprintf(stderr, "[DNS Override] DNS64 prefix: %s\n", config.dns64_prefix);
-            } else if (strcmp(key, "filter_aaaa") == 0) {
-                config.filter_aaaa = (strcmp(value, "true") == 0 || strcmp(value, "1") == 0);
-                if (config.filter_aaaa) {
-                    fprintf(stderr, "[DNS Override] AAAA record filtering enabled - native IPv6 addresses will be removed\n");
-                }
-            } else if (strcmp(key, "filter_a") == 0) {
-                config.filter_a = (strcmp(value, "true") == 0 || strcmp(value, "1") == 0);
-                if (config.filter_a) {
-                    fprintf(stderr, "[DNS Override] A record filtering enabled - IPv4 addresses will be removed from final results\n");
-                }
+        if (c->dns_families[i] == AF_INET6) {
+            struct sockaddr_in6 *sin6 = (struct sockaddr_in6 *)ss;
+            sin6->sin6_family = AF_INET6;
+            sin6->sin6_port = htons(c->dns_ports[i]);
+            if (inet_pton(AF_INET6, c->dns_servers[i], &sin6->sin6_addr) == 1) {
+                c->dns_addrlens[i] = sizeof(*sin6);
+            }
+        } else {
+            struct sockaddr_in *sin = (struct sockaddr_in *)ss;
+            c->dns_families[i] = AF_INET;
+            sin->sin_family = AF_INET;
+            sin->sin_port = htons(c->dns_ports[i]);
+            if (inet_pton(AF_INET, c->dns_servers[i], &sin->sin_addr) == 1) {
+                c->dns_addrlens[i] = sizeof(*sin);
             }
         }
     }
+}
+
+// Parse dns64_prefix ("PREFIX" or "PREFIX/LEN") into bytes and a length.
+// A missing length means /96. Invalid prefixes fall back to 64:ff9b::/96.
+static void parse_dns64_prefix(struct dns_config *c) {
+    char prefix[sizeof(c->dns64_prefix)];
+    int len = 96;
     
-    fclose(file);
+    snprintf(prefix, sizeof(prefix), "%s", c->dns64_prefix);
+    char *slash = strchr(prefix, '/');
+    if (slash) {
+        *slash = '\0';
+        len = atoi(slash + 1);
+    }
     
-    // If no servers were configured, use defaults
-    if (config.server_count == 0) {
-        strncpy(config.dns_servers[0], "8.8.8.8", sizeof(config.dns_servers[0]) - 1);
-        config.dns_ports[0] = DEFAULT_DNS_PORT;
-        strncpy(config.dns_servers[1], "1.1.1.1", sizeof(config.dns_servers[1]) - 1);
-        config.dns_ports[1] = DEFAULT_DNS_PORT;
-        config.server_count = 2;
-        fprintf(stderr, "[DNS Override] No servers configured, using defaults\n");
+    struct in6_addr addr;
+    int valid = (len == 32 || len == 40 || len == 48 || len == 56 || len == 64 || len == 96) &&
+                inet_pton(AF_INET6, prefix, &addr) == 1;
+    if (!valid) {
+        fprintf(stderr, "[DNS Override] Invalid DNS64 prefix %s (RFC 6052 lengths: 32, 40, 48, 56, 64, 96), "
+               "using 64:ff9b::/96\n", c->dns64_prefix);
+        inet_pton(AF_INET6, "64:ff9b::", &addr);
+        len = 96;
     }
     
-    config_loaded = 1;
+    memcpy(c->dns64_prefix_addr, &addr, sizeof(c->dns64_prefix_addr));
+    c->dns64_prefix_len = len;
+    
+    // Bits 64-71 (the "u" octet) are reserved and must be zero (RFC 6052 2.2)
+    if (c->dns64_prefix_addr[8] != 0) {
+        fprintf(stderr, "[DNS Override] DNS64 prefix has a non-zero u-octet (bits 64-71), clearing it\n");
+        c->dns64_prefix_addr[8] = 0;
+    }
 }
 
-// Initialize original function pointers
-static void init_original_functions() {
-    if (!original_gethostbyname) {
-        original_gethostbyname = dlsym(RTLD_NEXT, "gethostbyname");
-    }
-    if (!original_getaddrinfo) {
-        original_getaddrinfo = dlsym(RTLD_NEXT, "getaddrinfo");
+// ---------------------------------------------------------------------------
+// Static host table
+//
+// "host NAME ADDR..." lines and the hosts_file (in /etc/hosts format) pin
+// names to fixed addresses. Lookups of those names are answered from this
+// table before the caches and without any network traffic. Names
+// starting with "*." match every name below that suffix, through a suffix
+// trie (an exact entry wins over a wildcard).
+//
+// The table is built while the config is loaded. Entries for the same name
+// are merged, keeping file order. Exact names go into an open-addressing
+// hash index. The whole table is immutable and belongs to the snapshot.
+// ---------------------------------------------------------------------------
+
+struct host_addr {
+    int family;
+    unsigned char addr[16];
+};
+
+struct host_entry {
+    const char *name;    // Lowercased, no trailing dot; "*." kept for wildcards
+    uint32_t name_len;
+    uint32_t hash;
+    uint32_t addr_first; // Index into hosts_table.addrs
+    uint32_t addr_count;
+};
+
+struct hosts_table {
+    struct host_entry *entries;
+    uint32_t entry_count;
+    uint32_t *index;  // Hash slots holding entry index + 1, 0 if empty
+    uint32_t mask;    // Number of slots - 1
+    struct host_addr *addrs;
+    char *names;      // String pool for entry names
+    struct suffix_trie wildcards; // Wildcard suffix -> entry index
+};
+
+// One name/address pair read from the config, before merging
+struct hosts_pair {
+    char *name;
+    uint32_t seq; // Keeps addresses in file order through the sort
+    struct host_addr addr;
+};
+
+struct hosts_builder {
+    struct hosts_pair *pairs;
+    size_t count;
+    size_t cap;
+};
+
+static uint32_t host_name_hash(const char *name, size_t len) {
+    uint32_t h = 2166136261u; // FNV-1a over the lowercased name
+    for (size_t i = 0; i < len; i++) {
+        h = (h ^ (unsigned char)tolower((unsigned char)name[i])) * 16777619u;
     }
+    return h;
 }
 
-// DNS64 synthesis: Convert IPv4 address to IPv6 using DNS64 prefix
-static int synthesize_dns64_address(const char *ipv4_str, char *ipv6_str, size_t ipv6_len) {
-    struct in_addr ipv4_addr;
-    if (inet_pton(AF_INET, ipv4_str, &ipv4_addr) != 1) {
-        return 0; // Invalid IPv4 address
-    }
-    
-    // Parse DNS64 prefix (default: 64:ff9b::)
-    char prefix[46];
-    strncpy(prefix, config.dns64_prefix, sizeof(prefix) - 1);
-    prefix[sizeof(prefix) - 1] = '\0';
-    
-    // Remove trailing :: if present
-    char *double_colon = strstr(prefix, "::");
-    if (double_colon) {
-        *double_colon = '\0';
+static void hosts_builder_add(struct hosts_builder *b, const char *name, const char *addr_str) {
+    struct host_addr addr;
+    memset(&addr, 0, sizeof(addr));
+    if (inet_pton(AF_INET, addr_str, addr.addr) == 1) {
+        addr.family = AF_INET;
+    } else if (inet_pton(AF_INET6, addr_str, addr.addr) == 1) {
+        addr.family = AF_INET6;
+    } else {
+        fprintf(stderr, "[DNS Override] Invalid address for host %s: %s\n", name, addr_str);
+        return;
     }
     
-    // Convert IPv4 to hex representation
-    uint32_t ipv4_net = ntohl(ipv4_addr.s_addr);
-    uint16_t high = (ipv4_net >> 16) & 0xFFFF;
-    uint16_t low = ipv4_net & 0xFFFF;
-    
-    // Create DNS64 address: prefix + IPv4 embedded
-    // For 64:ff9b::/96 prefix, format is: 64:ff9b::XXXX:YYYY
-    // where XXXX:YYYY is the IPv4 address in hex
-    snprintf(ipv6_str, ipv6_len, "%s::%x:%x", prefix, high, low);
+    size_t len = strlen(name);
+    if (len && name[len - 1] == '.') len--;
+    if (len == 0 || len >= NS_MAXDNAME) return;
     
-    if (config.debug) {
-        fprintf(stderr, "[DNS Override] DNS64 synthesis: %s -> %s\n", ipv4_str, ipv6_str);
+    if (b->count == b->cap) {
+        size_t cap = b->cap ? 2 * b->cap : 64;
+        struct hosts_pair *grown = realloc(b->pairs, cap * sizeof(*grown));
+        if (!grown) return;
+        b->pairs = grown;
+        b->cap = cap;
     }
+    char *copy = malloc(len + 1);
+    if (!copy) return;
+    for (size_t i = 0; i < len; i++) copy[i] = (char)tolower((unsigned char)name[i]);
+    copy[len] = '\0';
     
-    return 1; // Success
+    struct hosts_pair *p = &b->pairs[b->count];
+    p->name = copy;
+    p->seq = (uint32_t)b->count;
+    p->addr = addr;
+    b->count++;
 }
 
-// Create synthetic IPv6 addresses from IPv4 results
-static int add_dns64_addresses(struct addrinfo **result, struct addrinfo *ipv4_results) {
-    if (!config.enable_dns64 || !ipv4_results) {
-        return 0;
+// Read a file in /etc/hosts format: "ADDR NAME [ALIAS...]", # comments
+static void hosts_builder_read_file(struct hosts_builder *b, const char *path) {
+    FILE *file = fopen(path, "r");
+    if (!file) {
+        fprintf(stderr, "[DNS Override] Cannot open hosts_file %s: %s\n", path, strerror(errno));
+        return;
     }
     
-    struct addrinfo *current = ipv4_results;
-    struct addrinfo *last_result = *result;
+    char line[4096];
+    while (fgets(line, sizeof(line), file)) {
+        line[strcspn(line, "#\r\n")] = '\0';
+        char *saveptr = NULL;
+        char *addr = strtok_r(line, " \t", &saveptr);
+        if (!addr) continue;
+        for (char *name = strtok_r(NULL, " \t", &saveptr); name; name = strtok_r(NULL, " \t", &saveptr)) {
+            hosts_builder_add(b, name, addr);
+        }
+    }
+    fclose(file);
+}
+
+static int hosts_pair_compare(const void *a, const void *b) {
+    const struct hosts_pair *x = a, *y = b;
+    int rc = strcmp(x->name, y->name);
+    if (rc) return rc;
+    return x->seq < y->seq ? -1 : x->seq > y->seq;
+}
+
+static void hosts_table_free(struct hosts_table *t) {
+    if (!t) return;
+    free(t->entries);
+    free(t->index);
+    free(t->addrs);
+    free(t->names);
+    suffix_trie_free(&t->wildcards);
+    free(t);
+}
+
+// Turn the collected pairs into a table and empty the builder. Returns NULL
+// if there were no entries or memory ran out.
+static struct hosts_table *hosts_table_build(struct hosts_builder *b) {
+    struct hosts_table *t = NULL;
+    if (b->count == 0) goto done;
+    qsort(b->pairs, b->count, sizeof(b->pairs[0]), hosts_pair_compare);
     
-    // Find the end of the current result chain
-    if (last_result) {
-        while (last_result->ai_next) {
-            last_result = last_result->ai_next;
+    size_t entries = 0, names_len = 0;
+    for (size_t i = 0; i < b->count; i++) {
+        if (i == 0 || strcmp(b->pairs[i].name, b->pairs[i - 1].name) != 0) {
+            entries++;
+            names_len += strlen(b->pairs[i].name) + 1;
         }
     }
+    uint32_t slots = 16;
+    while (slots < 2 * entries) slots *= 2; // Load factor at most 1/2
     
-    int added_count = 0;
+    t = calloc(1, sizeof(*t));
+    if (!t) goto done;
+    t->entries = calloc(entries, sizeof(*t->entries));
+    t->index = calloc(slots, sizeof(*t->index));
+    t->addrs = calloc(b->count, sizeof(*t->addrs));
+    t->names = malloc(names_len);
+    if (!t->entries || !t->index || !t->addrs || !t->names) goto fail;
+    t->mask = slots - 1;
     
-    while (current) {
-        if (current->ai_family == AF_INET) {
-            struct sockaddr_in *ipv4_addr = (struct sockaddr_in *)current->ai_addr;
-            char ipv4_str[INET_ADDRSTRLEN];
-            char ipv6_str[INET6_ADDRSTRLEN];
+    size_t names_used = 0;
+    uint32_t addr_count = 0;
+    struct host_entry *e = NULL;
+    for (size_t i = 0; i < b->count; i++) {
+        const struct hosts_pair *p = &b->pairs[i];
+        if (!e || strcmp(p->name, e->name) != 0) {
+            e = &t->entries[t->entry_count];
+            size_t len = strlen(p->name);
+            memcpy(t->names + names_used, p->name, len + 1);
+            e->name = t->names + names_used;
+            e->name_len = (uint32_t)len;
+            e->hash = host_name_hash(e->name, len);
+            e->addr_first = addr_count;
+            names_used += len + 1;
             
-            // Convert IPv4 to string
-            if (inet_ntop(AF_INET, &ipv4_addr->sin_addr, ipv4_str, sizeof(ipv4_str))) {
-                // Synthesize DNS64 address
-                if (synthesize_dns64_address(ipv4_str, ipv6_str, sizeof(ipv6_str))) {
-                    // Create new IPv6 addrinfo structure
-                    struct addrinfo *new_ai = malloc(sizeof(struct addrinfo));
-                    struct sockaddr_in6 *ipv6_sockaddr = malloc(sizeof(struct sockaddr_in6));
-                    
-                    if (new_ai && ipv6_sockaddr) {
-                        memset(new_ai, 0, sizeof(struct addrinfo));
-                        memset(ipv6_sockaddr, 0, sizeof(struct sockaddr_in6));
-                        
-                        // Set up IPv6 address structure
-                        ipv6_sockaddr->sin6_family = AF_INET6;
-                        ipv6_sockaddr->sin6_port = ipv4_addr->sin_port;
-                        
-                        if (inet_pton(AF_INET6, ipv6_str, &ipv6_sockaddr->sin6_addr) == 1) {
-                            // Set up addrinfo structure
-                            new_ai->ai_family = AF_INET6;
-                            new_ai->ai_socktype = current->ai_socktype;
-                            new_ai->ai_protocol = current->ai_protocol;
-                            new_ai->ai_addrlen = sizeof(struct sockaddr_in6);
-                            new_ai->ai_addr = (struct sockaddr *)ipv6_sockaddr;
-                            new_ai->ai_next = NULL;
-                            
-                            // Add to result chain
-                            if (last_result) {
-                                last_result->ai_next = new_ai;
-                            } else {
-                                *result = new_ai;
-                            }
-                            last_result = new_ai;
-                            added_count++;
-                            
-                            if (config.debug) {
-                                fprintf(stderr, "[DNS Override] Added DNS64 address: %s\n", ipv6_str);
-                            }
-                        } else {
-                            free(new_ai);
-                            free(ipv6_sockaddr);
-                        }
-                    } else {
-                        free(new_ai);
-                        free(ipv6_sockaddr);
-                    }
-                }
+            if (strncmp(e->name, "*.", 2) == 0) {
+                if (suffix_trie_insert(&t->wildcards, e->name + 2, (int)t->entry_count) != 0) goto fail;
+            } else {
+                uint32_t slot = e->hash & t->mask;
+                while (t->index[slot]) slot = (slot + 1) & t->mask;
+                t->index[slot] = t->entry_count + 1;
             }
+            t->entry_count++;
+        }
+        if (e->addr_count < MAX_HOST_ADDRS) {
+            t->addrs[addr_count++] = p->addr;
+            e->addr_count++;
         }
-        current = current->ai_next;
     }
+    goto done;
     
-    return added_count;
+fail:
+    hosts_table_free(t);
+    t = NULL;
+done:
+    for (size_t i = 0; i < b->count; i++) free(b->pairs[i].name);
+    free(b->pairs);
+    memset(b, 0, sizeof(*b));
+    return t;
 }
 
-// Filter out AAAA (IPv6) records from DNS results
-static int filter_aaaa_records(struct addrinfo **result) {
-    if (!config.filter_aaaa || !*result) {
-        return 0;
+// Entry pinning name, exact names first, then the longest wildcard
+static const struct host_entry *hosts_table_find(const struct hosts_table *t, const char *name) {
+    size_t len = strlen(name);
+    if (len && name[len - 1] == '.') len--;
+    uint32_t hash = host_name_hash(name, len);
+    for (uint32_t slot = hash & t->mask; t->index[slot]; slot = (slot + 1) & t->mask) {
+        const struct host_entry *e = &t->entries[t->index[slot] - 1];
+        if (e->hash == hash && e->name_len == len && strncasecmp(e->name, name, len) == 0) return e;
+    }
+    int wildcard = suffix_trie_match(&t->wildcards, name, 1);
+    return wildcard >= 0 ? &t->entries[wildcard] : NULL;
+}
+
+static const char *server_scheme(int proto) {
+    return proto == SERVER_TLS ? "tls://" : proto == SERVER_HTTPS ? "https://" : "";
+}
+
+// Parse one server spec (IPv4[:port], IPv6 or [IPv6]:port) into the next
+// server slot. Returns the slot index, or -1 if the spec is invalid or all
+// MAX_DNS_SERVERS slots are taken. A tls:// or https:// prefix selects an
+// encrypted transport: "tls://ADDR[:port][#name]" and
+// "https://ADDR[:port][/path][#name]", where name is what the server
+// certificate is checked against (default: the address itself).
+static int config_add_server(struct dns_config *c, const char *spec) {
+    if (c->server_count >= MAX_DNS_SERVERS) {
+        fprintf(stderr, "[DNS Override] Too many DNS servers, ignoring %s\n", spec);
+        return -1;
     }
     
-    struct addrinfo *original_result = *result;
-    struct addrinfo *new_result = NULL;
-    struct addrinfo *last_new = NULL;
-    struct addrinfo *current = original_result;
-    int removed_count = 0;
-    
-    while (current) {
-        if (current->ai_family == AF_INET6) {
-            // This is an IPv6 address, skip it (don't copy to new result)
-            if (config.debug) {
-                char ipv6_str[INET6_ADDRSTRLEN];
-                struct sockaddr_in6 *ipv6_addr = (struct sockaddr_in6 *)current->ai_addr;
-                if (inet_ntop(AF_INET6, &ipv6_addr->sin6_addr, ipv6_str, sizeof(ipv6_str))) {
-                    fprintf(stderr, "[DNS Override] Filtering out AAAA record: %s\n", ipv6_str);
-                }
-            }
-            removed_count++;
-        } else {
-            // This is an IPv4 address, copy it to new result
-            struct addrinfo *new_ai = malloc(sizeof(struct addrinfo));
-            if (!new_ai) {
-                // Memory allocation failed, clean up and return error
-                if (new_result) {
-                    freeaddrinfo(new_result);
-                }
-                return -1;
-            }
-            
-            // Copy the addrinfo structure
-            memcpy(new_ai, current, sizeof(struct addrinfo));
-            
-            // Allocate and copy the sockaddr structure
-            new_ai->ai_addr = malloc(current->ai_addrlen);
-            if (!new_ai->ai_addr) {
-                free(new_ai);
-                if (new_result) {
-                    freeaddrinfo(new_result);
-                }
-                return -1;
-            }
-            memcpy(new_ai->ai_addr, current->ai_addr, current->ai_addrlen);
-            
-            // Copy canonname if it exists
-            if (current->ai_canonname) {
-                new_ai->ai_canonname = strdup(current->ai_canonname);
-                if (!new_ai->ai_canonname) {
-                    free(new_ai->ai_addr);
-                    free(new_ai);
-                    if (new_result) {
-                        freeaddrinfo(new_result);
-                    }
-                    return -1;
+    char server_addr[46];
+    int port = DEFAULT_DNS_PORT;
+    int family = AF_INET; // Default to IPv4
+    int proto = SERVER_PLAIN;
+    char value[256], tls_name[256] = "", path[128] = DEFAULT_DOH_PATH;
+    
+    if (strncmp(spec, "tls://", 6) == 0) {
+        proto = SERVER_TLS;
+        port = DEFAULT_TLS_PORT;
+        spec += 6;
+    } else if (strncmp(spec, "https://", 8) == 0) {
+        proto = SERVER_HTTPS;
+        port = DEFAULT_HTTPS_PORT;
+        spec += 8;
+    }
+    snprintf(value, sizeof(value), "%s", spec);
+    if (proto != SERVER_PLAIN) {
+#ifndef DNS_OVERRIDE_TLS
+        fprintf(stderr, "[DNS Override] Built without TLS support, ignoring %s%s\n", server_scheme(proto), spec);
+        return -1;
+#endif
+        char *hash = strchr(value, '#');
+        if (hash) {
+            snprintf(tls_name, sizeof(tls_name), "%s", hash + 1);
+            *hash = '\0';
+        }
+        char *slash = strchr(value, '/');
+        if (slash) {
+            if (proto == SERVER_HTTPS && strlen(slash) < sizeof(path)) snprintf(path, sizeof(path), "%s", slash);
+            *slash = '\0';
+        }
+    }
+    
+    // Check if this is an IPv6 address with port: [address]:port
+    if (value[0] == '[') {
+        char *bracket_end = strchr(value, ']');
+        if (bracket_end) {
+            // Extract IPv6 address from brackets
+            size_t addr_len = bracket_end - value - 1;
+            if (addr_len < sizeof(server_addr)) {
+                strncpy(server_addr, value + 1, addr_len);
+                server_addr[addr_len] = '\0';
+                family = AF_INET6;
+                
+                // Check for port after the bracket
+                if (*(bracket_end + 1) == ':') {
+                    port = atoi(bracket_end + 2);
                 }
             } else {
-                new_ai->ai_canonname = NULL;
+                return -1; // Address too long
             }
-            
-            new_ai->ai_next = NULL;
-            
-            // Add to new result chain
-            if (last_new) {
-                last_new->ai_next = new_ai;
+        } else {
+            return -1; // Malformed IPv6 address
+        }
+    } else {
+        // IPv4 address or IPv6 without brackets
+        char *port_str = strrchr(value, ':');
+        
+        // Try to determine if this is IPv6 by checking for multiple colons
+        int colon_count = 0;
+        for (const char *p = value; *p; p++) {
+            if (*p == ':') colon_count++;
+        }
+        
+        if (colon_count > 1) {
+            // Likely IPv6 address without port
+            strncpy(server_addr, value, sizeof(server_addr) - 1);
+            server_addr[sizeof(server_addr) - 1] = '\0';
+            family = AF_INET6;
+        } else if (port_str) {
+            // IPv4 with port
+            size_t addr_len = port_str - value;
+            if (addr_len < sizeof(server_addr)) {
+                strncpy(server_addr, value, addr_len);
+                server_addr[addr_len] = '\0';
+                port = atoi(port_str + 1);
+                family = AF_INET;
             } else {
-                new_result = new_ai;
+                return -1; // Address too long
             }
-            last_new = new_ai;
+        } else {
+            // IPv4 without port
+            strncpy(server_addr, value, sizeof(server_addr) - 1);
+            server_addr[sizeof(server_addr) - 1] = '\0';
+            family = AF_INET;
         }
-        current = current->ai_next;
     }
     
-    // Free the original result and replace with filtered result
-    freeaddrinfo(original_result);
-    *result = new_result;
+    // Validate the address format
+    struct sockaddr_in addr4;
+    struct sockaddr_in6 addr6;
+    int valid = 0;
+    
+    if (family == AF_INET) {
+        valid = (inet_pton(AF_INET, server_addr, &addr4.sin_addr) == 1);
+    } else {
+        valid = (inet_pton(AF_INET6, server_addr, &addr6.sin6_addr) == 1);
+    }
     
-    if (removed_count > 0 && config.debug) {
-        fprintf(stderr, "[DNS Override] Filtered out %d AAAA records\n", removed_count);
+    if (!valid) {
+        fprintf(stderr, "[DNS Override] Invalid DNS server address: %s\n", value);
+        return -1;
     }
     
-    return removed_count;
+    int idx = c->server_count++;
+    snprintf(c->dns_servers[idx], sizeof(c->dns_servers[idx]), "%s", server_addr);
+    c->dns_ports[idx] = port;
+    c->dns_families[idx] = family;
+    c->dns_timeouts[idx] = 0;
+    c->dns_protos[idx] = proto;
+    snprintf(c->dns_tls_names[idx], sizeof(c->dns_tls_names[idx]), "%s", tls_name);
+    snprintf(c->dns_paths[idx], sizeof(c->dns_paths[idx]), "%s", path);
+    if (proto != SERVER_PLAIN) c->encrypted_servers++;
+    return idx;
 }
 
-// Filter out A (IPv4) records from DNS results
-static int filter_a_records(struct addrinfo **result) {
-    if (!config.filter_a || !*result) {
-        return 0;
+// Parse "route SUFFIX SERVER[,SERVER...] [timeout=MS]" into a new route
+static void config_add_route(struct dns_config *c, const char *suffix, char *options) {
+    if (c->route_count >= MAX_ROUTES) {
+        fprintf(stderr, "[DNS Override] Too many routes, ignoring %s\n", suffix);
+        return;
     }
+    if (strncmp(suffix, "*.", 2) == 0) suffix += 2;
     
-    struct addrinfo *original_result = *result;
-    struct addrinfo *new_result = NULL;
-    struct addrinfo *last_new = NULL;
-    struct addrinfo *current = original_result;
-    int removed_count = 0;
-    
-    while (current) {
-        if (current->ai_family == AF_INET) {
-            // This is an IPv4 address, skip it (don't copy to new result)
-            if (config.debug) {
-                char ipv4_str[INET_ADDRSTRLEN];
-                struct sockaddr_in *ipv4_addr = (struct sockaddr_in *)current->ai_addr;
-                if (inet_ntop(AF_INET, &ipv4_addr->sin_addr, ipv4_str, sizeof(ipv4_str))) {
-                    fprintf(stderr, "[DNS Override] Filtering out A record: %s\n", ipv4_str);
-                }
-            }
-            removed_count++;
+    char *saveptr = NULL;
+    char *servers = strtok_r(options, " \t", &saveptr);
+    int timeout = 0;
+    for (char *opt = strtok_r(NULL, " \t", &saveptr); opt; opt = strtok_r(NULL, " \t", &saveptr)) {
+        if (strncmp(opt, "timeout=", 8) == 0) {
+            timeout = atoi(opt + 8);
+            if (timeout < 0) timeout = 0;
         } else {
-            // This is an IPv6 address, copy it to new result
-            struct addrinfo *new_ai = malloc(sizeof(struct addrinfo));
-            if (!new_ai) {
-                // Memory allocation failed, clean up and return error
-                if (new_result) {
-                    freeaddrinfo(new_result);
-                }
-                return -1;
-            }
-            
-            // Copy the addrinfo structure
-            memcpy(new_ai, current, sizeof(struct addrinfo));
-            
-            // Allocate and copy the sockaddr structure
-            new_ai->ai_addr = malloc(current->ai_addrlen);
-            if (!new_ai->ai_addr) {
-                free(new_ai);
-                if (new_result) {
-                    freeaddrinfo(new_result);
-                }
-                return -1;
-            }
-            memcpy(new_ai->ai_addr, current->ai_addr, current->ai_addrlen);
-            
-            // Copy canonname if it exists
-            if (current->ai_canonname) {
-                new_ai->ai_canonname = strdup(current->ai_canonname);
-                if (!new_ai->ai_canonname) {
-                    free(new_ai->ai_addr);
-                    free(new_ai);
-                    if (new_result) {
-                        freeaddrinfo(new_result);
-                    }
-                    return -1;
-                }
-            } else {
-                new_ai->ai_canonname = NULL;
-            }
-            
-            new_ai->ai_next = NULL;
-            
-            // Add to new result chain
-            if (last_new) {
-                last_new->ai_next = new_ai;
-            } else {
-                new_result = new_ai;
-            }
-            last_new = new_ai;
+            fprintf(stderr, "[DNS Override] Unknown route option: %s\n", opt);
         }
-        current = current->ai_next;
     }
     
-    // Free the original result and replace with filtered result
-    freeaddrinfo(original_result);
-    *result = new_result;
-    
-    if (removed_count > 0 && config.debug) {
-        fprintf(stderr, "[DNS Override] Filtered out %d A records\n", removed_count);
+    struct dns_route *route = &c->routes[c->route_count];
+    memset(route, 0, sizeof(*route));
+    char *server_saveptr = NULL;
+    for (char *server = servers ? strtok_r(servers, ",", &server_saveptr) : NULL; server;
+         server = strtok_r(NULL, ",", &server_saveptr)) {
+        // Every route gets server slots of its own, so also its own health
+        int idx = config_add_server(c, server);
+        if (idx < 0) continue;
+        c->dns_timeouts[idx] = timeout;
+        route->servers[route->count++] = idx;
+    }
+    if (route->count == 0) {
+        fprintf(stderr, "[DNS Override] Route %s has no valid servers, ignoring it\n", suffix);
+        return;
     }
     
-    return removed_count;
+    snprintf(route->suffix, sizeof(route->suffix), "%s", suffix);
+    if (suffix_trie_insert(&c->route_trie, route->suffix, c->route_count) != 0) return;
+    c->route_count++;
+    fprintf(stderr, "[DNS Override] Added route for %s: %d servers\n", route->suffix, route->count);
 }
 
-// Perform DNS query using custom DNS server
-static int query_custom_dns(const char *hostname, int query_type, void *result_buffer, size_t buffer_size) {
-    load_dns_config();
-    
-    if (config.debug) {
-        fprintf(stderr, "[DNS Override] Querying custom DNS for %s (type %d)\n", hostname, query_type);
+// Fall back to public resolvers when no dns_server line gave any
+static void config_use_default_servers(struct dns_config *c) {
+    static const char *const defaults[] = { "8.8.8.8", "1.1.1.1" };
+    for (int i = 0; i < 2; i++) {
+        int idx = config_add_server(c, defaults[i]);
+        if (idx >= 0) c->routes[0].servers[c->routes[0].count++] = idx;
     }
-    
-    // Try each configured DNS server
-    for (int server_idx = 0; server_idx < config.server_count; server_idx++) {
-        int sockfd;
-        int family = config.dns_families[server_idx];
-        
-        // Create socket with appropriate family (IPv4 or IPv6)
-        sockfd = socket(family, config.use_tcp ? SOCK_STREAM : SOCK_DGRAM, 0);
-        if (sockfd < 0) {
-            continue;
+}
+
+// Read all of fd into a NUL-terminated buffer with as few read() calls as
+// its size allows. Returns NULL on failure; *len excludes the NUL.
+static char *config_read_all(int fd, off_t size_hint, size_t *len) {
+    size_t cap = (size_hint > 0 ? (size_t)size_hint : 0) + 1;
+    char *text = malloc(cap);
+    size_t used = 0;
+    while (text) {
+        if (used + 1 == cap) {
+            char *grown = realloc(text, 2 * cap);
+            if (!grown) break;
+            text = grown;
+            cap *= 2;
         }
-        
-        // Set socket timeout
-        struct timeval timeout;
-        timeout.tv_sec = config.timeout_ms / 1000;
-        timeout.tv_usec = (config.timeout_ms % 1000) * 1000;
-        setsockopt(sockfd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
-        setsockopt(sockfd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
-        
-        // Setup server address based on family
-        if (family == AF_INET) {
-            // IPv4 setup
-            struct sockaddr_in server_addr4;
-            memset(&server_addr4, 0, sizeof(server_addr4));
-            server_addr4.sin_family = AF_INET;
-            server_addr4.sin_port = htons(config.dns_ports[server_idx]);
-            
-            if (inet_pton(AF_INET, config.dns_servers[server_idx], &server_addr4.sin_addr) != 1) {
-                close(sockfd);
-                continue;
-            }
-            
-            // Connect to IPv4 DNS server
-            if (connect(sockfd, (struct sockaddr*)&server_addr4, sizeof(server_addr4)) < 0) {
-                close(sockfd);
-                continue;
-            }
-        } else if (family == AF_INET6) {
-            // IPv6 setup
-            struct sockaddr_in6 server_addr6;
-            memset(&server_addr6, 0, sizeof(server_addr6));
-            server_addr6.sin6_family = AF_INET6;
-            server_addr6.sin6_port = htons(config.dns_ports[server_idx]);
-            
-            if (inet_pton(AF_INET6, config.dns_servers[server_idx], &server_addr6.sin6_addr) != 1) {
-                close(sockfd);
-                continue;
+        ssize_t n = read(fd, text + used, cap - 1 - used);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) {
+            if (n == 0) {
+                text[used] = '\0';
+                *len = used;
+                return text;
             }
-            
-            // Connect to IPv6 DNS server
-            if (connect(sockfd, (struct sockaddr*)&server_addr6, sizeof(server_addr6)) < 0) {
-                close(sockfd);
-                continue;
-            }
-        } else {
-            close(sockfd);
-            continue;
-        }
-        
-        // For simplicity, we'll use the system's resolver but modify the nameserver
-        // This is a simplified approach - a full implementation would build DNS packets
-        close(sockfd);
-        
-        if (config.debug) {
-            const char* family_str = (family == AF_INET6) ? "IPv6" : "IPv4";
-            fprintf(stderr, "[DNS Override] Using %s DNS server %s:%d\n", 
-                   family_str, config.dns_servers[server_idx], config.dns_ports[server_idx]);
+            break;
         }
-        
-        // Modify resolv.conf temporarily or use res_ninit with custom configuration
-        // For now, we'll use a different approach by calling the original function
-        // but with modified resolver state
-        return 1; // Success indicator
+        used += n;
     }
-    
-    return 0; // Failed to query any server
+    free(text);
+    return NULL;
 }
 
-// Override gethostbyname to use custom DNS servers
-struct hostent *gethostbyname(const char *name) {
-    init_original_functions();
-    load_dns_config();
+// Split a config line in place into "key value [options...]". Returns 0 for
+// lines with fewer than two words; options is "" when there are none.
+static int config_split_line(char *line, char **key, char **value, char **options) {
+    char *p = line + strspn(line, " \t");
+    *key = p;
+    p += strcspn(p, " \t");
+    if (!*p) return 0;
+    *p++ = '\0';
+    p += strspn(p, " \t");
+    if (!*p) return 0;
+    *value = p;
+    p += strcspn(p, " \t");
+    if (*p) *p++ = '\0';
+    *options = p + strspn(p, " \t");
+    return 1;
+}
+
+// Read the config file from scratch into c, which the caller has zeroed
+static void load_dns_config(struct dns_config *c) {
+    // Set defaults
+    c->server_count = 0;
+    c->encrypted_servers = 0;
+    c->route_count = 1; // routes[0] holds the dns_server lines
+    c->attempt_timeout_ms = DEFAULT_ATTEMPT_TIMEOUT_MS;
+    c->total_timeout_ms = 0;
+    c->retries = DEFAULT_RETRIES;
+    c->use_tcp = 0;
+    c->tcp_idle_timeout_ms = DEFAULT_TCP_IDLE_TIMEOUT_MS;
+    c->edns_udp_size = DEFAULT_EDNS_UDP_SIZE;
+    c->debug = 0;
+    c->enable_dns64 = 0;
+    c->filter_aaaa = 0;
+    c->filter_a = 0;  // Default: don't filter A records
+    c->result_order = RESULT_ORDER_UPSTREAM;
+    c->resolver = RESOLVER_GLIBC;
+    c->query_strategy = QUERY_SEQUENTIAL;
+    c->query_stagger_ms = DEFAULT_QUERY_STAGGER_MS;
+    c->query_parallelism = 0;
+    c->cache_size = 0;
+    c->cache_max_bytes = DEFAULT_CACHE_MAX_BYTES;
+    c->cache_min_ttl = DEFAULT_CACHE_MIN_TTL;
+    c->cache_max_ttl = DEFAULT_CACHE_MAX_TTL;
+    c->negative_ttl = DEFAULT_NEGATIVE_TTL;
+    c->serve_stale = 0;
+    c->prefetch_threshold = 0;
+    c->reload_interval = DEFAULT_RELOAD_INTERVAL;
+    c->reload_on_sighup = 0;
+    c->shared_cache_slots = DEFAULT_SHARED_CACHE_SLOTS;
+    c->cache_snapshot_interval = DEFAULT_CACHE_SNAPSHOT_INTERVAL;
+    c->stats_signal = 0;
+    snprintf(c->stats_dir, sizeof(c->stats_dir), "%s", DEFAULT_STATS_DIR);
+    c->log_level = -1; // Unset; resolved against "debug" after parsing
+    c->log_sample = 1;
+    c->log_name_count = 0;
+    c->log_sink = LOG_SINK_STDERR;
+    strncpy(c->dns64_prefix, "64:ff9b::", sizeof(c->dns64_prefix) - 1);
+    c->dns64_prefix[sizeof(c->dns64_prefix) - 1] = '\0';
     
-    if (config.debug) {
-        fprintf(stderr, "[DNS Override] gethostbyname called for: %s\n", name);
+    const char* config_file = get_config_file_path();
+    int fd = open(config_file, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        // Use default DNS servers if no config file
+        config_use_default_servers(c);
+        fprintf(stderr, "[DNS Override] Config file not found: %s\n", config_file);
+        fprintf(stderr, "[DNS Override] Using default DNS servers: 8.8.8.8, 1.1.1.1\n");
+        c->log_level = LOG_LEVEL_ERROR;
+        precompute_server_addresses(c);
+        parse_dns64_prefix(c);
+        return;
     }
     
-    // Save original resolver state
-    struct __res_state original_state;
-    memcpy(&original_state, &_res, sizeof(_res));
-    
-    // Modify resolver to use our DNS servers
-    res_init();
-    _res.nscount = 0;
-    
-    for (int i = 0; i < config.server_count && i < MAXNS; i++) {
-        struct sockaddr_in *ns = (struct sockaddr_in*)&_res.nsaddr_list[i];
-        memset(ns, 0, sizeof(*ns));
-        ns->sin_family = AF_INET;
-        ns->sin_port = htons(config.dns_ports[i]);
-        
-        if (inet_pton(AF_INET, config.dns_servers[i], &ns->sin_addr) == 1) {
-            _res.nscount++;
-            if (config.debug) {
-                fprintf(stderr, "[DNS Override] Using nameserver: %s:%d\n", 
-                       config.dns_servers[i], config.dns_ports[i]);
-            }
-        }
+    if (c->debug) {
+        fprintf(stderr, "[DNS Override] Loading configuration from: %s\n", config_file);
     }
     
-    // Set timeout
-    _res.retrans = config.timeout_ms / 1000;
-    _res.retry = 2;
-    
-    // Call original function with modified resolver
-    struct hostent *result = original_gethostbyname(name);
+    // Remember exactly which version of the file this snapshot reflects,
+    // then take the whole file in one read rather than line by line
+    struct stat st;
+    off_t size_hint = 0;
+    if (fstat(fd, &st) == 0) {
+        config_file_identity(&st, &c->file_id);
+        size_hint = st.st_size;
+    }
+    size_t text_len = 0;
+    char *text = config_read_all(fd, size_hint, &text_len);
+    close(fd);
+    if (!text) {
+        fprintf(stderr, "[DNS Override] Cannot read %s: %s\n", config_file, strerror(errno));
+    }
     
-    // Restore original resolver state
-    memcpy(&_res, &original_state, sizeof(_res));
+    struct hosts_builder hosts = {0};
+    char line[512];
+    const char *end = text ? text + text_len : NULL;
+    for (const char *pos = text; pos && pos < end;) {
+        const char *eol = memchr(pos, '\n', end - pos);
+        if (!eol) eol = end;
+        size_t len = eol - pos < (ptrdiff_t)sizeof(line) ? (size_t)(eol - pos) : sizeof(line) - 1;
+        memcpy(line, pos, len);
+        line[len] = '\0';
+        pos = eol < end ? eol + 1 : end;
+        
+        // Skip comments and empty lines
+        if (line[0] == '#' || line[0] == '\0' || line[0] == '\r') continue;
+        
+        // Remove trailing carriage return
+        line[strcspn(line, "\r")] = 0;
+        
+        char *key, *value, *options;
+        if (config_split_line(line, &key, &value, &options)) {
+            if (strcmp(key, "dns_server") == 0) {
+                int idx = config_add_server(c, value);
+                if (idx >= 0) {
+                    // Options after the address, e.g. "timeout=200"
+                    char *saveptr = NULL;
+                    for (char *opt = strtok_r(options, " \t", &saveptr); opt; opt = strtok_r(NULL, " \t", &saveptr)) {
+                        if (strncmp(opt, "timeout=", 8) == 0) {
+                            c->dns_timeouts[idx] = atoi(opt + 8);
+                            if (c->dns_timeouts[idx] < 0) {
+                                c->dns_timeouts[idx] = 0;
+                            }
+                        } else {
+                            fprintf(stderr, "[DNS Override] Unknown dns_server option: %s\n", opt);
+                        }
+                    }
+                    
+                    c->routes[0].servers[c->routes[0].count++] = idx;
+                    const char* family_str = (c->dns_families[idx] == AF_INET6) ? "IPv6" : "IPv4";
+                    fprintf(stderr, "[DNS Override] Added %s DNS server: %s%s:%d\n", 
+                           family_str, server_scheme(c->dns_protos[idx]), c->dns_servers[idx], c->dns_ports[idx]);
+                }
+            } else if (strcmp(key, "route") == 0) {
+                config_add_route(c, value, options);
+            } else if (strcmp(key, "timeout") == 0 || strcmp(key, "attempt_timeout_ms") == 0) {
+                // "timeout" is the original name of the per-attempt timeout
+                c->attempt_timeout_ms = atoi(value);
+                if (c->attempt_timeout_ms < 1) c->attempt_timeout_ms = 1;
+            } else if (strcmp(key, "total_timeout_ms") == 0) {
+                c->total_timeout_ms = atoi(value);
+                if (c->total_timeout_ms < 0) c->total_timeout_ms = 0;
+            } else if (strcmp(key, "retries") == 0) {
+                c->retries = atoi(value);
+                if (c->retries < 0) c->retries = 0;
+            } else if (strcmp(key, "use_tcp") == 0) {
+                c->use_tcp = (strcmp(value, "true") == 0 || strcmp(value, "1") == 0);
+            } else if (strcmp(key, "tcp_idle_timeout_ms") == 0) {
+                c->tcp_idle_timeout_ms = atoi(value);
+                if (c->tcp_idle_timeout_ms < 0) c->tcp_idle_timeout_ms = 0;
+            } else if (strcmp(key, "edns_udp_size") == 0) {
+                // RFC 6891: payloads below 512 are treated as 512
+                c->edns_udp_size = atoi(value);
+                if (c->edns_udp_size < 0) c->edns_udp_size = 0;
+                if (c->edns_udp_size > 0 && c->edns_udp_size < 512) c->edns_udp_size = 512;
+                if (c->edns_udp_size > MAX_EDNS_UDP_SIZE) c->edns_udp_size = MAX_EDNS_UDP_SIZE;
+            } else if (strcmp(key, "debug") == 0) {
+                c->debug = (strcmp(value, "true") == 0 || strcmp(value, "1") == 0);
+            } else if (strcmp(key, "enable_dns64") == 0) {
+                c->enable_dns64 = (strcmp(value, "true") == 0 || strcmp(value, "1") == 0);
+                if (c->enable_dns64) {
+                    fprintf(stderr, "[DNS Override] DNS64 synthesis enabled\n");
+                }
+            } else if (strcmp(key, "dns64_prefix") == 0) {
+                strncpy(c->dns64_prefix, value, sizeof(c->dns64_prefix) - 1);
+                c->dns64_prefix[sizeof(c->dns64_prefix) - 1] = '\0';
+                fprintf(stderr, "[DNS Override] DNS64 prefix: %s\n", c->dns64_prefix);
+            } else if (strcmp(key, "filter_aaaa") == 0) {
+                c->filter_aaaa = (strcmp(value, "true") == 0 || strcmp(value, "1") == 0);
+                if (c->filter_aaaa) {
+                    fprintf(stderr, "[DNS Override] AAAA record filtering enabled - native IPv6 addresses will be removed\n");
+                }
+            } else if (strcmp(key, "filter_a") == 0) {
+                c->filter_a = (strcmp(value, "true") == 0 || strcmp(value, "1") == 0);
+                if (c->filter_a) {
+                    fprintf(stderr, "[DNS Override] A record filtering enabled - IPv4 addresses will be removed from final results\n");
+                }
+            } else if (strcmp(key, "result_order") == 0) {
+                if (strcmp(value, "upstream") == 0) {
+                    c->result_order = RESULT_ORDER_UPSTREAM;
+                } else if (strcmp(value, "rfc6724") == 0) {
+                    c->result_order = RESULT_ORDER_RFC6724;
+                } else if (strcmp(value, "dns64-first") == 0) {
+                    c->result_order = RESULT_ORDER_DNS64_FIRST;
+                } else if (strcmp(value, "round-robin") == 0) {
+                    c->result_order = RESULT_ORDER_ROUND_ROBIN;
+                } else if (strcmp(value, "rtt") == 0) {
+                    c->result_order = RESULT_ORDER_RTT;
+                } else {
+                    fprintf(stderr, "[DNS Override] Unknown result_order: %s\n", value);
+                }
+            } else if (strcmp(key, "resolver") == 0) {
+                if (strcmp(value, "reentrant") == 0) {
+                    c->resolver = RESOLVER_REENTRANT;
+                    fprintf(stderr, "[DNS Override] Using re-entrant per-thread resolver\n");
+                } else if (strcmp(value, "native") == 0) {
+                    c->resolver = RESOLVER_NATIVE;
+                    fprintf(stderr, "[DNS Override] Using built-in DNS client\n");
+                } else if (strcmp(value, "glibc") == 0) {
+                    c->resolver = RESOLVER_GLIBC;
+                } else {
+                    fprintf(stderr, "[DNS Override] Unknown resolver: %s\n", value);
+                }
+            } else if (strcmp(key, "query_strategy") == 0) {
+                if (strcmp(value, "sequential") == 0) {
+                    c->query_strategy = QUERY_SEQUENTIAL;
+                } else if (strcmp(value, "parallel") == 0) {
+                    c->query_strategy = QUERY_PARALLEL;
+                } else if (strcmp(value, "staggered") == 0) {
+                    c->query_strategy = QUERY_STAGGERED;
+                } else {
+                    fprintf(stderr, "[DNS Override] Unknown query_strategy: %s\n", value);
+                }
+            } else if (strcmp(key, "query_stagger_ms") == 0) {
+                c->query_stagger_ms = atoi(value);
+                if (c->query_stagger_ms < 1) c->query_stagger_ms = 1;
+            } else if (strcmp(key, "query_parallelism") == 0) {
+                c->query_parallelism = atoi(value);
+                if (c->query_parallelism < 0) c->query_parallelism = 0;
+            } else if (strcmp(key, "cache_size") == 0) {
+                c->cache_size = atoi(value);
+                if (c->cache_size < 0) c->cache_size = 0;
+            } else if (strcmp(key, "cache_max_bytes") == 0) {
+                // Bytes, or with a K, M or G suffix
+                char *end;
+                unsigned long long bytes = strtoull(value, &end, 10);
+                if (*end == 'K' || *end == 'k') bytes <<= 10;
+                else if (*end == 'M' || *end == 'm') bytes <<= 20;
+                else if (*end == 'G' || *end == 'g') bytes <<= 30;
+                c->cache_max_bytes = bytes;
+            } else if (strcmp(key, "cache_min_ttl") == 0) {
+                c->cache_min_ttl = atoi(value);
+                if (c->cache_min_ttl < 0) c->cache_min_ttl = 0;
+            } else if (strcmp(key, "cache_max_ttl") == 0) {
+                c->cache_max_ttl = atoi(value);
+                if (c->cache_max_ttl < 0) c->cache_max_ttl = 0;
+            } else if (strcmp(key, "negative_ttl") == 0) {
+                c->negative_ttl = atoi(value);
+                if (c->negative_ttl < 0) c->negative_ttl = 0;
+            } else if (strcmp(key, "serve_stale") == 0) {
+                c->serve_stale = atoi(value);
+                if (c->serve_stale < 0) c->serve_stale = 0;
+            } else if (strcmp(key, "prefetch_threshold") == 0) {
+                c->prefetch_threshold = atoi(value);
+                if (c->prefetch_threshold < 0) c->prefetch_threshold = 0;
+                if (c->prefetch_threshold > 100) c->prefetch_threshold = 100;
+            } else if (strcmp(key, "reload_interval") == 0) {
+                c->reload_interval = atoi(value);
+                if (c->reload_interval < 0) c->reload_interval = 0;
+            } else if (strcmp(key, "reload_on_sighup") == 0) {
+                c->reload_on_sighup = (strcmp(value, "true") == 0 || strcmp(value, "1") == 0);
+            } else if (strcmp(key, "shared_cache") == 0) {
+                snprintf(c->shared_cache_path, sizeof(c->shared_cache_path), "%s", value);
+            } else if (strcmp(key, "cache_snapshot") == 0) {
+                snprintf(c->cache_snapshot_path, sizeof(c->cache_snapshot_path), "%s", value);
+            } else if (strcmp(key, "cache_snapshot_interval") == 0) {
+                c->cache_snapshot_interval = atoi(value);
+                if (c->cache_snapshot_interval < 0) c->cache_snapshot_interval = 0;
+            } else if (strcmp(key, "stats_signal") == 0) {
+                if (strcasecmp(value, "usr1") == 0 || strcasecmp(value, "SIGUSR1") == 0) {
+                    c->stats_signal = SIGUSR1;
+                } else if (strcasecmp(value, "usr2") == 0 || strcasecmp(value, "SIGUSR2") == 0) {
+                    c->stats_signal = SIGUSR2;
+                } else if (strcmp(value, "none") == 0) {
+                    c->stats_signal = 0;
+                } else {
+                    fprintf(stderr, "[DNS Override] Unknown stats_signal: %s\n", value);
+                }
+            } else if (strcmp(key, "stats_dir") == 0) {
+                snprintf(c->stats_dir, sizeof(c->stats_dir), "%s", value);
+            } else if (strcmp(key, "shared_cache_slots") == 0) {
+                c->shared_cache_slots = atoi(value);
+                if (c->shared_cache_slots < 1) c->shared_cache_slots = 1;
+            } else if (strcmp(key, "host") == 0) {
+                char *saveptr = NULL;
+                int added = 0;
+                for (char *addr = strtok_r(options, " \t", &saveptr); addr; addr = strtok_r(NULL, " \t", &saveptr)) {
+                    hosts_builder_add(&hosts, value, addr);
+                    added++;
+                }
+                if (!added) {
+                    fprintf(stderr, "[DNS Override] host %s has no addresses\n", value);
+                }
+            } else if (strcmp(key, "hosts_file") == 0) {
+                snprintf(c->hosts_file, sizeof(c->hosts_file), "%s", value);
+            } else if (strcmp(key, "log_level") == 0) {
+                if (strcmp(value, "error") == 0) {
+                    c->log_level = LOG_LEVEL_ERROR;
+                } else if (strcmp(value, "warn") == 0) {
+                    c->log_level = LOG_LEVEL_WARN;
+                } else if (strcmp(value, "info") == 0) {
+                    c->log_level = LOG_LEVEL_INFO;
+                } else if (strcmp(value, "trace") == 0) {
+                    c->log_level = LOG_LEVEL_TRACE;
+                } else {
+                    fprintf(stderr, "[DNS Override] Unknown log_level: %s\n", value);
+                }
+            } else if (strcmp(key, "log_sample") == 0) {
+                // "1/1000" or just "1000"
+                int num = 1, den = 1;
+                if (strchr(value, '/')) {
+                    sscanf(value, "%d/%d", &num, &den);
+                } else {
+                    den = atoi(value);
+                }
+                c->log_sample = (num > 0 && den >= num) ? den / num : 1;
+            } else if (strcmp(key, "log_name") == 0) {
+                if (c->log_name_count < MAX_LOG_NAMES) {
+                    const char *name = strncmp(value, "*.", 2) == 0 ? value + 2 : value;
+                    snprintf(c->log_names[c->log_name_count], sizeof(c->log_names[0]), "%s", name);
+                    size_t len = strlen(c->log_names[c->log_name_count]);
+                    if (len > 1 && c->log_names[c->log_name_count][len - 1] == '.') {
+                        c->log_names[c->log_name_count][len - 1] = '\0';
+                    }
+                    c->log_name_count++;
+                } else {
+                    fprintf(stderr, "[DNS Override] Too many log_name lines, ignoring %s\n", value);
+                }
+            } else if (strcmp(key, "log_file") == 0) {
+                if (strcmp(value, "stderr") == 0) {
+                    c->log_sink = LOG_SINK_STDERR;
+                } else if (strcmp(value, "syslog") == 0) {
+                    c->log_sink = LOG_SINK_SYSLOG;
+                } else {
+                    c->log_sink = LOG_SINK_FILE;
+                    snprintf(c->log_path, sizeof(c->log_path), "%s", value);
+                }
+            }
+        }
+    }
+    
+    free(text);
+    
+    if (c->encrypted_servers && c->resolver != RESOLVER_NATIVE) {
+        fprintf(stderr, "[DNS Override] tls:// and https:// servers need resolver native; they are skipped\n");
+    }
+    if (c->hosts_file[0]) {
+        hosts_builder_read_file(&hosts, c->hosts_file);
+    }
+    c->hosts = hosts_table_build(&hosts);
+    if (c->hosts) {
+        fprintf(stderr, "[DNS Override] Static host table: %u names\n", c->hosts->entry_count);
+    }
+    
+    if (c->log_level < 0) {
+        c->log_level = c->debug ? LOG_LEVEL_TRACE : LOG_LEVEL_ERROR;
+    }
+    if (c->cache_max_ttl < c->cache_min_ttl) {
+        c->cache_max_ttl = c->cache_min_ttl;
+    }
+    if (c->cache_size > 0) {
+        fprintf(stderr, "[DNS Override] Answer cache enabled: %d entries, %zu KB, TTL %d-%ds, negative TTL %ds\n",
+               c->cache_size, c->cache_max_bytes >> 10, c->cache_min_ttl, c->cache_max_ttl, c->negative_ttl);
+    }
+    
+    // If no servers were configured, use defaults
+    if (c->routes[0].count == 0) {
+        config_use_default_servers(c);
+        fprintf(stderr, "[DNS Override] No servers configured, using defaults\n");
+    }
+    
+    precompute_server_addresses(c);
+    parse_dns64_prefix(c);
+}
+
+// Initialize original function pointers
+static void init_original_functions() {
+    if (!original_getaddrinfo) {
+        original_getaddrinfo = dlsym(RTLD_NEXT, "getaddrinfo");
+    }
+    if (!original_freeaddrinfo) {
+        original_freeaddrinfo = dlsym(RTLD_NEXT, "freeaddrinfo");
+    }
+    if (!original_getnameinfo) {
+        original_getnameinfo = dlsym(RTLD_NEXT, "getnameinfo");
+    }
+}
+
+// ---------------------------------------------------------------------------
+// Runtime statistics
+//
+// Counters are always on. Every thread owns a block of counters and is the
+// only writer to it, so bumping a counter is a relaxed load and store on a
+// cache line no other thread writes: no lock and no atomic read-modify-write.
+// Readers add up all blocks. Blocks are never freed; a thread that exits
+// hands its block (and its totals) to the next new thread.
+//
+// With stats_signal set, that signal makes the process write its totals to
+// <stats_dir>/dns_override.<pid>.stats. The dump runs in the signal handler
+// and only uses async-signal-safe calls, so no thread is needed while
+// nobody is reading. The file is first written when the handler is
+// installed; "dns_config.sh stats" signals only processes that have one and
+// then prints the files.
+// ---------------------------------------------------------------------------
+
+enum {
+    STAT_GETADDRINFO,
+    STAT_GETHOSTBYNAME,
+    STAT_RES_QUERY,
+    STAT_GETNAMEINFO,
+    STAT_ASYNC,
+    STAT_CACHE_HIT,
+    STAT_CACHE_MISS,
+    STAT_CACHE_STALE,
+    STAT_SHARED_CACHE_HIT,
+    STAT_PREFETCH,
+    STAT_FILTERED_AAAA,
+    STAT_FILTERED_A,
+    STAT_DNS64_SYNTHESIZED,
+    STAT_COALESCED,
+    STAT_HOST_OVERRIDE,
+    STAT_TCP_CONNECT,
+    STAT_TCP_REUSE,
+    STAT_TLS_HANDSHAKE,
+    STAT_TLS_RESUMED,
+    STAT_COUNT
+};
+
+static const char *const stat_names[STAT_COUNT] = {
+    "lookups_getaddrinfo", "lookups_gethostbyname", "lookups_res_query",
+    "lookups_getnameinfo", "lookups_async", "cache_hits", "cache_misses",
+    "cache_stale", "shared_cache_hits", "prefetches", "filtered_aaaa", "filtered_a",
+    "dns64_synthesized", "coalesced_lookups", "host_overrides", "tcp_connects",
+    "tcp_reuses", "tls_handshakes", "tls_resumed",
+};
+
+enum { SERVER_QUERIES, SERVER_TIMEOUTS, SERVER_ERRORS, SERVER_STAT_COUNT };
+
+// Upper bounds (ms) of the RTT histogram buckets; the last bucket is open
+#define RTT_BUCKETS 12
+static const int rtt_bucket_ms[RTT_BUCKETS - 1] = { 1, 2, 5, 10, 20, 50, 100, 200, 500, 1000, 2000 };
+
+struct stats_block {
+    struct stats_block *next; // Registry link
+    _Atomic int in_use;
+    _Atomic uint64_t counters[STAT_COUNT];
+    _Atomic uint64_t server[MAX_DNS_SERVERS][SERVER_STAT_COUNT];
+    _Atomic uint64_t rtt[MAX_DNS_SERVERS][RTT_BUCKETS];
+} __attribute__((aligned(64)));
+
+// Used by threads that could not get a block of their own
+static struct stats_block stats_shared_block = { .in_use = 1 };
+static struct stats_block *_Atomic stats_blocks = &stats_shared_block;
+static __thread struct stats_block *stats_block = NULL;
+static pthread_once_t stats_once = PTHREAD_ONCE_INIT;
+static pthread_key_t stats_key;
+
+// Dump target and server labels, copied from the config snapshot so the
+// signal handler never touches a snapshot
+static char stats_dir[256] = "/tmp";
+static char stats_server_names[MAX_DNS_SERVERS][INET6_ADDRSTRLEN + 8];
+static _Atomic int stats_server_count = 0;
+static int stats_signal_installed = 0; // Signal number, 0 if none
+
+// Lookups currently leading a coalesced flight (see flight_join())
+static _Atomic int flights_in_progress = 0;
+static struct sigaction stats_saved_action;
+
+static void stats_block_release(void *arg) {
+    struct stats_block *b = arg;
+    atomic_store(&b->in_use, 0);
+}
+
+static void stats_key_init() {
+    pthread_key_create(&stats_key, stats_block_release);
+}
+
+static struct stats_block *get_stats_block() {
+    if (stats_block) return stats_block;
+    
+    pthread_once(&stats_once, stats_key_init);
+    
+    struct stats_block *b;
+    for (b = atomic_load(&stats_blocks); b; b = b->next) {
+        int expected = 0;
+        if (atomic_compare_exchange_strong(&b->in_use, &expected, 1)) break;
+    }
+    if (!b) {
+        if (posix_memalign((void **)&b, 64, sizeof(*b)) != 0) {
+            stats_block = &stats_shared_block;
+            return stats_block;
+        }
+        memset(b, 0, sizeof(*b));
+        atomic_init(&b->in_use, 1);
+        b->next = atomic_load(&stats_blocks);
+        while (!atomic_compare_exchange_weak(&stats_blocks, &b->next, b)) {
+        }
+    }
+    
+    pthread_setspecific(stats_key, b);
+    stats_block = b;
+    return b;
+}
+
+static inline void stat_bump(_Atomic uint64_t *counter, uint64_t n) {
+    atomic_store_explicit(counter, atomic_load_explicit(counter, memory_order_relaxed) + n,
+                          memory_order_relaxed);
+}
+
+static void stat_add(int stat, uint64_t n) {
+    if (n) stat_bump(&get_stats_block()->counters[stat], n);
+}
+
+static void stat_server(int server, int stat) {
+    stat_bump(&get_stats_block()->server[server][stat], 1);
+}
+
+static void stat_server_rtt(int server, int64_t rtt_us) {
+    int bucket = 0;
+    while (bucket < RTT_BUCKETS - 1 && rtt_us > (int64_t)rtt_bucket_ms[bucket] * 1000) {
+        bucket++;
+    }
+    stat_bump(&get_stats_block()->rtt[server][bucket], 1);
+}
+
+// Zero a server slot's counters in every block, as the slot now stands
+// for a different server
+static void stats_server_reset(int server) {
+    for (struct stats_block *b = atomic_load(&stats_blocks); b; b = b->next) {
+        for (int i = 0; i < SERVER_STAT_COUNT; i++) {
+            atomic_store_explicit(&b->server[server][i], 0, memory_order_relaxed);
+        }
+        for (int i = 0; i < RTT_BUCKETS; i++) {
+            atomic_store_explicit(&b->rtt[server][i], 0, memory_order_relaxed);
+        }
+    }
+}
+
+static uint64_t stats_sum(size_t offset) {
+    uint64_t total = 0;
+    for (struct stats_block *b = atomic_load(&stats_blocks); b; b = b->next) {
+        total += atomic_load_explicit((_Atomic uint64_t *)((char *)b + offset), memory_order_relaxed);
+    }
+    return total;
+}
+
+// Minimal async-signal-safe formatting into a fixed buffer
+struct stats_buf {
+    char data[8192];
+    size_t len;
+};
+
+static void stats_puts(struct stats_buf *out, const char *s) {
+    while (*s && out->len < sizeof(out->data)) {
+        out->data[out->len++] = *s++;
+    }
+}
+
+static void stats_putu(struct stats_buf *out, uint64_t v) {
+    char digits[24];
+    int n = 0;
+    do {
+        digits[n++] = '0' + v % 10;
+        v /= 10;
+    } while (v);
+    while (n && out->len < sizeof(out->data)) {
+        out->data[out->len++] = digits[--n];
+    }
+}
+
+// Format the process totals, one "key value" per line
+static void stats_format(struct stats_buf *out) {
+    out->len = 0;
+    stats_puts(out, "pid ");
+    stats_putu(out, (uint64_t)getpid());
+    stats_puts(out, "\n");
+    for (int i = 0; i < STAT_COUNT; i++) {
+        stats_puts(out, stat_names[i]);
+        stats_puts(out, " ");
+        stats_putu(out, stats_sum(offsetof(struct stats_block, counters) + i * sizeof(uint64_t)));
+        stats_puts(out, "\n");
+    }
+    stats_puts(out, "inflight_lookups ");
+    stats_putu(out, (uint64_t)atomic_load(&flights_in_progress));
+    stats_puts(out, "\n");
+    
+    static const char *const server_stat_names[SERVER_STAT_COUNT] = { " queries ", " timeouts ", " errors " };
+    int servers = atomic_load(&stats_server_count);
+    for (int s = 0; s < servers; s++) {
+        stats_puts(out, "server ");
+        stats_puts(out, stats_server_names[s]);
+        for (int i = 0; i < SERVER_STAT_COUNT; i++) {
+            stats_puts(out, server_stat_names[i]);
+            stats_putu(out, stats_sum(offsetof(struct stats_block, server) +
+                                      (s * SERVER_STAT_COUNT + i) * sizeof(uint64_t)));
+        }
+        stats_puts(out, " rtt_ms");
+        for (int b = 0; b < RTT_BUCKETS; b++) {
+            stats_puts(out, " ");
+            if (b < RTT_BUCKETS - 1) {
+                stats_putu(out, (uint64_t)rtt_bucket_ms[b]);
+            } else {
+                stats_puts(out, "inf");
+            }
+            stats_puts(out, ":");
+            stats_putu(out, stats_sum(offsetof(struct stats_block, rtt) +
+                                      (s * RTT_BUCKETS + b) * sizeof(uint64_t)));
+        }
+        stats_puts(out, "\n");
+    }
+}
+
+// Write the statistics file. Only async-signal-safe calls from here on.
+static void stats_dump() {
+    // Static: too big for an arbitrary signal stack
+    static struct stats_buf out, path;
+    stats_format(&out);
+    
+    // <stats_dir>/dns_override.<pid>.stats, replaced atomically via a .tmp file
+    path.len = 0;
+    stats_puts(&path, stats_dir);
+    stats_puts(&path, "/dns_override.");
+    stats_putu(&path, (uint64_t)getpid());
+    stats_puts(&path, ".stats");
+    char final_path[sizeof(stats_dir) + 64];
+    memcpy(final_path, path.data, path.len);
+    final_path[path.len < sizeof(final_path) ? path.len : sizeof(final_path) - 1] = '\0';
+    stats_puts(&path, ".tmp");
+    path.data[path.len < sizeof(path.data) ? path.len : sizeof(path.data) - 1] = '\0';
+    
+    int fd = open(path.data, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd >= 0) {
+        size_t done = 0;
+        while (done < out.len) {
+            ssize_t n = write(fd, out.data + done, out.len - done);
+            if (n <= 0) break;
+            done += n;
+        }
+        close(fd);
+        rename(path.data, final_path);
+    }
+}
+
+static void stats_signal_handler(int sig, siginfo_t *info, void *context) {
+    int saved_errno = errno;
+    stats_dump();
+    
+    // Keep whatever the application installed before us working
+    if (stats_saved_action.sa_flags & SA_SIGINFO) {
+        if (stats_saved_action.sa_sigaction) stats_saved_action.sa_sigaction(sig, info, context);
+    } else if (stats_saved_action.sa_handler != SIG_DFL && stats_saved_action.sa_handler != SIG_IGN) {
+        stats_saved_action.sa_handler(sig);
+    }
+    errno = saved_errno;
+}
+
+// Copy what the dump needs out of a new config snapshot and install or
+// move the signal handler to match stats_signal
+static void stats_config_changed(const struct dns_config *c) {
+    snprintf(stats_dir, sizeof(stats_dir), "%s", c->stats_dir);
+    for (int i = 0; i < c->server_count; i++) {
+        snprintf(stats_server_names[i], sizeof(stats_server_names[i]),
+                 c->dns_families[i] == AF_INET6 ? "[%s]:%d" : "%s:%d", c->dns_servers[i], c->dns_ports[i]);
+    }
+    atomic_store(&stats_server_count, c->server_count);
+    
+    if (stats_signal_installed && stats_signal_installed != c->stats_signal) {
+        sigaction(stats_signal_installed, &stats_saved_action, NULL);
+        stats_signal_installed = 0;
+    }
+    if (c->stats_signal && !stats_signal_installed) {
+        struct sigaction sa;
+        memset(&sa, 0, sizeof(sa));
+        sa.sa_sigaction = stats_signal_handler;
+        sa.sa_flags = SA_SIGINFO | SA_RESTART;
+        sigemptyset(&sa.sa_mask);
+        if (sigaction(c->stats_signal, &sa, &stats_saved_action) == 0) {
+            stats_signal_installed = c->stats_signal;
+            // The file's presence tells dns_config.sh this process handles the signal
+            stats_dump();
+            if (c->debug) {
+                fprintf(stderr, "[DNS Override] Statistics dumped to %s on signal %d\n",
+                       c->stats_dir, c->stats_signal);
+            }
+        }
+    }
+}
+
+// ---------------------------------------------------------------------------
+// Logging
+//
+// Messages below log_level cost one compare: the log_*() macros test the
+// level before any argument is evaluated. Info and trace messages are also
+// subject to the lookup filters. With log_name set, only lookups of those
+// domains are logged. With log_sample 1/N, one lookup in N is. Errors and
+// warnings always pass.
+//
+// A message that passes is formatted straight into a slot of a lock-free
+// ring and left there. A writer thread, started with the first message,
+// prints the records to stderr, a file or syslog. The resolving thread
+// makes no system calls and takes no locks for this. Address lists are put
+// in the ring as raw sockaddrs and turned into text by the writer. When
+// the ring is full, records are dropped and the writer reports how many.
+// ---------------------------------------------------------------------------
+
+#define LOG_RING_SIZE 1024     // Records in flight (power of two)
+#define LOG_TEXT_MAX 224       // Message bytes per record
+#define LOG_DRAIN_INTERVAL_MS 50 // Writer sleep when the ring is empty
+
+struct log_record {
+    _Atomic size_t seq; // Ring protocol: pos when free, pos + 1 when filled
+    int level;
+    struct timespec when;
+    struct sockaddr_in6 addr; // Appended to the text unless sin6_family is 0
+    char text[LOG_TEXT_MAX];
+};
+
+enum { LOG_STATE_IDLE, LOG_STATE_RUNNING, LOG_STATE_FAILED };
+
+static struct log_record log_ring[LOG_RING_SIZE];
+static _Alignas(64) _Atomic size_t log_enqueue_pos = 0;
+static _Alignas(64) _Atomic size_t log_dequeue_pos = 0;
+static _Atomic uint64_t log_dropped = 0;
+static _Atomic int log_state = LOG_STATE_IDLE;
+
+// Sink settings, copied from the config snapshot; the lock is only taken by
+// the writer, config_publish() and the fallback path, never per message
+static pthread_mutex_t log_sink_lock = PTHREAD_MUTEX_INITIALIZER;
+static int log_sink = LOG_SINK_STDERR;
+static char log_path[256];
+static int log_fd = -1; // Open log_path, -1 until the first write
+static char log_out[8192]; // Lines batched into one write()
+static size_t log_out_len = 0;
+
+// Whether the current lookup passed log_name/log_sample
+static __thread int log_selected = 1;
+static __thread int log_sample_count = 0;
+
+#define log_enabled(level) \
+    ((level) <= cfg->log_level && ((level) <= LOG_LEVEL_WARN || log_selected))
+#define log_at(level, addr, ...) \
+    do { if (log_enabled(level)) log_push(level, addr, __VA_ARGS__); } while (0)
+#define log_error(...) log_at(LOG_LEVEL_ERROR, NULL, __VA_ARGS__)
+#define log_warn(...) log_at(LOG_LEVEL_WARN, NULL, __VA_ARGS__)
+#define log_info(...) log_at(LOG_LEVEL_INFO, NULL, __VA_ARGS__)
+#define log_trace(...) log_at(LOG_LEVEL_TRACE, NULL, __VA_ARGS__)
+// Trace message followed by the address (and port) of a sockaddr
+#define log_trace_addr(addr, ...) log_at(LOG_LEVEL_TRACE, addr, __VA_ARGS__)
+
+static int log_name_matches(const char *name, const char *domain) {
+    size_t name_len = strlen(name);
+    size_t domain_len = strlen(domain);
+    if (name_len && name[name_len - 1] == '.') name_len--;
+    if (name_len < domain_len) return 0;
+    const char *tail = name + name_len - domain_len;
+    if (strncasecmp(tail, domain, domain_len) != 0) return 0;
+    return tail == name || tail[-1] == '.';
+}
+
+// Decide whether info/trace messages of the lookup of name are logged
+static void log_lookup_begin(const char *name) {
+    if (cfg->log_level <= LOG_LEVEL_WARN) return;
+    
+    int selected = 1;
+    if (cfg->log_name_count > 0) {
+        selected = 0;
+        for (int i = 0; i < cfg->log_name_count && name; i++) {
+            if (log_name_matches(name, cfg->log_names[i])) {
+                selected = 1;
+                break;
+            }
+        }
+    }
+    if (selected && cfg->log_sample > 1) {
+        // Per-thread count: no shared cache line, and close enough to 1 in N
+        if (++log_sample_count >= cfg->log_sample) {
+            log_sample_count = 0;
+        } else {
+            selected = 0;
+        }
+    }
+    log_selected = selected;
+}
+
+static void log_out_flush() {
+    size_t done = 0;
+    int fd = log_sink == LOG_SINK_FILE ? log_fd : STDERR_FILENO;
+    while (fd >= 0 && done < log_out_len) {
+        ssize_t n = write(fd, log_out + done, log_out_len - done);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) break;
+        done += n;
+    }
+    log_out_len = 0;
+}
+
+// Print one record to the sink; called with log_sink_lock held
+static void log_write(const struct log_record *r) {
+    char addr_str[INET6_ADDRSTRLEN + 8] = "";
+    if (r->addr.sin6_family == AF_INET || r->addr.sin6_family == AF_INET6) {
+        const struct sockaddr_in *sin = (const struct sockaddr_in *)&r->addr;
+        const void *addr = r->addr.sin6_family == AF_INET
+            ? (const void *)&sin->sin_addr : (const void *)&r->addr.sin6_addr;
+        int port = ntohs(r->addr.sin6_family == AF_INET ? sin->sin_port : r->addr.sin6_port);
+        inet_ntop(r->addr.sin6_family, addr, addr_str, INET6_ADDRSTRLEN);
+        if (port > 0) {
+            size_t len = strlen(addr_str);
+            snprintf(addr_str + len, sizeof(addr_str) - len, ":%d", port);
+        }
+    }
+    
+    if (log_sink == LOG_SINK_SYSLOG) {
+        static const int priorities[] = { LOG_ERR, LOG_WARNING, LOG_INFO, LOG_DEBUG };
+        syslog(LOG_USER | priorities[r->level], "[DNS Override] %s%s", r->text, addr_str);
+        return;
+    }
+    
+    if (log_sink == LOG_SINK_FILE && log_fd < 0) {
+        log_fd = open(log_path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+        if (log_fd < 0) return;
+    }
+    
+    // Files get a timestamp: records may be written well after the fact
+    char stamp[40] = "";
+    if (log_sink == LOG_SINK_FILE) {
+        struct tm tm;
+        localtime_r(&r->when.tv_sec, &tm);
+        size_t len = strftime(stamp, sizeof(stamp), "%Y-%m-%d %H:%M:%S", &tm);
+        snprintf(stamp + len, sizeof(stamp) - len, ".%06ld ", r->when.tv_nsec / 1000);
+    }
+    
+    if (log_out_len + sizeof(stamp) + LOG_TEXT_MAX + sizeof(addr_str) + 32 > sizeof(log_out)) {
+        log_out_flush();
+    }
+    int n = snprintf(log_out + log_out_len, sizeof(log_out) - log_out_len,
+                     "%s[DNS Override] %s%s\n", stamp, r->text, addr_str);
+    if (n > 0) {
+        size_t room = sizeof(log_out) - log_out_len;
+        log_out_len += (size_t)n < room ? (size_t)n : room - 1;
+    }
+}
+
+// Take the oldest filled record out of the ring
+static int log_pop(struct log_record *out) {
+    size_t pos = atomic_load_explicit(&log_dequeue_pos, memory_order_relaxed);
+    for (;;) {
+        struct log_record *r = &log_ring[pos & (LOG_RING_SIZE - 1)];
+        size_t seq = atomic_load_explicit(&r->seq, memory_order_acquire);
+        intptr_t diff = (intptr_t)(seq - (pos + 1));
+        if (diff == 0) {
+            if (atomic_compare_exchange_weak_explicit(&log_dequeue_pos, &pos, pos + 1,
+                                                      memory_order_relaxed, memory_order_relaxed)) {
+                out->level = r->level;
+                out->when = r->when;
+                out->addr = r->addr;
+                memcpy(out->text, r->text, sizeof(out->text));
+                atomic_store_explicit(&r->seq, pos + LOG_RING_SIZE, memory_order_release);
+                return 1;
+            }
+        } else if (diff < 0) {
+            return 0; // Empty, or the next record is still being filled
+        } else {
+            pos = atomic_load_explicit(&log_dequeue_pos, memory_order_relaxed);
+        }
+    }
+}
+
+// Write out everything queued so far; returns the number of records
+static int log_drain() {
+    struct log_record r;
+    int count = 0;
+    pthread_mutex_lock(&log_sink_lock);
+    while (log_pop(&r)) {
+        log_write(&r);
+        count++;
+    }
+    uint64_t dropped = atomic_exchange(&log_dropped, 0);
+    if (dropped) {
+        memset(&r, 0, sizeof(r));
+        r.level = LOG_LEVEL_WARN;
+        clock_gettime(CLOCK_REALTIME, &r.when);
+        snprintf(r.text, sizeof(r.text), "Log ring full, dropped %llu records", (unsigned long long)dropped);
+        log_write(&r);
+    }
+    log_out_flush();
+    pthread_mutex_unlock(&log_sink_lock);
+    return count;
+}
+
+static void *log_thread(void *arg) {
+    (void)arg;
+    for (;;) {
+        if (log_drain() == 0) {
+            struct timespec pause = { 0, LOG_DRAIN_INTERVAL_MS * 1000000L };
+            nanosleep(&pause, NULL);
+        }
+    }
+    return NULL;
+}
+
+// Set up the ring and the writer thread; returns 0 if there is no writer
+static int log_start() {
+    pthread_mutex_lock(&log_sink_lock);
+    if (atomic_load(&log_state) == LOG_STATE_IDLE) {
+        for (size_t i = 0; i < LOG_RING_SIZE; i++) {
+            atomic_store_explicit(&log_ring[i].seq, i, memory_order_relaxed);
+        }
+        atomic_store(&log_enqueue_pos, 0);
+        atomic_store(&log_dequeue_pos, 0);
+        
+        // Keep the application's signals away from our thread
+        sigset_t all, saved;
+        sigfillset(&all);
+        pthread_sigmask(SIG_SETMASK, &all, &saved);
+        pthread_t thread;
+        int ok = pthread_create(&thread, NULL, log_thread, NULL) == 0;
+        if (ok) pthread_detach(thread);
+        pthread_sigmask(SIG_SETMASK, &saved, NULL);
+        atomic_store(&log_state, ok ? LOG_STATE_RUNNING : LOG_STATE_FAILED);
+    }
+    pthread_mutex_unlock(&log_sink_lock);
+    return atomic_load(&log_state) == LOG_STATE_RUNNING;
+}
+
+__attribute__((format(printf, 3, 4)))
+static void log_push(int level, const struct sockaddr *addr, const char *fmt, ...) {
+    int queued = atomic_load_explicit(&log_state, memory_order_acquire) == LOG_STATE_RUNNING || log_start();
+    
+    // Claim a free slot; a full ring drops the message rather than wait
+    struct log_record local, *r = &local;
+    size_t pos = 0;
+    if (queued) {
+        pos = atomic_load_explicit(&log_enqueue_pos, memory_order_relaxed);
+        for (;;) {
+            r = &log_ring[pos & (LOG_RING_SIZE - 1)];
+            size_t seq = atomic_load_explicit(&r->seq, memory_order_acquire);
+            intptr_t diff = (intptr_t)(seq - pos);
+            if (diff == 0) {
+                if (atomic_compare_exchange_weak_explicit(&log_enqueue_pos, &pos, pos + 1,
+                                                          memory_order_relaxed, memory_order_relaxed)) {
+                    break;
+                }
+            } else if (diff < 0) {
+                atomic_fetch_add_explicit(&log_dropped, 1, memory_order_relaxed);
+                return;
+            } else {
+                pos = atomic_load_explicit(&log_enqueue_pos, memory_order_relaxed);
+            }
+        }
+    }
+    
+    r->level = level;
+    clock_gettime(CLOCK_REALTIME, &r->when);
+    memset(&r->addr, 0, sizeof(r->addr));
+    if (addr && (addr->sa_family == AF_INET || addr->sa_family == AF_INET6)) {
+        memcpy(&r->addr, addr, addr->sa_family == AF_INET ? sizeof(struct sockaddr_in) : sizeof(struct sockaddr_in6));
+    }
+    va_list args;
+    va_start(args, fmt);
+    vsnprintf(r->text, sizeof(r->text), fmt, args);
+    va_end(args);
+    
+    if (queued) {
+        atomic_store_explicit(&r->seq, pos + 1, memory_order_release);
+    } else {
+        // No writer thread could be started: write synchronously
+        pthread_mutex_lock(&log_sink_lock);
+        log_write(r);
+        log_out_flush();
+        pthread_mutex_unlock(&log_sink_lock);
+    }
+}
+
+// Point the writer at the sink of a new config snapshot
+static void log_config_changed(const struct dns_config *c) {
+    pthread_mutex_lock(&log_sink_lock);
+    if (c->log_sink != log_sink || strcmp(c->log_path, log_path) != 0) {
+        log_out_flush();
+        if (log_fd >= 0) close(log_fd);
+        log_fd = -1;
+        log_sink = c->log_sink;
+        snprintf(log_path, sizeof(log_path), "%s", c->log_path);
+    }
+    pthread_mutex_unlock(&log_sink_lock);
+}
+
+// The writer thread does not survive fork(); the child starts a new one and
+// does not repeat the parent's pending records
+static void log_atfork_prepare() { pthread_mutex_lock(&log_sink_lock); }
+static void log_atfork_parent() { pthread_mutex_unlock(&log_sink_lock); }
+static void log_atfork_child() {
+    log_out_len = 0;
+    atomic_store(&log_state, LOG_STATE_IDLE);
+    pthread_mutex_init(&log_sink_lock, NULL);
+}
+
+// ---------------------------------------------------------------------------
+// Owned addrinfo blocks
+//
+// Chains the library builds itself (cache hits, DNS64 synthesis) are carved
+// out of one allocation: a block holding every node, its socket address and
+// optionally the canonical name. The freeaddrinfo() override recognises
+// owned nodes and frees the block once its last node is released. All other
+// nodes are handed to glibc's freeaddrinfo().
+//
+// The public fields, ai_flags included, are exactly what glibc would
+// return. Instead, an owned node keeps a mark word between its addrinfo and
+// its socket address. glibc (and copy_addrinfo_chain()) put the address
+// right after the addrinfo, so ai_addr alone tells the layouts apart, and
+// the mark is only read once ai_addr says it is there.
+// ---------------------------------------------------------------------------
+
+#define OWNED_NODE_MAGIC 0x64656e774f736e44ull // "DnsOwned", xored with the node address
+
+struct owned_node {
+    struct owned_block *block;
+    struct addrinfo ai;
+    uint64_t mark;            // OWNED_NODE_MAGIC ^ address of the node
+    struct sockaddr_in6 addr; // Large enough for either family
+};
+
+struct owned_block {
+    int refs;        // Nodes not yet released
+    char *canonname; // Name stored after the nodes, or NULL
+    struct owned_node nodes[];
+};
+
+// The owned node holding ai, or NULL if something else allocated it
+static struct owned_node *owned_node_of(const struct addrinfo *ai) {
+    struct owned_node *node = (struct owned_node *)((char *)ai - offsetof(struct owned_node, ai));
+    if ((const void *)ai->ai_addr != (const void *)&node->addr) return NULL;
+    if (node->mark != (OWNED_NODE_MAGIC ^ (uintptr_t)node)) return NULL;
+    return node;
+}
+
+// Point a fresh owned node at its own address and mark it as owned
+static void owned_node_init(struct owned_node *node, struct owned_block *block) {
+    node->block = block;
+    node->mark = OWNED_NODE_MAGIC ^ (uintptr_t)node;
+    node->ai.ai_addr = (struct sockaddr *)&node->addr;
+}
+
+// Release one detached node, whoever allocated it
+static void release_addrinfo_node(struct addrinfo *ai) {
+    struct owned_node *node = owned_node_of(ai);
+    if (node) {
+        struct owned_block *block = node->block;
+        if (ai->ai_canonname != block->canonname) free(ai->ai_canonname);
+        if (--block->refs == 0) free(block);
+        return;
+    }
+    ai->ai_next = NULL;
+    init_original_functions();
+    original_freeaddrinfo(ai);
+}
+
+// Allocate a zeroed, linked chain of count owned nodes with room for a
+// canonical name of canon_len bytes (0 = none)
+static struct owned_block *owned_block_new(int count, size_t canon_len) {
+    size_t size = sizeof(struct owned_block) + count * sizeof(struct owned_node);
+    struct owned_block *block = calloc(1, size + canon_len);
+    if (!block) return NULL;
+    block->refs = count;
+    if (canon_len) block->canonname = (char *)block + size;
+    for (int i = 0; i < count; i++) {
+        struct owned_node *node = &block->nodes[i];
+        owned_node_init(node, block);
+        node->ai.ai_next = (i + 1 < count) ? &block->nodes[i + 1].ai : NULL;
+    }
+    return block;
+}
+
+// Fill in one node of an owned block
+static void owned_node_set(struct owned_node *node, int flags, int family, int socktype, int protocol,
+                           uint16_t port, const unsigned char *addr, uint32_t scope_id) {
+    node->ai.ai_flags = flags;
+    node->ai.ai_family = family;
+    node->ai.ai_socktype = socktype;
+    node->ai.ai_protocol = protocol;
+    if (family == AF_INET6) {
+        node->ai.ai_addrlen = sizeof(struct sockaddr_in6);
+        node->addr.sin6_family = AF_INET6;
+        node->addr.sin6_port = port;
+        node->addr.sin6_scope_id = scope_id;
+        memcpy(&node->addr.sin6_addr, addr, 16);
+    } else {
+        struct sockaddr_in *sin = (struct sockaddr_in *)&node->addr;
+        node->ai.ai_addrlen = sizeof(struct sockaddr_in);
+        sin->sin_family = AF_INET;
+        sin->sin_port = port;
+        memcpy(&sin->sin_addr, addr, 4);
+    }
+}
+
+// ---------------------------------------------------------------------------
+// Answer cache
+//
+// getaddrinfo() results are cached after filtering and DNS64 processing, keyed
+// on (node, service, hints->ai_family/ai_socktype/ai_protocol/ai_flags).
+// Successful answers and EAI_NONAME/EAI_NODATA answers are both stored.
+//
+// Each entry is one flat allocation: a small header, the key strings, one
+// 8-byte descriptor per addrinfo node and the address bytes (4 per IPv4
+// address, 16 plus the scope ID per IPv6 one), shared by the nodes that only
+// differ in socket type. Canonical names are interned, so the names behind
+// many keys are stored once. A hit materializes the answer as an owned
+// block, a single allocation the caller releases with freeaddrinfo().
+//
+// The cache is split into up to CACHE_SHARDS independent shards picked by
+// the top bits of the key hash, each with its own read-write lock, hash
+// table and interned names, so threads looking up different names rarely
+// meet. Hits only take the read lock. Eviction is CLOCK over the hash table:
+// a hit sets the entry's reference bit, and the hand sweeping the buckets
+// clears set bits and evicts the first entry it finds unreferenced or dead.
+// Small caches use fewer shards, so that each holds at least
+// CACHE_MIN_SHARD_ENTRIES entries. cache_size and cache_max_bytes are split
+// across the shards in use, so their sum is exactly the configured limit
+// (counting entries, names and tables).
+// ---------------------------------------------------------------------------
+
+#define CACHE_SHARD_BITS 6
+#define CACHE_SHARDS (1 << CACHE_SHARD_BITS)
+#define CACHE_MIN_BUCKETS 16
+#define CACHE_MIN_SHARD_ENTRIES 16
+#define CACHE_ALLOC_OVERHEAD 16 // malloc() header charged to every allocation
+#define CACHE_ADDR_LEN(family) ((family) == AF_INET6 ? 20 : 4)
+
+// One addrinfo node of a stored answer
+struct cache_node {
+    uint8_t family;
+    uint8_t socktype;
+    uint16_t protocol;
+    uint16_t port;     // Network byte order
+    uint16_t addr_off; // Offset of the address bytes in the entry's data
+};
+
+// An interned canonical name (shard lock)
+struct cache_name {
+    struct cache_name *next;
+    uint32_t hash;
+    uint32_t refs;
+    char name[];
+};
+
+struct cache_entry {
+    struct cache_entry *hash_next;
+    struct cache_name *canonname;      // NULL if the answer has none
+    uint32_t hash;
+    int32_t flags;                     // Hints the answer was produced for
+    int32_t socktype;
+    int16_t family;
+    int16_t protocol;
+    int16_t status;                    // 0 for a positive answer, otherwise the EAI_* code
+    uint16_t count;                    // Nodes in the answer (0 for negative answers)
+    uint32_t expires;                  // CLOCK_MONOTONIC seconds
+    _Atomic uint32_t refresh_started;  // When a prefetch was last queued (0 = never)
+    uint32_t stale_until;              // Serve the expired answer without asking upstream until then
+    int32_t lifetime;                  // Seconds the answer was stored for
+    uint16_t service_off;              // Offset of the service in data (0 = none)
+    uint16_t nodes_off;                // Offset of the cache_node array in data
+    uint16_t data_len;
+    _Atomic uint8_t referenced;        // CLOCK bit, set by hits
+    char data[];                       // Node name, service, nodes, address bytes
+};
+
+struct cache_shard {
+    pthread_rwlock_t lock;
+    uint64_t generation;          // Config snapshot the stored answers belong to
+    struct cache_entry **buckets; // Also the face the CLOCK hand sweeps
+    size_t mask;
+    size_t hand;                  // Bucket the CLOCK hand points at
+    int count;
+    size_t bytes;                 // Entries, names and tables
+    struct cache_name **names;
+    size_t name_mask;
+    int name_count;
+} __attribute__((aligned(64)));
+
+static struct cache_shard cache_shards[CACHE_SHARDS] = {
+    [0 ... CACHE_SHARDS - 1] = { .lock = PTHREAD_RWLOCK_INITIALIZER },
+};
+
+
+static time_t monotonic_seconds() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return ts.tv_sec;
+}
+
+// FNV-1a over the lookup key
+static uint32_t cache_hash(const char *node, const char *service, int family,
+                           int socktype, int protocol, int flags) {
+    uint32_t h = 2166136261u;
+    for (const char *p = node; *p; p++) {
+        h = (h ^ (unsigned char)*p) * 16777619u;
+    }
+    h = (h ^ 0xff) * 16777619u;
+    if (service) {
+        for (const char *p = service; *p; p++) {
+            h = (h ^ (unsigned char)*p) * 16777619u;
+        }
+    }
+    int ints[4] = { family, socktype, protocol, flags };
+    for (int i = 0; i < 4; i++) {
+        h = (h ^ (uint32_t)ints[i]) * 16777619u;
+    }
+    return h;
+}
+
+// Duplicate an addrinfo chain using glibc's node layout so freeaddrinfo() can release it
+static struct addrinfo *copy_addrinfo_chain(const struct addrinfo *src) {
+    struct addrinfo *head = NULL;
+    struct addrinfo **tail = &head;
+    
+    for (const struct addrinfo *cur = src; cur; cur = cur->ai_next) {
+        struct addrinfo *node = malloc(sizeof(struct addrinfo) + cur->ai_addrlen);
+        if (!node) {
+            freeaddrinfo(head);
+            return NULL;
+        }
+        memcpy(node, cur, sizeof(struct addrinfo));
+        node->ai_addr = (struct sockaddr *)(node + 1);
+        memcpy(node->ai_addr, cur->ai_addr, cur->ai_addrlen);
+        node->ai_canonname = NULL;
+        node->ai_next = NULL;
+        if (cur->ai_canonname) {
+            node->ai_canonname = strdup(cur->ai_canonname);
+            if (!node->ai_canonname) {
+                free(node);
+                freeaddrinfo(head);
+                return NULL;
+            }
+        }
+        *tail = node;
+        tail = &node->ai_next;
+    }
+    
+    return head;
+}
+
+static struct cache_node *cache_entry_nodes(const struct cache_entry *entry) {
+    return (struct cache_node *)(entry->data + entry->nodes_off);
+}
+
+// Shards in use for a cache_size, as a number of hash bits. Every reload
+// moves to a new generation, which empties the shards as they are next
+// used; cache_release_unused() frees those no longer used at all.
+static int cache_shard_bits(int cache_size) {
+    int bits = 0;
+    while (bits < CACHE_SHARD_BITS && (cache_size >> (bits + 1)) >= CACHE_MIN_SHARD_ENTRIES) bits++;
+    return bits;
+}
+
+static struct cache_shard *cache_shard_for(uint32_t hash) {
+    int bits = cache_shard_bits(cfg->cache_size);
+    return &cache_shards[bits ? hash >> (32 - bits) : 0];
+}
+
+// The shard's part of cache_size; the first shards take the remainder
+static int cache_shard_max_entries(const struct cache_shard *shard) {
+    int shards = 1 << cache_shard_bits(cfg->cache_size);
+    return cfg->cache_size / shards + ((shard - cache_shards) < cfg->cache_size % shards);
+}
+
+static size_t cache_shard_max_bytes(const struct cache_shard *shard) {
+    size_t shards = (size_t)1 << cache_shard_bits(cfg->cache_size);
+    return cfg->cache_max_bytes / shards + ((size_t)(shard - cache_shards) < cfg->cache_max_bytes % shards);
+}
+
+// Find or add an interned copy of a canonical name (write lock held)
+static struct cache_name *cache_name_intern(struct cache_shard *shard, const char *name) {
+    uint32_t hash = cache_hash(name, NULL, 0, 0, 0, 0);
+    if (shard->names) {
+        for (struct cache_name *n = shard->names[hash & shard->name_mask]; n; n = n->next) {
+            if (n->hash == hash && strcmp(n->name, name) == 0) {
+                n->refs++;
+                return n;
+            }
+        }
+    }
+    
+    // Keep the chains short: double the table once it is full
+    size_t old_buckets = shard->names ? shard->name_mask + 1 : 0;
+    if ((size_t)shard->name_count >= old_buckets) {
+        size_t buckets = old_buckets ? 2 * old_buckets : CACHE_MIN_BUCKETS;
+        struct cache_name **table = calloc(buckets, sizeof(*table));
+        if (!table) return NULL;
+        for (size_t b = 0; b < old_buckets; b++) {
+            while (shard->names[b]) {
+                struct cache_name *n = shard->names[b];
+                shard->names[b] = n->next;
+                n->next = table[n->hash & (buckets - 1)];
+                table[n->hash & (buckets - 1)] = n;
+            }
+        }
+        free(shard->names);
+        shard->names = table;
+        shard->name_mask = buckets - 1;
+        shard->bytes += (buckets - old_buckets) * sizeof(*table);
+    }
+    
+    size_t len = strlen(name) + 1;
+    struct cache_name *n = malloc(sizeof(*n) + len);
+    if (!n) return NULL;
+    n->hash = hash;
+    n->refs = 1;
+    memcpy(n->name, name, len);
+    n->next = shard->names[hash & shard->name_mask];
+    shard->names[hash & shard->name_mask] = n;
+    shard->name_count++;
+    shard->bytes += sizeof(*n) + len + CACHE_ALLOC_OVERHEAD;
+    return n;
+}
+
+static void cache_name_release(struct cache_shard *shard, struct cache_name *name) {
+    if (--name->refs > 0) return;
+    struct cache_name **link = &shard->names[name->hash & shard->name_mask];
+    while (*link != name) {
+        link = &(*link)->next;
+    }
+    *link = name->next;
+    shard->bytes -= sizeof(*name) + strlen(name->name) + 1 + CACHE_ALLOC_OVERHEAD;
+    free(name);
+    shard->name_count--;
+}
+
+// Rebuild a stored answer as an owned chain (shard lock held)
+static struct addrinfo *cache_entry_to_addrinfo(const struct cache_entry *entry) {
+    size_t canon_len = entry->canonname ? strlen(entry->canonname->name) + 1 : 0;
+    struct owned_block *block = owned_block_new(entry->count, canon_len);
+    if (!block) return NULL;
+    
+    const struct cache_node *nodes = cache_entry_nodes(entry);
+    for (int i = 0; i < entry->count; i++) {
+        const unsigned char *addr = (const unsigned char *)entry->data + nodes[i].addr_off;
+        uint32_t scope_id = 0;
+        if (nodes[i].family == AF_INET6) memcpy(&scope_id, addr + 16, sizeof(scope_id));
+        owned_node_set(&block->nodes[i], entry->flags, nodes[i].family, nodes[i].socktype,
+                       nodes[i].protocol, nodes[i].port, addr, scope_id);
+    }
+    if (canon_len) {
+        memcpy(block->canonname, entry->canonname->name, canon_len);
+        block->nodes[0].ai.ai_canonname = block->canonname;
+    }
+    return &block->nodes[0].ai;
+}
+
+static size_t cache_entry_bytes(const struct cache_entry *entry) {
+    return sizeof(*entry) + entry->data_len + CACHE_ALLOC_OVERHEAD;
+}
+
+// Unlink an entry from its bucket and free it (write lock held)
+static void cache_remove(struct cache_shard *shard, struct cache_entry *entry) {
+    struct cache_entry **link = &shard->buckets[entry->hash & shard->mask];
+    while (*link && *link != entry) {
+        link = &(*link)->hash_next;
+    }
+    if (*link) *link = entry->hash_next;
+    if (entry->canonname) cache_name_release(shard, entry->canonname);
+    shard->bytes -= cache_entry_bytes(entry);
+    free(entry);
+    shard->count--;
+}
+
+// Drop everything a shard holds (write lock held)
+static void cache_shard_clear(struct cache_shard *shard) {
+    for (size_t b = 0; shard->buckets && b <= shard->mask; b++) {
+        while (shard->buckets[b]) {
+            cache_remove(shard, shard->buckets[b]);
+        }
+    }
+    free(shard->buckets);
+    free(shard->names);
+    shard->buckets = NULL;
+    shard->names = NULL;
+    shard->mask = shard->name_mask = shard->hand = 0;
+    shard->count = shard->name_count = 0;
+    shard->bytes = 0;
+}
+
+// Grow the bucket array to keep up with the entry count, up to the
+// shard's share of cache_size (write lock held). Returns 0 only when
+// there is no table at all.
+static int cache_ensure_table(struct cache_shard *shard) {
+    size_t old_buckets = shard->buckets ? shard->mask + 1 : 0;
+    if (old_buckets && ((size_t)shard->count < old_buckets ||
+                        old_buckets >= (size_t)cache_shard_max_entries(shard))) {
+        return 1;
+    }
+    
+    size_t buckets = old_buckets ? 2 * old_buckets : CACHE_MIN_BUCKETS;
+    struct cache_entry **table = calloc(buckets, sizeof(*table));
+    if (!table) return old_buckets > 0;
+    for (size_t b = 0; b < old_buckets; b++) {
+        while (shard->buckets[b]) {
+            struct cache_entry *entry = shard->buckets[b];
+            shard->buckets[b] = entry->hash_next;
+            entry->hash_next = table[entry->hash & (buckets - 1)];
+            table[entry->hash & (buckets - 1)] = entry;
+        }
+    }
+    free(shard->buckets);
+    shard->buckets = table;
+    shard->mask = buckets - 1;
+    shard->hand = 0;
+    shard->bytes += (buckets - old_buckets) * sizeof(*table);
+    return 1;
+}
+
+// Drop every stored answer once a newer config snapshot is in use, since
+// the servers, filters or TTL limits they were produced with may have
+// changed (write lock held). Returns 0 when the caller is still on an older
+// snapshot than the shard, in which case it must not use the shard.
+static int cache_sync_generation(struct cache_shard *shard) {
+    if (cfg->generation == shard->generation) return 1;
+    if (cfg->generation < shard->generation) return 0;
+    
+    cache_shard_clear(shard); // Tables are re-sized for the new limits on next use
+    shard->generation = cfg->generation;
+    return 1;
+}
+
+// Free the shards beyond those next uses; a smaller cache_size would
+// otherwise leave the old answers there forever
+static void cache_release_unused(const struct dns_config *next) {
+    for (int i = 1 << cache_shard_bits(next->cache_size); i < CACHE_SHARDS; i++) {
+        struct cache_shard *shard = &cache_shards[i];
+        pthread_rwlock_wrlock(&shard->lock);
+        if (shard->generation < next->generation) {
+            cache_shard_clear(shard);
+            shard->generation = next->generation;
+        }
+        pthread_rwlock_unlock(&shard->lock);
+    }
+}
+
+// Read-lock the shard for the caller's config snapshot. Returns 0, with no
+// lock held, when the shard belongs to a newer snapshot.
+static int cache_read_lock(struct cache_shard *shard) {
+    pthread_rwlock_rdlock(&shard->lock);
+    if (shard->generation == cfg->generation) return 1;
+    pthread_rwlock_unlock(&shard->lock);
+    
+    pthread_rwlock_wrlock(&shard->lock);
+    int current = cache_sync_generation(shard);
+    pthread_rwlock_unlock(&shard->lock);
+    if (!current) return 0;
+    
+    // Another reload may have moved the shard on in between
+    pthread_rwlock_rdlock(&shard->lock);
+    if (shard->generation == cfg->generation) return 1;
+    pthread_rwlock_unlock(&shard->lock);
+    return 0;
+}
+
+// Write-lock the shard for the caller's config snapshot; same contract
+static int cache_write_lock(struct cache_shard *shard) {
+    pthread_rwlock_wrlock(&shard->lock);
+    if (cache_sync_generation(shard)) return 1;
+    pthread_rwlock_unlock(&shard->lock);
+    return 0;
+}
+
+static int cache_key_matches(const struct cache_entry *entry, uint32_t hash, const char *node,
+                             const char *service, const struct addrinfo *hints) {
+    if (entry->hash != hash) return 0;
+    if (entry->family != (hints ? hints->ai_family : AF_UNSPEC)) return 0;
+    if (entry->socktype != (hints ? hints->ai_socktype : 0)) return 0;
+    if (entry->protocol != (hints ? hints->ai_protocol : 0)) return 0;
+    if (entry->flags != (hints ? hints->ai_flags : 0)) return 0;
+    if (strcmp(entry->data, node) != 0) return 0;
+    if (!entry->service_off || !service) return !entry->service_off && !service;
+    return strcmp(entry->data + entry->service_off, service) == 0;
+}
+
+static struct cache_entry *cache_find(const struct cache_shard *shard, uint32_t hash, const char *node,
+                                      const char *service, const struct addrinfo *hints) {
+    if (!shard->buckets) return NULL;
+    struct cache_entry *entry = shard->buckets[hash & shard->mask];
+    while (entry && !cache_key_matches(entry, hash, node, service, hints)) {
+        entry = entry->hash_next;
+    }
+    return entry;
+}
+
+// Expired and of no further use: negative, or past the serve_stale window
+static int cache_entry_dead(const struct cache_entry *entry, time_t now) {
+    if (entry->expires > now) return 0;
+    return entry->status != 0 || entry->expires + cfg->serve_stale <= now;
+}
+
+// Move the CLOCK hand to the next entry to evict: a dead one, or one not
+// hit since the hand last passed it (write lock held)
+static struct cache_entry *cache_clock_victim(struct cache_shard *shard, time_t now) {
+    if (shard->count == 0) return NULL;
+    // Two sweeps at most: the first clears every reference bit
+    for (size_t step = 0; step <= 2 * (shard->mask + 1); step++) {
+        for (struct cache_entry *entry = shard->buckets[shard->hand]; entry; entry = entry->hash_next) {
+            if (cache_entry_dead(entry, now) ||
+                !atomic_load_explicit(&entry->referenced, memory_order_relaxed)) {
+                return entry;
+            }
+            atomic_store_explicit(&entry->referenced, 0, memory_order_relaxed);
+        }
+        shard->hand = (shard->hand + 1) & shard->mask;
+    }
+    return NULL;
+}
+
+// Only named lookups are worth caching; numeric hosts never touch the network
+static int cache_key_applicable(const char *node, const struct addrinfo *hints) {
+    if (!node) return 0;
+    if (hints && (hints->ai_flags & AI_NUMERICHOST)) return 0;
+    
+    unsigned char buf[sizeof(struct in6_addr)];
+    if (inet_pton(AF_INET, node, buf) == 1 || inet_pton(AF_INET6, node, buf) == 1) {
+        return 0;
+    }
+    return 1;
+}
+
+static int cache_applicable(const char *node, const struct addrinfo *hints) {
+    return cfg->cache_size > 0 && cache_key_applicable(node, hints);
+}
+
+// How long to keep a getaddrinfo() outcome, in seconds (0 = do not cache).
+// ttl is the answer TTL, or 0 when the resolution path could not report one;
+// positive lifetimes are clamped to [cache_min_ttl, cache_max_ttl] and
+// negative ones capped at negative_ttl.
+static int cache_lifetime(int status, const struct addrinfo *result, int ttl) {
+    int lifetime;
+    if (status == 0) {
+        if (!result) return 0;
+        lifetime = ttl;
+        if (lifetime < cfg->cache_min_ttl) lifetime = cfg->cache_min_ttl;
+        if (lifetime > cfg->cache_max_ttl) lifetime = cfg->cache_max_ttl;
+    } else if (status == EAI_NONAME || status == EAI_NODATA) {
+        // A negative TTL reported by the server (SOA minimum) may shorten negative_ttl
+        lifetime = cfg->negative_ttl;
+        if (ttl > 0 && ttl < lifetime) lifetime = ttl;
+    } else {
+        return 0; // Transient failures (EAI_AGAIN, EAI_FAIL, ...) are not cached
+    }
+    return lifetime > 0 ? lifetime : 0;
+}
+
+// Look up a cached answer. Returns 1 on a hit with *status set to the cached
+// getaddrinfo() return value and *res set to a private copy of the chain.
+// *refresh is set when the hit is close enough to expiry that the caller
+// should queue a prefetch (prefetch_threshold), *stale when the answer has
+// expired and is being served under serve_stale.
+static int cache_lookup(const char *node, const char *service, const struct addrinfo *hints,
+                        struct addrinfo **res, int *status, int *refresh, int *stale) {
+    *refresh = 0;
+    *stale = 0;
+    if (!cache_applicable(node, hints)) return 0;
+    
+    uint32_t hash = cache_hash(node, service,
+                               hints ? hints->ai_family : AF_UNSPEC,
+                               hints ? hints->ai_socktype : 0,
+                               hints ? hints->ai_protocol : 0,
+                               hints ? hints->ai_flags : 0);
+    struct cache_shard *shard = cache_shard_for(hash);
+    time_t now = monotonic_seconds();
+    int hit = 0;
+    
+    if (!cache_read_lock(shard)) return 0;
+    struct cache_entry *entry = cache_find(shard, hash, node, service, hints);
+    // An expired entry is left for the CLOCK hand or the next store to replace;
+    // a positive one may still stand in for a failed lookup (serve_stale)
+    if (entry && (entry->expires > now || entry->stale_until > now)) {
+        if (entry->status == 0) {
+            struct addrinfo *copy = cache_entry_to_addrinfo(entry);
+            if (copy) {
+                *res = copy;
+                *status = 0;
+                hit = 1;
+            }
+        } else {
+            *status = entry->status;
+            hit = 1;
+        }
+        // Only write the bit when it changes, to keep the line shared
+        if (hit && !atomic_load_explicit(&entry->referenced, memory_order_relaxed)) {
+            atomic_store_explicit(&entry->referenced, 1, memory_order_relaxed);
+        }
+        *stale = hit && entry->expires <= now;
+        if (hit && entry->status == 0 && cfg->prefetch_threshold > 0 &&
+            (int64_t)(entry->expires - now) * 100 < (int64_t)entry->lifetime * cfg->prefetch_threshold) {
+            // One of the threads hitting the entry claims the prefetch
+            uint32_t started = atomic_load_explicit(&entry->refresh_started, memory_order_relaxed);
+            *refresh = (!started || started + PREFETCH_RETRY_SECONDS <= now) &&
+                       atomic_compare_exchange_strong_explicit(&entry->refresh_started, &started, (uint32_t)now,
+                                                               memory_order_relaxed, memory_order_relaxed);
+        }
+    }
+    pthread_rwlock_unlock(&shard->lock);
+    
+    if (hit) {
+        log_trace("Cache hit for %s%s", node, *status ? " (negative)" : *stale ? " (stale)" : "");
+    }
+    
+    return hit;
+}
+
+// Fetch an expired positive answer still inside its serve_stale window, for
+// use when the upstream servers cannot be reached (RFC 8767)
+static int cache_lookup_stale(const char *node, const char *service, const struct addrinfo *hints,
+                              struct addrinfo **res) {
+    if (cfg->serve_stale <= 0 || !cache_applicable(node, hints)) return 0;
+    
+    uint32_t hash = cache_hash(node, service,
+                               hints ? hints->ai_family : AF_UNSPEC,
+                               hints ? hints->ai_socktype : 0,
+                               hints ? hints->ai_protocol : 0,
+                               hints ? hints->ai_flags : 0);
+    struct cache_shard *shard = cache_shard_for(hash);
+    time_t now = monotonic_seconds();
+    int hit = 0;
+    
+    if (!cache_write_lock(shard)) return 0;
+    struct cache_entry *entry = cache_find(shard, hash, node, service, hints);
+    if (entry && entry->status == 0 && entry->expires + cfg->serve_stale > now) {
+        *res = cache_entry_to_addrinfo(entry);
+        hit = *res != NULL;
+        // Give the upstream servers a rest before the next attempt
+        // (RFC 8767 failure recheck), within the stale window
+        entry->stale_until = now + STALE_RECHECK_SECONDS;
+        if (entry->stale_until > entry->expires + cfg->serve_stale) {
+            entry->stale_until = entry->expires + cfg->serve_stale;
+        }
+    }
+    pthread_rwlock_unlock(&shard->lock);
+    
+    if (hit) {
+        log_info("Serving stale answer for %s", node);
+    }
+    
+    return hit;
+}
+
+// Answers stored since startup; the snapshot writer skips unchanged caches
+static _Atomic uint64_t cache_store_count = 0;
+
+// Link a filled-in entry into its shard, replacing any answer for the same
+// key, then evict until it fits the shard's share of cache_size and
+// cache_max_bytes. Takes ownership of entry; returns 0 if it was dropped.
+static int cache_insert(struct cache_entry *entry, const char *canonname) {
+    struct addrinfo hints = { .ai_flags = entry->flags, .ai_family = entry->family,
+                              .ai_socktype = entry->socktype, .ai_protocol = entry->protocol };
+    const char *service = entry->service_off ? entry->data + entry->service_off : NULL;
+    struct cache_shard *shard = cache_shard_for(entry->hash);
+    if (!cache_write_lock(shard)) {
+        free(entry);
+        return 0;
+    }
+    if (!cache_ensure_table(shard) ||
+        (canonname && !(entry->canonname = cache_name_intern(shard, canonname)))) {
+        pthread_rwlock_unlock(&shard->lock);
+        free(entry);
+        return 0;
+    }
+    
+    struct cache_entry *old = cache_find(shard, entry->hash, entry->data, service, &hints);
+    if (old) cache_remove(shard, old);
+    size_t bytes = cache_entry_bytes(entry);
+    time_t now = monotonic_seconds();
+    while (shard->count >= cache_shard_max_entries(shard) || shard->bytes + bytes > cache_shard_max_bytes(shard)) {
+        struct cache_entry *victim = cache_clock_victim(shard, now);
+        if (!victim) break;
+        cache_remove(shard, victim);
+    }
+    if (shard->count >= cache_shard_max_entries(shard) || shard->bytes + bytes > cache_shard_max_bytes(shard)) {
+        if (entry->canonname) cache_name_release(shard, entry->canonname);
+        pthread_rwlock_unlock(&shard->lock);
+        free(entry);
+        return 0;
+    }
+    
+    struct cache_entry **bucket = &shard->buckets[entry->hash & shard->mask];
+    entry->hash_next = *bucket;
+    *bucket = entry;
+    shard->count++;
+    shard->bytes += bytes;
+    pthread_rwlock_unlock(&shard->lock);
+    return 1;
+}
+
+// Store a getaddrinfo() outcome (see cache_lifetime() for ttl)
+static void cache_store(const char *node, const char *service, const struct addrinfo *hints,
+                        int status, const struct addrinfo *result, int ttl) {
+    if (!cache_applicable(node, hints)) return;
+    
+    int lifetime = cache_lifetime(status, result, ttl);
+    if (lifetime <= 0) return;
+    
+    // Lay out the key, node descriptors and address bytes; a node whose
+    // address an earlier node already stored points at those bytes
+    size_t node_len = strlen(node) + 1;
+    size_t service_len = service ? strlen(service) + 1 : 0;
+    size_t nodes_off = node_len + service_len;
+    nodes_off += (offsetof(struct cache_entry, data) + nodes_off) & 1; // cache_node is 16-bit aligned
+    int count = 0;
+    size_t addr_len = 0;
+    for (const struct addrinfo *cur = (status == 0) ? result : NULL; cur; cur = cur->ai_next) {
+        if (cur->ai_family != AF_INET && cur->ai_family != AF_INET6) return;
+        count++;
+        addr_len += CACHE_ADDR_LEN(cur->ai_family);
+    }
+    size_t size = nodes_off + count * sizeof(struct cache_node) + addr_len;
+    if (size > UINT16_MAX) return; // Offsets are 16-bit
+    struct cache_entry *entry = calloc(1, sizeof(*entry) + size);
+    if (!entry) return;
+    
+    memcpy(entry->data, node, node_len);
+    if (service) {
+        entry->service_off = node_len;
+        memcpy(entry->data + node_len, service, service_len);
+    }
+    entry->family = hints ? hints->ai_family : AF_UNSPEC;
+    entry->socktype = hints ? hints->ai_socktype : 0;
+    entry->protocol = hints ? hints->ai_protocol : 0;
+    entry->flags = hints ? hints->ai_flags : 0;
+    entry->hash = cache_hash(node, service, entry->family, entry->socktype,
+                             entry->protocol, entry->flags);
+    entry->status = status;
+    entry->expires = monotonic_seconds() + lifetime;
+    entry->lifetime = lifetime;
+    entry->count = count;
+    entry->nodes_off = nodes_off;
+    
+    struct cache_node *nodes = cache_entry_nodes(entry);
+    size_t addr_end = nodes_off + count * sizeof(struct cache_node);
+    int i = 0;
+    for (const struct addrinfo *cur = (status == 0) ? result : NULL; cur; cur = cur->ai_next, i++) {
+        unsigned char addr[20];
+        int len = CACHE_ADDR_LEN(cur->ai_family);
+        if (cur->ai_family == AF_INET6) {
+            const struct sockaddr_in6 *sin6 = (const struct sockaddr_in6 *)cur->ai_addr;
+            nodes[i].port = sin6->sin6_port;
+            memcpy(addr, &sin6->sin6_addr, 16);
+            memcpy(addr + 16, &sin6->sin6_scope_id, 4);
+        } else {
+            const struct sockaddr_in *sin = (const struct sockaddr_in *)cur->ai_addr;
+            nodes[i].port = sin->sin_port;
+            memcpy(addr, &sin->sin_addr, 4);
+        }
+        nodes[i].family = cur->ai_family;
+        nodes[i].socktype = cur->ai_socktype;
+        nodes[i].protocol = cur->ai_protocol;
+        nodes[i].addr_off = addr_end;
+        for (int j = i - 1; j >= 0; j--) {
+            if (nodes[j].family == nodes[i].family &&
+                memcmp(entry->data + nodes[j].addr_off, addr, len) == 0) {
+                nodes[i].addr_off = nodes[j].addr_off;
+                break;
+            }
+        }
+        if (nodes[i].addr_off == addr_end) {
+            memcpy(entry->data + addr_end, addr, len);
+            addr_end += len;
+        }
+    }
+    // Give back what the shared addresses saved
+    if (addr_end < size) {
+        struct cache_entry *shrunk = realloc(entry, sizeof(*entry) + addr_end);
+        if (shrunk) entry = shrunk;
+    }
+    
+    entry->data_len = addr_end;
+    
+    if (!cache_insert(entry, status == 0 ? result->ai_canonname : NULL)) return;
+    atomic_fetch_add_explicit(&cache_store_count, 1, memory_order_relaxed);
+    
+    log_trace("Cached %s answer for %s (%ds)", status == 0 ? "positive" : "negative", node, lifetime);
+}
+
+// Keep the shard locks usable in children of multi-threaded parents. The
+// child reinitialises them rather than unlocking: a write lock belongs to
+// the thread that took it, and the child's thread has a different ID.
+static void cache_atfork_prepare() {
+    for (int i = 0; i < CACHE_SHARDS; i++) {
+        pthread_rwlock_wrlock(&cache_shards[i].lock);
+    }
+}
+
+static void cache_atfork_parent() {
+    for (int i = 0; i < CACHE_SHARDS; i++) {
+        pthread_rwlock_unlock(&cache_shards[i].lock);
+    }
+}
+
+static void cache_atfork_child() {
+    for (int i = 0; i < CACHE_SHARDS; i++) {
+        pthread_rwlock_init(&cache_shards[i].lock, NULL);
+    }
+}
+
+// ---------------------------------------------------------------------------
+// Shared answer cache
+//
+// With shared_cache set, getaddrinfo() answers are also kept in a file
+// mapped MAP_SHARED by every preloaded process that names the same path
+// (a file under /dev/shm keeps it in memory). The file holds a header and a
+// fixed-size open-addressed table of fixed-layout slots, so no pointer ever
+// crosses a process boundary. Each slot is guarded by a sequence counter
+// (seqlock): a writer makes it odd while it rewrites the slot, and a reader
+// copies the slot out and retries elsewhere if the counter moved. Lookups
+// never block and never take a lock.
+//
+// Entries carry a fingerprint of the settings that shape an answer (servers,
+// backend, DNS64 and filtering), so processes with different configurations
+// can share one file without seeing each other's results.
+//
+// The file may outlive a boot, so expiry times are wall-clock (time())
+// seconds, as in cache snapshots: monotonic time restarts at zero on boot
+// and would let entries from a long previous uptime look fresh.
+// ---------------------------------------------------------------------------
+
+#define SHARED_CACHE_MAGIC 0x43534e44u // "DNSC"
+#define SHARED_CACHE_VERSION 2         // 2: expires is wall-clock time
+#define SHARED_CACHE_PROBE 8     // Slots examined per lookup
+#define SHARED_CACHE_MAX_ADDRS 32 // addrinfo nodes per entry
+#define SHARED_CACHE_KEY_MAX 256  // Node and service, each NUL-terminated
+
+struct shared_cache_addr {
+    int16_t family;
+    int16_t socktype;
+    int16_t protocol;
+    uint16_t port;      // Network byte order
+    uint32_t scope_id;
+    unsigned char addr[16];
+};
+
+struct shared_cache_slot {
+    _Atomic uint32_t seq; // Odd while a writer owns the slot
+    uint32_t hash;
+    uint64_t fingerprint;
+    int64_t expires;      // time() seconds (0 = empty)
+    int32_t family;       // Hints the answer was produced for
+    int32_t socktype;
+    int32_t protocol;
+    int32_t flags;
+    int32_t status;       // 0 or the cached EAI_* code
+    uint16_t count;       // Used entries of addrs
+    uint16_t service_off; // Offset of the service in key (0 = no service)
+    char key[SHARED_CACHE_KEY_MAX];
+    char canonname[256];  // Longer names are not shared
+    struct shared_cache_addr addrs[SHARED_CACHE_MAX_ADDRS];
+} __attribute__((aligned(64)));
+
+struct shared_cache_header {
+    _Atomic uint32_t state; // 0 = new file, 1 = being initialised, 2 = ready
+    uint32_t magic;
+    uint32_t version;
+    uint32_t slot_size;
+    uint32_t slot_count;    // Power of two
+} __attribute__((aligned(64)));
+
+static struct shared_cache_slot *shared_cache_slots(const struct dns_config *c) {
+    return (struct shared_cache_slot *)(c->shared_cache + 1);
+}
+
+// Hash of the settings that decide what a lookup returns
+static uint64_t answer_fingerprint(const struct dns_config *c) {
+    uint64_t h = 14695981039346656037ull;
+    int ints[7] = { c->server_count, c->resolver, c->enable_dns64, c->dns64_prefix_len,
+                    c->filter_aaaa, c->filter_a, c->result_order };
+    const unsigned char *parts[3] = { (const unsigned char *)ints, c->dns64_prefix_addr,
+                                      (const unsigned char *)c->dns_addrs };
+    size_t lens[3] = { sizeof(ints), sizeof(c->dns64_prefix_addr),
+                       c->server_count * sizeof(c->dns_addrs[0]) };
+    for (int p = 0; p < 3; p++) {
+        for (size_t i = 0; i < lens[p]; i++) {
+            h = (h ^ parts[p][i]) * 1099511628211ull;
+        }
+    }
+    // Which names go to which servers
+    for (int r = 0; r < c->route_count; r++) {
+        const struct dns_route *route = &c->routes[r];
+        for (const char *ch = route->suffix; *ch; ch++) {
+            h = (h ^ (unsigned char)tolower((unsigned char)*ch)) * 1099511628211ull;
+        }
+        for (int i = 0; i < route->count; i++) {
+            h = (h ^ (uint64_t)(route->servers[i] + 1)) * 1099511628211ull;
+        }
+        h = (h ^ 0xff) * 1099511628211ull;
+    }
+    return h;
+}
+
+// Map the shared cache file named by c->shared_cache_path, creating and
+// initialising it if needed. Leaves c->shared_cache NULL on any failure.
+static void shared_cache_attach(struct dns_config *c) {
+    c->shared_cache = NULL;
+    if (!c->shared_cache_path[0]) return;
+    c->answer_fingerprint = answer_fingerprint(c);
+    
+    size_t slots = 16;
+    while (slots < (size_t)c->shared_cache_slots) {
+        slots <<= 1;
+    }
+    
+    int fd = open(c->shared_cache_path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if (fd < 0) {
+        fprintf(stderr, "[DNS Override] Cannot open shared cache %s: %s\n",
+               c->shared_cache_path, strerror(errno));
+        return;
+    }
+    
+    // An existing file keeps its own table size
+    struct stat st;
+    size_t size = sizeof(struct shared_cache_header) + slots * sizeof(struct shared_cache_slot);
+    if (fstat(fd, &st) != 0 || ((size_t)st.st_size < size && ftruncate(fd, size) != 0)) {
+        fprintf(stderr, "[DNS Override] Cannot size shared cache %s: %s\n",
+               c->shared_cache_path, strerror(errno));
+        close(fd);
+        return;
+    }
+    if ((size_t)st.st_size > size) size = st.st_size;
+    
+    void *map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        fprintf(stderr, "[DNS Override] Cannot map shared cache %s: %s\n",
+               c->shared_cache_path, strerror(errno));
+        return;
+    }
+    
+    // The first process to map a new (zero-filled) file writes the header
+    struct shared_cache_header *hdr = map;
+    uint32_t state = 0;
+    if (atomic_compare_exchange_strong(&hdr->state, &state, 1)) {
+        hdr->magic = SHARED_CACHE_MAGIC;
+        hdr->version = SHARED_CACHE_VERSION;
+        hdr->slot_size = sizeof(struct shared_cache_slot);
+        hdr->slot_count = slots;
+        atomic_store(&hdr->state, 2);
+    } else {
+        for (int spins = 0; spins < 1000 && atomic_load(&hdr->state) != 2; spins++) {
+            sched_yield();
+        }
+    }
+    
+    if (atomic_load(&hdr->state) != 2 || hdr->magic != SHARED_CACHE_MAGIC ||
+        hdr->version != SHARED_CACHE_VERSION || hdr->slot_size != sizeof(struct shared_cache_slot) ||
+        hdr->slot_count == 0 || (hdr->slot_count & (hdr->slot_count - 1)) != 0 ||
+        sizeof(*hdr) + (size_t)hdr->slot_count * hdr->slot_size > size) {
+        fprintf(stderr, "[DNS Override] Shared cache %s has an incompatible layout, not using it\n",
+               c->shared_cache_path);
+        munmap(map, size);
+        return;
+    }
+    
+    c->shared_cache = hdr;
+    c->shared_cache_mapped = size;
+    if (c->debug) {
+        fprintf(stderr, "[DNS Override] Shared cache %s: %u slots\n", c->shared_cache_path, hdr->slot_count);
+    }
+}
+
+static void shared_cache_detach(struct dns_config *c) {
+    if (c->shared_cache) munmap(c->shared_cache, c->shared_cache_mapped);
+    c->shared_cache = NULL;
+}
+
+static uint32_t shared_cache_hash(const char *node, const char *service, const struct addrinfo *hints) {
+    uint32_t h = cache_hash(node, service,
+                            hints ? hints->ai_family : AF_UNSPEC,
+                            hints ? hints->ai_socktype : 0,
+                            hints ? hints->ai_protocol : 0,
+                            hints ? hints->ai_flags : 0);
+    return h ^ (uint32_t)(cfg->answer_fingerprint ^ (cfg->answer_fingerprint >> 32));
+}
+
+// Does a slot copy hold the answer for this key? (copy taken under the seqlock)
+static int shared_slot_matches(const struct shared_cache_slot *slot, uint32_t hash, const char *node,
+                               const char *service, const struct addrinfo *hints) {
+    if (slot->hash != hash || slot->fingerprint != cfg->answer_fingerprint) return 0;
+    if (slot->family != (hints ? hints->ai_family : AF_UNSPEC)) return 0;
+    if (slot->socktype != (hints ? hints->ai_socktype : 0)) return 0;
+    if (slot->protocol != (hints ? hints->ai_protocol : 0)) return 0;
+    if (slot->flags != (hints ? hints->ai_flags : 0)) return 0;
+    if (slot->service_off >= SHARED_CACHE_KEY_MAX) return 0;
+    if (strncmp(slot->key, node, SHARED_CACHE_KEY_MAX) != 0) return 0;
+    if (!slot->service_off || !service) return !slot->service_off && !service;
+    return strncmp(slot->key + slot->service_off, service, SHARED_CACHE_KEY_MAX - slot->service_off) == 0;
+}
+
+// Rebuild an answer from a slot copy as an owned chain
+static struct addrinfo *shared_slot_to_addrinfo(const struct shared_cache_slot *slot) {
+    int count = slot->count < SHARED_CACHE_MAX_ADDRS ? slot->count : SHARED_CACHE_MAX_ADDRS;
+    if (count == 0) return NULL;
+    size_t canon_len = slot->canonname[0] ? strnlen(slot->canonname, sizeof(slot->canonname) - 1) + 1 : 0;
+    struct owned_block *block = owned_block_new(count, canon_len);
+    if (!block) return NULL;
+    
+    for (int i = 0; i < count; i++) {
+        const struct shared_cache_addr *a = &slot->addrs[i];
+        owned_node_set(&block->nodes[i], slot->flags, a->family == AF_INET6 ? AF_INET6 : AF_INET,
+                       a->socktype, a->protocol, a->port, a->addr, a->scope_id);
+    }
+    if (canon_len) {
+        memcpy(block->canonname, slot->canonname, canon_len - 1);
+        block->nodes[0].ai.ai_canonname = block->canonname;
+    }
+    return &block->nodes[0].ai;
+}
+
+// Look up an answer in the shared cache; same contract as cache_lookup()
+static int shared_cache_lookup(const char *node, const char *service, const struct addrinfo *hints,
+                               struct addrinfo **res, int *status) {
+    if (!cfg->shared_cache || !cache_key_applicable(node, hints)) return 0;
+    
+    struct shared_cache_slot *slots = shared_cache_slots(cfg);
+    uint32_t mask = cfg->shared_cache->slot_count - 1;
+    uint32_t hash = shared_cache_hash(node, service, hints);
+    int64_t now = time(NULL);
+    struct shared_cache_slot copy;
+    
+    for (uint32_t probe = 0; probe < SHARED_CACHE_PROBE; probe++) {
+        struct shared_cache_slot *slot = &slots[(hash + probe) & mask];
+        uint32_t seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+        if ((seq & 1) || slot->hash != hash) continue;
+        
+        // Copy the slot out, then make sure no writer touched it meanwhile
+        memcpy((char *)&copy + sizeof(copy.seq), (char *)slot + sizeof(slot->seq),
+               sizeof(copy) - sizeof(copy.seq));
+        atomic_thread_fence(memory_order_acquire);
+        if (atomic_load_explicit(&slot->seq, memory_order_relaxed) != seq) continue;
+        
+        if (copy.expires <= now || !shared_slot_matches(&copy, hash, node, service, hints)) continue;
+        
+        if (copy.status == 0) {
+            struct addrinfo *result = shared_slot_to_addrinfo(&copy);
+            if (!result) return 0;
+            *res = result;
+        }
+        *status = copy.status;
+        log_trace("Shared cache hit for %s%s", node, *status ? " (negative)" : "");
+        return 1;
+    }
+    return 0;
+}
+
+// Publish an answer to the shared cache. Answers that do not fit a slot are
+// simply not shared. A slot another writer holds is skipped, never waited on.
+static void shared_cache_store(const char *node, const char *service, const struct addrinfo *hints,
+                               int status, const struct addrinfo *result, int ttl) {
+    if (!cfg->shared_cache || !cache_key_applicable(node, hints)) return;
+    int lifetime = cache_lifetime(status, result, ttl);
+    if (lifetime <= 0) return;
+    
+    size_t node_len = strlen(node) + 1;
+    size_t service_len = service ? strlen(service) + 1 : 0;
+    if (node_len + service_len > SHARED_CACHE_KEY_MAX) return;
+    int count = 0;
+    for (const struct addrinfo *cur = result; cur; cur = cur->ai_next) {
+        if (cur->ai_family != AF_INET && cur->ai_family != AF_INET6) return;
+        if (++count > SHARED_CACHE_MAX_ADDRS) return;
+    }
+    
+    struct shared_cache_slot *slots = shared_cache_slots(cfg);
+    if (result && result->ai_canonname && strlen(result->ai_canonname) >= sizeof(slots->canonname)) return;
+    uint32_t mask = cfg->shared_cache->slot_count - 1;
+    uint32_t hash = shared_cache_hash(node, service, hints);
+    int64_t now = time(NULL);
+    
+    // Prefer the slot already holding this key, then a free or expired one,
+    // then the one closest to expiry
+    struct shared_cache_slot *victim = NULL;
+    for (uint32_t probe = 0; probe < SHARED_CACHE_PROBE; probe++) {
+        struct shared_cache_slot *slot = &slots[(hash + probe) & mask];
+        if (slot->hash == hash && slot->fingerprint == cfg->answer_fingerprint &&
+            strncmp(slot->key, node, SHARED_CACHE_KEY_MAX) == 0) {
+            victim = slot;
+            break;
+        }
+        if (!victim || (victim->expires > now && slot->expires < victim->expires)) {
+            victim = slot;
+        }
+    }
+    
+    uint32_t seq = atomic_load_explicit(&victim->seq, memory_order_relaxed);
+    if ((seq & 1) || !atomic_compare_exchange_strong_explicit(&victim->seq, &seq, seq + 1,
+                                                               memory_order_acquire, memory_order_relaxed)) {
+        return;
+    }
+    atomic_thread_fence(memory_order_release);
+    
+    victim->hash = hash;
+    victim->fingerprint = cfg->answer_fingerprint;
+    victim->expires = now + lifetime;
+    victim->family = hints ? hints->ai_family : AF_UNSPEC;
+    victim->socktype = hints ? hints->ai_socktype : 0;
+    victim->protocol = hints ? hints->ai_protocol : 0;
+    victim->flags = hints ? hints->ai_flags : 0;
+    victim->status = status;
+    memcpy(victim->key, node, node_len);
+    victim->service_off = service ? node_len : 0;
+    if (service) memcpy(victim->key + node_len, service, service_len);
+    victim->canonname[0] = '\0';
+    if (result && result->ai_canonname) {
+        snprintf(victim->canonname, sizeof(victim->canonname), "%s", result->ai_canonname);
+    }
+    
+    int i = 0;
+    for (const struct addrinfo *cur = result; cur; cur = cur->ai_next, i++) {
+        struct shared_cache_addr *a = &victim->addrs[i];
+        memset(a, 0, sizeof(*a));
+        a->family = cur->ai_family;
+        a->socktype = cur->ai_socktype;
+        a->protocol = cur->ai_protocol;
+        if (cur->ai_family == AF_INET6) {
+            const struct sockaddr_in6 *sin6 = (const struct sockaddr_in6 *)cur->ai_addr;
+            a->port = sin6->sin6_port;
+            a->scope_id = sin6->sin6_scope_id;
+            memcpy(a->addr, &sin6->sin6_addr, 16);
+        } else {
+            const struct sockaddr_in *sin = (const struct sockaddr_in *)cur->ai_addr;
+            a->port = sin->sin_port;
+            memcpy(a->addr, &sin->sin_addr, 4);
+        }
+    }
+    victim->count = i;
+    
+    atomic_store_explicit(&victim->seq, seq + 2, memory_order_release);
+}
+
+// ---------------------------------------------------------------------------
+// Request coalescing (single-flight)
+//
+// When several threads miss the cache for the same getaddrinfo() key at the
+// same time, only the first (the leader) resolves it. The others join its
+// flight, sleep until the leader finishes and then take private copies of
+// its final, post-processed result. The key is the full cache key (node,
+// service and hints) so every follower gets exactly the answer its own call
+// would have produced.
+// ---------------------------------------------------------------------------
+
+#define FLIGHT_BUCKETS 64
+
+struct flight {
+    struct flight *next;
+    uint32_t hash;
+    int family;
+    int socktype;
+    int protocol;
+    int flags;
+    int followers;           // Callers waiting for, or copying, the result
+    int done;
+    int status;              // Leader's getaddrinfo() return value
+    int ttl;
+    struct addrinfo *result; // Shared copy for the followers (owned by the flight)
+    pthread_cond_t cond;
+    char *service;           // Points into key storage below (NULL if none)
+    char node[];
+};
+
+static struct flight *flight_buckets[FLIGHT_BUCKETS];
+static pthread_mutex_t flight_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int flight_key_matches(const struct flight *f, uint32_t hash, const char *node,
+                              const char *service, const struct addrinfo *hints) {
+    if (f->hash != hash) return 0;
+    if (f->family != (hints ? hints->ai_family : AF_UNSPEC)) return 0;
+    if (f->socktype != (hints ? hints->ai_socktype : 0)) return 0;
+    if (f->protocol != (hints ? hints->ai_protocol : 0)) return 0;
+    if (f->flags != (hints ? hints->ai_flags : 0)) return 0;
+    if (strcmp(f->node, node) != 0) return 0;
+    if (!f->service || !service) return f->service == service;
+    return strcmp(f->service, service) == 0;
+}
+
+static void flight_free(struct flight *f) {
+    if (f->result) freeaddrinfo(f->result);
+    pthread_cond_destroy(&f->cond);
+    free(f);
+}
+
+// Either join a lookup already in flight for this key or start one.
+// Returns 1 if another caller resolved the key, with *status, *res and *ttl
+// set from its result. Otherwise returns 0 and sets *leader to the flight
+// the caller now leads (NULL if the lookup is not coalesced), which must be
+// handed to flight_finish().
+static int flight_join(const char *node, const char *service, const struct addrinfo *hints,
+                       struct addrinfo **res, int *status, int *ttl, struct flight **leader) {
+    *leader = NULL;
+    if (!cache_key_applicable(node, hints)) return 0;
+    
+    int family = hints ? hints->ai_family : AF_UNSPEC;
+    int socktype = hints ? hints->ai_socktype : 0;
+    int protocol = hints ? hints->ai_protocol : 0;
+    int flags = hints ? hints->ai_flags : 0;
+    uint32_t hash = cache_hash(node, service, family, socktype, protocol, flags);
+    struct flight **bucket = &flight_buckets[hash % FLIGHT_BUCKETS];
+    
+    pthread_mutex_lock(&flight_lock);
+    struct flight *f = *bucket;
+    while (f && !flight_key_matches(f, hash, node, service, hints)) {
+        f = f->next;
+    }
+    
+    if (!f) {
+        size_t node_len = strlen(node) + 1;
+        size_t service_len = service ? strlen(service) + 1 : 0;
+        f = calloc(1, sizeof(*f) + node_len + service_len);
+        if (f) {
+            memcpy(f->node, node, node_len);
+            if (service) {
+                f->service = f->node + node_len;
+                memcpy(f->service, service, service_len);
+            }
+            f->hash = hash;
+            f->family = family;
+            f->socktype = socktype;
+            f->protocol = protocol;
+            f->flags = flags;
+            pthread_cond_init(&f->cond, NULL);
+            f->next = *bucket;
+            *bucket = f;
+            atomic_fetch_add_explicit(&flights_in_progress, 1, memory_order_relaxed);
+        }
+        pthread_mutex_unlock(&flight_lock);
+        *leader = f;
+        return 0;
+    }
+    
+    f->followers++;
+    while (!f->done) {
+        pthread_cond_wait(&f->cond, &flight_lock);
+    }
+    pthread_mutex_unlock(&flight_lock);
+    
+    // The finished flight's result no longer changes; copy it unlocked
+    *status = f->status;
+    *ttl = f->ttl;
+    *res = NULL;
+    if (f->status == 0) {
+        *res = copy_addrinfo_chain(f->result);
+        if (!*res) *status = EAI_MEMORY;
+    }
+    stat_add(STAT_COALESCED, 1);
+    log_trace("Shared in-flight lookup for %s", node);
+    
+    pthread_mutex_lock(&flight_lock);
+    int last = (--f->followers == 0);
+    pthread_mutex_unlock(&flight_lock);
+    if (last) flight_free(f);
+    
+    return 1;
+}
+
+// Publish the leader's outcome to its followers and retire the flight
+static void flight_finish(struct flight *f, int status, const struct addrinfo *result, int ttl) {
+    if (!f) return;
+    
+    // Copy before taking the lock; the copy is wasted only if nobody joined
+    struct addrinfo *copy = (status == 0 && result) ? copy_addrinfo_chain(result) : NULL;
+    
+    pthread_mutex_lock(&flight_lock);
+    struct flight **link = &flight_buckets[f->hash % FLIGHT_BUCKETS];
+    while (*link != f) {
+        link = &(*link)->next;
+    }
+    *link = f->next;
+    atomic_fetch_sub_explicit(&flights_in_progress, 1, memory_order_relaxed);
+    
+    f->status = (status == 0 && !copy) ? EAI_MEMORY : status;
+    f->result = copy;
+    f->ttl = ttl;
+    f->done = 1;
+    int followers = f->followers;
+    pthread_cond_broadcast(&f->cond);
+    pthread_mutex_unlock(&flight_lock);
+    
+    if (!followers) flight_free(f);
+}
+
+// A child starts with no lookups in flight: the leaders stayed in the parent
+static void flight_atfork_prepare() { pthread_mutex_lock(&flight_lock); }
+static void flight_atfork_parent() { pthread_mutex_unlock(&flight_lock); }
+static void flight_atfork_child() {
+    memset(flight_buckets, 0, sizeof(flight_buckets));
+    atomic_store(&flights_in_progress, 0);
+    pthread_mutex_init(&flight_lock, NULL);
+}
+
+// Embed an IPv4 address in the configured DNS64 prefix (RFC 6052 2.2).
+// The IPv4 bytes follow the prefix, skipping the reserved u-octet (byte 8);
+// the remaining suffix bits are zero.
+static void synthesize_dns64_address(const struct in_addr *ipv4, struct in6_addr *ipv6) {
+    const unsigned char *v4 = (const unsigned char *)&ipv4->s_addr;
+    unsigned char *out = ipv6->s6_addr;
+    int pos = cfg->dns64_prefix_len / 8;
+    
+    memcpy(out, cfg->dns64_prefix_addr, pos);
+    memset(out + pos, 0, 16 - pos);
+    for (int i = 0; i < 4; i++) {
+        if (pos == 8) pos++; // u-octet
+        out[pos++] = v4[i];
+    }
+}
+
+// ---------------------------------------------------------------------------
+// Result rewriting: AAAA filtering, DNS64 synthesis and A filtering
+//
+// The three steps run as one pass over the chain. Filtered nodes are
+// unlinked and released where they are, and synthesized DNS64 nodes are
+// carved out of a single owned block (see above) appended to the tail.
+// ---------------------------------------------------------------------------
+
+// Apply filter_aaaa, DNS64 synthesis and filter_a to a chain in place.
+// Synthesized addresses are appended after the surviving records, and the
+// canonical name moves to the new head if the old one was filtered out.
+// Returns 0 or EAI_MEMORY; counts are reported through the out parameters.
+static int rewrite_addrinfo_chain(struct addrinfo **result, int *removed_aaaa,
+                                  int *added_dns64, int *removed_a) {
+    *removed_aaaa = *added_dns64 = *removed_a = 0;
+    
+    struct owned_block *block = NULL;
+    if (cfg->enable_dns64) {
+        int ipv4_count = 0;
+        for (struct addrinfo *cur = *result; cur; cur = cur->ai_next) {
+            if (cur->ai_family == AF_INET) ipv4_count++;
+        }
+        if (ipv4_count > 0) {
+            block = malloc(sizeof(*block) + ipv4_count * sizeof(block->nodes[0]));
+            if (!block) return EAI_MEMORY;
+            block->refs = 0;
+            block->canonname = NULL;
+        }
+    }
+    
+    char *canonname = NULL;
+    struct addrinfo **link = result;
+    struct addrinfo *cur = *result;
+    while (cur) {
+        struct addrinfo *next = cur->ai_next;
+        
+        if (block && cur->ai_family == AF_INET) {
+            const struct sockaddr_in *sin = (const struct sockaddr_in *)cur->ai_addr;
+            struct owned_node *node = &block->nodes[block->refs];
+            
+            memset(node, 0, sizeof(*node));
+            owned_node_init(node, block);
+            synthesize_dns64_address(&sin->sin_addr, &node->addr.sin6_addr);
+            node->addr.sin6_family = AF_INET6;
+            node->addr.sin6_port = sin->sin_port;
+            node->ai.ai_flags = cur->ai_flags;
+            node->ai.ai_family = AF_INET6;
+            node->ai.ai_socktype = cur->ai_socktype;
+            node->ai.ai_protocol = cur->ai_protocol;
+            node->ai.ai_addrlen = sizeof(struct sockaddr_in6);
+            block->refs++;
+            
+            if (log_enabled(LOG_LEVEL_TRACE)) {
+                char ipv4_str[INET_ADDRSTRLEN];
+                inet_ntop(AF_INET, &sin->sin_addr, ipv4_str, sizeof(ipv4_str));
+                log_trace_addr((const struct sockaddr *)&node->addr, "DNS64 synthesis: %s -> ", ipv4_str);
+            }
+        }
+        
+        int drop = (cfg->filter_aaaa && cur->ai_family == AF_INET6) ||
+                   (cfg->filter_a && cur->ai_family == AF_INET);
+        if (drop) {
+            log_trace_addr(cur->ai_addr, "Filtering out %s record: ",
+                           cur->ai_family == AF_INET6 ? "AAAA" : "A");
+            if (cur->ai_family == AF_INET6) (*removed_aaaa)++; else (*removed_a)++;
+            
+            // Keep the canonical name for whichever node ends up first
+            if (cur->ai_canonname && !canonname) {
+                canonname = cur->ai_canonname;
+                cur->ai_canonname = NULL;
+            }
+            release_addrinfo_node(cur);
+            *link = next;
+        } else {
+            link = &cur->ai_next;
+        }
+        cur = next;
+    }
+    
+    if (block) {
+        *added_dns64 = block->refs;
+        if (block->refs == 0) {
+            free(block);
+        } else {
+            for (int i = 0; i < block->refs; i++) {
+                block->nodes[i].ai.ai_next = (i + 1 < block->refs) ? &block->nodes[i + 1].ai : NULL;
+            }
+            *link = &block->nodes[0].ai;
+        }
+    }
+    
+    if (canonname) {
+        if (*result && !(*result)->ai_canonname) {
+            (*result)->ai_canonname = canonname;
+        } else {
+            free(canonname);
+        }
+    }
+    
+    return 0;
+}
+
+// ---------------------------------------------------------------------------
+// Answer ordering ("result_order")
+//
+// Clients mostly connect to the first address they are given, so the order
+// of a result decides where connections go. result_order rearranges the
+// chain by relinking its nodes, never by copying them; the nodes of one
+// address (one per socket type) move together as a group.
+//
+// - rfc6724 applies the RFC 6724 destination address selection rules with
+//   the default policy table, using the source address the kernel would
+//   pick for each destination (a UDP connect(), which sends nothing).
+// - dns64-first moves addresses inside the DNS64 prefix to the front.
+// - round-robin rotates the groups one more place on every lookup a thread
+//   makes.
+// - rtt sorts by the connect times applications report through
+//   dns_report_connect() (dns_override.h). Addresses nobody has reported on
+//   go first, so each gets measured once.
+//
+// rfc6724 and dns64-first only depend on the answer, so they run once, in
+// the post-processing pass, and cached answers keep that order. round-robin
+// and rtt run on every lookup, cache hits included.
+// ---------------------------------------------------------------------------
+
+#define ORDER_MAX_GROUPS 256       // Longer chains are returned as they are
+#define ADDR_RTT_SLOTS 4096        // Reported addresses remembered (power of two)
+#define ADDR_RTT_PROBE 4
+#define ADDR_RTT_FAILED_US 10000000 // Counted for a failed connect()
+
+struct order_group {
+    struct addrinfo *first;
+    struct addrinfo *last;
+    int family;      // Of the address as a 16-byte (IPv4-mapped) value
+    int rank[5];     // Sort keys, most significant first; lower sorts first
+    int prefix_len;  // rfc6724 rule 9: bits shared with the source (IPv6 only)
+};
+
+// Connect times reported by the application, keyed by a hash of the address.
+// Key and time are updated separately; a torn pair only skews an order.
+struct addr_rtt {
+    _Atomic uint64_t key;
+    _Atomic int64_t srtt_us;
+};
+
+static struct addr_rtt addr_rtts[ADDR_RTT_SLOTS];
+static __thread unsigned order_rotation = 0;
+
+// The address of ai as 16 bytes, IPv4 in its IPv4-mapped form
+static void order_addr16(const struct addrinfo *ai, unsigned char out[16]) {
+    if (ai->ai_family == AF_INET6) {
+        memcpy(out, &((const struct sockaddr_in6 *)ai->ai_addr)->sin6_addr, 16);
+    } else {
+        memset(out, 0, 10);
+        out[10] = out[11] = 0xff;
+        memcpy(out + 12, &((const struct sockaddr_in *)ai->ai_addr)->sin_addr, 4);
+    }
+}
+
+static uint64_t addr_rtt_key(const unsigned char addr[16]) {
+    uint64_t h = 14695981039346656037ull;
+    for (int i = 0; i < 16; i++) {
+        h = (h ^ addr[i]) * 1099511628211ull;
+    }
+    return h | 1; // 0 marks a free slot
+}
+
+// Record a connect() time (or a failure, rtt_us < 0) for addr
+static void addr_rtt_report(const unsigned char addr[16], int64_t rtt_us) {
+    if (rtt_us < 0) rtt_us = ADDR_RTT_FAILED_US;
+    if (rtt_us < 1) rtt_us = 1;
+    uint64_t key = addr_rtt_key(addr);
+    struct addr_rtt *slot = &addr_rtts[key & (ADDR_RTT_SLOTS - 1)];
+    for (int i = 0; i < ADDR_RTT_PROBE; i++) {
+        struct addr_rtt *s = &addr_rtts[(key + i) & (ADDR_RTT_SLOTS - 1)];
+        uint64_t seen = atomic_load_explicit(&s->key, memory_order_relaxed);
+        if (seen == 0 && atomic_compare_exchange_strong(&s->key, &seen, key)) {
+            atomic_store_explicit(&s->srtt_us, rtt_us, memory_order_relaxed);
+            return;
+        }
+        if (seen == key) {
+            // Same smoothing as the server SRTT (see health_record_success())
+            int64_t srtt = atomic_load_explicit(&s->srtt_us, memory_order_relaxed);
+            srtt = srtt ? srtt + (rtt_us - srtt) / 8 : rtt_us;
+            atomic_store_explicit(&s->srtt_us, srtt > 0 ? srtt : 1, memory_order_relaxed);
+            return;
+        }
+    }
+    // Neighbourhood full: the first slot goes to the newest address
+    atomic_store_explicit(&slot->key, key, memory_order_relaxed);
+    atomic_store_explicit(&slot->srtt_us, rtt_us, memory_order_relaxed);
+}
+
+// Smoothed connect time for addr, 0 if none was reported
+static int64_t addr_rtt_lookup(const unsigned char addr[16]) {
+    uint64_t key = addr_rtt_key(addr);
+    for (int i = 0; i < ADDR_RTT_PROBE; i++) {
+        struct addr_rtt *s = &addr_rtts[(key + i) & (ADDR_RTT_SLOTS - 1)];
+        if (atomic_load_explicit(&s->key, memory_order_relaxed) == key) {
+            return atomic_load_explicit(&s->srtt_us, memory_order_relaxed);
+        }
+    }
+    return 0;
+}
+
+// RFC 6724 section 2.1 default policy table: precedence, and the label
+static int rfc6724_policy(const unsigned char a[16], int *label) {
+    static const struct {
+        unsigned char prefix[16];
+        int bits;
+        int precedence;
+        int label;
+    } table[] = {
+        { { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 1 }, 128, 50, 0 }, // ::1
+        { { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0xff, 0xff }, 96, 35, 4 },        // ::ffff:0:0/96 (IPv4)
+        { { 0 }, 96, 1, 3 },                                                 // ::/96
+        { { 0x20, 0x01, 0, 0 }, 32, 5, 5 },                                  // 2001::/32 (Teredo)
+        { { 0x20, 0x02 }, 16, 30, 2 },                                       // 2002::/16 (6to4)
+        { { 0x3f, 0xfe }, 16, 1, 12 },                                       // 3ffe::/16
+        { { 0xfe, 0xc0 }, 10, 1, 11 },                                       // fec0::/10
+        { { 0xfc }, 7, 3, 13 },                                              // fc00::/7 (ULA)
+        { { 0 }, 0, 40, 1 },                                                 // ::/0
+    };
+    for (size_t i = 0; i < sizeof(table) / sizeof(table[0]); i++) {
+        int bits = table[i].bits;
+        if (memcmp(a, table[i].prefix, bits / 8) != 0) continue;
+        if (bits % 8 && ((a[bits / 8] ^ table[i].prefix[bits / 8]) & (0xff << (8 - bits % 8)) & 0xff)) {
+            continue;
+        }
+        *label = table[i].label;
+        return table[i].precedence;
+    }
+    *label = 1;
+    return 40;
+}
+
+// RFC 6724 section 3.1 scope of a (possibly IPv4-mapped) address
+static int rfc6724_scope(const unsigned char a[16]) {
+    static const unsigned char loopback[16] = { [15] = 1 };
+    static const unsigned char mapped[12] = { [10] = 0xff, [11] = 0xff };
+    if (a[0] == 0xff) return a[1] & 0x0f;                    // Multicast
+    if (a[0] == 0xfe && (a[1] & 0xc0) == 0x80) return 2;     // Link-local
+    if (a[0] == 0xfe && (a[1] & 0xc0) == 0xc0) return 5;     // Site-local
+    if (memcmp(a, loopback, 16) == 0) return 2;
+    if (memcmp(a, mapped, 12) == 0 &&
+        (a[12] == 127 || (a[12] == 169 && a[13] == 254))) {
+        return 2;
+    }
+    return 14;
+}
+
+// Source address the kernel would use towards ai (16-byte form); 0 if the
+// destination is unreachable. fds caches one socket per family.
+static int rfc6724_source(const struct addrinfo *ai, int fds[2], unsigned char src[16]) {
+    int v6 = ai->ai_family == AF_INET6;
+    if (fds[v6] < 0) fds[v6] = socket(ai->ai_family, SOCK_DGRAM | SOCK_CLOEXEC, IPPROTO_UDP);
+    if (fds[v6] < 0) return 0;
+    
+    struct sockaddr_storage dst, local;
+    memcpy(&dst, ai->ai_addr, ai->ai_addrlen);
+    if (v6 && !((struct sockaddr_in6 *)&dst)->sin6_port) ((struct sockaddr_in6 *)&dst)->sin6_port = htons(9);
+    if (!v6 && !((struct sockaddr_in *)&dst)->sin_port) ((struct sockaddr_in *)&dst)->sin_port = htons(9);
+    socklen_t len = sizeof(local);
+    if (connect(fds[v6], (struct sockaddr *)&dst, ai->ai_addrlen) != 0 ||
+        getsockname(fds[v6], (struct sockaddr *)&local, &len) != 0) {
+        return 0;
+    }
+    struct addrinfo probe = { .ai_family = local.ss_family, .ai_addr = (struct sockaddr *)&local };
+    order_addr16(&probe, src);
+    return 1;
+}
+
+// Sort keys for one group under policy
+static void order_rank(struct order_group *g, int policy, int fds[2]) {
+    unsigned char dst[16];
+    order_addr16(g->first, dst);
+    memset(g->rank, 0, sizeof(g->rank));
+    g->prefix_len = 0;
+    
+    if (policy == RESULT_ORDER_DNS64_FIRST) {
+        int bits = cfg->dns64_prefix_len;
+        g->rank[0] = !(g->first->ai_family == AF_INET6 && memcmp(dst, cfg->dns64_prefix_addr, bits / 8) == 0);
+    } else if (policy == RESULT_ORDER_RTT) {
+        int64_t srtt = addr_rtt_lookup(dst);
+        g->rank[0] = srtt > INT_MAX ? INT_MAX : (int)srtt;
+    } else if (policy == RESULT_ORDER_RFC6724) {
+        unsigned char src[16];
+        int dst_label, src_label;
+        int precedence = rfc6724_policy(dst, &dst_label);
+        int dst_scope = rfc6724_scope(dst);
+        if (!rfc6724_source(g->first, fds, src)) {
+            g->rank[0] = 1;                                  // Rule 1: avoid unusable destinations
+        } else {
+            rfc6724_policy(src, &src_label);
+            g->rank[1] = rfc6724_scope(src) != dst_scope;    // Rule 2: prefer matching scope
+            g->rank[2] = src_label != dst_label;             // Rule 5: prefer matching label
+            if (g->family == AF_INET6) {
+                // Rule 9: longest matching prefix, up to the usual /64
+                while (g->prefix_len < 64 &&
+                       !((dst[g->prefix_len / 8] ^ src[g->prefix_len / 8]) & (0x80 >> (g->prefix_len % 8)))) {
+                    g->prefix_len++;
+                }
+            }
+        }
+        g->rank[3] = -precedence;                            // Rule 6: higher precedence
+        g->rank[4] = dst_scope;                              // Rule 8: smaller scope
+    }
+}
+
+static int order_compare(const struct order_group *a, const struct order_group *b) {
+    for (int i = 0; i < 5; i++) {
+        if (a->rank[i] != b->rank[i]) return a->rank[i] < b->rank[i] ? -1 : 1;
+    }
+    if (a->family == AF_INET6 && b->family == AF_INET6 && a->prefix_len != b->prefix_len) {
+        return a->prefix_len > b->prefix_len ? -1 : 1;
+    }
+    return 0; // Rule 10: keep the upstream order
+}
+
+// Give the new head the canonical name. A name stored inside an owned block
+// lives as long as that block, so another block's node gets a copy.
+static void order_move_canonname(struct addrinfo *from, struct addrinfo *to) {
+    if (!from->ai_canonname || to->ai_canonname) return;
+    int stored = 0;
+    struct owned_node *node = owned_node_of(from);
+    if (node) {
+        stored = from->ai_canonname == node->block->canonname;
+        struct owned_node *to_node = owned_node_of(to);
+        if (stored && to_node) stored = to_node->block != node->block;
+    }
+    if (stored) {
+        to->ai_canonname = strdup(from->ai_canonname); // The old head keeps its pointer
+    } else {
+        to->ai_canonname = from->ai_canonname;
+        from->ai_canonname = NULL;
+    }
+}
+
+// Reorder *res in place by policy (RESULT_ORDER_*)
+static void order_addrinfo(struct addrinfo **res, int policy) {
+    if (policy == RESULT_ORDER_UPSTREAM || !*res || !(*res)->ai_next) return;
+    
+    // Split the chain into runs of nodes sharing one address
+    struct order_group groups[ORDER_MAX_GROUPS];
+    int n = 0;
+    for (struct addrinfo *cur = *res; cur; cur = cur->ai_next) {
+        if (n > 0 && cur->ai_family == groups[n - 1].first->ai_family &&
+            cur->ai_addrlen == groups[n - 1].first->ai_addrlen &&
+            memcmp(cur->ai_addr, groups[n - 1].first->ai_addr, cur->ai_addrlen) == 0) {
+            groups[n - 1].last = cur;
+            continue;
+        }
+        if (n == ORDER_MAX_GROUPS) return;
+        groups[n].first = groups[n].last = cur;
+        groups[n].family = cur->ai_family;
+        n++;
+    }
+    if (n < 2) return;
+    
+    struct order_group sorted[ORDER_MAX_GROUPS];
+    if (policy == RESULT_ORDER_ROUND_ROBIN) {
+        if (order_rotation == 0) order_rotation = (unsigned)((uintptr_t)&order_rotation >> 6);
+        unsigned start = order_rotation++ % n;
+        for (int i = 0; i < n; i++) {
+            sorted[i] = groups[(start + i) % n];
+        }
+    } else {
+        int fds[2] = { -1, -1 };
+        for (int i = 0; i < n; i++) {
+            order_rank(&groups[i], policy, fds);
+            // Insertion sort: stable, and n is small
+            int j = i;
+            while (j > 0 && order_compare(&sorted[j - 1], &groups[i]) > 0) {
+                sorted[j] = sorted[j - 1];
+                j--;
+            }
+            sorted[j] = groups[i];
+        }
+        if (fds[0] >= 0) close(fds[0]);
+        if (fds[1] >= 0) close(fds[1]);
+    }
+    
+    struct addrinfo *old_head = *res;
+    for (int i = 0; i < n; i++) {
+        sorted[i].last->ai_next = (i + 1 < n) ? sorted[i + 1].first : NULL;
+    }
+    *res = sorted[0].first;
+    if (*res != old_head) order_move_canonname(old_head, *res);
+}
+
+// Per-lookup ordering of a result about to be returned (cache hits included)
+static void order_addrinfo_lookup(int status, struct addrinfo **res) {
+    if (status == 0 && (cfg->result_order == RESULT_ORDER_ROUND_ROBIN || cfg->result_order == RESULT_ORDER_RTT)) {
+        order_addrinfo(res, cfg->result_order);
+    }
+}
+
+// ---------------------------------------------------------------------------
+// Upstream server health
+//
+// Every configured server keeps a smoothed RTT, a count of consecutive
+// failures and a backoff deadline. Each lookup orders the servers of its
+// route (the dns_server list, or a "route" line matching the name) by SRTT
+// and leaves out those still backing off, so a dead server stops costing a
+// timeout on every lookup. The state is a set of per-server atomics, each
+// server on its own cache line, so threads update it without taking a lock.
+// ---------------------------------------------------------------------------
+
+#define HEALTH_FAILURE_THRESHOLD 2  // Consecutive failures before a server is skipped
+#define HEALTH_BACKOFF_BASE_MS 1000 // First backoff, doubled on every further failure
+#define HEALTH_BACKOFF_MAX_MS 60000
+
+struct server_health {
+    _Atomic int64_t srtt_us;       // Smoothed RTT in microseconds (0 = not measured yet)
+    _Atomic int failures;          // Consecutive failures
+    _Atomic int64_t backoff_until; // monotonic_us() until which the server is skipped
+} __attribute__((aligned(64)));
+
+static struct server_health server_health[MAX_DNS_SERVERS];
+
+// Servers in the order a lookup should try them
+struct server_order {
+    int count;
+    int idx[MAX_DNS_SERVERS];
+};
+
+static int64_t monotonic_us() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static int64_t monotonic_ms() {
+    return monotonic_us() / 1000;
+}
+
+// A server answered (any rcode other than SERVFAIL/REFUSED) after rtt_us
+static void health_record_success(int idx, int64_t rtt_us) {
+    struct server_health *h = &server_health[idx];
+    int64_t srtt = atomic_load_explicit(&h->srtt_us, memory_order_relaxed);
+    if (rtt_us < 1) rtt_us = 1;
+    // Same smoothing as TCP's SRTT (RFC 6298): srtt += (rtt - srtt) / 8
+    srtt = srtt ? srtt + (rtt_us - srtt) / 8 : rtt_us;
+    atomic_store_explicit(&h->srtt_us, srtt > 0 ? srtt : 1, memory_order_relaxed);
+    
+    // Avoid dirtying the cache line when the server was already healthy
+    if (atomic_load_explicit(&h->failures, memory_order_relaxed)) {
+        atomic_store_explicit(&h->failures, 0, memory_order_relaxed);
+    }
+    if (atomic_load_explicit(&h->backoff_until, memory_order_relaxed)) {
+        atomic_store_explicit(&h->backoff_until, 0, memory_order_relaxed);
+    }
+}
+
+// A server timed out, refused the connection or sent SERVFAIL/REFUSED.
+// penalty_ms raises its SRTT to at least that much (0 leaves SRTT alone).
+static void health_record_failure(int idx, int penalty_ms) {
+    struct server_health *h = &server_health[idx];
+    int64_t penalty_us = (int64_t)penalty_ms * 1000;
+    if (atomic_load_explicit(&h->srtt_us, memory_order_relaxed) < penalty_us) {
+        atomic_store_explicit(&h->srtt_us, penalty_us, memory_order_relaxed);
+    }
+    
+    int failures = atomic_fetch_add_explicit(&h->failures, 1, memory_order_relaxed) + 1;
+    if (failures < HEALTH_FAILURE_THRESHOLD) return;
+    
+    int shift = failures - HEALTH_FAILURE_THRESHOLD;
+    int64_t backoff_ms = HEALTH_BACKOFF_BASE_MS;
+    while (shift-- > 0 && backoff_ms < HEALTH_BACKOFF_MAX_MS) backoff_ms *= 2;
+    if (backoff_ms > HEALTH_BACKOFF_MAX_MS) backoff_ms = HEALTH_BACKOFF_MAX_MS;
+    atomic_store_explicit(&h->backoff_until, monotonic_us() + backoff_ms * 1000, memory_order_relaxed);
+    
+    log_warn("Server %s:%d failed %d times, skipping it for %lld ms",
+             cfg->dns_servers[idx], cfg->dns_ports[idx], failures, (long long)backoff_ms);
+}
+
+// Route of a name: the longest matching "route" suffix, else the
+// dns_server list
+static const struct dns_route *route_for(const char *name) {
+    int r = name ? suffix_trie_match(&cfg->route_trie, name, 0) : -1;
+    return &cfg->routes[r > 0 ? r : 0];
+}
+
+// Order the servers of a route for one lookup: healthy servers by ascending
+// SRTT, with unmeasured servers and servers whose backoff just expired first
+// so they get (re)probed. Servers still backing off are left out unless
+// every server is, in which case all are used, soonest to recover first.
+static void health_server_order(struct server_order *order, const struct dns_route *route) {
+    int64_t key[MAX_DNS_SERVERS];
+    int64_t now = monotonic_us();
+    int backing_off = 0;
+    
+    order->count = 0;
+    for (int pass = 0; pass < 2 && order->count == 0; pass++) {
+        for (int r = 0; r < route->count; r++) {
+            int i = route->servers[r];
+            struct server_health *h = &server_health[i];
+            int64_t until = atomic_load_explicit(&h->backoff_until, memory_order_relaxed);
+            int64_t k;
+            if (pass == 0) {
+                if (until > now) {
+                    backing_off++;
+                    continue;
+                }
+                k = until ? 0 : atomic_load_explicit(&h->srtt_us, memory_order_relaxed);
+            } else {
+                k = until;
+            }
+            
+            // Insertion sort; equal keys keep the configured order
+            int pos = order->count++;
+            while (pos > 0 && key[pos - 1] > k) {
+                key[pos] = key[pos - 1];
+                order->idx[pos] = order->idx[pos - 1];
+                pos--;
+            }
+            key[pos] = k;
+            order->idx[pos] = i;
+        }
+    }
+    
+    if (backing_off) {
+        log_info("%d of %d servers%s%s are backing off", backing_off, route->count,
+                 route->suffix[0] ? " for " : "", route->suffix);
+    }
+}
+
+// Attribute the outcome of a res_nsearch()/glibc lookup to the first server
+// it was sent to. glibc does not say which server answered, so an answer that
+// came back within one attempt timeout counts as a success of the first
+// server, and a slower answer or a timeout as a failure of it.
+static void health_record_res_outcome(const struct server_order *order, int64_t started_us, int timed_out) {
+    if (order->count == 0) return;
+    int64_t elapsed_us = monotonic_us() - started_us;
+    int first = order->idx[0];
+    int retrans_ms = ((cfg->attempt_timeout_ms + 999) / 1000) * 1000;
+    stat_server(first, SERVER_QUERIES);
+    if (timed_out) {
+        stat_server(first, SERVER_TIMEOUTS);
+    } else {
+        stat_server_rtt(first, elapsed_us);
+    }
+    if (timed_out || elapsed_us >= (int64_t)retrans_ms * 1000) {
+        health_record_failure(first, retrans_ms);
+    } else {
+        health_record_success(first, elapsed_us);
+    }
+}
+
+// ---------------------------------------------------------------------------
+// Configuration snapshots and hot reload
+//
+// The configuration is an immutable snapshot published through an atomic
+// pointer. Each lookup pins the current snapshot on entry and uses it until
+// it returns, so a reload never changes settings under an in-flight lookup.
+// Pinning is a hazard pointer: the thread stores the snapshot in its reader
+// slot and re-checks the published pointer, with no lock taken. Replaced
+// snapshots are freed once no reader slot refers to them.
+//
+// At most once per reload_interval seconds one lookup stats the config
+// file; if it changed, that lookup builds a new snapshot and publishes it
+// while other threads carry on with the old one. With reload_on_sighup the
+// library also forces a reload on the next lookup after SIGHUP.
+// ---------------------------------------------------------------------------
+
+struct config_reader {
+    struct config_reader *next;       // Registry link (readers are never freed)
+    _Atomic int in_use;               // Claimed by a live thread
+    struct dns_config *_Atomic hazard; // Snapshot the thread is using, or NULL
+};
+
+static struct dns_config *_Atomic active_config = NULL;
+static struct dns_config config_boot;             // Storage for the first snapshot
+static struct dns_config *config_retired = NULL;  // Replaced, possibly still pinned
+static struct config_reader *_Atomic config_readers = NULL;
+static atomic_flag config_reloading = ATOMIC_FLAG_INIT; // Held by the thread reloading
+static _Atomic int64_t config_next_check = 0;      // monotonic_seconds() of next stat()
+static _Atomic int config_reload_requested = 0;    // Set by the SIGHUP handler
+static pthread_once_t config_once = PTHREAD_ONCE_INIT;
+static pthread_once_t config_reader_once = PTHREAD_ONCE_INIT;
+static pthread_key_t config_reader_key;
+
+static __thread struct config_reader *config_reader = NULL;
+static __thread int config_depth = 0; // Nesting of config_acquire() calls
+
+static struct sigaction config_saved_sighup;
+static int config_sighup_installed = 0;
+
+static void config_reader_release(void *arg) {
+    struct config_reader *r = arg;
+    atomic_store(&r->hazard, NULL);
+    atomic_store(&r->in_use, 0);
+}
+
+static void config_reader_key_init() {
+    pthread_key_create(&config_reader_key, config_reader_release);
+}
+
+// Claim a free reader slot for this thread, adding one if all are taken
+static struct config_reader *get_config_reader() {
+    if (config_reader) return config_reader;
+    
+    pthread_once(&config_reader_once, config_reader_key_init);
+    
+    struct config_reader *r;
+    for (r = atomic_load(&config_readers); r; r = r->next) {
+        int expected = 0;
+        if (atomic_compare_exchange_strong(&r->in_use, &expected, 1)) break;
+    }
+    if (!r) {
+        r = calloc(1, sizeof(*r));
+        if (!r) return NULL;
+        atomic_init(&r->in_use, 1);
+        r->next = atomic_load(&config_readers);
+        while (!atomic_compare_exchange_weak(&config_readers, &r->next, r)) {
+        }
+    }
+    
+    pthread_setspecific(config_reader_key, r);
+    config_reader = r;
+    return r;
+}
+
+static void config_sighup_handler(int sig, siginfo_t *info, void *context) {
+    atomic_store(&config_reload_requested, 1);
+    
+    // Keep whatever the application installed before us working
+    if (config_saved_sighup.sa_flags & SA_SIGINFO) {
+        if (config_saved_sighup.sa_sigaction) config_saved_sighup.sa_sigaction(sig, info, context);
+    } else if (config_saved_sighup.sa_handler != SIG_DFL && config_saved_sighup.sa_handler != SIG_IGN) {
+        config_saved_sighup.sa_handler(sig);
+    }
+}
+
+// Install or remove the SIGHUP handler to match reload_on_sighup
+static void config_update_sighup(const struct dns_config *c) {
+    if (c->reload_on_sighup && !config_sighup_installed) {
+        struct sigaction sa;
+        memset(&sa, 0, sizeof(sa));
+        sa.sa_sigaction = config_sighup_handler;
+        sa.sa_flags = SA_SIGINFO | SA_RESTART;
+        sigemptyset(&sa.sa_mask);
+        if (sigaction(SIGHUP, &sa, &config_saved_sighup) == 0) {
+            config_sighup_installed = 1;
+            fprintf(stderr, "[DNS Override] SIGHUP reloads the configuration\n");
+        }
+    } else if (!c->reload_on_sighup && config_sighup_installed) {
+        sigaction(SIGHUP, &config_saved_sighup, NULL);
+        config_sighup_installed = 0;
+    }
+}
+
+// Forget the health and statistics of servers whose address changed: the
+// slot now describes a different server
+static void health_config_changed(const struct dns_config *old, const struct dns_config *next) {
+    for (int i = 0; i < MAX_DNS_SERVERS; i++) {
+        int same = i < old->server_count && i < next->server_count &&
+                   old->dns_addrlens[i] == next->dns_addrlens[i] &&
+                   memcmp(&old->dns_addrs[i], &next->dns_addrs[i], old->dns_addrlens[i]) == 0;
+        if (same) continue;
+        atomic_store_explicit(&server_health[i].srtt_us, 0, memory_order_relaxed);
+        atomic_store_explicit(&server_health[i].failures, 0, memory_order_relaxed);
+        atomic_store_explicit(&server_health[i].backoff_until, 0, memory_order_relaxed);
+        stats_server_reset(i);
+    }
+}
+
+// Make next the snapshot new lookups use (caller holds config_reloading or
+// is the one-time initial load)
+static void config_publish(struct dns_config *next) {
+    struct dns_config *old = atomic_load(&active_config);
+    next->generation = old ? old->generation + 1 : 1;
+    if (old) {
+        health_config_changed(old, next);
+        cache_release_unused(next);
+    }
+    shared_cache_attach(next);
+    
+    atomic_store(&active_config, next);
+    atomic_store(&config_next_check, next->reload_interval > 0
+                 ? (int64_t)monotonic_seconds() + next->reload_interval : INT64_MAX);
+    config_update_sighup(next);
+    stats_config_changed(next);
+    log_config_changed(next);
+    
+    if (old) {
+        old->retired_next = config_retired;
+        config_retired = old;
+        fprintf(stderr, "[DNS Override] Configuration reloaded (%d servers)\n", next->server_count);
+    }
+}
+
+// Free replaced snapshots that no thread has pinned (config_reloading held)
+static void config_reclaim() {
+    struct dns_config **link = &config_retired;
+    while (*link) {
+        struct dns_config *c = *link;
+        int pinned = 0;
+        for (struct config_reader *r = atomic_load(&config_readers); r && !pinned; r = r->next) {
+            pinned = atomic_load(&r->hazard) == c;
+        }
+        if (pinned) {
+            link = &c->retired_next;
+        } else {
+            *link = c->retired_next;
+            // The first snapshot stays usable as a fallback, mapping included
+            if (c != &config_boot) {
+                shared_cache_detach(c);
+                hosts_table_free(c->hosts);
+                suffix_trie_free(&c->route_trie);
+                free(c);
+            }
+        }
+    }
+}
+
+static void config_initial_load() {
+    const char* config_file = get_config_file_path();
+    fprintf(stderr, "[DNS Override] Upstream DNS resolver override loaded. Config: %s\n", config_file);
+    if (getenv(CONFIG_ENV_VAR)) {
+        fprintf(stderr, "[DNS Override] Using custom config path from %s environment variable\n", CONFIG_ENV_VAR);
+    }
+    load_dns_config(&config_boot);
+    config_publish(&config_boot);
+}
+
+// Rebuild the snapshot if the config file changed or SIGHUP asked for it.
+// Only the thread that wins config_reloading does the work; the rest keep
+// going with the current snapshot.
+static void config_maybe_reload() {
+    int64_t now = monotonic_seconds();
+    if (now < atomic_load_explicit(&config_next_check, memory_order_relaxed) &&
+        !atomic_load_explicit(&config_reload_requested, memory_order_relaxed)) {
+        return;
+    }
+    if (atomic_flag_test_and_set(&config_reloading)) return;
+    
+    struct dns_config *current = atomic_load(&active_config);
+    int forced = atomic_exchange(&config_reload_requested, 0);
+    atomic_store(&config_next_check, current->reload_interval > 0
+                 ? now + current->reload_interval : INT64_MAX);
+    
+    struct config_file_id id = {0};
+    struct stat st;
+    if (stat(get_config_file_path(), &st) == 0) {
+        config_file_identity(&st, &id);
+    }
+    const struct config_file_id *seen = &current->file_id;
+    int changed = id.exists != seen->exists ||
+                  (id.exists && (id.dev != seen->dev || id.ino != seen->ino || id.size != seen->size ||
+                                 id.mtime.tv_sec != seen->mtime.tv_sec ||
+                                 id.mtime.tv_nsec != seen->mtime.tv_nsec));
+    
+    if (changed || forced) {
+        struct dns_config *next = calloc(1, sizeof(*next));
+        if (next) {
+            load_dns_config(next);
+            config_publish(next);
+        }
+    }
+    config_reclaim();
+    atomic_flag_clear(&config_reloading);
+}
+
+// Pin the current snapshot as cfg for the calling thread. Every public entry
+// point brackets its work with config_acquire()/config_release().
+static void config_acquire() {
+    if (config_depth++ > 0) return;
+    
+    if (!atomic_load_explicit(&active_config, memory_order_acquire)) {
+        pthread_once(&config_once, config_initial_load);
+    }
+    config_maybe_reload();
+    
+    struct config_reader *r = get_config_reader();
+    struct dns_config *c = atomic_load(&active_config);
+    if (r) {
+        // Publish the pin, then make sure the snapshot was not replaced (and
+        // possibly reclaimed) before the pin became visible
+        atomic_store(&r->hazard, c);
+        while ((c = atomic_load(&active_config)) != atomic_load(&r->hazard)) {
+            atomic_store(&r->hazard, c);
+        }
+    } else {
+        // No reader slot: fall back to the first snapshot, which is never freed
+        c = &config_boot;
+    }
+    cfg = c;
+}
+
+static void config_release() {
+    if (--config_depth > 0) return;
+    if (config_reader) atomic_store(&config_reader->hazard, NULL);
+    cfg = NULL;
+}
+
+// Hold reloads off across fork() so the child never inherits a half-done one
+static void config_atfork_prepare() {
+    while (atomic_flag_test_and_set(&config_reloading)) {
+        sched_yield();
+    }
+}
+static void config_atfork_release() { atomic_flag_clear(&config_reloading); }
+
+// ---------------------------------------------------------------------------
+// Cache snapshots
+//
+// With cache_snapshot set, the answer cache is written to a binary file
+// every cache_snapshot_interval seconds (by a short-lived helper thread,
+// after a lookup notices the interval is up) and once more when the library
+// is unloaded. The next process using the same file maps it at its first
+// lookup and loads every answer still within its TTL, so its lookups are
+// served from memory instead of going upstream. Only processes that cached new
+// answers write, so short-lived programs that never resolve a name do not
+// replace a useful snapshot with an empty one.
+//
+// The file is a header followed by one record per answer, holding the
+// entry's packed data as the cache stores it, its canonical name and its
+// expiry as wall-clock time. Writers fill a temporary file and rename() it
+// into place, so readers only ever see complete snapshots. The header
+// carries the answer fingerprint (see answer_fingerprint()) and the file is
+// ignored when it was written for different servers, filters or DNS64
+// settings, or is damaged in any way.
+// ---------------------------------------------------------------------------
+
+#define CACHE_SNAPSHOT_MAGIC 0x53534e44u // "DNSS"
+#define CACHE_SNAPSHOT_VERSION 1
+
+struct cache_snapshot_header {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t data_align; // offsetof(struct cache_entry, data), which nodes_off depends on
+    uint32_t count;      // Records that follow
+    uint64_t fingerprint;
+    int64_t written;     // CLOCK_REALTIME seconds
+    uint64_t checksum;   // FNV-1a over the records
+};
+
+struct cache_snapshot_record {
+    int64_t expires;      // CLOCK_REALTIME seconds
+    int32_t flags;
+    int32_t socktype;
+    int32_t lifetime;
+    int16_t family;
+    int16_t protocol;
+    int16_t status;
+    uint16_t count;
+    uint16_t service_off;
+    uint16_t nodes_off;
+    uint16_t data_len;
+    uint16_t canon_len;   // Including the NUL (0 = no canonical name)
+    // Followed by data_len bytes of entry data and the canonical name,
+    // padded to a multiple of 8 bytes
+};
+
+#define CACHE_SNAPSHOT_PAD(len) (((len) + 7) & ~(size_t)7)
+
+static uint64_t cache_snapshot_checksum(const char *data, size_t len) {
+    uint64_t h = 14695981039346656037ull;
+    for (size_t i = 0; i < len; i++) {
+        h = (h ^ (unsigned char)data[i]) * 1099511628211ull;
+    }
+    return h;
+}
+
+static pthread_once_t cache_snapshot_once = PTHREAD_ONCE_INIT; // Load on first lookup
+static _Atomic time_t cache_snapshot_due = 0;        // Next periodic write (monotonic)
+static _Atomic uint64_t cache_snapshot_stores = 0;  // cache_store_count at the last write
+static atomic_flag cache_snapshot_busy = ATOMIC_FLAG_INIT;
+
+// Check a record taken from a file before anything trusts its offsets
+static int cache_snapshot_record_valid(const struct cache_snapshot_record *rec, const char *data,
+                                       const char *canon) {
+    if (rec->data_len == 0 || rec->lifetime <= 0) return 0;
+    if (rec->family != AF_UNSPEC && rec->family != AF_INET && rec->family != AF_INET6) return 0;
+    if (!memchr(data, '\0', rec->data_len)) return 0;
+    if (rec->service_off &&
+        (rec->service_off >= rec->data_len ||
+         !memchr(data + rec->service_off, '\0', rec->data_len - rec->service_off))) {
+        return 0;
+    }
+    if ((rec->status == 0) != (rec->count > 0)) return 0;
+    if (rec->status == 0 &&
+        ((offsetof(struct cache_entry, data) + rec->nodes_off) & 1 ||
+         (size_t)rec->nodes_off + rec->count * sizeof(struct cache_node) > rec->data_len)) {
+        return 0;
+    }
+    for (int i = 0; i < rec->count; i++) {
+        struct cache_node node;
+        memcpy(&node, data + rec->nodes_off + i * sizeof(node), sizeof(node));
+        if (node.family != AF_INET && node.family != AF_INET6) return 0;
+        if ((size_t)node.addr_off + CACHE_ADDR_LEN(node.family) > rec->data_len) return 0;
+    }
+    if (rec->canon_len && (rec->status != 0 || canon[rec->canon_len - 1] != '\0')) return 0;
+    return 1;
+}
+
+// Load the answers in cfg->cache_snapshot_path that are still within their
+// TTL into the cache (once, before the first cache lookup). A missing,
+// foreign or damaged file is skipped.
+static void cache_snapshot_load() {
+    if (!cfg->cache_snapshot_path[0] || cfg->cache_size <= 0) return;
+    int fd = open(cfg->cache_snapshot_path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return;
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(struct cache_snapshot_header)) {
+        close(fd);
+        return;
+    }
+    size_t size = st.st_size;
+    const char *map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) return;
+    
+    const struct cache_snapshot_header *hdr = (const struct cache_snapshot_header *)map;
+    if (hdr->magic != CACHE_SNAPSHOT_MAGIC || hdr->version != CACHE_SNAPSHOT_VERSION ||
+        hdr->data_align != offsetof(struct cache_entry, data) ||
+        hdr->fingerprint != answer_fingerprint(cfg)) {
+        log_info("Ignoring cache snapshot %s: written by another version or configuration",
+                 cfg->cache_snapshot_path);
+        munmap((void *)map, size);
+        return;
+    }
+    
+    if (hdr->checksum != cache_snapshot_checksum(map + sizeof(*hdr), size - sizeof(*hdr))) {
+        log_warn("Ignoring damaged cache snapshot %s", cfg->cache_snapshot_path);
+        munmap((void *)map, size);
+        return;
+    }
+    
+    time_t wall = time(NULL);
+    time_t now = monotonic_seconds();
+    size_t off = sizeof(*hdr);
+    uint32_t loaded = 0;
+    uint32_t i;
+    for (i = 0; i < hdr->count; i++) {
+        if (size - off < sizeof(struct cache_snapshot_record)) break;
+        const struct cache_snapshot_record *rec = (const struct cache_snapshot_record *)(map + off);
+        size_t len = sizeof(*rec) + CACHE_SNAPSHOT_PAD((size_t)rec->data_len + rec->canon_len);
+        if (size - off < len) break;
+        const char *data = (const char *)(rec + 1);
+        const char *canon = data + rec->data_len;
+        if (!cache_snapshot_record_valid(rec, data, canon)) break;
+        off += len;
+        if (rec->expires <= wall) continue;
+        
+        // The remaining TTL carries over; the clock it counts on does not
+        int remaining = rec->expires - wall < rec->lifetime ? (int)(rec->expires - wall) : rec->lifetime;
+        struct cache_entry *entry = calloc(1, sizeof(*entry) + rec->data_len);
+        if (!entry) break;
+        memcpy(entry->data, data, rec->data_len);
+        entry->flags = rec->flags;
+        entry->socktype = rec->socktype;
+        entry->family = rec->family;
+        entry->protocol = rec->protocol;
+        entry->status = rec->status;
+        entry->count = rec->count;
+        entry->expires = now + remaining;
+        entry->lifetime = rec->lifetime;
+        entry->service_off = rec->service_off;
+        entry->nodes_off = rec->nodes_off;
+        entry->data_len = rec->data_len;
+        entry->hash = cache_hash(entry->data, entry->service_off ? entry->data + entry->service_off : NULL,
+                                 entry->family, entry->socktype, entry->protocol, entry->flags);
+        if (cache_insert(entry, rec->canon_len ? canon : NULL)) loaded++;
+    }
+    if (i < hdr->count) {
+        log_warn("Cache snapshot %s is damaged; loaded %u of its answers",
+                 cfg->cache_snapshot_path, loaded);
+    } else {
+        log_info("Loaded %u cached answers from %s", loaded, cfg->cache_snapshot_path);
+    }
+    munmap((void *)map, size);
+}
+
+// Append the live answers of one shard to *buf (read lock taken here)
+static int cache_snapshot_collect(struct cache_shard *shard, char **buf, size_t *len, size_t *cap,
+                                  uint32_t *count, time_t now, time_t wall) {
+    if (!cache_read_lock(shard)) return 1;
+    int ok = 1;
+    for (size_t b = 0; shard->buckets && b <= shard->mask && ok; b++) {
+        for (const struct cache_entry *entry = shard->buckets[b]; entry; entry = entry->hash_next) {
+            if (entry->expires <= now) continue;
+            size_t canon_len = entry->canonname ? strlen(entry->canonname->name) + 1 : 0;
+            if (canon_len > UINT16_MAX) continue;
+            size_t need = sizeof(struct cache_snapshot_record) +
+                          CACHE_SNAPSHOT_PAD(entry->data_len + canon_len);
+            if (*len + need > *cap) {
+                size_t grown = *cap ? *cap : 65536;
+                while (*len + need > grown) {
+                    grown *= 2;
+                }
+                char *bigger = realloc(*buf, grown);
+                if (!bigger) {
+                    ok = 0;
+                    break;
+                }
+                *buf = bigger;
+                *cap = grown;
+            }
+            
+            struct cache_snapshot_record *rec = (struct cache_snapshot_record *)(*buf + *len);
+            memset(rec, 0, need);
+            rec->expires = wall + (entry->expires - now);
+            rec->flags = entry->flags;
+            rec->socktype = entry->socktype;
+            rec->lifetime = entry->lifetime;
+            rec->family = entry->family;
+            rec->protocol = entry->protocol;
+            rec->status = entry->status;
+            rec->count = entry->count;
+            rec->service_off = entry->service_off;
+            rec->nodes_off = entry->nodes_off;
+            rec->data_len = entry->data_len;
+            rec->canon_len = canon_len;
+            memcpy(rec + 1, entry->data, entry->data_len);
+            if (canon_len) memcpy((char *)(rec + 1) + entry->data_len, entry->canonname->name, canon_len);
+            *len += need;
+            (*count)++;
+        }
+    }
+    pthread_rwlock_unlock(&shard->lock);
+    return ok;
+}
+
+static int cache_snapshot_write(int fd, const void *data, size_t len) {
+    size_t done = 0;
+    while (done < len) {
+        ssize_t n = write(fd, (const char *)data + done, len - done);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return 0;
+        done += n;
+    }
+    return 1;
+}
+
+// Write the cache to cfg->cache_snapshot_path if it gained answers since the
+// last write. One writer per process at a time.
+static void cache_snapshot_save() {
+    if (!cfg->cache_snapshot_path[0] || cfg->cache_size <= 0) return;
+    uint64_t stores = atomic_load(&cache_store_count);
+    if (stores == atomic_load(&cache_snapshot_stores)) return;
+    if (atomic_flag_test_and_set(&cache_snapshot_busy)) return;
+    
+    struct cache_snapshot_header hdr = {
+        .magic = CACHE_SNAPSHOT_MAGIC,
+        .version = CACHE_SNAPSHOT_VERSION,
+        .data_align = offsetof(struct cache_entry, data),
+        .fingerprint = answer_fingerprint(cfg),
+        .written = time(NULL),
+    };
+    char *buf = NULL;
+    size_t len = 0, cap = 0;
+    time_t now = monotonic_seconds();
+    int ok = 1;
+    for (int i = 0; i < CACHE_SHARDS && ok; i++) {
+        ok = cache_snapshot_collect(&cache_shards[i], &buf, &len, &cap, &hdr.count, now, hdr.written);
+    }
+    
+    hdr.checksum = cache_snapshot_checksum(buf, len);
+    
+    char tmp[sizeof(cfg->cache_snapshot_path) + 32];
+    snprintf(tmp, sizeof(tmp), "%s.%d.tmp", cfg->cache_snapshot_path, (int)getpid());
+    int fd = ok ? open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600) : -1;
+    if (fd >= 0) {
+        ok = cache_snapshot_write(fd, &hdr, sizeof(hdr)) && cache_snapshot_write(fd, buf, len);
+        ok = (close(fd) == 0) && ok;
+        if (ok) ok = rename(tmp, cfg->cache_snapshot_path) == 0;
+        if (!ok) unlink(tmp);
+    } else {
+        ok = 0;
+    }
+    free(buf);
+    
+    if (ok) {
+        atomic_store(&cache_snapshot_stores, stores);
+        log_trace("Wrote %u cached answers to %s", hdr.count, cfg->cache_snapshot_path);
+    } else {
+        log_warn("Could not write cache snapshot %s: %s", cfg->cache_snapshot_path, strerror(errno));
+    }
+    atomic_flag_clear(&cache_snapshot_busy);
+}
+
+static void *cache_snapshot_thread(void *arg) {
+    (void)arg;
+    config_acquire();
+    cache_snapshot_save();
+    config_release();
+    return NULL;
+}
+
+// Called after a lookup stored an answer: start a write in the background
+// once cache_snapshot_interval has passed since the last one
+static void cache_snapshot_tick() {
+    if (!cfg->cache_snapshot_path[0] || cfg->cache_snapshot_interval <= 0) return;
+    time_t now = monotonic_seconds();
+    time_t due = atomic_load_explicit(&cache_snapshot_due, memory_order_relaxed);
+    if (due == 0) {
+        atomic_compare_exchange_strong(&cache_snapshot_due, &due, now + cfg->cache_snapshot_interval);
+        return;
+    }
+    if (now < due ||
+        !atomic_compare_exchange_strong(&cache_snapshot_due, &due, now + cfg->cache_snapshot_interval)) {
+        return;
+    }
+    
+    sigset_t all, saved;
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &saved);
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, cache_snapshot_thread, NULL) == 0) pthread_detach(thread);
+    pthread_sigmask(SIG_SETMASK, &saved, NULL);
+}
+
+// A writer caught mid-way by fork() does not exist in the child
+static void cache_snapshot_atfork_child() { atomic_flag_clear(&cache_snapshot_busy); }
+
+// ---------------------------------------------------------------------------
+// Re-entrant resolution path ("resolver reentrant")
+//
+// Lookups never touch the process-global _res. Each thread lazily creates its
+// own res_state with res_ninit(), points it at the configured servers once and
+// reuses it for every later res_nsearch(). Answers are parsed with the ns_*
+// helpers from libresolv and expanded into addrinfo chains here, so worker
+// threads resolve in parallel without sharing any mutable resolver state.
+// The native client below shares the per-thread buffers and the addrinfo
+// construction.
+// ---------------------------------------------------------------------------
+
+#define MAX_ANSWER_ADDRS 64
+#define DNS_ANSWER_BUFSIZE 65536
+#define HOSTENT_BUFSIZE 8192 // Room for a gethostbyname() result of MAX_ANSWER_ADDRS addresses
+
+// Addresses collected from upstream answers for one name
+struct dns_answer {
+    int count;
+    struct {
+        int family;
+        unsigned char addr[16];
+    } addrs[MAX_ANSWER_ADDRS];
+    uint32_t ttl;                // Smallest TTL across the address records
+    char canonname[NS_MAXDNAME]; // Owner name of the address records
+};
+
+#ifdef DNS_OVERRIDE_TLS
+// ---------------------------------------------------------------------------
+// OpenSSL, loaded on demand
+//
+// Preloading must not pull libssl into every process, so it is opened with
+// dlopen() the first time a tls:// or https:// server is contacted. One
+// SSL_CTX serves all threads; it requires TLS 1.2 or later and verifies
+// certificates against the system trust store (SSL_CERT_FILE and
+// SSL_CERT_DIR point it elsewhere). The last resumable session of each
+// server is shared by all threads, so a thread's first connection to a
+// server resumes instead of paying for a full handshake.
+// ---------------------------------------------------------------------------
+
+#define TLS_FUNCTIONS(X) \
+    X(TLS_client_method) X(SSL_CTX_new) X(SSL_CTX_ctrl) X(SSL_CTX_set_verify) \
+    X(SSL_CTX_set_default_verify_paths) X(SSL_new) X(SSL_free) X(SSL_set_fd) X(SSL_ctrl) \
+    X(SSL_set1_host) X(SSL_get0_param) X(X509_VERIFY_PARAM_set1_ip_asc) X(SSL_set_alpn_protos) \
+    X(SSL_get0_alpn_selected) X(SSL_set_session) X(SSL_get1_session) X(SSL_session_reused) \
+    X(SSL_SESSION_free) X(SSL_SESSION_is_resumable) X(SSL_connect) X(SSL_read) X(SSL_write) \
+    X(SSL_set_shutdown) X(SSL_get_error) X(ERR_clear_error)
+
+static struct {
+#define TLS_FUNCTION_POINTER(fn) __typeof__(fn) *fn;
+    TLS_FUNCTIONS(TLS_FUNCTION_POINTER)
+#undef TLS_FUNCTION_POINTER
+    SSL_CTX *ctx; // NULL if libssl could not be loaded
+} tls;
+
+static pthread_once_t tls_once = PTHREAD_ONCE_INIT;
+
+// Resumable session per server slot, valid for the snapshot it was made in
+static SSL_SESSION *tls_sessions[MAX_DNS_SERVERS];
+static uint64_t tls_session_generations[MAX_DNS_SERVERS];
+static pthread_mutex_t tls_session_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void tls_load() {
+    void *handle = dlopen("libssl.so.3", RTLD_NOW | RTLD_LOCAL);
+    if (!handle) handle = dlopen("libssl.so", RTLD_NOW | RTLD_LOCAL);
+    if (!handle) {
+        log_error("Cannot load libssl, tls:// and https:// servers are unusable: %s", dlerror());
+        return;
+    }
+#define TLS_FUNCTION_LOAD(fn) \
+    if (!(tls.fn = (__typeof__(fn) *)dlsym(handle, #fn))) { \
+        log_error("libssl has no %s, tls:// and https:// servers are unusable", #fn); \
+        return; \
+    }
+    TLS_FUNCTIONS(TLS_FUNCTION_LOAD)
+#undef TLS_FUNCTION_LOAD
+    
+    SSL_CTX *ctx = tls.SSL_CTX_new(tls.TLS_client_method());
+    if (!ctx) return;
+    tls.SSL_CTX_ctrl(ctx, SSL_CTRL_SET_MIN_PROTO_VERSION, TLS1_2_VERSION, NULL);
+    tls.SSL_CTX_ctrl(ctx, SSL_CTRL_MODE, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER, NULL);
+    tls.SSL_CTX_set_verify(ctx, SSL_VERIFY_PEER, NULL);
+    tls.SSL_CTX_set_default_verify_paths(ctx);
+    tls.ctx = ctx;
+}
+#endif
+
+#define TCP_OUT_BUFSIZE 4096 // Queued queries not yet written to a TCP connection
+#define H2_STREAMS 8         // DoH requests outstanding on one connection
+
+// One DoH request (an HTTP/2 stream) and the response body collected for it
+struct h2_stream {
+    uint32_t id;         // 0 when the slot is free
+    uint16_t dns_id;     // ID of the query sent on the stream
+    int failed;          // Non-200 status or a reset: the request failed
+    int headers;         // The final (non-1xx) response headers arrived
+    int len;
+    int size;
+    unsigned char *body;
+};
+
+// A TCP connection of the native client to one server, kept open by its
+// thread across lookups (see "Pooled TCP connections" below)
+struct tcp_conn {
+    int fd;              // -1 when closed
+    int server;          // Slot in thread_resolver.tcp[]
+    int proto;           // SERVER_PLAIN, SERVER_TLS or SERVER_HTTPS
+    int connected;       // connect() has completed
+    int ready;           // Handshake done too: queued output can be written
+    int want_write;      // The TLS handshake waits for the socket to become writable
+    void *tls;           // SSL * of a tls:// or https:// connection
+    int session_saved;   // This connection's session was offered for resumption
+    uint64_t lookup;     // tcp_lookup_serial of the lookup that opened it
+    uint64_t generation; // Snapshot the server slot belonged to
+    int64_t idle_since;  // monotonic_ms() of the last reply (or the connect)
+    int out_len;
+    unsigned char out[TCP_OUT_BUFSIZE];
+    int have;            // Bytes of the reply (or HTTP/2 frame) in in[] so far
+    int need;            // Bytes needed for the length prefix or the whole reply
+    unsigned char *in;   // 2 + 65535, allocated on first use
+    uint32_t h2_next_stream;
+    int h2_done;         // Stream whose body the last read returned, -1 if none
+    struct h2_stream streams[H2_STREAMS];
+    unsigned char failure[12]; // SERVFAIL header standing in for a failed DoH request
+};
+
+static void tcp_conn_close(struct tcp_conn *c) {
+#ifdef DNS_OVERRIDE_TLS
+    if (c->tls) {
+        // Closing without a shutdown would mark the session not resumable;
+        // nothing is sent, as a forked child shares the socket with its parent
+        if (c->ready) tls.SSL_set_shutdown(c->tls, SSL_SENT_SHUTDOWN | SSL_RECEIVED_SHUTDOWN);
+        tls.SSL_free(c->tls);
+    }
+#endif
+    c->tls = NULL;
+    if (c->fd >= 0) close(c->fd);
+    c->fd = -1;
+    c->connected = 0;
+    c->ready = 0;
+    c->want_write = 0;
+    c->session_saved = 0;
+    c->out_len = 0;
+    c->have = 0;
+    c->need = 2;
+    c->h2_done = -1;
+    for (int i = 0; i < H2_STREAMS; i++) {
+        free(c->streams[i].body);
+        memset(&c->streams[i], 0, sizeof(c->streams[i]));
+    }
+}
+
+static void tcp_conns_free(struct tcp_conn **conns) {
+    for (int i = 0; i < MAX_DNS_SERVERS; i++) {
+        if (!conns[i]) continue;
+        tcp_conn_close(conns[i]);
+        free(conns[i]->in);
+        free(conns[i]);
+        conns[i] = NULL;
+    }
+}
+
+// Per-thread resolver state, allocated on first use and released at thread exit
+struct thread_resolver {
+    struct __res_state res;
+    int res_ready; // res has been set up with res_ninit()
+    struct server_order res_order; // Server order res currently uses
+    uint64_t res_generation;       // Config snapshot res was configured from
+    unsigned char answer[DNS_ANSWER_BUFSIZE];
+    struct tcp_conn *tcp[MAX_DNS_SERVERS]; // Native client: pooled connection per server
+    
+    // Storage for the hostent returned by gethostbyname()/gethostbyname2()
+    struct hostent host;
+    char host_buf[HOSTENT_BUFSIZE];
+};
+
+static __thread struct thread_resolver *thread_resolver = NULL;
+static pthread_key_t thread_resolver_key;
+static pthread_once_t thread_resolver_once = PTHREAD_ONCE_INIT;
+
+static void thread_resolver_destroy(void *arg) {
+    struct thread_resolver *tr = arg;
+    if (tr->res_ready) res_nclose(&tr->res);
+    tcp_conns_free(tr->tcp);
+    free(tr);
+}
+
+static void thread_resolver_key_init() {
+    pthread_key_create(&thread_resolver_key, thread_resolver_destroy);
+}
+
+// res_state timeouts are whole seconds: round the attempt timeout up so a
+// sub-second budget never becomes 0 (which glibc would replace by its default)
+static int res_retrans_seconds() {
+    int seconds = (cfg->attempt_timeout_ms + 999) / 1000;
+    return seconds < 1 ? 1 : seconds;
+}
+
+// Passes over the server list for res_state: 1 + retries, reduced so that
+// total_timeout_ms is not exceeded by much (glibc has no overall deadline)
+static int res_retry_count(int servers) {
+    int passes = cfg->retries + 1;
+    if (cfg->total_timeout_ms > 0 && servers > 0) {
+        int budget = cfg->total_timeout_ms / (res_retrans_seconds() * 1000 * servers);
+        if (budget < passes) passes = budget;
+    }
+    return passes < 1 ? 1 : passes;
+}
+
+// Point a res_state at the configured servers, in the given order. IPv4
+// servers go into nsaddr_list; IPv6 servers into _u._ext.nsaddrs with a
+// zero sin_family placeholder at the same index. The IPv6 slots are
+// allocated the first time they are needed and then reused, so changing
+// the order only copies precomputed addresses.
+static void configure_res_state(res_state statp, const struct server_order *order) {
+    statp->nscount = 0;
+    statp->_u._ext.nscount = 0;
+    
+    for (int o = 0; o < order->count && statp->nscount < MAXNS; o++) {
+        int i = order->idx[o];
+        int n = statp->nscount;
+        // res_send() only speaks plain DNS
+        if (!cfg->dns_addrlens[i] || cfg->dns_protos[i] != SERVER_PLAIN) continue;
+        
+        if (cfg->dns_families[i] == AF_INET6) {
+            if (!statp->_u._ext.nsaddrs[n]) {
+                statp->_u._ext.nsaddrs[n] = malloc(sizeof(struct sockaddr_in6));
+                if (!statp->_u._ext.nsaddrs[n]) continue;
+            }
+            memcpy(statp->_u._ext.nsaddrs[n], &cfg->dns_addrs[i], sizeof(struct sockaddr_in6));
+            memset(&statp->nsaddr_list[n], 0, sizeof(statp->nsaddr_list[n]));
+        } else {
+            memcpy(&statp->nsaddr_list[n], &cfg->dns_addrs[i], sizeof(struct sockaddr_in));
+        }
+        statp->nscount++;
+    }
+    
+    statp->retrans = res_retrans_seconds();
+    statp->retry = res_retry_count(statp->nscount);
+}
+
+// Get (creating on first use) the calling thread's resolver state
+static struct thread_resolver *get_thread_resolver() {
+    if (thread_resolver) return thread_resolver;
+    
+    pthread_once(&thread_resolver_once, thread_resolver_key_init);
+    
+    struct thread_resolver *tr = calloc(1, sizeof(*tr));
+    if (!tr) return NULL;
+    
+    pthread_setspecific(thread_resolver_key, tr);
+    thread_resolver = tr;
+    return tr;
+}
+
+// Set up the thread's res_state on first use by the re-entrant path and
+// re-point it whenever the health-based server order or the config changes
+static res_state get_thread_res_state(struct thread_resolver *tr, const struct server_order *order) {
+    if (tr->res_ready) {
+        if (tr->res_generation != cfg->generation || tr->res_order.count != order->count ||
+            memcmp(tr->res_order.idx, order->idx, order->count * sizeof(order->idx[0])) != 0) {
+            configure_res_state(&tr->res, order);
+            tr->res_order = *order;
+            tr->res_generation = cfg->generation;
+        }
+        return &tr->res;
+    }
+    
+    if (res_ninit(&tr->res) != 0) return NULL;
+    configure_res_state(&tr->res, order);
+    tr->res_order = *order;
+    tr->res_generation = cfg->generation;
+    tr->res_ready = 1;
+    
+    log_info("Initialized per-thread resolver with %d nameservers", tr->res.nscount);
+    
+    return &tr->res;
+}
+
+// res_nquery() (or res_nsearch() when search is set) on the thread's
+// res_state, pointed at the servers of the name's route. Returns the answer
+// length, or -1 with h_errno set, like res_query().
+static int route_res_query(const char *name, int class, int type,
+                           unsigned char *answer, int anslen, int search) {
+    struct thread_resolver *tr = get_thread_resolver();
+    struct server_order order;
+    health_server_order(&order, route_for(name));
+    res_state statp = tr ? get_thread_res_state(tr, &order) : NULL;
+    if (!statp) {
+        h_errno = NO_RECOVERY;
+        return -1;
+    }
+    
+    int64_t started = monotonic_us();
+    int len = search ? res_nsearch(statp, name, class, type, answer, anslen)
+                     : res_nquery(statp, name, class, type, answer, anslen);
+    health_record_res_outcome(&order, started, len < 0 && statp->res_h_errno == TRY_AGAIN);
+    if (len < 0) h_errno = statp->res_h_errno;
+    return len;
+}
+
+// Query one record type with the thread's res_state and append the addresses
+// to the answer. Returns 0 on success or an h_errno code.
+static int reentrant_query(const char *name, int type, struct dns_answer *ans) {
+    struct thread_resolver *tr = get_thread_resolver();
+    if (!tr) return NO_RECOVERY;
+    
+    int len = route_res_query(name, ns_c_in, type, tr->answer, sizeof(tr->answer), 1);
+    int herr = (len < 0) ? h_errno : 0;
+    if (len < 0) {
+        return herr ? herr : NO_RECOVERY;
+    }
+    if (len > (int)sizeof(tr->answer)) {
+        len = sizeof(tr->answer);
+    }
+    
+    ns_msg msg;
+    if (ns_initparse(tr->answer, len, &msg) < 0) {
+        return NO_RECOVERY;
+    }
+    
+    int found = 0;
+    int addr_len = (type == ns_t_a) ? 4 : 16;
+    for (int i = 0; i < ns_msg_count(msg, ns_s_an) && ans->count < MAX_ANSWER_ADDRS; i++) {
+        ns_rr rr;
+        if (ns_parserr(&msg, ns_s_an, i, &rr) < 0) break;
+        if (ns_rr_class(rr) != ns_c_in || (int)ns_rr_type(rr) != type) continue;
+        if (ns_rr_rdlen(rr) != addr_len) continue;
+        
+        ans->addrs[ans->count].family = (type == ns_t_a) ? AF_INET : AF_INET6;
+        memcpy(ans->addrs[ans->count].addr, ns_rr_rdata(rr), addr_len);
+        ans->count++;
+        if (ns_rr_ttl(rr) < ans->ttl) ans->ttl = ns_rr_ttl(rr);
+        if (!ans->canonname[0]) {
+            snprintf(ans->canonname, sizeof(ans->canonname), "%s", ns_rr_name(rr));
+        }
+        found++;
+    }
+    
+    return found ? 0 : NO_DATA;
+}
+
+// Combine the outcome of two queries for the same name
+static int merge_query_status(int a, int b) {
+    if (a == 0 || b == 0) return 0;
+    if (a == TRY_AGAIN || b == TRY_AGAIN) return TRY_AGAIN;
+    if (a == HOST_NOT_FOUND || b == HOST_NOT_FOUND) return HOST_NOT_FOUND;
+    if (a == NO_RECOVERY || b == NO_RECOVERY) return NO_RECOVERY;
+    return NO_DATA;
+}
+
+static int herrno_to_eai(int herr) {
+    switch (herr) {
+        case 0:              return 0;
+        case HOST_NOT_FOUND: return EAI_NONAME;
+        case NO_DATA:        return EAI_NODATA;
+        case TRY_AGAIN:      return EAI_AGAIN;
+        default:             return EAI_FAIL;
+    }
+}
+
+// ---------------------------------------------------------------------------
+// Native DNS client ("resolver native")
+//
+// A minimal stub resolver speaking the DNS wire protocol directly: it builds
+// A/AAAA queries, sends them over UDP (or TCP with use_tcp, and after a
+// truncated UDP reply), validates the response against the question and
+// collects addresses, the CNAME-resolved owner name and TTLs. Names are sent
+// as-is; no search domains are appended.
+//
+// Queries carry an EDNS0 OPT record advertising edns_udp_size bytes, so
+// answers with many addresses fit in one datagram and only replies larger
+// than that come back truncated and go to TCP. A server that rejects EDNS
+// with FORMERR is asked again without it.
+// ---------------------------------------------------------------------------
+
+#define DNS_HEADER_SIZE 12
+#define DNS_UDP_BUFSIZE MAX_EDNS_UDP_SIZE // Largest reply edns_udp_size lets a server send
+#define DNS_OPT_RR_SIZE 11                // Root name, type, class, TTL, empty RDATA
+#define DNS_QUERY_MAX (DNS_HEADER_SIZE + 256 + 4 + DNS_OPT_RR_SIZE)
+#define DNS_MAX_CNAME_CHAIN 16
+
+#define DNS_RCODE_NOERROR 0
+#define DNS_RCODE_FORMERR 1
+#define DNS_RCODE_SERVFAIL 2
+#define DNS_RCODE_NXDOMAIN 3
+
+static __thread uint64_t dns_rng_state = 0;
+
+// Query IDs come from a per-thread xorshift generator seeded from the kernel
+static uint16_t dns_next_id() {
+    if (dns_rng_state == 0) {
+        int fd = open("/dev/urandom", O_RDONLY | O_CLOEXEC);
+        if (fd >= 0) {
+            if (read(fd, &dns_rng_state, sizeof(dns_rng_state)) != sizeof(dns_rng_state)) {
+                dns_rng_state = 0;
+            }
+            close(fd);
+        }
+        if (dns_rng_state == 0) {
+            struct timespec ts;
+            clock_gettime(CLOCK_MONOTONIC, &ts);
+            dns_rng_state = ((uint64_t)ts.tv_nsec << 32) ^ (uint64_t)ts.tv_sec ^ (uint64_t)(uintptr_t)&ts;
+        }
+    }
+    dns_rng_state ^= dns_rng_state >> 12;
+    dns_rng_state ^= dns_rng_state << 25;
+    dns_rng_state ^= dns_rng_state >> 27;
+    return (uint16_t)((dns_rng_state * 2685821657736338717ULL) >> 48);
+}
+
+static uint16_t dns_get16(const unsigned char *p) {
+    return (uint16_t)((p[0] << 8) | p[1]);
+}
+
+static uint32_t dns_get32(const unsigned char *p) {
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
+
+// Build a recursive query for name/qtype, with an EDNS0 OPT record offering
+// udp_size bytes unless that is 0. Returns the message length or -1.
+static int dns_build_query(unsigned char *buf, size_t size, uint16_t id, const char *name, int qtype,
+                           int udp_size) {
+    size_t name_len = strlen(name);
+    if (name_len && name[name_len - 1] == '.') name_len--;
+    if (name_len == 0 || name_len > 253 ||
+        size < DNS_HEADER_SIZE + name_len + 2 + 4 + (udp_size ? DNS_OPT_RR_SIZE : 0)) {
+        return -1;
+    }
+    
+    memset(buf, 0, DNS_HEADER_SIZE);
+    buf[0] = id >> 8;
+    buf[1] = id & 0xff;
+    buf[2] = 0x01; // RD
+    buf[5] = 1;    // QDCOUNT
+    
+    size_t off = DNS_HEADER_SIZE;
+    const char *label = name;
+    const char *end = name + name_len;
+    while (label < end) {
+        const char *dot = memchr(label, '.', end - label);
+        size_t label_len = (dot ? dot : end) - label;
+        if (label_len == 0 || label_len > 63) return -1;
+        buf[off++] = (unsigned char)label_len;
+        memcpy(buf + off, label, label_len);
+        off += label_len;
+        label += label_len + (dot ? 1 : 0);
+    }
+    buf[off++] = 0;
+    buf[off++] = qtype >> 8;
+    buf[off++] = qtype & 0xff;
+    buf[off++] = 0;
+    buf[off++] = ns_c_in;
+    
+    if (udp_size) {
+        buf[11] = 1; // ARCOUNT
+        buf[off++] = 0; // Root owner name
+        buf[off++] = ns_t_opt >> 8;
+        buf[off++] = ns_t_opt & 0xff;
+        buf[off++] = udp_size >> 8; // CLASS carries the payload size
+        buf[off++] = udp_size & 0xff;
+        memset(buf + off, 0, 6); // Extended RCODE, version 0, no flags, no options
+        off += 6;
+    }
+    return (int)off;
+}
+
+// A server that does not speak EDNS0 answers FORMERR without an OPT record
+static int dns_edns_rejected(const unsigned char *msg, int len) {
+    return len >= DNS_HEADER_SIZE && (msg[3] & 0x0f) == DNS_RCODE_FORMERR && dns_get16(msg + 10) == 0;
+}
+
+// Expand a possibly compressed name at off into out (dotted, no trailing dot).
+// Returns the offset just past the name in the original position, or -1.
+static int dns_read_name(const unsigned char *msg, int len, int off, char *out, size_t out_size) {
+    size_t out_len = 0;
+    int next = -1;
+    int jumps = 0;
+    
+    while (off < len) {
+        unsigned char c = msg[off];
+        if (c == 0) {
+            if (next < 0) next = off + 1;
+            if (out_size) out[out_len < out_size ? out_len : out_size - 1] = '\0';
+            return next;
+        }
+        if ((c & 0xc0) == 0xc0) {
+            if (off + 1 >= len || ++jumps > 32) return -1;
+            if (next < 0) next = off + 2;
+            off = ((c & 0x3f) << 8) | msg[off + 1];
+            continue;
+        }
+        if (c & 0xc0) return -1; // Unsupported label type
+        if (off + 1 + c > len) return -1;
+        if (out_size) {
+            if (out_len && out_len < out_size - 1) out[out_len++] = '.';
+            for (int i = 0; i < c && out_len < out_size - 1; i++) {
+                out[out_len++] = (char)msg[off + 1 + i];
+            }
+        }
+        off += 1 + c;
+    }
+    return -1;
+}
+
+// Parse a response to (name, qtype) and append its addresses to the answer.
+// Returns 0 with addresses found, or HOST_NOT_FOUND/NO_DATA for definitive
+// negative answers (ans->ttl then carries the SOA-derived negative TTL),
+// TRY_AGAIN for SERVFAIL/REFUSED and NO_RECOVERY for malformed replies.
+static int dns_parse_response(const unsigned char *msg, int len, uint16_t id, const char *name,
+                              int qtype, struct dns_answer *ans) {
+    if (len < DNS_HEADER_SIZE || dns_get16(msg) != id || !(msg[2] & 0x80)) {
+        return NO_RECOVERY;
+    }
+    int rcode = msg[3] & 0x0f;
+    int qdcount = dns_get16(msg + 4);
+    int ancount = dns_get16(msg + 6);
+    int nscount = dns_get16(msg + 8);
+    if (qdcount != 1) return NO_RECOVERY;
+    
+    // The question must echo ours
+    char owner[NS_MAXDNAME];
+    int off = dns_read_name(msg, len, DNS_HEADER_SIZE, owner, sizeof(owner));
+    if (off < 0 || off + 4 > len) return NO_RECOVERY;
+    size_t name_len = strlen(name);
+    if (name_len && name[name_len - 1] == '.') name_len--;
+    if (strlen(owner) != name_len || strncasecmp(owner, name, name_len) != 0 ||
+        dns_get16(msg + off) != qtype || dns_get16(msg + off + 2) != ns_c_in) {
+        return NO_RECOVERY;
+    }
+    off += 4;
+    
+    if (rcode != DNS_RCODE_NOERROR && rcode != DNS_RCODE_NXDOMAIN) {
+        return (rcode == DNS_RCODE_SERVFAIL || rcode == 5 /* REFUSED */) ? TRY_AGAIN : NO_RECOVERY;
+    }
+    
+    // Follow the CNAME chain from the queried name to the address records
+    char target[NS_MAXDNAME];
+    snprintf(target, sizeof(target), "%.*s", (int)name_len, name);
+    uint32_t ttl = UINT32_MAX;
+    int found = 0;
+    int addr_len = (qtype == ns_t_a) ? 4 : 16;
+    
+    for (int pass = 0; pass < DNS_MAX_CNAME_CHAIN; pass++) {
+        char next[NS_MAXDNAME];
+        int rr_off = off;
+        int followed = 0;
+        for (int i = 0; i < ancount; i++) {
+            rr_off = dns_read_name(msg, len, rr_off, owner, sizeof(owner));
+            if (rr_off < 0 || rr_off + 10 > len) return found ? 0 : NO_RECOVERY;
+            int type = dns_get16(msg + rr_off);
+            int klass = dns_get16(msg + rr_off + 2);
+            uint32_t rr_ttl = dns_get32(msg + rr_off + 4);
+            int rdlen = dns_get16(msg + rr_off + 8);
+            int rdata = rr_off + 10;
+            rr_off = rdata + rdlen;
+            if (rr_off > len) return found ? 0 : NO_RECOVERY;
+            if (klass != ns_c_in || strcasecmp(owner, target) != 0) continue;
+            
+            if (type == qtype && rdlen == addr_len) {
+                if (ans->count < MAX_ANSWER_ADDRS) {
+                    ans->addrs[ans->count].family = (qtype == ns_t_a) ? AF_INET : AF_INET6;
+                    memcpy(ans->addrs[ans->count].addr, msg + rdata, addr_len);
+                    ans->count++;
+                }
+                if (rr_ttl < ttl) ttl = rr_ttl;
+                found++;
+            } else if (type == ns_t_cname && !followed) {
+                if (dns_read_name(msg, len, rdata, next, sizeof(next)) < 0) return NO_RECOVERY;
+                if (rr_ttl < ttl) ttl = rr_ttl;
+                followed = 1;
+            }
+        }
+        if (found || !followed) break;
+        snprintf(target, sizeof(target), "%s", next);
+    }
+    
+    if (found) {
+        if (!ans->canonname[0]) snprintf(ans->canonname, sizeof(ans->canonname), "%s", target);
+        if (ttl < ans->ttl) ans->ttl = ttl;
+        return 0;
+    }
+    
+    // Negative answer: RFC 2308 negative TTL is min(SOA TTL, SOA MINIMUM)
+    int rr_off = off;
+    for (int i = 0; i < ancount && rr_off >= 0; i++) {
+        rr_off = dns_read_name(msg, len, rr_off, NULL, 0);
+        if (rr_off < 0 || rr_off + 10 > len) return NO_RECOVERY;
+        rr_off += 10 + dns_get16(msg + rr_off + 8);
+    }
+    for (int i = 0; i < nscount && rr_off >= 0 && rr_off < len; i++) {
+        rr_off = dns_read_name(msg, len, rr_off, NULL, 0);
+        if (rr_off < 0 || rr_off + 10 > len) break;
+        int type = dns_get16(msg + rr_off);
+        uint32_t rr_ttl = dns_get32(msg + rr_off + 4);
+        int rdlen = dns_get16(msg + rr_off + 8);
+        int rdata = rr_off + 10;
+        rr_off = rdata + rdlen;
+        if (type == ns_t_soa && rr_off <= len && rdlen >= 22) {
+            uint32_t minimum = dns_get32(msg + rr_off - 4);
+            uint32_t neg_ttl = rr_ttl < minimum ? rr_ttl : minimum;
+            if (ans->count == 0 && (ans->ttl == UINT32_MAX || neg_ttl < ans->ttl)) ans->ttl = neg_ttl;
+            break;
+        }
+    }
+    
+    return (rcode == DNS_RCODE_NXDOMAIN) ? HOST_NOT_FOUND : NO_DATA;
+}
+
+// Copy the precomputed socket address of a configured server
+static socklen_t server_sockaddr(int idx, struct sockaddr_storage *ss) {
+    memcpy(ss, &cfg->dns_addrs[idx], sizeof(*ss));
+    return cfg->dns_addrlens[idx];
+}
+
+// One question (name + record type) being resolved by the native client
+struct dns_question {
+    const char *name;
+    int qtype;
+    uint16_t id;
+    int qlen;
+    unsigned char query[2 + DNS_QUERY_MAX]; // TCP length prefix + message
+    int edns;          // The query ends in an OPT record
+    int status;        // h_errno-style outcome, -1 while pending
+    int last_error;    // Outcome reported if every attempt fails
+    int attempts;      // Attempts launched so far
+    int inflight;      // Attempts currently waiting for an answer
+    int64_t next_launch; // Staggered strategy: when the next server joins the race
+    struct dns_answer ans;
+};
+
+// One outstanding exchange of a question with a server
+struct dns_attempt {
+    int fd;         // UDP: the attempt's socket; TCP: the connection's, as an in-flight mark
+    int question;
+    int server;
+    struct tcp_conn *conn; // TCP: pooled connection carrying the query
+    uint16_t id;    // The question's query ID, for cancelling its HTTP/2 stream
+    int64_t started_us; // For the server's RTT estimate
+    int64_t deadline;
+};
+
+#define MAX_DNS_QUESTIONS 3
+// At most one attempt per server and question is in flight at a time
+#define MAX_DNS_ATTEMPTS (MAX_DNS_QUESTIONS * MAX_DNS_SERVERS)
+
+// Attempt timeout for one server: its dns_server timeout= option or attempt_timeout_ms
+static int server_timeout_ms(int idx) {
+    return cfg->dns_timeouts[idx] > 0 ? cfg->dns_timeouts[idx] : cfg->attempt_timeout_ms;
+}
+
+// Attempts a question may use: each usable server once per pass, 1 + retries passes
+static int max_question_attempts(const struct server_order *order) {
+    return order->count * (cfg->retries + 1);
+}
+
+// ---------------------------------------------------------------------------
+// Pooled TCP connections
+//
+// Each thread keeps at most one TCP connection per server open across
+// lookups (RFC 7766), so a TCP query costs one round trip instead of a
+// handshake plus a round trip. The questions of a lookup are pipelined on
+// the same connection and the replies, which may come in any order, are
+// matched by query ID. A connection is closed after tcp_idle_timeout_ms
+// without traffic, when the config changes and when the server closes it.
+// A reused connection that turns out to be dead is reopened once and its
+// queries are sent again, without counting against the server's health.
+// tls:// and https:// servers use the same pool, with TLS on top of the
+// connection and, for https://, HTTP/2 framing instead of length prefixes.
+// ---------------------------------------------------------------------------
+
+static __thread uint64_t tcp_lookup_serial = 0; // Lookups of this thread so far
+
+#ifdef DNS_OVERRIDE_TLS
+enum { TLS_CONNECT, TLS_READ, TLS_WRITE };
+
+// Run one SSL operation with SIGPIPE blocked: libssl writes with write(),
+// and a server that went away must not kill the process. Returns the
+// operation's result; *err gets SSL_get_error() when it is not positive.
+static int tls_call(struct tcp_conn *c, int op, void *buf, int len, int *err) {
+    sigset_t pipe_set, saved, pending;
+    sigemptyset(&pipe_set);
+    sigaddset(&pipe_set, SIGPIPE);
+    pthread_sigmask(SIG_BLOCK, &pipe_set, &saved);
+    sigpending(&pending);
+    int was_pending = sigismember(&pending, SIGPIPE);
+    
+    tls.ERR_clear_error();
+    int rc = op == TLS_CONNECT ? tls.SSL_connect(c->tls)
+           : op == TLS_READ ? tls.SSL_read(c->tls, buf, len) : tls.SSL_write(c->tls, buf, len);
+    *err = rc > 0 ? SSL_ERROR_NONE : tls.SSL_get_error(c->tls, rc);
+    
+    if (!was_pending && *err == SSL_ERROR_SYSCALL) {
+        const struct timespec zero = { 0, 0 };
+        sigtimedwait(&pipe_set, NULL, &zero);
+    }
+    pthread_sigmask(SIG_SETMASK, &saved, NULL);
+    return rc;
+}
+
+// Set up the SSL object of a connection whose TCP connect completed
+static int tls_start(struct tcp_conn *c) {
+    pthread_once(&tls_once, tls_load);
+    if (!tls.ctx) return -1;
+    SSL *ssl = tls.SSL_new(tls.ctx);
+    if (!ssl) return -1;
+    c->tls = ssl;
+    if (!tls.SSL_set_fd(ssl, c->fd)) return -1;
+    
+    // The certificate must match the configured name, or the address itself
+    const char *name = cfg->dns_tls_names[c->server][0] ? cfg->dns_tls_names[c->server] : cfg->dns_servers[c->server];
+    unsigned char addr[16];
+    if (inet_pton(AF_INET, name, addr) == 1 || inet_pton(AF_INET6, name, addr) == 1) {
+        if (!tls.X509_VERIFY_PARAM_set1_ip_asc(tls.SSL_get0_param(ssl), name)) return -1;
+    } else {
+        tls.SSL_ctrl(ssl, SSL_CTRL_SET_TLSEXT_HOSTNAME, TLSEXT_NAMETYPE_host_name, (void *)name);
+        if (!tls.SSL_set1_host(ssl, name)) return -1;
+    }
+    // DoH is HTTP/2 only (RFC 8484 section 5.2)
+    if (c->proto == SERVER_HTTPS && tls.SSL_set_alpn_protos(ssl, (const unsigned char *)"\x02h2", 3) != 0) {
+        return -1;
+    }
+    
+    pthread_mutex_lock(&tls_session_lock);
+    if (tls_sessions[c->server] && tls_session_generations[c->server] == cfg->generation) {
+        tls.SSL_set_session(ssl, tls_sessions[c->server]);
+    }
+    pthread_mutex_unlock(&tls_session_lock);
+    return 0;
+}
+
+// Advance the TLS handshake. Returns 1 once it completed, 0 while it
+// waits for the socket, -1 on failure.
+static int tls_handshake(struct tcp_conn *c) {
+    if (!c->tls && tls_start(c) < 0) {
+        log_warn("Cannot set up TLS for %s:%d", cfg->dns_servers[c->server], cfg->dns_ports[c->server]);
+        return -1;
+    }
+    int err;
+    if (tls_call(c, TLS_CONNECT, NULL, 0, &err) != 1) {
+        c->want_write = err == SSL_ERROR_WANT_WRITE;
+        if (err == SSL_ERROR_WANT_READ || err == SSL_ERROR_WANT_WRITE) return 0;
+        log_warn("TLS handshake with %s:%d failed", cfg->dns_servers[c->server], cfg->dns_ports[c->server]);
+        return -1;
+    }
+    c->want_write = 0;
+    
+    if (c->proto == SERVER_HTTPS) {
+        const unsigned char *alpn = NULL;
+        unsigned int alpn_len = 0;
+        tls.SSL_get0_alpn_selected(c->tls, &alpn, &alpn_len);
+        if (alpn_len != 2 || memcmp(alpn, "h2", 2) != 0) {
+            log_warn("%s:%d does not offer HTTP/2", cfg->dns_servers[c->server], cfg->dns_ports[c->server]);
+            return -1;
+        }
+    }
+    stat_add(STAT_TLS_HANDSHAKE, 1);
+    if (tls.SSL_session_reused(c->tls)) stat_add(STAT_TLS_RESUMED, 1);
+    log_trace("TLS connection to %s:%d established%s", cfg->dns_servers[c->server], cfg->dns_ports[c->server],
+              tls.SSL_session_reused(c->tls) ? " (resumed)" : "");
+    return 1;
+}
+
+// Offer the connection's session to later connections to the server. TLS 1.3
+// tickets arrive after the handshake, so this is retried after each reply
+// until the session is resumable.
+static void tls_save_session(struct tcp_conn *c) {
+    SSL_SESSION *session = tls.SSL_get1_session(c->tls);
+    if (!session) return;
+    if (!tls.SSL_SESSION_is_resumable(session)) {
+        tls.SSL_SESSION_free(session);
+        return;
+    }
+    pthread_mutex_lock(&tls_session_lock);
+    SSL_SESSION *old = tls_sessions[c->server];
+    tls_sessions[c->server] = session;
+    tls_session_generations[c->server] = cfg->generation;
+    pthread_mutex_unlock(&tls_session_lock);
+    if (old) tls.SSL_SESSION_free(old);
+    c->session_saved = 1;
+}
+#endif
+
+// send()/recv() on the connection, through TLS when it has it. Same results
+// as those calls: -1 with errno EAGAIN while the socket would block.
+static ssize_t conn_send(struct tcp_conn *c, const void *buf, size_t len) {
+#ifdef DNS_OVERRIDE_TLS
+    if (c->tls) {
+        int err;
+        int n = tls_call(c, TLS_WRITE, (void *)buf, (int)len, &err);
+        if (n > 0) return n;
+        errno = (err == SSL_ERROR_WANT_READ || err == SSL_ERROR_WANT_WRITE) ? EAGAIN : ECONNRESET;
+        return -1;
+    }
+#endif
+    return send(c->fd, buf, len, MSG_NOSIGNAL);
+}
+
+static ssize_t conn_recv(struct tcp_conn *c, void *buf, size_t len) {
+#ifdef DNS_OVERRIDE_TLS
+    if (c->tls) {
+        int err;
+        int n = tls_call(c, TLS_READ, buf, (int)len, &err);
+        if (n > 0) return n;
+        if (err == SSL_ERROR_ZERO_RETURN) return 0;
+        errno = (err == SSL_ERROR_WANT_READ || err == SSL_ERROR_WANT_WRITE) ? EAGAIN : ECONNRESET;
+        return -1;
+    }
+#endif
+    return recv(c->fd, buf, len, 0);
+}
+
+// ---------------------------------------------------------------------------
+// DNS over HTTPS
+//
+// An https:// connection speaks just enough HTTP/2 (RFC 9113) for RFC 8484:
+// every query is a POST on a stream of its own, so the queries of all
+// lookups on the thread share one connection. Header blocks are sent as
+// HPACK literals that never touch the dynamic table, and our SETTINGS give
+// the server's encoder no dynamic table either. Of the response headers
+// only :status is decoded, since the DNS message in the body is validated
+// anyway; any status but 200 fails the request, and so does a header block
+// continued in CONTINUATION frames, which are not reassembled. A stream that
+// fails yields a SERVFAIL header carrying the query ID, so the caller treats
+// it like a server error and moves on to the next server. Streams of
+// attempts that are over are reset, so their slots free up; with every slot
+// taken, a new query goes to the next server instead.
+// ---------------------------------------------------------------------------
+
+#define H2_DATA 0x0
+#define H2_HEADERS 0x1
+#define H2_RST_STREAM 0x3
+#define H2_SETTINGS 0x4
+#define H2_PING 0x6
+#define H2_GOAWAY 0x7
+#define H2_WINDOW_UPDATE 0x8
+#define H2_CANCEL 0x8 // RST_STREAM error code
+
+#define H2_END_STREAM 0x1
+#define H2_ACK 0x1
+#define H2_END_HEADERS 0x4
+#define H2_PADDED 0x8
+#define H2_PRIORITY 0x20
+
+#define H2_FRAME_HEADER 9
+#define H2_MAX_FRAME 16384 // SETTINGS_MAX_FRAME_SIZE, left at its default
+#define H2_MAX_STREAM_ID 0x7ffffff0
+
+// Queue one frame. Returns -1 if the output buffer is full.
+static int h2_frame(struct tcp_conn *c, int type, int flags, uint32_t stream, const void *payload, int len) {
+    if (c->out_len + H2_FRAME_HEADER + len > TCP_OUT_BUFSIZE) return -1;
+    unsigned char *p = c->out + c->out_len;
+    p[0] = len >> 16;
+    p[1] = len >> 8;
+    p[2] = len;
+    p[3] = type;
+    p[4] = flags;
+    p[5] = (stream >> 24) & 0x7f;
+    p[6] = stream >> 16;
+    p[7] = stream >> 8;
+    p[8] = stream;
+    if (len > 0) memcpy(p + H2_FRAME_HEADER, payload, len);
+    c->out_len += H2_FRAME_HEADER + len;
+    return 0;
+}
+
+// Connection preface and our SETTINGS (HEADER_TABLE_SIZE 0, server push off)
+static void h2_start(struct tcp_conn *c) {
+    static const char preface[] = "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n";
+    static const unsigned char settings[] = { 0x00, 0x01, 0x00, 0x00, 0x00, 0x00,
+                                              0x00, 0x02, 0x00, 0x00, 0x00, 0x00 };
+    memcpy(c->out, preface, sizeof(preface) - 1);
+    c->out_len = sizeof(preface) - 1;
+    h2_frame(c, H2_SETTINGS, 0, 0, settings, sizeof(settings));
+    c->h2_next_stream = 1;
+    c->need = H2_FRAME_HEADER;
+}
+
+// HPACK literal header field without indexing, with a name from the static
+// table and a raw (not Huffman-coded) value (RFC 7541 section 6.2.2)
+static int hpack_field(unsigned char *p, int name_index, const char *value) {
+    int n = 0;
+    if (name_index < 15) {
+        p[n++] = name_index;
+    } else {
+        p[n++] = 15;
+        p[n++] = name_index - 15;
+    }
+    size_t len = strlen(value);
+    if (len < 127) {
+        p[n++] = len;
+    } else {
+        p[n++] = 127;
+        size_t rest = len - 127;
+        for (; rest >= 128; rest >>= 7) p[n++] = (rest & 0x7f) | 0x80;
+        p[n++] = rest;
+    }
+    memcpy(p + n, value, len);
+    return n + (int)len;
+}
+
+// HPACK integer with an n-bit prefix (RFC 7541 section 5.1). Returns -1 if
+// it is truncated or too large to matter.
+static int hpack_int(const unsigned char *p, int len, int *pos, int bits) {
+    if (*pos >= len) return -1;
+    int max = (1 << bits) - 1;
+    int value = p[(*pos)++] & max;
+    if (value < max) return value;
+    for (int shift = 0; shift <= 21; shift += 7) {
+        if (*pos >= len) return -1;
+        unsigned char b = p[(*pos)++];
+        value += (b & 0x7f) << shift;
+        if (!(b & 0x80)) return value;
+    }
+    return -1;
+}
+
+// HPACK string literal (RFC 7541 section 5.2) into out, NUL-terminated.
+// Huffman-coded strings are decoded as far as digits go, which is all a
+// :status value holds: '0'-'2' are the 5-bit codes 00000-00010 and '3'-'9'
+// the 6-bit codes 011001-011111, and padding is up to 7 one bits. Returns
+// the length, or -1 for a longer string or any other symbol.
+static int hpack_string(const unsigned char *p, int len, int *pos, char *out, int size) {
+    if (*pos >= len) return -1;
+    int huffman = p[*pos] & 0x80;
+    int slen = hpack_int(p, len, pos, 7);
+    if (slen < 0 || slen > len - *pos) return -1;
+    const unsigned char *s = p + *pos;
+    *pos += slen;
+    
+    int n = 0;
+    if (!huffman) {
+        if (slen >= size) return -1;
+        memcpy(out, s, slen);
+        n = slen;
+    } else {
+        uint32_t acc = 0;
+        int nbits = 0, i = 0;
+        for (;;) {
+            for (; nbits <= 24 && i < slen; i++) {
+                acc = (acc << 8) | s[i];
+                nbits += 8;
+            }
+            acc &= (nbits < 32) ? (1u << nbits) - 1 : 0xffffffffu;
+            if (i == slen && nbits < 8 && acc == (1u << nbits) - 1) break; // Padding (or nothing) left
+            if (n == size - 1 || nbits < 5) return -1;
+            uint32_t code = acc >> (nbits - 5);
+            if (code <= 2) {
+                out[n++] = '0' + code;
+                nbits -= 5;
+                continue;
+            }
+            if (nbits < 6) return -1;
+            code = acc >> (nbits - 6);
+            if (code < 0x19 || code > 0x1f) return -1;
+            out[n++] = '3' + (code - 0x19);
+            nbits -= 6;
+        }
+    }
+    out[n] = '\0';
+    return n;
+}
+
+// The :status of a response header block, its first field as the only
+// response pseudo-header (RFC 9113 section 8.3.2). Returns -1 if it is
+// missing or in a form we do not read, such as a Huffman-coded name.
+static int h2_status(const unsigned char *p, int len) {
+    // Static table entries 8-14 are :status with these values
+    static const int statuses[] = { 200, 204, 206, 304, 400, 404, 500 };
+    int pos = 0;
+    while (pos < len && (p[pos] & 0xe0) == 0x20) {
+        if (hpack_int(p, len, &pos, 5) < 0) return -1; // Dynamic table size update
+    }
+    if (pos >= len) return -1;
+    
+    int first = p[pos];
+    if (first & 0x80) {
+        // Indexed field; with no dynamic table, only static entries exist
+        int index = hpack_int(p, len, &pos, 7);
+        return (index >= 8 && index <= 14) ? statuses[index - 8] : -1;
+    }
+    // Literal with incremental indexing (6-bit name index), or without
+    // indexing / never indexed (4-bit)
+    int index = hpack_int(p, len, &pos, (first & 0x40) ? 6 : 4);
+    char name[8], value[4];
+    if (index == 0) {
+        if (hpack_string(p, len, &pos, name, sizeof(name)) < 0 || strcmp(name, ":status") != 0) return -1;
+    } else if (index < 8 || index > 14) {
+        return -1;
+    }
+    if (hpack_string(p, len, &pos, value, sizeof(value)) != 3 || strspn(value, "0123456789") != 3) return -1;
+    return atoi(value);
+}
+
+// A free stream slot, or -1 while every slot waits for an answer
+static int h2_free_stream(const struct tcp_conn *c) {
+    for (int i = 0; i < H2_STREAMS; i++) {
+        if (c->streams[i].id == 0) return i;
+    }
+    return -1;
+}
+
+// Queue a query as a POST request on a new stream. Returns -1 on failure.
+static int h2_send_query(struct tcp_conn *c, const struct dns_question *q) {
+    int slot = h2_free_stream(c);
+    if (slot < 0 || c->h2_next_stream > H2_MAX_STREAM_ID) return -1;
+    
+    char authority[300], length[8];
+    int server = c->server;
+    if (cfg->dns_tls_names[server][0]) {
+        snprintf(authority, sizeof(authority), "%s", cfg->dns_tls_names[server]);
+    } else {
+        snprintf(authority, sizeof(authority), cfg->dns_families[server] == AF_INET6 ? "[%s]" : "%s",
+                 cfg->dns_servers[server]);
+    }
+    snprintf(length, sizeof(length), "%d", q->qlen);
+    
+    unsigned char block[700];
+    int n = 0;
+    block[n++] = 0x83; // :method POST
+    block[n++] = 0x87; // :scheme https
+    n += hpack_field(block + n, 1, authority);
+    n += hpack_field(block + n, 4, cfg->dns_paths[server]);
+    n += hpack_field(block + n, 31, "application/dns-message"); // content-type
+    n += hpack_field(block + n, 19, "application/dns-message"); // accept
+    n += hpack_field(block + n, 28, length);                    // content-length
+    
+    uint32_t id = c->h2_next_stream;
+    int saved = c->out_len;
+    if (h2_frame(c, H2_HEADERS, H2_END_HEADERS, id, block, n) < 0 ||
+        h2_frame(c, H2_DATA, H2_END_STREAM, id, q->query + 2, q->qlen) < 0) {
+        c->out_len = saved;
+        return -1;
+    }
+    c->h2_next_stream += 2;
+    
+    struct h2_stream *st = &c->streams[slot];
+    st->id = id;
+    st->dns_id = q->id;
+    st->failed = 0;
+    st->headers = 0;
+    st->len = 0;
+    return 0;
+}
+
+// Reset the stream of a query whose attempt is over, so that its slot does
+// not stay taken by an answer that may never come
+static void h2_cancel(struct tcp_conn *c, uint16_t dns_id) {
+    static const unsigned char cancel[4] = { 0, 0, 0, H2_CANCEL };
+    if (c->proto != SERVER_HTTPS || c->fd < 0) return;
+    for (int i = 0; i < H2_STREAMS; i++) {
+        struct h2_stream *st = &c->streams[i];
+        if (st->id == 0 || i == c->h2_done || st->dns_id != dns_id) continue;
+        // Without room for the frame, a late answer is dropped on arrival
+        h2_frame(c, H2_RST_STREAM, 0, st->id, cancel, sizeof(cancel));
+        st->id = 0;
+    }
+}
+
+// Hand back flow-control credit for a connection (stream 0) or a stream
+static int h2_window_update(struct tcp_conn *c, uint32_t stream, int n) {
+    unsigned char increment[4] = { n >> 24, n >> 16, n >> 8, n };
+    return h2_frame(c, H2_WINDOW_UPDATE, 0, stream, increment, sizeof(increment));
+}
+
+// End of a stream: return its body, or a SERVFAIL header for the query
+static int h2_stream_done(struct tcp_conn *c, int slot, unsigned char **resp) {
+    struct h2_stream *st = &c->streams[slot];
+    c->h2_done = slot;
+    if (!st->failed && st->len > 0) {
+        *resp = st->body;
+        return st->len;
+    }
+    memset(c->failure, 0, sizeof(c->failure));
+    c->failure[0] = st->dns_id >> 8;
+    c->failure[1] = st->dns_id & 0xff;
+    c->failure[2] = 0x80; // QR
+    c->failure[3] = 0x02; // RCODE SERVFAIL
+    *resp = c->failure;
+    return sizeof(c->failure);
+}
+
+// Handle one received frame. Returns a response length as h2_read() does,
+// 0 if the frame completed no response, -1 if the connection must close.
+static int h2_frame_received(struct tcp_conn *c, int type, int flags, uint32_t id,
+                             unsigned char *payload, int len, unsigned char **resp) {
+    int frame_len = len;
+    if ((type == H2_DATA || type == H2_HEADERS) && (flags & H2_PADDED)) {
+        if (len < 1 || payload[0] >= len) return -1;
+        len -= 1 + payload[0];
+        payload++;
+    }
+    if (type == H2_HEADERS && (flags & H2_PRIORITY)) {
+        if (len < 5) return -1;
+        payload += 5;
+        len -= 5;
+    }
+    
+    switch (type) {
+    case H2_SETTINGS:
+        return (flags & H2_ACK) || h2_frame(c, H2_SETTINGS, H2_ACK, 0, NULL, 0) == 0 ? 0 : -1;
+    case H2_PING:
+        return (flags & H2_ACK) || len != 8 || h2_frame(c, H2_PING, H2_ACK, 0, payload, 8) == 0 ? 0 : -1;
+    case H2_GOAWAY:
+        log_info("HTTP/2 connection to %s:%d closed by the server",
+                 cfg->dns_servers[c->server], cfg->dns_ports[c->server]);
+        return -1;
+    case H2_DATA:
+        // Give the connection's flow-control credit back right away
+        if (frame_len > 0 && h2_window_update(c, 0, frame_len) < 0) return -1;
+        break;
+    case H2_HEADERS:
+    case H2_RST_STREAM:
+        break;
+    default:
+        return 0; // WINDOW_UPDATE, PRIORITY, CONTINUATION...
+    }
+    
+    int slot = -1;
+    for (int i = 0; i < H2_STREAMS && slot < 0; i++) {
+        if (id != 0 && c->streams[i].id == id) slot = i;
+    }
+    if (slot < 0) return 0; // A stream given up on
+    struct h2_stream *st = &c->streams[slot];
+    
+    if (type == H2_RST_STREAM) {
+        st->failed = 1;
+        return h2_stream_done(c, slot, resp);
+    }
+    if (type == H2_HEADERS) {
+        if (!(flags & H2_END_HEADERS)) {
+            // The block goes on in CONTINUATION frames: fail now rather than
+            // at the timeout; those frames match no stream and are dropped
+            log_info("HTTP/2 response headers from %s:%d span several frames",
+                     cfg->dns_servers[c->server], cfg->dns_ports[c->server]);
+            st->failed = 1;
+            return h2_stream_done(c, slot, resp);
+        }
+        if (!st->headers) {
+            int status = h2_status(payload, len);
+            if (status / 100 != 1) { // 1xx: informational, the final headers follow
+                st->headers = 1;
+                if (status != 200) st->failed = 1;
+            }
+        }
+    } else {
+        // And the stream's, or a body beyond its initial window would stall
+        if (frame_len > 0 && !(flags & H2_END_STREAM) && h2_window_update(c, id, frame_len) < 0) return -1;
+        if (st->len + len > 65535) {
+            st->failed = 1;
+        } else if (len > 0) {
+            if (st->len + len > st->size) {
+                int size = st->size ? st->size : 512;
+                while (size < st->len + len) size *= 2;
+                unsigned char *body = realloc(st->body, size);
+                if (!body) return -1;
+                st->body = body;
+                st->size = size;
+            }
+            memcpy(st->body + st->len, payload, len);
+            st->len += len;
+        }
+    }
+    return (flags & H2_END_STREAM) ? h2_stream_done(c, slot, resp) : 0;
+}
+
+// Read frames until a response is complete; same results as tcp_conn_read()
+static int h2_read(struct tcp_conn *c, unsigned char **resp) {
+    if (c->h2_done >= 0) {
+        // The caller is done with the previously returned body
+        c->streams[c->h2_done].id = 0;
+        c->h2_done = -1;
+    }
+    for (;;) {
+        ssize_t n = conn_recv(c, c->in + c->have, c->need - c->have);
+        if (n == 0) return -1;
+        if (n < 0) return (errno == EAGAIN || errno == EINTR) ? 0 : -1;
+        c->have += n;
+        if (c->have < c->need) continue;
+        if (c->need == H2_FRAME_HEADER) {
+            int len = (c->in[0] << 16) | (c->in[1] << 8) | c->in[2];
+            if (len > H2_MAX_FRAME) return -1;
+            c->need += len;
+            if (len > 0) continue;
+        }
+        
+        uint32_t id = ((uint32_t)(c->in[5] & 0x7f) << 24) | (c->in[6] << 16) | (c->in[7] << 8) | c->in[8];
+        int len = c->need - H2_FRAME_HEADER;
+        c->have = 0;
+        c->need = H2_FRAME_HEADER;
+        int rc = h2_frame_received(c, c->in[3], c->in[4], id, c->in + H2_FRAME_HEADER, len, resp);
+        if (rc != 0) return rc;
+    }
+}
+
+// Open (or keep) the connection to a server. Returns -1 on failure.
+static int tcp_conn_open(struct tcp_conn *c, int server, int64_t now) {
+    if (c->fd >= 0) {
+        int stale = c->generation != cfg->generation || now - c->idle_since >= cfg->tcp_idle_timeout_ms ||
+                    c->h2_next_stream > H2_MAX_STREAM_ID;
+        if (!stale && c->connected) {
+            // Readable while idle: either late replies to an earlier lookup,
+            // which are read and dropped later, or the server closed it
+            struct pollfd pfd = { .fd = c->fd, .events = POLLIN };
+            unsigned char byte;
+            if (poll(&pfd, 1, 0) > 0 &&
+                ((pfd.revents & (POLLERR | POLLHUP)) || recv(c->fd, &byte, 1, MSG_PEEK | MSG_DONTWAIT) <= 0)) {
+                stale = 1;
+            }
+        }
+        if (!stale) return 0;
+        log_trace("Closing TCP connection to %s:%d", cfg->dns_servers[server], cfg->dns_ports[server]);
+        tcp_conn_close(c);
+    }
+    
+    struct sockaddr_storage ss;
+    socklen_t sslen = server_sockaddr(server, &ss);
+    if (!sslen) return -1;
+    int fd = socket(ss.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) return -1;
+    int connected = connect(fd, (struct sockaddr *)&ss, sslen) == 0;
+    if (!connected && errno != EINPROGRESS) {
+        close(fd);
+        return -1;
+    }
+    
+    c->fd = fd;
+    c->server = server;
+    c->proto = cfg->dns_protos[server];
+    c->connected = connected;
+    c->ready = connected && c->proto == SERVER_PLAIN;
+    c->lookup = tcp_lookup_serial;
+    c->generation = cfg->generation;
+    c->idle_since = now;
+    c->out_len = 0;
+    c->have = 0;
+    c->need = 2;
+    if (c->proto == SERVER_HTTPS) h2_start(c);
+    stat_add(STAT_TCP_CONNECT, 1);
+    return 0;
+}
+
+// Finish the TLS handshake if there is one, then write as much of the queued
+// output as the socket takes. Returns -1 on error.
+static int tcp_conn_flush(struct tcp_conn *c) {
+    if (!c->connected) return 0;
+    if (!c->ready) {
+#ifdef DNS_OVERRIDE_TLS
+        int rc = c->proto == SERVER_PLAIN ? 1 : tls_handshake(c);
+        if (rc <= 0) return rc;
+#endif
+        c->ready = 1;
+    }
+    while (c->out_len > 0) {
+        ssize_t n = conn_send(c, c->out, c->out_len);
+        if (n < 0) return (errno == EAGAIN || errno == EINTR) ? 0 : -1;
+        memmove(c->out, c->out + n, c->out_len - n);
+        c->out_len -= n;
+    }
+    return 0;
+}
+
+// Queue a query on the connection: length-prefixed, or as a DoH request.
+// Returns -1 on failure.
+static int tcp_conn_send(struct tcp_conn *c, const struct dns_question *q) {
+    if (c->proto == SERVER_HTTPS) {
+        if (h2_send_query(c, q) < 0) return -1;
+    } else {
+        int total = q->qlen + 2;
+        if (c->out_len + total > TCP_OUT_BUFSIZE) return -1;
+        memcpy(c->out + c->out_len, q->query, total);
+        c->out_len += total;
+    }
+    return tcp_conn_flush(c);
+}
+
+// Read the next complete reply. Returns its length with *resp pointing at
+// it (valid until the next call), 0 if more data is needed, -1 on EOF or error.
+static int tcp_conn_read(struct tcp_conn *c, unsigned char **resp) {
+    if (!c->ready) return 0;
+    if (!c->in) {
+        c->in = malloc(2 + 65535);
+        if (!c->in) return -1;
+    }
+    int len = -1;
+    if (c->proto == SERVER_HTTPS) {
+        len = h2_read(c, resp);
+    } else {
+        if (c->have == c->need && c->need > 2) {
+            // The previous reply was consumed
+            c->have = 0;
+            c->need = 2;
+        }
+        for (;;) {
+            ssize_t n = conn_recv(c, c->in + c->have, c->need - c->have);
+            if (n == 0) break;
+            if (n < 0) {
+                if (errno == EAGAIN || errno == EINTR) len = 0;
+                break;
+            }
+            c->have += n;
+            if (c->have < c->need) continue;
+            if (c->need == 2) {
+                c->need = 2 + dns_get16(c->in);
+                if (c->need == 2) break;
+                continue;
+            }
+            *resp = c->in + 2;
+            len = c->need - 2;
+            break;
+        }
+    }
+#ifdef DNS_OVERRIDE_TLS
+    if (len > 0 && c->tls && !c->session_saved) tls_save_session(c);
+#endif
+    return len;
+}
+
+// The thread's connection slot for a server
+static struct tcp_conn *tcp_conn_for(struct thread_resolver *tr, int server) {
+    if (!tr->tcp[server]) {
+        tr->tcp[server] = calloc(1, sizeof(struct tcp_conn));
+        if (!tr->tcp[server]) return NULL;
+        tr->tcp[server]->fd = -1;
+        tr->tcp[server]->need = 2;
+        tr->tcp[server]->h2_done = -1;
+    }
+    return tr->tcp[server];
+}
+
+static void attempt_close(struct dns_attempt *attempt) {
+    if (attempt->conn) {
+        h2_cancel(attempt->conn, attempt->id);
+    } else if (attempt->fd >= 0) {
+        close(attempt->fd);
+    }
+    attempt->fd = -1;
+    attempt->conn = NULL;
+}
+
+// Open a socket for one attempt and send the query (UDP), or queue it on the
+// server's pooled connection (TCP). Returns 0 when the attempt is in flight,
+// -1 if it failed immediately.
+static int attempt_start(struct dns_attempt *attempt, struct dns_question *q, int question,
+                         int server, int use_tcp, int64_t now) {
+    memset(attempt, 0, sizeof(*attempt));
+    attempt->fd = -1;
+    attempt->question = question;
+    attempt->server = server;
+    attempt->started_us = monotonic_us();
+    attempt->deadline = now + server_timeout_ms(server);
+    
+    if (use_tcp || cfg->dns_protos[server] != SERVER_PLAIN) {
+        struct thread_resolver *tr = get_thread_resolver();
+        struct tcp_conn *c = tr ? tcp_conn_for(tr, server) : NULL;
+        if (!c || tcp_conn_open(c, server, now) < 0) return -1;
+        if (c->lookup != tcp_lookup_serial) stat_add(STAT_TCP_REUSE, 1);
+        if (c->proto == SERVER_HTTPS && h2_free_stream(c) < 0) {
+            // Every stream still waits for an answer: try the next server
+            // rather than evict one, and keep the connection for them
+            log_info("All HTTP/2 streams to %s:%d are busy",
+                     cfg->dns_servers[server], cfg->dns_ports[server]);
+            return -1;
+        }
+        if (tcp_conn_send(c, q) < 0) {
+            tcp_conn_close(c);
+            return -1;
+        }
+        attempt->conn = c;
+        attempt->fd = c->fd;
+        attempt->id = q->id;
+        stat_server(server, SERVER_QUERIES);
+        return 0;
+    }
+    
+    struct sockaddr_storage ss;
+    socklen_t sslen = server_sockaddr(server, &ss);
+    if (!sslen) return -1;
+    int fd = socket(ss.ss_family, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) return -1;
+    attempt->fd = fd;
+    if (connect(fd, (struct sockaddr *)&ss, sslen) < 0 || send(fd, q->query + 2, q->qlen, 0) != q->qlen) {
+        attempt_close(attempt);
+        return -1;
+    }
+    stat_server(server, SERVER_QUERIES);
+    return 0;
+}
+
+// Launch the next attempt(s) for a question according to query_strategy
+static void question_launch(struct dns_question *q, int qi, const struct server_order *order,
+                            struct dns_attempt *attempts, int *nattempts, int count, int64_t now) {
+    while (count-- > 0 && q->attempts < max_question_attempts(order)) {
+        // Reuse the slot of a finished attempt before growing the table
+        int slot = 0;
+        while (slot < *nattempts && attempts[slot].fd >= 0) slot++;
+        if (slot == MAX_DNS_ATTEMPTS) return;
+    
+        int server = order->idx[q->attempts % order->count];
+        q->attempts++;
+        if (attempt_start(&attempts[slot], q, qi, server, cfg->use_tcp, now) == 0) {
+            if (slot == *nattempts) (*nattempts)++;
+            q->inflight++;
+        } else {
+            log_warn("Could not send query for %s to %s:%d",
+                     q->name, cfg->dns_servers[server], cfg->dns_ports[server]);
+        }
+    }
+}
+
+// Number of servers raced at once by the parallel and staggered strategies
+static int race_width(const struct server_order *order) {
+    if (cfg->query_parallelism > 0 && cfg->query_parallelism < order->count) {
+        return cfg->query_parallelism;
+    }
+    return order->count;
+}
+
+// The server of an attempt did not answer: connection refused or reset
+static void attempt_failed(struct dns_attempt *attempt, struct dns_question *q) {
+    log_info("No answer from %s:%d for %s (error)",
+             cfg->dns_servers[attempt->server], cfg->dns_ports[attempt->server], q->name);
+    health_record_failure(attempt->server, server_timeout_ms(attempt->server));
+    stat_server(attempt->server, SERVER_ERRORS);
+    attempt_close(attempt);
+    q->inflight--;
+}
+
+// A pooled connection failed. If it was carried over from an earlier lookup
+// the server most likely closed it while idle: reconnect once and resend.
+// Otherwise its attempts fail like a refused UDP query.
+static void tcp_conn_failed(struct tcp_conn *c, struct dns_question *questions,
+                            struct dns_attempt *attempts, int nattempts, int64_t now) {
+    int reused = c->lookup != tcp_lookup_serial;
+    tcp_conn_close(c);
+    
+    for (int a = 0; a < nattempts; a++) {
+        struct dns_attempt *attempt = &attempts[a];
+        if (attempt->fd < 0 || attempt->conn != c) continue;
+        struct dns_question *q = &questions[attempt->question];
+        if (reused && (c->fd >= 0 || tcp_conn_open(c, attempt->server, now) == 0) &&
+            tcp_conn_send(c, q) == 0) {
+            log_info("Reconnected to %s:%d for %s",
+                     cfg->dns_servers[attempt->server], cfg->dns_ports[attempt->server], q->name);
+            attempt->fd = c->fd;
+            continue;
+        }
+        attempt_failed(attempt, q);
+    }
+}
+
+// Settle a response to an attempt; cancels the rest of the race for the
+// question when the answer is definitive
+static void attempt_answered(struct dns_attempt *attempt, struct dns_question *questions,
+                             struct dns_attempt *attempts, int nattempts,
+                             const unsigned char *resp, int len, int64_t now) {
+    struct dns_question *q = &questions[attempt->question];
+    int status = dns_parse_response(resp, len, q->id, q->name, q->qtype, &q->ans);
+    log_trace("Using DNS server %s:%d for %s (type %d): status %d",
+              cfg->dns_servers[attempt->server], cfg->dns_ports[attempt->server],
+              q->name, q->qtype, status);
+    if (status == 0 || status == HOST_NOT_FOUND || status == NO_DATA) {
+        int64_t rtt_us = monotonic_us() - attempt->started_us;
+        health_record_success(attempt->server, rtt_us);
+        stat_server_rtt(attempt->server, rtt_us);
+    } else {
+        health_record_failure(attempt->server, 0); // SERVFAIL, REFUSED or malformed
+        stat_server(attempt->server, SERVER_ERRORS);
+    }
+    attempt_close(attempt);
+    q->inflight--;
+    
+    if (status == 0 || status == HOST_NOT_FOUND || status == NO_DATA) {
+        q->status = status;
+        for (int a = 0; a < nattempts; a++) {
+            if (attempts[a].fd >= 0 && attempts[a].question == (int)(q - questions)) {
+                attempt_close(&attempts[a]);
+                q->inflight--;
+            }
+        }
+    } else {
+        q->last_error = status;
+        if (cfg->query_strategy == QUERY_STAGGERED) q->next_launch = now;
+    }
+}
+
+// Resolve several record types for one name over the configured servers.
+// All questions are in flight at the same time. query_strategy decides how
+// servers are used: sequential tries them one after another, parallel races
+// the first query_parallelism servers at once, and staggered starts the next
+// server every query_stagger_ms until one answers. The first definitive
+// answer for a question wins and its other attempts are cancelled.
+// Addresses are appended to ans in the order of types[]; returns the merged
+// h_errno-style status.
+static int query_custom_dns(const char *hostname, const int *types, int ntypes, struct dns_answer *ans) {
+    struct thread_resolver *tr = get_thread_resolver();
+    if (!tr || ntypes > MAX_DNS_QUESTIONS || cfg->server_count == 0) return NO_RECOVERY;
+    
+    log_trace("Querying custom DNS for %s (%d record types)", hostname, ntypes);
+    tcp_lookup_serial++;
+    
+    struct dns_question questions[MAX_DNS_QUESTIONS];
+    struct dns_attempt attempts[MAX_DNS_ATTEMPTS];
+    int nattempts = 0;
+    int64_t now = monotonic_ms();
+    int64_t total_deadline = cfg->total_timeout_ms > 0 ? now + cfg->total_timeout_ms : INT64_MAX;
+    struct server_order order;
+    health_server_order(&order, route_for(hostname));
+    int width = (cfg->query_strategy == QUERY_PARALLEL) ? race_width(&order) : 1;
+    
+    for (int i = 0; i < ntypes; i++) {
+        struct dns_question *q = &questions[i];
+        q->name = hostname;
+        q->qtype = types[i];
+        q->id = dns_next_id();
+        q->qlen = dns_build_query(q->query + 2, sizeof(q->query) - 2, q->id, hostname, types[i],
+                                  cfg->edns_udp_size);
+        q->edns = cfg->edns_udp_size > 0;
+        q->status = (q->qlen < 0) ? HOST_NOT_FOUND : -1; // Not a valid DNS name
+        q->last_error = TRY_AGAIN;
+        q->attempts = 0;
+        q->inflight = 0;
+        q->next_launch = now + cfg->query_stagger_ms;
+        q->ans.count = 0;
+        q->ans.ttl = UINT32_MAX;
+        q->ans.canonname[0] = '\0';
+        if (q->qlen > 0) {
+            q->query[0] = q->qlen >> 8;
+            q->query[1] = q->qlen & 0xff;
+            question_launch(q, i, &order, attempts, &nattempts, width, now);
+        }
+    }
+    
+    for (;;) {
+        now = monotonic_ms();
+        int pending = 0;
+        int64_t wake = INT64_MAX;
+    
+        if (now >= total_deadline) {
+            log_warn("Lookup of %s exceeded total_timeout_ms (%d ms)", hostname, cfg->total_timeout_ms);
+            break; // Unanswered questions keep their last error (TRY_AGAIN by default)
+        }
+    
+        // Expire attempts, start new ones and settle questions that ran out of servers
+        for (int a = 0; a < nattempts; a++) {
+            if (attempts[a].fd >= 0 && attempts[a].deadline <= now) {
+                struct dns_question *q = &questions[attempts[a].question];
+                struct tcp_conn *c = attempts[a].conn;
+                log_info("Timeout from %s:%d for %s",
+                         cfg->dns_servers[attempts[a].server], cfg->dns_ports[attempts[a].server], q->name);
+                health_record_failure(attempts[a].server, server_timeout_ms(attempts[a].server));
+                stat_server(attempts[a].server, SERVER_TIMEOUTS);
+                attempt_close(&attempts[a]);
+                q->inflight--;
+                if (c && !c->connected) {
+                    // The server never accepted the connection: the other
+                    // queries queued on it fail too, later ones reconnect
+                    tcp_conn_close(c);
+                    for (int b = 0; b < nattempts; b++) {
+                        if (attempts[b].fd >= 0 && attempts[b].conn == c) {
+                            stat_server(attempts[b].server, SERVER_TIMEOUTS);
+                            attempt_close(&attempts[b]);
+                            questions[attempts[b].question].inflight--;
+                        }
+                    }
+                }
+            }
+        }
+        for (int i = 0; i < ntypes; i++) {
+            struct dns_question *q = &questions[i];
+            if (q->status >= 0) continue;
+            if (cfg->query_strategy == QUERY_STAGGERED && q->inflight < race_width(&order) &&
+                now >= q->next_launch) {
+                question_launch(q, i, &order, attempts, &nattempts, 1, now);
+                q->next_launch = now + cfg->query_stagger_ms;
+            }
+            if (q->inflight == 0) {
+                question_launch(q, i, &order, attempts, &nattempts, width, now);
+                q->next_launch = now + cfg->query_stagger_ms;
+            }
+            if (q->inflight == 0) {
+                q->status = q->last_error;
+                continue;
+            }
+            pending = 1;
+            if (cfg->query_strategy == QUERY_STAGGERED && q->attempts < max_question_attempts(&order) &&
+                q->next_launch < wake) {
+                wake = q->next_launch;
+            }
+        }
+        if (!pending) break;
+    
+        // One pollfd per UDP attempt and per TCP connection in use
+        struct pollfd pfds[MAX_DNS_ATTEMPTS];
+        int map[MAX_DNS_ATTEMPTS];
+        int npfds = 0;
+        for (int a = 0; a < nattempts; a++) {
+            if (attempts[a].fd < 0) continue;
+            if (attempts[a].deadline < wake) wake = attempts[a].deadline;
+            struct tcp_conn *c = attempts[a].conn;
+            int seen = 0;
+            for (int p = 0; c && p < npfds && !seen; p++) {
+                seen = attempts[map[p]].conn == c;
+            }
+            if (seen) continue;
+            pfds[npfds].fd = attempts[a].fd;
+            pfds[npfds].events = POLLIN;
+            if (c && (!c->connected || c->want_write || (c->ready && c->out_len > 0))) {
+                pfds[npfds].events |= POLLOUT;
+            }
+            pfds[npfds].revents = 0;
+            map[npfds++] = a;
+        }
+    
+        if (total_deadline < wake) wake = total_deadline;
+        int timeout = (wake == INT64_MAX) ? cfg->attempt_timeout_ms : (int)(wake > now ? wake - now : 0);
+        int rc = poll(pfds, npfds, timeout);
+        if (rc < 0 && errno != EINTR) break;
+        if (rc <= 0) continue;
+        now = monotonic_ms();
+    
+        for (int p = 0; p < npfds; p++) {
+            if (!pfds[p].revents) continue;
+            struct dns_attempt *attempt = &attempts[map[p]];
+            struct tcp_conn *c = attempt->conn;
+    
+            if (c) {
+                // Another attempt's failure may have replaced or closed the connection
+                if (c->fd != pfds[p].fd) continue;
+                if (!c->connected) {
+                    int err = 0;
+                    socklen_t errlen = sizeof(err);
+                    if (!(pfds[p].revents & (POLLOUT | POLLERR | POLLHUP))) continue;
+                    if (getsockopt(c->fd, SOL_SOCKET, SO_ERROR, &err, &errlen) < 0 || err != 0) {
+                        tcp_conn_failed(c, questions, attempts, nattempts, now);
+                        continue;
+                    }
+                    c->connected = 1;
+                }
+                if (tcp_conn_flush(c) < 0) {
+                    tcp_conn_failed(c, questions, attempts, nattempts, now);
+                    continue;
+                }
+                for (;;) {
+                    unsigned char *resp = NULL;
+                    int len = tcp_conn_read(c, &resp);
+                    if (len == 0) break;
+                    if (len < 0) {
+                        tcp_conn_failed(c, questions, attempts, nattempts, now);
+                        break;
+                    }
+                    c->idle_since = now;
+                    // Pipelined replies come in any order; late ones match nothing
+                    for (int a = 0; a < nattempts; a++) {
+                        if (attempts[a].fd >= 0 && attempts[a].conn == c && len >= DNS_HEADER_SIZE &&
+                            questions[attempts[a].question].id == dns_get16(resp)) {
+                            attempt_answered(&attempts[a], questions, attempts, nattempts, resp, len, now);
+                            break;
+                        }
+                    }
+                }
+                // Reading may have queued HTTP/2 acknowledgements
+                if (c->fd >= 0 && tcp_conn_flush(c) < 0) {
+                    tcp_conn_failed(c, questions, attempts, nattempts, now);
+                }
+                continue;
+            }
+    
+            if (attempt->fd < 0) continue; // Cancelled by an earlier winner
+            struct dns_question *q = &questions[attempt->question];
+            ssize_t n = recv(attempt->fd, tr->answer, DNS_UDP_BUFSIZE, 0);
+            if (n < 0) {
+                if (errno != EAGAIN && errno != EINTR) attempt_failed(attempt, q); // e.g. ECONNREFUSED
+                continue;
+            }
+            // Ignore stray datagrams that do not carry our ID
+            if (n < DNS_HEADER_SIZE || dns_get16(tr->answer) != q->id) continue;
+    
+            if (tr->answer[2] & 0x02) {
+                // Truncated: repeat the query to the same server over TCP
+                log_info("Truncated UDP answer for %s, retrying over TCP", q->name);
+                int server = attempt->server;
+                attempt_close(attempt);
+                if (attempt_start(attempt, q, (int)(q - questions), server, 1, now) < 0) {
+                    q->inflight--;
+                }
+                continue;
+            }
+            if (q->edns && dns_edns_rejected(tr->answer, (int)n)) {
+                // Drop the OPT record (the last thing in the query) and ask again
+                log_info("%s:%d rejected EDNS for %s, retrying without it",
+                         cfg->dns_servers[attempt->server], cfg->dns_ports[attempt->server], q->name);
+                q->edns = 0;
+                q->qlen -= DNS_OPT_RR_SIZE;
+                q->query[0] = q->qlen >> 8;
+                q->query[1] = q->qlen & 0xff;
+                q->query[2 + 11] = 0; // ARCOUNT
+                int server = attempt->server;
+                attempt_close(attempt);
+                if (attempt_start(attempt, q, (int)(q - questions), server, 0, now) < 0) {
+                    q->inflight--;
+                }
+                continue;
+            }
+            attempt_answered(attempt, questions, attempts, nattempts, tr->answer, (int)n, now);
+        }
+    }
+    
+    for (int a = 0; a < nattempts; a++) {
+        attempt_close(&attempts[a]);
+    }
+    
+    // Merge per-question results in the requested order
+    int status = -1;
+    for (int i = 0; i < ntypes; i++) {
+        struct dns_question *q = &questions[i];
+        int qstatus = q->status < 0 ? q->last_error : q->status;
+        status = (status < 0) ? qstatus : merge_query_status(status, qstatus);
+        for (int j = 0; j < q->ans.count && ans->count < MAX_ANSWER_ADDRS; j++) {
+            ans->addrs[ans->count++] = q->ans.addrs[j];
+        }
+        if (q->ans.ttl < ans->ttl) ans->ttl = q->ans.ttl;
+        if (!ans->canonname[0] && q->ans.canonname[0]) {
+            memcpy(ans->canonname, q->ans.canonname, sizeof(ans->canonname));
+        }
+    }
+    return status < 0 ? NO_RECOVERY : status;
+}
+
+// Record types the native client asks for, all sent together: A, AAAA and
+// the A query behind AI_V4MAPPED. Returns the count.
+static int native_query_types(int family, int flags, int *types) {
+    int ntypes = 0;
+    if (family == AF_UNSPEC || family == AF_INET) types[ntypes++] = ns_t_a;
+    if (family == AF_UNSPEC || family == AF_INET6) types[ntypes++] = ns_t_aaaa;
+    if (family == AF_INET6 && (flags & AI_V4MAPPED)) types[ntypes++] = ns_t_a;
+    return ntypes;
+}
+
+// Without AI_ALL, mapped addresses are only used when there is no AAAA
+static void native_drop_mapped(int family, int flags, struct dns_answer *ans) {
+    if (family != AF_INET6 || !(flags & AI_V4MAPPED) || (flags & AI_ALL)) return;
+    
+    int has_v6 = 0;
+    for (int i = 0; i < ans->count; i++) {
+        if (ans->addrs[i].family == AF_INET6) has_v6 = 1;
+    }
+    if (has_v6) {
+        int kept = 0;
+        for (int i = 0; i < ans->count; i++) {
+            if (ans->addrs[i].family == AF_INET6) ans->addrs[kept++] = ans->addrs[i];
+        }
+        ans->count = kept;
+    }
+}
+
+// Resolve the A and/or AAAA records a lookup with this family and flags needs.
+// Returns 0 when at least one address was found, otherwise an h_errno code.
+// ans->ttl holds the answer TTL, or the negative TTL when it is known.
+static int resolve_addresses(const char *name, int family, int flags, struct dns_answer *ans) {
+    ans->count = 0;
+    ans->ttl = UINT32_MAX;
+    ans->canonname[0] = '\0';
+    
+    int v4mapped = (family == AF_INET6 && (flags & AI_V4MAPPED));
+    int status = NO_DATA;
+    
+    if (cfg->resolver == RESOLVER_NATIVE) {
+        int types[MAX_DNS_QUESTIONS];
+        int ntypes = native_query_types(family, flags, types);
+        status = query_custom_dns(name, types, ntypes, ans);
+        native_drop_mapped(family, flags, ans);
+    } else {
+        if (family == AF_UNSPEC || family == AF_INET) {
+            status = reentrant_query(name, ns_t_a, ans);
+        }
+        if (family == AF_UNSPEC || family == AF_INET6) {
+            int status6 = reentrant_query(name, ns_t_aaaa, ans);
+            status = (family == AF_UNSPEC) ? merge_query_status(status, status6) : status6;
+        }
+        // AI_V4MAPPED: fall back to (or with AI_ALL, add) mapped A records
+        if (v4mapped && (ans->count == 0 || (flags & AI_ALL))) {
+            status = merge_query_status(status, reentrant_query(name, ns_t_a, ans));
+        }
+    }
+    
+    if (ans->ttl == UINT32_MAX) ans->ttl = 0;
+    if (ans->count > 0) return 0;
+    return status ? status : NO_DATA;
+}
+
+// Socket type, protocol and port combinations of one lookup, in the order
+// glibc's getaddrinfo() produces them
+#define MAX_SERVICE_TEMPLATES 8
+struct service_template {
+    int socktype;
+    int protocol;
+    in_port_t port; // Network byte order
+};
+
+// Expand service and hints into templates. No service or a numeric one with
+// a plain stream/datagram socktype is done here; anything else is left to
+// the system resolver (with a numeric host, so it never touches the
+// network). Returns the template count or a negative EAI_* code.
+static int service_templates(const char *service, const struct addrinfo *hints,
+                             struct service_template *out) {
+    int socktype = hints ? hints->ai_socktype : 0;
+    int protocol = hints ? hints->ai_protocol : 0;
+    char *end = NULL;
+    unsigned long port = 0;
+    int numeric = !service || (service[0] >= '0' && service[0] <= '9' &&
+                               (port = strtoul(service, &end, 10)) <= 65535 && *end == '\0');
+    int simple = (socktype == 0 && protocol == 0) ||
+                 (socktype == SOCK_STREAM && (protocol == 0 || protocol == IPPROTO_TCP)) ||
+                 (socktype == SOCK_DGRAM && (protocol == 0 || protocol == IPPROTO_UDP));
+    if (numeric && simple) {
+        int n = 0;
+        if (socktype == 0 || socktype == SOCK_STREAM) {
+            out[n++] = (struct service_template){ SOCK_STREAM, IPPROTO_TCP, htons((in_port_t)port) };
+        }
+        if (socktype == 0 || socktype == SOCK_DGRAM) {
+            out[n++] = (struct service_template){ SOCK_DGRAM, IPPROTO_UDP, htons((in_port_t)port) };
+        }
+        if (socktype == 0) {
+            out[n++] = (struct service_template){ SOCK_RAW, 0, htons((in_port_t)port) };
+        }
+        return n;
+    }
+    
+    struct addrinfo tmpl_hints;
+    memset(&tmpl_hints, 0, sizeof(tmpl_hints));
+    tmpl_hints.ai_family = AF_INET;
+    tmpl_hints.ai_socktype = socktype;
+    tmpl_hints.ai_protocol = protocol;
+    tmpl_hints.ai_flags = AI_NUMERICHOST;
+    if (hints) {
+        tmpl_hints.ai_flags |= hints->ai_flags & ~(AI_CANONNAME | AI_ADDRCONFIG | AI_V4MAPPED | AI_ALL);
+    }
+    
+    struct addrinfo *tmpl = NULL;
+    int rc = original_getaddrinfo("0.0.0.0", service, &tmpl_hints, &tmpl);
+    if (rc != 0) return rc;
+    int n = 0;
+    for (struct addrinfo *t = tmpl; t && n < MAX_SERVICE_TEMPLATES; t = t->ai_next) {
+        out[n].socktype = t->ai_socktype;
+        out[n].protocol = t->ai_protocol;
+        out[n].port = ((struct sockaddr_in *)t->ai_addr)->sin_port;
+        n++;
+    }
+    freeaddrinfo(tmpl);
+    return n;
+}
+
+// Expand a resolved answer into an addrinfo chain for the given service and
+// hints, using glibc's node layout so the caller can use freeaddrinfo().
+static int build_addrinfo_result(const struct dns_answer *ans, const char *node,
+                                 const char *service, const struct addrinfo *hints,
+                                 struct addrinfo **res) {
+    struct service_template tmpl[MAX_SERVICE_TEMPLATES];
+    int ntmpl = service_templates(service, hints, tmpl);
+    if (ntmpl < 0) return ntmpl;
+    
+    int family = hints ? hints->ai_family : AF_UNSPEC;
+    int flags = hints ? hints->ai_flags : 0;
+    struct addrinfo *head = NULL;
+    struct addrinfo **tail = &head;
+    
+    for (int i = 0; i < ans->count; i++) {
+        int out_family = ans->addrs[i].family;
+        int v4mapped = (family == AF_INET6 && out_family == AF_INET);
+        if (v4mapped) out_family = AF_INET6;
+        socklen_t addrlen = (out_family == AF_INET) ? sizeof(struct sockaddr_in)
+                                                    : sizeof(struct sockaddr_in6);
+        
+        for (int t = 0; t < ntmpl; t++) {
+            in_port_t port = tmpl[t].port;
+            struct addrinfo *ai = calloc(1, sizeof(struct addrinfo) + addrlen);
+            if (!ai) {
+                freeaddrinfo(head);
+                return EAI_MEMORY;
+            }
+            ai->ai_flags = flags;
+            ai->ai_family = out_family;
+            ai->ai_socktype = tmpl[t].socktype;
+            ai->ai_protocol = tmpl[t].protocol;
+            ai->ai_addrlen = addrlen;
+            ai->ai_addr = (struct sockaddr *)(ai + 1);
+            
+            if (out_family == AF_INET) {
+                struct sockaddr_in *sin = (struct sockaddr_in *)ai->ai_addr;
+                sin->sin_family = AF_INET;
+                sin->sin_port = port;
+                memcpy(&sin->sin_addr, ans->addrs[i].addr, 4);
+            } else {
+                struct sockaddr_in6 *sin6 = (struct sockaddr_in6 *)ai->ai_addr;
+                sin6->sin6_family = AF_INET6;
+                sin6->sin6_port = port;
+                if (v4mapped) {
+                    sin6->sin6_addr.s6_addr[10] = 0xff;
+                    sin6->sin6_addr.s6_addr[11] = 0xff;
+                    memcpy(&sin6->sin6_addr.s6_addr[12], ans->addrs[i].addr, 4);
+                } else {
+                    memcpy(&sin6->sin6_addr, ans->addrs[i].addr, 16);
+                }
+            }
+            
+            if (!head && (flags & AI_CANONNAME)) {
+                ai->ai_canonname = strdup(ans->canonname[0] ? ans->canonname : node);
+                if (!ai->ai_canonname) {
+                    free(ai);
+                    return EAI_MEMORY;
+                }
+            }
+            
+            *tail = ai;
+            tail = &ai->ai_next;
+        }
+    }
+    
+    if (!head) return EAI_NODATA;
+    *res = head;
+    return 0;
+}
+
+// Numeric addresses and localhost names are answered by the system resolver
+// without any DNS traffic, so the DNS paths leave them alone.
+static int is_local_or_numeric(const char *name) {
+    unsigned char buf[sizeof(struct in6_addr)];
+    if (inet_pton(AF_INET, name, buf) == 1 || inet_pton(AF_INET6, name, buf) == 1) {
+        return 1;
+    }
+    
+    size_t len = strlen(name);
+    if (len && name[len - 1] == '.') len--;
+    if (len == 9 && strncasecmp(name, "localhost", 9) == 0) return 1;
+    if (len > 10 && strncasecmp(name + len - 10, ".localhost", 10) == 0) return 1;
+    return 0;
+}
+
+static int dns_getaddrinfo(const char *node, const char *service,
+                                 const struct addrinfo *hints, struct addrinfo **res, int *ttl) {
+    int family = hints ? hints->ai_family : AF_UNSPEC;
+    int flags = hints ? hints->ai_flags : 0;
+    if (family != AF_UNSPEC && family != AF_INET && family != AF_INET6) {
+        return EAI_FAMILY;
+    }
+    
+    struct dns_answer ans;
+    int herr = resolve_addresses(node, family, flags, &ans);
+    *ttl = ans.ttl;
+    if (herr != 0) {
+        return herrno_to_eai(herr);
+    }
+    
+    return build_addrinfo_result(&ans, node, service, hints, res);
+}
+
+// Answer a getaddrinfo() of a name pinned in the static host table.
+// Returns 0 if the table does not have the name, otherwise 1 with *status
+// set to the getaddrinfo() result. No DNS64 or filtering is applied: the
+// configured addresses are returned as written.
+static int hosts_getaddrinfo(const char *node, const char *service,
+                             const struct addrinfo *hints, struct addrinfo **res, int *status) {
+    if (!cfg->hosts || !node) return 0;
+    const struct host_entry *e = hosts_table_find(cfg->hosts, node);
+    if (!e) return 0;
+    
+    int family = hints ? hints->ai_family : AF_UNSPEC;
+    int flags = hints ? hints->ai_flags : 0;
+    if (family != AF_UNSPEC && family != AF_INET && family != AF_INET6) {
+        *status = EAI_FAMILY;
+        return 1;
+    }
+    
+    // The family rules of resolve_addresses(), AI_V4MAPPED included
+    const struct host_addr *addrs = &cfg->hosts->addrs[e->addr_first];
+    int has_v6 = 0;
+    for (uint32_t i = 0; i < e->addr_count; i++) {
+        if (addrs[i].family == AF_INET6) has_v6 = 1;
+    }
+    int want_v4 = family != AF_INET6 ||
+                  ((flags & AI_V4MAPPED) && (!has_v6 || (flags & AI_ALL)));
+    struct dns_answer ans;
+    ans.count = 0;
+    ans.ttl = 0;
+    ans.canonname[0] = '\0';
+    for (uint32_t i = 0; i < e->addr_count && ans.count < MAX_ANSWER_ADDRS; i++) {
+        if (addrs[i].family == AF_INET ? want_v4 : family != AF_INET) {
+            ans.addrs[ans.count].family = addrs[i].family;
+            memcpy(ans.addrs[ans.count].addr, addrs[i].addr, sizeof(addrs[i].addr));
+            ans.count++;
+        }
+    }
+    
+    *status = ans.count ? build_addrinfo_result(&ans, node, service, hints, res) : EAI_NODATA;
+    stat_add(STAT_HOST_OVERRIDE, 1);
+    log_trace("Host table entry %s answers %s", e->name, node);
+    return 1;
+}
+
+// ---------------------------------------------------------------------------
+// System resolver path ("resolver glibc")
+//
+// Temporarily rewrites the process-global _res to point at the configured
+// servers, calls the original glibc function and restores _res afterwards.
+// The replacement state is the thread's prepared res_state: it is built with
+// res_ninit() on the thread's first lookup and then only copied in, so the
+// hot path does not re-read /etc/resolv.conf, parse addresses or allocate.
+// ---------------------------------------------------------------------------
+
+// Install the thread's resolver state for name as _res, saving the caller's
+// state. Returns NULL (leaving _res alone) if the state could not be set up.
+static struct thread_resolver *system_res_enter(const char *name, struct __res_state *saved,
+                                                struct server_order *order) {
+    struct thread_resolver *tr = get_thread_resolver();
+    health_server_order(order, route_for(name));
+    if (!tr || !get_thread_res_state(tr, order)) return NULL;
+    
+    if (log_enabled(LOG_LEVEL_TRACE)) {
+        for (int o = 0; o < order->count && o < MAXNS; o++) {
+            log_trace("Using nameserver: %s:%d", cfg->dns_servers[order->idx[o]], cfg->dns_ports[order->idx[o]]);
+        }
+    }
+    
+    memcpy(saved, &_res, sizeof(_res));
+    memcpy(&_res, &tr->res, sizeof(_res));
+    return tr;
+}
+
+// Take back the thread's resolver state (with any sockets glibc opened on
+// it) and restore the caller's _res
+static void system_res_leave(struct thread_resolver *tr, const struct __res_state *saved) {
+    memcpy(&tr->res, &_res, sizeof(_res));
+    memcpy(&_res, saved, sizeof(_res));
+}
+
+static int system_getaddrinfo(const char *node, const char *service,
+                              const struct addrinfo *hints, struct addrinfo **res) {
+    struct __res_state original_state;
+    struct server_order order;
+    struct thread_resolver *tr = system_res_enter(node, &original_state, &order);
+    
+    // Call original function with modified resolver
+    int64_t started = monotonic_us();
+    int result = original_getaddrinfo(node, service, hints, res);
+    
+    if (tr) {
+        system_res_leave(tr, &original_state);
+        if (node && !is_local_or_numeric(node)) {
+            health_record_res_outcome(&order, started, result == EAI_AGAIN);
+        }
+    }
+    
+    return result;
+}
+
+// Apply AAAA filtering, DNS64 synthesis and A filtering to a successful result
+static int postprocess_addrinfo(const char *node, struct addrinfo **res) {
+    // Orders that only depend on the answer are applied here, once
+    int static_order = cfg->result_order == RESULT_ORDER_RFC6724 ||
+                       cfg->result_order == RESULT_ORDER_DNS64_FIRST;
+    if (!cfg->filter_aaaa && !cfg->enable_dns64 && !cfg->filter_a) {
+        if (static_order) order_addrinfo(res, cfg->result_order);
+        return 0;
+    }
+    
+    int removed_aaaa, added_dns64, removed_a;
+    if (rewrite_addrinfo_chain(res, &removed_aaaa, &added_dns64, &removed_a) != 0) {
+        return EAI_MEMORY;
+    }
+    stat_add(STAT_FILTERED_AAAA, removed_aaaa);
+    stat_add(STAT_DNS64_SYNTHESIZED, added_dns64);
+    stat_add(STAT_FILTERED_A, removed_a);
+    
+    if (removed_aaaa > 0) {
+        log_trace("Removed %d native IPv6 addresses for %s", removed_aaaa, node);
+    }
+    if (added_dns64 > 0) {
+        log_trace("Added %d DNS64 synthetic addresses for %s", added_dns64, node);
+    }
+    if (removed_a > 0) {
+        log_trace("Removed %d IPv4 addresses from final results for %s", removed_a, node);
+    }
+    
+    if (static_order) order_addrinfo(res, cfg->result_order);
+    
+    // Never report success with an empty list (e.g. filter_a on an IPv4-only name)
+    return *res ? 0 : EAI_NODATA;
+}
+
+// Resolve a getaddrinfo() request with the configured backend, bypassing
+// the caches, and apply the result rewriting. *ttl is set as for
+// dns_getaddrinfo() (0 when the backend reports no TTL).
+static int resolve_addrinfo(const char *node, const char *service,
+                            const struct addrinfo *hints, struct addrinfo **res, int *ttl) {
+    int result;
+    *ttl = 0;
+    if (cfg->resolver != RESOLVER_GLIBC && node &&
+        !(hints && (hints->ai_flags & AI_NUMERICHOST)) && !is_local_or_numeric(node)) {
+        result = dns_getaddrinfo(node, service, hints, res, ttl);
+    } else if (cfg->resolver != RESOLVER_GLIBC) {
+        // Nothing to send upstream; never touch _res in this mode
+        result = original_getaddrinfo(node, service, hints, res);
+    } else {
+        result = system_getaddrinfo(node, service, hints, res);
+    }
+    
+    // If we got results, apply filtering and DNS64 processing
+    if (result == 0 && node && *res) {
+        result = postprocess_addrinfo(node, res);
+        if (result != 0) {
+            freeaddrinfo(*res);
+            *res = NULL;
+        }
+    }
+    return result;
+}
+
+// ---------------------------------------------------------------------------
+// Reverse lookups
+//
+// getnameinfo() asks the configured servers for the PTR record of the
+// address. The reverse name is routed like any other name, so a
+// "route 10.in-addr.arpa ..." line sends private ranges to the internal
+// resolver. Numeric hosts, the service part, loopback and link-local
+// addresses are left to glibc, which answers them without DNS.
+// ---------------------------------------------------------------------------
+
+// Write the in-addr.arpa or ip6.arpa name of sa to out (at least 80 bytes).
+// Returns -1 for addresses that are not looked up in DNS.
+static int reverse_name(const struct sockaddr *sa, socklen_t salen, char *out, size_t outlen) {
+    const unsigned char *a;
+    if (sa->sa_family == AF_INET && salen >= sizeof(struct sockaddr_in)) {
+        a = (const unsigned char *)&((const struct sockaddr_in *)sa)->sin_addr;
+    } else if (sa->sa_family == AF_INET6 && salen >= sizeof(struct sockaddr_in6)) {
+        const struct in6_addr *a6 = &((const struct sockaddr_in6 *)sa)->sin6_addr;
+        if (IN6_IS_ADDR_LOOPBACK(a6) || IN6_IS_ADDR_LINKLOCAL(a6) || IN6_IS_ADDR_UNSPECIFIED(a6)) {
+            return -1;
+        }
+        a = a6->s6_addr;
+        if (!IN6_IS_ADDR_V4MAPPED(a6)) {
+            size_t n = 0;
+            for (int i = 15; i >= 0; i--) {
+                n += snprintf(out + n, outlen - n, "%x.%x.", a[i] & 0xf, a[i] >> 4);
+            }
+            snprintf(out + n, outlen - n, "ip6.arpa");
+            return 0;
+        }
+        a += 12;
+    } else {
+        return -1;
+    }
+    
+    if (a[0] == 127 || a[0] == 0 || (a[0] == 169 && a[1] == 254)) return -1;
+    snprintf(out, outlen, "%u.%u.%u.%u.in-addr.arpa", a[3], a[2], a[1], a[0]);
+    return 0;
+}
+
+// Copy the first PTR target for rev into host. Returns 0 or an EAI code.
+static int dns_reverse_lookup(const char *rev, char *host, socklen_t hostlen) {
+    struct thread_resolver *tr = get_thread_resolver();
+    if (!tr) return EAI_MEMORY;
+    
+    int len = route_res_query(rev, ns_c_in, ns_t_ptr, tr->answer, sizeof(tr->answer), 0);
+    if (len < 0) {
+        return h_errno == TRY_AGAIN ? EAI_AGAIN : EAI_NONAME;
+    }
+    if (len > (int)sizeof(tr->answer)) {
+        len = sizeof(tr->answer);
+    }
+    
+    ns_msg msg;
+    if (ns_initparse(tr->answer, len, &msg) < 0) {
+        return EAI_FAIL;
+    }
+    for (int i = 0; i < ns_msg_count(msg, ns_s_an); i++) {
+        ns_rr rr;
+        if (ns_parserr(&msg, ns_s_an, i, &rr) < 0) break;
+        if (ns_rr_class(rr) != ns_c_in || ns_rr_type(rr) != ns_t_ptr) continue;
+        
+        char name[NS_MAXDNAME];
+        if (dn_expand(ns_msg_base(msg), ns_msg_end(msg), ns_rr_rdata(rr), name, sizeof(name)) < 0) {
+            continue;
+        }
+        if (strlen(name) >= hostlen) return EAI_OVERFLOW;
+        strcpy(host, name);
+        return 0;
+    }
+    return EAI_NONAME;
+}
+
+// The getnameinfo() pipeline; the caller holds the config snapshot.
+// NI_NOFQDN needs glibc's idea of the local domain and is left to it.
+static int lookup_nameinfo(const struct sockaddr *sa, socklen_t salen, char *host, socklen_t hostlen,
+                           char *serv, socklen_t servlen, int flags) {
+    char rev[80];
+    if (!sa || !host || hostlen == 0 || (flags & (NI_NUMERICHOST | NI_NOFQDN)) ||
+        reverse_name(sa, salen, rev, sizeof(rev)) != 0) {
+        return original_getnameinfo(sa, salen, host, hostlen, serv, servlen, flags);
+    }
+    
+    log_lookup_begin(rev);
+    log_trace("getnameinfo called for: %s", rev);
+    
+    int result;
+    if (cfg->resolver == RESOLVER_GLIBC) {
+        struct __res_state original_state;
+        struct server_order order;
+        struct thread_resolver *tr = system_res_enter(rev, &original_state, &order);
+        int64_t started = monotonic_us();
+        result = original_getnameinfo(sa, salen, host, hostlen, serv, servlen, flags);
+        if (tr) {
+            system_res_leave(tr, &original_state);
+            health_record_res_outcome(&order, started, result == EAI_AGAIN);
+        }
+    } else {
+        result = serv && servlen ? original_getnameinfo(sa, salen, NULL, 0, serv, servlen, flags) : 0;
+        if (result == 0) {
+            result = dns_reverse_lookup(rev, host, hostlen);
+            if (result != 0 && result != EAI_OVERFLOW && result != EAI_MEMORY && !(flags & NI_NAMEREQD)) {
+                // No name: the numeric form, as glibc does
+                result = original_getnameinfo(sa, salen, host, hostlen, NULL, 0, flags | NI_NUMERICHOST);
+            }
+        }
+    }
+    
+    if (result == 0) {
+        log_trace("getnameinfo for %s returned %s", rev, host);
+    } else {
+        log_trace("getnameinfo failed for %s: %s", rev, gai_strerror(result));
+    }
+    return result;
+}
+
+// ---------------------------------------------------------------------------
+// Background prefetch
+//
+// A cache hit in the last prefetch_threshold percent of an answer's lifetime
+// queues the key for a background thread, which resolves it again and
+// replaces the cache entry. Callers keep getting the current answer
+// meanwhile, so a popular name never expires in front of a caller. The
+// thread is started on the first prefetch and blocks all signals.
+// ---------------------------------------------------------------------------
+
+struct prefetch_job {
+    struct prefetch_job *next;
+    int family;
+    int socktype;
+    int protocol;
+    int flags;
+    char *service; // Points into key storage below (NULL if none)
+    char node[];
+};
+
+static struct prefetch_job *prefetch_head = NULL;
+static struct prefetch_job *prefetch_tail = NULL;
+static int prefetch_queued = 0;
+static int prefetch_thread_running = 0;
+static pthread_mutex_t prefetch_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t prefetch_cond = PTHREAD_COND_INITIALIZER;
+
+static void *prefetch_thread(void *arg) {
+    (void)arg;
+    for (;;) {
+        pthread_mutex_lock(&prefetch_lock);
+        while (!prefetch_head) {
+            pthread_cond_wait(&prefetch_cond, &prefetch_lock);
+        }
+        struct prefetch_job *job = prefetch_head;
+        prefetch_head = job->next;
+        if (!prefetch_head) prefetch_tail = NULL;
+        prefetch_queued--;
+        pthread_mutex_unlock(&prefetch_lock);
+        
+        struct addrinfo hints;
+        memset(&hints, 0, sizeof(hints));
+        hints.ai_family = job->family;
+        hints.ai_socktype = job->socktype;
+        hints.ai_protocol = job->protocol;
+        hints.ai_flags = job->flags;
+        
+        config_acquire();
+        log_lookup_begin(job->node);
+        log_trace("Prefetching %s", job->node);
+        struct addrinfo *res = NULL;
+        int ttl;
+        int result = resolve_addrinfo(job->node, job->service, &hints, &res, &ttl);
+        // A failed refresh leaves the current entry alone; it is retried on a
+        // later hit or simply expires
+        if (result == 0 || result == EAI_NONAME || result == EAI_NODATA) {
+            cache_store(job->node, job->service, &hints, result, res, ttl);
+            shared_cache_store(job->node, job->service, &hints, result, res, ttl);
+        }
+        if (res) freeaddrinfo(res);
+        config_release();
+        free(job);
+    }
+    return NULL;
+}
+
+// Queue a refresh of a cache key; never blocks on the network
+static void prefetch_schedule(const char *node, const char *service, const struct addrinfo *hints) {
+    size_t node_len = strlen(node) + 1;
+    size_t service_len = service ? strlen(service) + 1 : 0;
+    struct prefetch_job *job = calloc(1, sizeof(*job) + node_len + service_len);
+    if (!job) return;
+    memcpy(job->node, node, node_len);
+    if (service) {
+        job->service = job->node + node_len;
+        memcpy(job->service, service, service_len);
+    }
+    job->family = hints ? hints->ai_family : AF_UNSPEC;
+    job->socktype = hints ? hints->ai_socktype : 0;
+    job->protocol = hints ? hints->ai_protocol : 0;
+    job->flags = hints ? hints->ai_flags : 0;
+    
+    pthread_mutex_lock(&prefetch_lock);
+    if (!prefetch_thread_running) {
+        // Keep the application's signals away from our thread
+        sigset_t all, saved;
+        sigfillset(&all);
+        pthread_sigmask(SIG_SETMASK, &all, &saved);
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, prefetch_thread, NULL) == 0) {
+            pthread_detach(thread);
+            prefetch_thread_running = 1;
+        }
+        pthread_sigmask(SIG_SETMASK, &saved, NULL);
+    }
+    if (!prefetch_thread_running || prefetch_queued >= PREFETCH_QUEUE_MAX) {
+        pthread_mutex_unlock(&prefetch_lock);
+        free(job);
+        return;
+    }
+    if (prefetch_tail) {
+        prefetch_tail->next = job;
+    } else {
+        prefetch_head = job;
+    }
+    prefetch_tail = job;
+    prefetch_queued++;
+    stat_add(STAT_PREFETCH, 1);
+    pthread_cond_signal(&prefetch_cond);
+    pthread_mutex_unlock(&prefetch_lock);
+}
+
+// The prefetch thread does not survive fork(); the child starts a new one
+static void prefetch_atfork_prepare() { pthread_mutex_lock(&prefetch_lock); }
+static void prefetch_atfork_parent() { pthread_mutex_unlock(&prefetch_lock); }
+static void prefetch_atfork_child() {
+    while (prefetch_head) {
+        struct prefetch_job *job = prefetch_head;
+        prefetch_head = job->next;
+        free(job);
+    }
+    prefetch_tail = NULL;
+    prefetch_queued = 0;
+    prefetch_thread_running = 0;
+    pthread_mutex_init(&prefetch_lock, NULL);
+    pthread_cond_init(&prefetch_cond, NULL);
+}
+
+// ---------------------------------------------------------------------------
+// Forward lookups
+//
+// lookup_addrinfo() is the getaddrinfo() pipeline behind every forward
+// lookup API: the static host table, the answer caches, coalescing, the
+// resolver and stale answers. The gethostbyname family turns its result
+// into a hostent. Callers hold the config snapshot.
+// ---------------------------------------------------------------------------
+
+// Answer from the static host table or the caches. Returns 1 with *result
+// set if one of them had the answer, 0 if the lookup has to go upstream.
+static int lookup_addrinfo_local(const char *node, const char *service,
+                                 const struct addrinfo *hints, struct addrinfo **res, int *result) {
+    if (hosts_getaddrinfo(node, service, hints, res, result)) {
+        return 1;
+    }
+    
+    pthread_once(&cache_snapshot_once, cache_snapshot_load);
+    int refresh, stale;
+    if (cache_lookup(node, service, hints, res, result, &refresh, &stale)) {
+        stat_add(stale ? STAT_CACHE_STALE : STAT_CACHE_HIT, 1);
+        if (refresh) prefetch_schedule(node, service, hints);
+        return 1;
+    }
+    if (shared_cache_lookup(node, service, hints, res, result)) {
+        stat_add(STAT_SHARED_CACHE_HIT, 1);
+        return 1;
+    }
+    if (cache_applicable(node, hints) || (cfg->shared_cache && cache_key_applicable(node, hints))) {
+        stat_add(STAT_CACHE_MISS, 1);
+    }
+    return 0;
+}
+
+// File the outcome of an upstream lookup in the caches, or replace an
+// upstream failure with a stale answer. Returns the final result.
+static int lookup_addrinfo_settle(const char *node, const char *service, const struct addrinfo *hints,
+                                  struct addrinfo **res, int result, int ttl) {
+    if ((result == EAI_AGAIN || result == EAI_FAIL || result == EAI_SYSTEM) &&
+        cache_lookup_stale(node, service, hints, res)) {
+        // Upstream trouble: an expired answer beats an error. It is not
+        // stored again, so it still ages out after serve_stale seconds.
+        stat_add(STAT_CACHE_STALE, 1);
+        return 0;
+    }
+    
+    // The system resolver does not report TTLs (ttl stays 0); the cache then
+    // applies cache_min_ttl, or negative_ttl for failed lookups
+    cache_store(node, service, hints, result, result == 0 ? *res : NULL, ttl);
+    shared_cache_store(node, service, hints, result, result == 0 ? *res : NULL, ttl);
+    cache_snapshot_tick();
+    return result;
+}
+
+// The upstream part of lookup_addrinfo()
+static int lookup_addrinfo_remote(const char *node, const char *service,
+                                  const struct addrinfo *hints, struct addrinfo **res) {
+    // Take the answer of an identical lookup another thread is already doing
+    int result;
+    int ttl = 0;
+    struct flight *flight;
+    if (flight_join(node, service, hints, res, &result, &ttl, &flight)) {
+        return result;
+    }
+    
+    result = resolve_addrinfo(node, service, hints, res, &ttl);
+    result = lookup_addrinfo_settle(node, service, hints, res, result, ttl);
+    flight_finish(flight, result, result == 0 ? *res : NULL, ttl);
+    return result;
+}
+
+static int lookup_addrinfo(const char *node, const char *service,
+                           const struct addrinfo *hints, struct addrinfo **res) {
+    int result;
+    if (!lookup_addrinfo_local(node, service, hints, res, &result)) {
+        result = lookup_addrinfo_remote(node, service, hints, res);
+    }
+    order_addrinfo_lookup(result, res);
+    return result;
+}
+
+// Lay out the af addresses of res as a hostent inside buf, the way
+// gethostbyname_r() does: h_name is the canonical name and the queried name
+// becomes an alias when they differ. Returns 0, ERANGE if buf is too small
+// or ENOENT if res has no address of that family.
+static int addrinfo_to_hostent(const char *name, int af, const struct addrinfo *res,
+                               struct hostent *ret, char *buf, size_t buflen) {
+    int addr_len = (af == AF_INET) ? 4 : 16;
+    int count = 0;
+    for (const struct addrinfo *ai = res; ai; ai = ai->ai_next) {
+        if (ai->ai_family == af) count++;
+    }
+    if (count == 0) return ENOENT;
+    
+    const char *canon = (res->ai_canonname && res->ai_canonname[0]) ? res->ai_canonname : name;
+    size_t canon_len = strlen(canon) + 1;
+    size_t alias_len = strcasecmp(canon, name) != 0 ? strlen(name) + 1 : 0;
+    size_t pad = (sizeof(char *) - (uintptr_t)buf % sizeof(char *)) % sizeof(char *);
+    size_t need = pad + (count + 3) * sizeof(char *) + (size_t)count * addr_len + canon_len + alias_len;
+    if (buflen < need) return ERANGE;
+    
+    // Pointer arrays first (aligned), then the addresses, then the names
+    char **addr_list = (char **)(buf + pad);
+    char **aliases = addr_list + count + 1;
+    char *addrs = (char *)(aliases + 2);
+    int n = 0;
+    for (const struct addrinfo *ai = res; ai; ai = ai->ai_next) {
+        if (ai->ai_family != af) continue;
+        const void *addr = (af == AF_INET) ? (const void *)&((struct sockaddr_in *)ai->ai_addr)->sin_addr
+                                           : (const void *)&((struct sockaddr_in6 *)ai->ai_addr)->sin6_addr;
+        int duplicate = 0;
+        for (int i = 0; i < n && !duplicate; i++) {
+            duplicate = memcmp(addr_list[i], addr, addr_len) == 0;
+        }
+        if (duplicate) continue;
+        memcpy(addrs + n * addr_len, addr, addr_len);
+        addr_list[n] = addrs + n * addr_len;
+        n++;
+    }
+    addr_list[n] = NULL;
+    
+    char *names = addrs + count * addr_len;
+    memcpy(names, canon, canon_len);
+    aliases[0] = NULL;
+    if (alias_len) {
+        memcpy(names + canon_len, name, alias_len);
+        aliases[0] = names + canon_len;
+        aliases[1] = NULL;
+    }
+    
+    ret->h_name = names;
+    ret->h_aliases = aliases;
+    ret->h_addrtype = af;
+    ret->h_length = addr_len;
+    ret->h_addr_list = addr_list;
+    return 0;
+}
+
+// Shared body of the gethostbyname family, with gethostbyname2_r()'s
+// contract: returns 0 (with *result NULL and *h_errnop set when the name has
+// no address), EAGAIN, ERANGE, EAFNOSUPPORT or EIO.
+static int lookup_hostent(const char *api, const char *name, int af, struct hostent *ret,
+                          char *buf, size_t buflen, struct hostent **result, int *h_errnop) {
+    init_original_functions();
+    config_acquire();
+    stat_add(STAT_GETHOSTBYNAME, 1);
+    
+    log_lookup_begin(name);
+    log_trace("%s called for: %s", api, name ? name : "(null)");
+    
+    *result = NULL;
+    int rc = 0;
+    if (af != AF_INET && af != AF_INET6) {
+        *h_errnop = NO_DATA;
+        rc = EAFNOSUPPORT;
+    } else if (!name) {
+        *h_errnop = HOST_NOT_FOUND;
+    } else {
+        // One node per address is enough for a hostent
+        struct addrinfo hints;
+        memset(&hints, 0, sizeof(hints));
+        hints.ai_family = af;
+        hints.ai_socktype = SOCK_DGRAM;
+        hints.ai_flags = AI_CANONNAME;
+        struct addrinfo *res = NULL;
+        int status = lookup_addrinfo(name, NULL, &hints, &res);
+        if (status == 0) {
+            int err = addrinfo_to_hostent(name, af, res, ret, buf, buflen);
+            freeaddrinfo(res);
+            if (err == 0) {
+                *result = ret;
+                *h_errnop = NETDB_SUCCESS;
+            } else if (err == ERANGE) {
+                *h_errnop = NETDB_INTERNAL;
+                rc = ERANGE;
+            } else {
+                *h_errnop = NO_DATA;
+            }
+        } else if (status == EAI_NONAME) {
+            *h_errnop = HOST_NOT_FOUND;
+        } else if (status == EAI_NODATA) {
+            *h_errnop = NO_DATA;
+        } else if (status == EAI_AGAIN) {
+            *h_errnop = TRY_AGAIN;
+            rc = EAGAIN;
+        } else {
+            *h_errnop = NO_RECOVERY;
+            rc = EIO;
+        }
+    }
+    
+    log_trace("%s %s for %s", api, *result ? "succeeded" : "failed", name ? name : "(null)");
+    
+    config_release();
+    return rc;
+}
+
+// gethostbyname()/gethostbyname2(): the result lives in per-thread storage
+static struct hostent *lookup_thread_hostent(const char *api, const char *name, int af) {
+    struct thread_resolver *tr = get_thread_resolver();
+    if (!tr) {
+        h_errno = NO_RECOVERY;
+        return NULL;
+    }
+    
+    struct hostent *result;
+    int herr;
+    lookup_hostent(api, name, af, &tr->host, tr->host_buf, sizeof(tr->host_buf), &result, &herr);
+    h_errno = (herr == NETDB_INTERNAL) ? NO_RECOVERY : herr;
+    return result;
+}
+
+// ---------------------------------------------------------------------------
+// Asynchronous lookups
+//
+// getaddrinfo_a(), gai_suspend(), gai_cancel() and gai_error(), and the
+// native dns_async_* API of dns_override.h, share one engine. Answers in
+// the host table or the caches complete at submission. Other names become
+// A/AAAA questions, and a single background thread multiplexes them all
+// over a few shared non-blocking UDP sockets with epoll. Thousands of
+// outstanding lookups therefore cost a handful of descriptors and no extra
+// threads.
+//
+// A reply is matched by socket, query ID and server address, and then
+// validated against the question like any native client answer. Each
+// question tries the servers of the name's route one at a time, in health
+// order, and follows attempt_timeout_ms, retries and total_timeout_ms.
+// Queries are queued per socket while the engine works through a wakeup
+// and leave in one sendmmsg() per socket at its end; replies are drained
+// with recvmmsg(). At high query rates this takes one syscall per batch of
+// datagrams instead of one per query. Each socket gets its own random
+// source port from the kernel.
+// Lookups the engine cannot do over UDP go to a small pool of helper threads
+// that run the ordinary getaddrinfo() path: resolver glibc or reentrant,
+// use_tcp, and truncated replies.
+// ---------------------------------------------------------------------------
+
+#define ASYNC_SOCKETS 4        // UDP sockets per address family
+#define ASYNC_HELPERS 4        // Threads for lookups the engine hands off
+#define ASYNC_HASH_SIZE 4096   // Buckets of the in-flight question table
+#define ASYNC_EVENTS 64        // epoll events taken per wakeup
+#define ASYNC_BATCH 32         // Datagrams per sendmmsg()/recvmmsg() call
+#define ASYNC_WAKE_TOKEN UINT32_MAX
+
+// One record type of an engine lookup
+struct async_question {
+    struct async_request *req;
+    struct async_question *hash_next;
+    int qtype;
+    uint16_t id;
+    int sock;           // async_socks[] slot of the attempt in flight
+    int server;         // Server of the attempt in flight
+    union {
+        struct sockaddr sa;
+        struct sockaddr_in sin;
+        struct sockaddr_in6 sin6;
+    } peer;             // Address the reply must come from
+    int attempts;
+    int status;         // h_errno-style outcome, -1 while pending
+    int last_error;     // Outcome reported if every attempt fails
+    int heap_index;     // Position in the deadline heap, -1 when not in flight
+    int64_t deadline;
+    int refused;        // The socket would not take the datagram
+    int64_t started_us; // For the server's RTT estimate
+    uint32_t ttl;
+    struct dns_answer *ans; // Addresses once answered, NULL if none
+};
+
+// getaddrinfo_a() requests that report their completion together
+struct async_group {
+    int pending;
+    struct sigevent sev;
+};
+
+struct async_request {
+    struct async_request *next; // Submission, helper or completion queue link
+    struct async_request *active_prev, *active_next; // Unfinished getaddrinfo_a() requests
+    struct gaicb *gaicb;        // NULL for dns_async_submit() and once cancelled
+    struct async_group *group;
+    int native;                 // Submitted with dns_async_submit()
+    void *user;
+    int result;                 // Outcome, while on the completion queue
+    struct addrinfo *res;
+    
+    int has_hints;
+    struct addrinfo hints;
+    char *node;
+    char *service;
+    
+    // Engine state
+    uint64_t generation;        // Snapshot the server order was taken from
+    struct server_order order;
+    int64_t total_deadline;
+    int nquestions;
+    int unsettled;
+    struct async_question questions[MAX_DNS_QUESTIONS];
+    int qlen;
+    int qtype_off;              // Where the QTYPE sits in query
+    unsigned char query[DNS_QUERY_MAX];
+    char strings[];             // node and service
+};
+
+// Queries waiting for the next sendmmsg() on one engine socket
+struct async_outbox {
+    int count;
+    struct mmsghdr msgs[ASYNC_BATCH];
+    struct iovec iov[ASYNC_BATCH];
+    struct sockaddr_storage peers[ASYNC_BATCH];
+    unsigned char datagrams[ASYNC_BATCH][DNS_QUERY_MAX];
+};
+
+static pthread_mutex_t async_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t async_cond = PTHREAD_COND_INITIALIZER;         // A getaddrinfo_a() request finished
+static pthread_cond_t async_helper_cond = PTHREAD_COND_INITIALIZER;
+static struct async_request *async_submit_head = NULL, *async_submit_tail = NULL;
+static struct async_request *async_helper_head = NULL, *async_helper_tail = NULL;
+static struct async_request *async_done_head = NULL, *async_done_tail = NULL;
+static struct async_request *async_active = NULL;
+static int async_engine_running = 0;
+static int async_helpers = 0;
+static int async_helpers_idle = 0;
+static int async_epoll_fd = -1;
+static int async_wake_fd = -1;  // Wakes the engine for new submissions
+static int async_done_fd = -1;  // dns_async_fd(): readable while results wait
+
+// Engine thread only
+static int async_socks[2 * ASYNC_SOCKETS] = { -1, -1, -1, -1, -1, -1, -1, -1 };
+static int async_next_sock = 0;
+static struct async_outbox *async_outboxes[2 * ASYNC_SOCKETS];
+static int async_outbox_pending = 0; // Sockets with queued queries
+static struct async_question *async_hash[ASYNC_HASH_SIZE];
+static struct async_question **async_heap = NULL;
+static int async_heap_len = 0;
+static int async_heap_cap = 0;
+
+static void async_queue_push(struct async_request **head, struct async_request **tail,
+                             struct async_request *req) {
+    req->next = NULL;
+    if (*tail) {
+        (*tail)->next = req;
+    } else {
+        *head = req;
+    }
+    *tail = req;
+}
+
+static struct async_request *async_queue_pop(struct async_request **head, struct async_request **tail) {
+    struct async_request *req = *head;
+    if (req) {
+        *head = req->next;
+        if (!*head) *tail = NULL;
+    }
+    return req;
+}
+
+static void async_signal_fd(int fd) {
+    uint64_t one = 1;
+    if (write(fd, &one, sizeof(one)) < 0) {
+        // Counter saturated: the reader is already due to wake up
+    }
+}
+
+static void async_drain_fd(int fd) {
+    uint64_t count;
+    while (read(fd, &count, sizeof(count)) > 0) {
+    }
+}
+
+static struct async_request *async_request_new(const char *node, const char *service,
+                                               const struct addrinfo *hints) {
+    size_t node_len = node ? strlen(node) + 1 : 0;
+    size_t service_len = service ? strlen(service) + 1 : 0;
+    struct async_request *req = calloc(1, sizeof(*req) + node_len + service_len);
+    if (!req) return NULL;
+    
+    if (node) {
+        req->node = req->strings;
+        memcpy(req->node, node, node_len);
+    }
+    if (service) {
+        req->service = req->strings + node_len;
+        memcpy(req->service, service, service_len);
+    }
+    if (hints) {
+        req->has_hints = 1;
+        req->hints.ai_family = hints->ai_family;
+        req->hints.ai_socktype = hints->ai_socktype;
+        req->hints.ai_protocol = hints->ai_protocol;
+        req->hints.ai_flags = hints->ai_flags;
+    }
+    return req;
+}
+
+static void *async_notify_thread(void *arg) {
+    struct async_group *group = arg;
+    void (*fn)(union sigval) = group->sev.sigev_notify_function;
+    union sigval value = group->sev.sigev_value;
+    free(group);
+    fn(value);
+    return NULL;
+}
+
+// Deliver the sigevent of a getaddrinfo_a() call whose requests all finished
+static void async_notify(struct async_group *group) {
+    if (group->sev.sigev_notify == SIGEV_SIGNAL) {
+        sigqueue(getpid(), group->sev.sigev_signo, group->sev.sigev_value);
+    } else if (group->sev.sigev_notify == SIGEV_THREAD && group->sev.sigev_notify_function) {
+        pthread_t thread;
+        if (pthread_create(&thread, group->sev.sigev_notify_attributes, async_notify_thread, group) == 0) {
+            pthread_detach(thread);
+            return;
+        }
+    }
+    free(group);
+}
+
+// Count one request of the group as finished; returns the group when it is
+// the last one (async_lock held)
+static struct async_group *async_group_done(struct async_group *group) {
+    return (group && --group->pending == 0) ? group : NULL;
+}
+
+static void async_active_unlink(struct async_request *req) {
+    if (req->active_prev) {
+        req->active_prev->active_next = req->active_next;
+    } else {
+        async_active = req->active_next;
+    }
+    if (req->active_next) req->active_next->active_prev = req->active_prev;
+    req->active_prev = req->active_next = NULL;
+}
+
+// Hand the outcome to whoever is waiting for it and release the request
+static void async_complete(struct async_request *req, int result, struct addrinfo *res) {
+    if (result != 0) res = NULL;
+    
+    pthread_mutex_lock(&async_lock);
+    if (req->native) {
+        req->result = result;
+        req->res = res;
+        async_queue_push(&async_done_head, &async_done_tail, req);
+        async_signal_fd(async_done_fd);
+        pthread_mutex_unlock(&async_lock);
+        return;
+    }
+    
+    struct gaicb *gaicb = req->gaicb;
+    struct async_group *group = NULL;
+    if (gaicb) {
+        async_active_unlink(req);
+        gaicb->ar_result = res;
+        __atomic_store_n(&gaicb->__return, result, __ATOMIC_RELEASE);
+        group = async_group_done(req->group);
+        pthread_cond_broadcast(&async_cond);
+    }
+    pthread_mutex_unlock(&async_lock);
+    
+    if (!gaicb && res) freeaddrinfo(res); // Cancelled meanwhile
+    if (group) async_notify(group);
+    free(req);
+}
+
+static void *async_helper_thread(void *arg) {
+    (void)arg;
+    for (;;) {
+        pthread_mutex_lock(&async_lock);
+        async_helpers_idle++;
+        while (!async_helper_head) {
+            pthread_cond_wait(&async_helper_cond, &async_lock);
+        }
+        async_helpers_idle--;
+        struct async_request *req = async_queue_pop(&async_helper_head, &async_helper_tail);
+        pthread_mutex_unlock(&async_lock);
+    
+        config_acquire();
+        log_lookup_begin(req->node);
+        struct addrinfo *res = NULL;
+        int result = lookup_addrinfo_remote(req->node, req->service,
+                                            req->has_hints ? &req->hints : NULL, &res);
+        order_addrinfo_lookup(result, &res);
+        config_release();
+        async_complete(req, result, res);
+    }
+    return NULL;
+}
+
+// Start a thread with all signals blocked, so the application's handlers
+// never run on it
+static int async_start_thread(void *(*fn)(void *)) {
+    sigset_t all, saved;
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &saved);
+    pthread_t thread;
+    int rc = pthread_create(&thread, NULL, fn, NULL);
+    if (rc == 0) pthread_detach(thread);
+    pthread_sigmask(SIG_SETMASK, &saved, NULL);
+    return rc;
+}
+
+// Queue a request for the helper threads, adding one if none is idle. With
+// no helper at all the lookup runs in the calling thread.
+static void async_helper_push(struct async_request *req) {
+    pthread_mutex_lock(&async_lock);
+    if (async_helpers_idle == 0 && async_helpers < ASYNC_HELPERS &&
+        async_start_thread(async_helper_thread) == 0) {
+        async_helpers++;
+    }
+    if (async_helpers > 0) {
+        async_queue_push(&async_helper_head, &async_helper_tail, req);
+        pthread_cond_signal(&async_helper_cond);
+        pthread_mutex_unlock(&async_lock);
+        return;
+    }
+    pthread_mutex_unlock(&async_lock);
     
-    if (config.debug) {
-        if (result) {
-            fprintf(stderr, "[DNS Override] gethostbyname succeeded for %s\n", name);
+    config_acquire();
+    struct addrinfo *res = NULL;
+    int result = lookup_addrinfo_remote(req->node, req->service, req->has_hints ? &req->hints : NULL, &res);
+    order_addrinfo_lookup(result, &res);
+    config_release();
+    async_complete(req, result, res);
+}
+
+// Deadline heap of the questions in flight (engine thread)
+
+static void async_heap_set(int i, struct async_question *q) {
+    async_heap[i] = q;
+    q->heap_index = i;
+}
+
+static void async_heap_sift(int i) {
+    struct async_question *q = async_heap[i];
+    while (i > 0 && async_heap[(i - 1) / 2]->deadline > q->deadline) {
+        async_heap_set(i, async_heap[(i - 1) / 2]);
+        i = (i - 1) / 2;
+    }
+    for (;;) {
+        int child = 2 * i + 1;
+        if (child >= async_heap_len) break;
+        if (child + 1 < async_heap_len && async_heap[child + 1]->deadline < async_heap[child]->deadline) child++;
+        if (async_heap[child]->deadline >= q->deadline) break;
+        async_heap_set(i, async_heap[child]);
+        i = child;
+    }
+    async_heap_set(i, q);
+}
+
+static int async_heap_push(struct async_question *q) {
+    if (async_heap_len == async_heap_cap) {
+        int cap = async_heap_cap ? async_heap_cap * 2 : 256;
+        struct async_question **heap = realloc(async_heap, cap * sizeof(*heap));
+        if (!heap) return -1;
+        async_heap = heap;
+        async_heap_cap = cap;
+    }
+    async_heap_set(async_heap_len++, q);
+    async_heap_sift(q->heap_index);
+    return 0;
+}
+
+static void async_heap_remove(struct async_question *q) {
+    int i = q->heap_index;
+    q->heap_index = -1;
+    if (--async_heap_len > i) {
+        async_heap_set(i, async_heap[async_heap_len]);
+        async_heap_sift(i);
+    }
+}
+
+static unsigned async_hash_slot(int sock, uint16_t id) {
+    return (id ^ ((unsigned)sock << 9)) & (ASYNC_HASH_SIZE - 1);
+}
+
+static struct async_question **async_hash_find(int sock, uint16_t id) {
+    struct async_question **link = &async_hash[async_hash_slot(sock, id)];
+    while (*link && ((*link)->sock != sock || (*link)->id != id)) {
+        link = &(*link)->hash_next;
+    }
+    return link;
+}
+
+// Take a question's attempt out of the in-flight table and the heap
+static void async_question_unlink(struct async_question *q) {
+    if (q->heap_index < 0) return;
+    struct async_question **link = async_hash_find(q->sock, q->id);
+    if (*link == q) *link = q->hash_next;
+    async_heap_remove(q);
+}
+
+// A shared UDP socket of the family, opened on first use
+static int async_socket(int family) {
+    int base = (family == AF_INET6) ? ASYNC_SOCKETS : 0;
+    int slot = base + (async_next_sock++ % ASYNC_SOCKETS);
+    if (async_socks[slot] < 0) {
+        if (!async_outboxes[slot]) {
+            async_outboxes[slot] = calloc(1, sizeof(struct async_outbox));
+            if (!async_outboxes[slot]) return -1;
+        }
+        int fd = socket(family, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (fd < 0) return -1;
+        struct epoll_event ev;
+        ev.events = EPOLLIN;
+        ev.data.u32 = slot;
+        if (epoll_ctl(async_epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+            close(fd);
+            return -1;
+        }
+        async_socks[slot] = fd;
+    }
+    return slot;
+}
+
+// Put a datagram in slot i of an outbox
+static void async_outbox_set(struct async_outbox *box, int i, const unsigned char *msg, int len,
+                             const struct sockaddr_storage *peer, socklen_t peerlen) {
+    if (box->datagrams[i] != msg) memcpy(box->datagrams[i], msg, len);
+    if (&box->peers[i] != peer) memcpy(&box->peers[i], peer, peerlen);
+    box->iov[i].iov_base = box->datagrams[i];
+    box->iov[i].iov_len = len;
+    memset(&box->msgs[i], 0, sizeof(box->msgs[i]));
+    box->msgs[i].msg_hdr.msg_name = &box->peers[i];
+    box->msgs[i].msg_hdr.msg_namelen = peerlen;
+    box->msgs[i].msg_hdr.msg_iov = &box->iov[i];
+    box->msgs[i].msg_hdr.msg_iovlen = 1;
+}
+
+// Send what is queued on one socket. Datagrams the socket has no room for
+// stay queued for the next round; a question whose datagram is refused
+// becomes due at once, and async_expire() moves it on to its next server.
+static void async_flush_socket(int sock) {
+    struct async_outbox *box = async_outboxes[sock];
+    int sent = 0;
+    while (sent < box->count) {
+        int n = sendmmsg(async_socks[sock], box->msgs + sent, box->count - sent, 0);
+        if (n > 0) {
+            sent += n;
+        } else if (n < 0 && errno == EINTR) {
+            continue;
+        } else if (n < 0 && (errno == EAGAIN || errno == ENOBUFS)) {
+            break;
         } else {
-            fprintf(stderr, "[DNS Override] gethostbyname failed for %s\n", name);
+            // e.g. ENETUNREACH
+            struct async_question *q = *async_hash_find(sock, dns_get16(box->datagrams[sent++]));
+            if (!q) continue;
+            q->refused = 1;
+            q->deadline = 0;
+            async_heap_sift(q->heap_index);
         }
     }
     
-    return result;
+    int left = box->count - sent;
+    for (int i = 0; i < left; i++) {
+        async_outbox_set(box, i, box->datagrams[sent + i], (int)box->iov[sent + i].iov_len,
+                         &box->peers[sent + i], box->msgs[sent + i].msg_hdr.msg_namelen);
+    }
+    box->count = left;
+    if (left == 0) async_outbox_pending &= ~(1 << sock);
 }
 
-// Override getaddrinfo to use custom DNS servers
-int getaddrinfo(const char *node, const char *service,
-                const struct addrinfo *hints, struct addrinfo **res) {
-    init_original_functions();
-    load_dns_config();
+// Send the question to one server. Returns 0 when the attempt is in flight.
+static int async_send(struct async_question *q, int server, int64_t now) {
+    struct async_request *req = q->req;
+    struct sockaddr_storage ss;
+    socklen_t sslen = server_sockaddr(server, &ss);
+    if (!sslen || sslen > sizeof(q->peer)) return -1;
+    int sock = async_socket(ss.ss_family);
+    if (sock < 0) return -1;
     
-    if (config.debug && node) {
-        fprintf(stderr, "[DNS Override] getaddrinfo called for: %s\n", node);
+    // IDs only have to be unique per socket
+    uint16_t id = dns_next_id();
+    for (int i = 0; i < 8 && *async_hash_find(sock, id); i++) {
+        id = dns_next_id();
     }
+    req->query[0] = id >> 8;
+    req->query[1] = id & 0xff;
+    req->query[req->qtype_off] = q->qtype >> 8;
+    req->query[req->qtype_off + 1] = q->qtype & 0xff;
+    struct async_outbox *box = async_outboxes[sock];
+    if (box->count == ASYNC_BATCH) async_flush_socket(sock);
+    if (box->count == ASYNC_BATCH) return -1; // The socket is not draining
+    async_outbox_set(box, box->count++, req->query, req->qlen, &ss, sslen);
+    async_outbox_pending |= 1 << sock;
     
-    // Save original resolver state
-    struct __res_state original_state;
-    memcpy(&original_state, &_res, sizeof(_res));
-    
-    // Modify resolver to use our DNS servers
-    res_init();
-    _res.nscount = 0;
-    _res._u._ext.nscount6 = 0;
-    
-    int ipv4_index = 0;
-    int ipv6_index = 0;
-    
-    for (int i = 0; i < config.server_count && (ipv4_index < MAXNS || ipv6_index < MAXNS); i++) {
-        if (config.dns_families[i] == AF_INET && ipv4_index < MAXNS) {
-            // IPv4 nameserver
-            struct sockaddr_in *ns = (struct sockaddr_in*)&_res.nsaddr_list[ipv4_index];
-            memset(ns, 0, sizeof(*ns));
-            ns->sin_family = AF_INET;
-            ns->sin_port = htons(config.dns_ports[i]);
-            
-            if (inet_pton(AF_INET, config.dns_servers[i], &ns->sin_addr) == 1) {
-                _res.nscount++;
-                ipv4_index++;
-                if (config.debug && node) {
-                    fprintf(stderr, "[DNS Override] Using IPv4 nameserver: %s:%d for %s\n", 
-                           config.dns_servers[i], config.dns_ports[i], node);
-                }
-            }
-        } else if (config.dns_families[i] == AF_INET6 && ipv6_index < MAXNS) {
-            // IPv6 nameserver - allocate and store in the nsaddrs array
-            struct sockaddr_in6 *ns6 = calloc(1, sizeof(struct sockaddr_in6));
-            if (ns6) {
-                ns6->sin6_family = AF_INET6;
-                ns6->sin6_port = htons(config.dns_ports[i]);
-                
-                if (inet_pton(AF_INET6, config.dns_servers[i], &ns6->sin6_addr) == 1) {
-                    _res._u._ext.nsaddrs[ipv6_index] = ns6;
-                    _res._u._ext.nscount6++;
-                    
-                    // Also add a placeholder in the main nsaddr_list to indicate total count
-                    // This is needed for the resolver to recognize we have nameservers
-                    if (_res.nscount < MAXNS) {
-                        struct sockaddr_in *placeholder = (struct sockaddr_in*)&_res.nsaddr_list[_res.nscount];
-                        memset(placeholder, 0, sizeof(*placeholder));
-                        placeholder->sin_family = AF_UNSPEC; // Mark as unspecified/placeholder
-                        _res.nscount++;
-                    }
-                    
-                    ipv6_index++;
-                    if (config.debug && node) {
-                        fprintf(stderr, "[DNS Override] Using IPv6 nameserver: %s:%d for %s\n", 
-                               config.dns_servers[i], config.dns_ports[i], node);
-                    }
-                } else {
-                    free(ns6);
-                }
-            }
+    q->id = id;
+    q->sock = sock;
+    q->server = server;
+    q->refused = 0;
+    memcpy(&q->peer, &ss, sslen);
+    q->started_us = monotonic_us();
+    q->deadline = now + server_timeout_ms(server);
+    if (q->deadline > req->total_deadline) q->deadline = req->total_deadline;
+    if (async_heap_push(q) < 0) return -1;
+    struct async_question **link = &async_hash[async_hash_slot(sock, id)];
+    q->hash_next = *link;
+    *link = q;
+    stat_server(server, SERVER_QUERIES);
+    return 0;
+}
+
+// All questions answered: build the result the way dns_getaddrinfo() and
+// resolve_addrinfo() would, file it in the caches and complete the request
+static void async_request_finish(struct async_request *req) {
+    struct dns_answer ans;
+    ans.count = 0;
+    ans.ttl = UINT32_MAX;
+    ans.canonname[0] = '\0';
+    int status = -1;
+    for (int i = 0; i < req->nquestions; i++) {
+        struct async_question *q = &req->questions[i];
+        status = (status < 0) ? q->status : merge_query_status(status, q->status);
+        if (q->ttl < ans.ttl) ans.ttl = q->ttl;
+        if (!q->ans) continue;
+        for (int j = 0; j < q->ans->count && ans.count < MAX_ANSWER_ADDRS; j++) {
+            ans.addrs[ans.count++] = q->ans->addrs[j];
         }
+        if (!ans.canonname[0]) memcpy(ans.canonname, q->ans->canonname, sizeof(ans.canonname));
+        free(q->ans);
+        q->ans = NULL;
     }
     
-    // Set timeout
-    _res.retrans = config.timeout_ms / 1000;
-    _res.retry = 2;
+    const struct addrinfo *hints = req->has_hints ? &req->hints : NULL;
+    native_drop_mapped(req->hints.ai_family, req->hints.ai_flags, &ans);
+    if (ans.ttl == UINT32_MAX) ans.ttl = 0;
+    int herr = ans.count ? 0 : (status > 0 ? status : NO_DATA);
     
-    // Call original function with modified resolver
-    int result = original_getaddrinfo(node, service, hints, res);
+    struct addrinfo *res = NULL;
+    int result = herr ? herrno_to_eai(herr) : build_addrinfo_result(&ans, req->node, req->service, hints, &res);
+    if (result == 0 && res) {
+        result = postprocess_addrinfo(req->node, &res);
+        if (result != 0) {
+            freeaddrinfo(res);
+            res = NULL;
+        }
+    }
+    result = lookup_addrinfo_settle(req->node, req->service, hints, &res, result, ans.ttl);
+    order_addrinfo_lookup(result, &res);
+    log_trace("Async lookup of %s finished: %s", req->node, result == 0 ? "success" : gai_strerror(result));
+    async_complete(req, result, res);
+}
+
+static void async_question_settle(struct async_question *q, int status) {
+    q->status = status;
+    if (--q->req->unsettled == 0) async_request_finish(q->req);
+}
+
+// Launch the question's next attempt, or settle it when it has run out of
+// servers or time
+static void async_question_next(struct async_question *q, int64_t now) {
+    struct async_request *req = q->req;
+    if (req->generation != cfg->generation) {
+        // Reloaded: server slots may now mean different servers
+        health_server_order(&req->order, route_for(req->node));
+        req->generation = cfg->generation;
+    }
     
-    // If we got results, apply filtering and DNS64 processing
-    if (result == 0 && node && *res) {
-        // First, filter out AAAA records if requested
-        if (config.filter_aaaa) {
-            int filtered = filter_aaaa_records(res);
-            if (filtered < 0) {
-                // Error in filtering, clean up and restore original state
-                for (int i = 0; i < _res._u._ext.nscount6; i++) {
-                    if (_res._u._ext.nsaddrs[i]) {
-                        free(_res._u._ext.nsaddrs[i]);
-                        _res._u._ext.nsaddrs[i] = NULL;
-                    }
-                }
-                memcpy(&_res, &original_state, sizeof(_res));
-                return EAI_MEMORY;
-            }
-            if (filtered > 0 && config.debug) {
-                fprintf(stderr, "[DNS Override] Removed %d native IPv6 addresses for %s\n", filtered, node);
-            }
+    while (req->order.count > 0 && q->attempts < max_question_attempts(&req->order) &&
+           now < req->total_deadline) {
+        int server = req->order.idx[q->attempts % req->order.count];
+        q->attempts++;
+        if (async_send(q, server, now) == 0) return;
+        log_warn("Could not send query for %s to %s:%d",
+                 req->node, cfg->dns_servers[server], cfg->dns_ports[server]);
+    }
+    async_question_settle(q, q->last_error);
+}
+
+// Give a request the engine cannot finish to the helper threads
+static void async_request_handoff(struct async_request *req) {
+    for (int i = 0; i < req->nquestions; i++) {
+        async_question_unlink(&req->questions[i]);
+        free(req->questions[i].ans);
+        req->questions[i].ans = NULL;
+    }
+    async_helper_push(req);
+}
+
+static void async_request_start(struct async_request *req, int64_t now) {
+    req->generation = cfg->generation;
+    health_server_order(&req->order, route_for(req->node));
+    req->total_deadline = cfg->total_timeout_ms > 0 ? now + cfg->total_timeout_ms : INT64_MAX;
+    req->qlen = dns_build_query(req->query, sizeof(req->query), 0, req->node, ns_t_a, cfg->edns_udp_size);
+    req->qtype_off = req->qlen - 4 - (cfg->edns_udp_size ? DNS_OPT_RR_SIZE : 0);
+    
+    int types[MAX_DNS_QUESTIONS];
+    int n = native_query_types(req->hints.ai_family, req->hints.ai_flags, types);
+    req->nquestions = n;
+    req->unsettled = n;
+    for (int i = 0; i < n; i++) {
+        struct async_question *q = &req->questions[i];
+        q->req = req;
+        q->qtype = types[i];
+        q->status = -1;
+        q->last_error = TRY_AGAIN;
+        q->heap_index = -1;
+        q->ttl = UINT32_MAX;
+    }
+    log_trace("Async lookup of %s: %d questions", req->node, n);
+    
+    // The last question to settle may release req
+    for (int i = 0; i < n; i++) {
+        if (req->qlen < 0) {
+            async_question_settle(&req->questions[i], HOST_NOT_FOUND); // Not a valid DNS name
+        } else {
+            async_question_next(&req->questions[i], now);
         }
-        
-        // Then, if DNS64 is enabled, add synthetic IPv6 addresses
-        if (config.enable_dns64 && *res) {
-            // Create a copy of the current results to process for DNS64
-            struct addrinfo *ipv4_results = *res;
-            
-            // Add DNS64 synthetic addresses
-            int added = add_dns64_addresses(res, ipv4_results);
-            
-            if (added > 0 && config.debug) {
-                fprintf(stderr, "[DNS Override] Added %d DNS64 synthetic addresses for %s\n", added, node);
+    }
+}
+
+static int async_same_peer(const struct async_question *q, const struct sockaddr_storage *from) {
+    if (from->ss_family != q->peer.sa.sa_family) return 0;
+    if (from->ss_family == AF_INET) {
+        const struct sockaddr_in *sin = (const struct sockaddr_in *)from;
+        return sin->sin_port == q->peer.sin.sin_port && sin->sin_addr.s_addr == q->peer.sin.sin_addr.s_addr;
+    }
+    const struct sockaddr_in6 *sin6 = (const struct sockaddr_in6 *)from;
+    return sin6->sin6_port == q->peer.sin6.sin6_port &&
+           memcmp(&sin6->sin6_addr, &q->peer.sin6.sin6_addr, sizeof(sin6->sin6_addr)) == 0;
+}
+
+static void async_question_reply(struct async_question *q, const unsigned char *msg, int len, int64_t now) {
+    struct async_request *req = q->req;
+    int server = q->server;
+    int same_config = req->generation == cfg->generation;
+    async_question_unlink(q);
+    
+    if (msg[2] & 0x02) {
+        log_info("Truncated UDP answer for %s, handing the lookup to TCP", req->node);
+        async_request_handoff(req);
+        return;
+    }
+    if (req->qtype_off + 4 < req->qlen && dns_edns_rejected(msg, len)) {
+        // The blocking client retries without EDNS
+        log_info("%s:%d rejected EDNS for %s", cfg->dns_servers[server], cfg->dns_ports[server], req->node);
+        async_request_handoff(req);
+        return;
+    }
+    
+    struct dns_answer ans;
+    ans.count = 0;
+    ans.ttl = UINT32_MAX;
+    ans.canonname[0] = '\0';
+    int status = dns_parse_response(msg, len, q->id, req->node, q->qtype, &ans);
+    log_trace("Using DNS server %s:%d for %s (type %d): status %d",
+              cfg->dns_servers[server], cfg->dns_ports[server], req->node, q->qtype, status);
+    if (status == 0 || status == HOST_NOT_FOUND || status == NO_DATA) {
+        if (same_config) {
+            int64_t rtt_us = monotonic_us() - q->started_us;
+            health_record_success(server, rtt_us);
+            stat_server_rtt(server, rtt_us);
+        }
+        q->ttl = ans.ttl;
+        if (status == 0) {
+            q->ans = malloc(sizeof(ans));
+            if (q->ans) {
+                memcpy(q->ans, &ans, sizeof(ans));
+            } else {
+                status = NO_RECOVERY;
             }
         }
+        async_question_settle(q, status);
+        return;
+    }
+    
+    if (same_config) {
+        health_record_failure(server, 0); // SERVFAIL, REFUSED or malformed
+        stat_server(server, SERVER_ERRORS);
+    }
+    q->last_error = status;
+    async_question_next(q, now);
+}
+
+// Drain a socket, ASYNC_BATCH datagrams per recvmmsg()
+static void async_receive(int sock) {
+    static unsigned char bufs[ASYNC_BATCH][DNS_UDP_BUFSIZE];
+    static struct sockaddr_storage from[ASYNC_BATCH];
+    struct mmsghdr msgs[ASYNC_BATCH];
+    struct iovec iov[ASYNC_BATCH];
+    for (;;) {
+        for (int i = 0; i < ASYNC_BATCH; i++) {
+            iov[i].iov_base = bufs[i];
+            iov[i].iov_len = sizeof(bufs[i]);
+            memset(&msgs[i], 0, sizeof(msgs[i]));
+            msgs[i].msg_hdr.msg_name = &from[i];
+            msgs[i].msg_hdr.msg_namelen = sizeof(from[i]);
+            msgs[i].msg_hdr.msg_iov = &iov[i];
+            msgs[i].msg_hdr.msg_iovlen = 1;
+        }
+        int n = recvmmsg(async_socks[sock], msgs, ASYNC_BATCH, MSG_DONTWAIT, NULL);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return; // EAGAIN, or an ICMP error for an attempt that then times out
+        }
         
-        // Finally, filter out A records if requested (after DNS64 synthesis)
-        if (config.filter_a && *res) {
-            int filtered = filter_a_records(res);
-            if (filtered < 0) {
-                // Error in filtering, clean up and restore original state
-                for (int i = 0; i < _res._u._ext.nscount6; i++) {
-                    if (_res._u._ext.nsaddrs[i]) {
-                        free(_res._u._ext.nsaddrs[i]);
-                        _res._u._ext.nsaddrs[i] = NULL;
-                    }
-                }
-                memcpy(&_res, &original_state, sizeof(_res));
-                return EAI_MEMORY;
+        int64_t now = monotonic_ms();
+        for (int i = 0; i < n; i++) {
+            if (msgs[i].msg_len < DNS_HEADER_SIZE) continue;
+            // Stray or late datagrams match no question in flight
+            struct async_question *q = *async_hash_find(sock, dns_get16(bufs[i]));
+            if (!q || !async_same_peer(q, &from[i])) continue;
+            async_question_reply(q, bufs[i], (int)msgs[i].msg_len, now);
+        }
+        if (n < ASYNC_BATCH) return;
+    }
+}
+
+// Send the queries queued during this wakeup
+static void async_flush() {
+    for (int sock = 0; async_outbox_pending && sock < 2 * ASYNC_SOCKETS; sock++) {
+        if (async_outbox_pending & (1 << sock)) async_flush_socket(sock);
+    }
+}
+
+// Retry timed out attempts; returns the epoll timeout until the next deadline
+static int async_expire() {
+    int64_t now = monotonic_ms();
+    while (async_heap_len > 0 && async_heap[0]->deadline <= now) {
+        struct async_question *q = async_heap[0];
+        async_question_unlink(q);
+        if (q->refused) {
+            log_warn("Could not send query for %s to %s:%d",
+                     q->req->node, cfg->dns_servers[q->server], cfg->dns_ports[q->server]);
+        } else if (q->req->generation == cfg->generation) {
+            log_info("Timeout from %s:%d for %s",
+                     cfg->dns_servers[q->server], cfg->dns_ports[q->server], q->req->node);
+            health_record_failure(q->server, server_timeout_ms(q->server));
+            stat_server(q->server, SERVER_TIMEOUTS);
+        }
+        if (now >= q->req->total_deadline) {
+            log_warn("Lookup of %s exceeded total_timeout_ms (%d ms)", q->req->node, cfg->total_timeout_ms);
+        }
+        async_question_next(q, now);
+    }
+    if (async_heap_len == 0) return -1;
+    int64_t wait = async_heap[0]->deadline - now;
+    return wait > INT32_MAX ? INT32_MAX : (int)wait;
+}
+
+static void *async_engine_thread(void *arg) {
+    (void)arg;
+    struct epoll_event events[ASYNC_EVENTS];
+    int timeout = -1;
+    for (;;) {
+        int n = epoll_wait(async_epoll_fd, events, ASYNC_EVENTS, timeout);
+        config_acquire();
+        for (int i = 0; i < n; i++) {
+            if (events[i].data.u32 != ASYNC_WAKE_TOKEN) {
+                async_receive((int)events[i].data.u32);
+                continue;
             }
-            if (filtered > 0 && config.debug) {
-                fprintf(stderr, "[DNS Override] Removed %d IPv4 addresses from final results for %s\n", filtered, node);
+            async_drain_fd(async_wake_fd);
+            pthread_mutex_lock(&async_lock);
+            struct async_request *req = async_submit_head;
+            async_submit_head = async_submit_tail = NULL;
+            pthread_mutex_unlock(&async_lock);
+            int64_t now = monotonic_ms();
+            while (req) {
+                struct async_request *next = req->next;
+                async_request_start(req, now);
+                req = next;
             }
         }
+        timeout = async_expire();
+        async_flush();
+        // Refused datagrams are due now; ones the sockets had no room for
+        // go out on the next round
+        if (async_heap_len > 0 && async_heap[0]->refused) {
+            timeout = 0;
+        } else if (async_outbox_pending && (timeout < 0 || timeout > 1)) {
+            timeout = 1;
+        }
+        config_release();
+    }
+    return NULL;
+}
+
+// Queue a request for the engine, starting it on first use. Returns -1 if
+// the engine is not available.
+static int async_engine_push(struct async_request *req) {
+    pthread_mutex_lock(&async_lock);
+    if (!async_engine_running) {
+        async_epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+        async_wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        struct epoll_event ev;
+        ev.events = EPOLLIN;
+        ev.data.u32 = ASYNC_WAKE_TOKEN;
+        if (async_epoll_fd < 0 || async_wake_fd < 0 ||
+            epoll_ctl(async_epoll_fd, EPOLL_CTL_ADD, async_wake_fd, &ev) < 0 ||
+            async_start_thread(async_engine_thread) != 0) {
+            if (async_epoll_fd >= 0) close(async_epoll_fd);
+            if (async_wake_fd >= 0) close(async_wake_fd);
+            async_epoll_fd = async_wake_fd = -1;
+            pthread_mutex_unlock(&async_lock);
+            return -1;
+        }
+        async_engine_running = 1;
+    }
+    async_queue_push(&async_submit_head, &async_submit_tail, req);
+    pthread_mutex_unlock(&async_lock);
+    async_signal_fd(async_wake_fd);
+    return 0;
+}
+
+// Start a request: complete it from the host table or the caches, or pass
+// it to the engine or the helper threads
+static void async_submit(struct async_request *req) {
+    init_original_functions();
+    config_acquire();
+    stat_add(STAT_ASYNC, 1);
+    
+    log_lookup_begin(req->node);
+    if (req->node) {
+        log_trace("Asynchronous getaddrinfo called for: %s", req->node);
+    }
+    
+    const struct addrinfo *hints = req->has_hints ? &req->hints : NULL;
+    int family = req->hints.ai_family;
+    struct addrinfo *res = NULL;
+    int result;
+    if (!req->node || (req->hints.ai_flags & AI_NUMERICHOST) || is_local_or_numeric(req->node) ||
+        (family != AF_UNSPEC && family != AF_INET && family != AF_INET6)) {
+        // Nothing to wait for
+        result = lookup_addrinfo(req->node, req->service, hints, &res);
+        config_release();
+        async_complete(req, result, res);
+        return;
+    }
+    if (lookup_addrinfo_local(req->node, req->service, hints, &res, &result)) {
+        order_addrinfo_lookup(result, &res);
+        config_release();
+        async_complete(req, result, res);
+        return;
+    }
+    int engine = cfg->resolver == RESOLVER_NATIVE && !cfg->use_tcp && !cfg->encrypted_servers;
+    config_release();
+    
+    if (!engine || async_engine_push(req) != 0) {
+        async_helper_push(req);
+    }
+}
+
+// Neither thread survives fork(); the child starts over with empty queues.
+// Its getaddrinfo_a() requests that were still in flight never finish.
+static void async_atfork_prepare() { pthread_mutex_lock(&async_lock); }
+static void async_atfork_parent() { pthread_mutex_unlock(&async_lock); }
+static void async_atfork_child() {
+    // Sockets inherited from the parent must not be shared with it
+    if (thread_resolver) {
+        tcp_conns_free(thread_resolver->tcp);
+        if (thread_resolver->res_ready) res_nclose(&thread_resolver->res);
+        thread_resolver->res_ready = 0;
+    }
+    if (async_epoll_fd >= 0) close(async_epoll_fd);
+    if (async_wake_fd >= 0) close(async_wake_fd);
+    async_epoll_fd = async_wake_fd = -1;
+    for (int i = 0; i < 2 * ASYNC_SOCKETS; i++) {
+        if (async_socks[i] >= 0) close(async_socks[i]);
+        async_socks[i] = -1;
+        if (async_outboxes[i]) async_outboxes[i]->count = 0;
+    }
+    async_outbox_pending = 0;
+    memset(async_hash, 0, sizeof(async_hash));
+    async_heap_len = 0;
+    async_submit_head = async_submit_tail = NULL;
+    async_helper_head = async_helper_tail = NULL;
+    async_active = NULL;
+    async_engine_running = 0;
+    async_helpers = 0;
+    async_helpers_idle = 0;
+    pthread_mutex_init(&async_lock, NULL);
+    pthread_cond_init(&async_cond, NULL);
+    pthread_cond_init(&async_helper_cond, NULL);
+}
+
+// Override getaddrinfo_a with the engine. glibc's version runs every
+// request on a thread of its own.
+int getaddrinfo_a(int mode, struct gaicb *list[], int nitems, struct sigevent *sevp) {
+    if (mode != GAI_WAIT && mode != GAI_NOWAIT) {
+        errno = EINVAL;
+        return EAI_SYSTEM;
     }
     
-    // Clean up allocated IPv6 nameserver memory
-    for (int i = 0; i < _res._u._ext.nscount6; i++) {
-        if (_res._u._ext.nsaddrs[i]) {
-            free(_res._u._ext.nsaddrs[i]);
-            _res._u._ext.nsaddrs[i] = NULL;
+    struct async_group *group = NULL;
+    if (mode == GAI_NOWAIT && sevp && sevp->sigev_notify != SIGEV_NONE) {
+        group = calloc(1, sizeof(*group));
+        if (!group) return EAI_MEMORY;
+        group->pending = 1; // Released below, once every request is queued
+        group->sev = *sevp;
+    }
+    
+    int rc = 0;
+    for (int i = 0; i < nitems; i++) {
+        struct gaicb *gaicb = list[i];
+        if (!gaicb) continue;
+        gaicb->ar_result = NULL;
+        struct async_request *req = async_request_new(gaicb->ar_name, gaicb->ar_service, gaicb->ar_request);
+        if (!req) {
+            __atomic_store_n(&gaicb->__return, EAI_MEMORY, __ATOMIC_RELEASE);
+            rc = EAI_MEMORY;
+            continue;
         }
+        __atomic_store_n(&gaicb->__return, EAI_INPROGRESS, __ATOMIC_RELEASE);
+    
+        pthread_mutex_lock(&async_lock);
+        req->gaicb = gaicb;
+        req->group = group;
+        if (group) group->pending++;
+        req->active_next = async_active;
+        if (async_active) async_active->active_prev = req;
+        async_active = req;
+        pthread_mutex_unlock(&async_lock);
+    
+        async_submit(req);
     }
     
-    // Restore original resolver state
-    memcpy(&_res, &original_state, sizeof(_res));
+    if (group) {
+        pthread_mutex_lock(&async_lock);
+        group = async_group_done(group);
+        pthread_mutex_unlock(&async_lock);
+        if (group) async_notify(group);
+    }
     
-    // Debug: Print final list of addresses being returned
-    if (config.debug && node && result == 0 && *res) {
-        fprintf(stderr, "[DNS Override] ===== Final addresses returned for %s =====\n", node);
-        int addr_count = 0;
-        struct addrinfo *current = *res;
-        while (current) {
-            addr_count++;
-            char addr_str[INET6_ADDRSTRLEN];
-            const char *family_str;
-            int port = 0;
-            
-            if (current->ai_family == AF_INET) {
-                struct sockaddr_in *ipv4 = (struct sockaddr_in *)current->ai_addr;
-                inet_ntop(AF_INET, &ipv4->sin_addr, addr_str, sizeof(addr_str));
-                port = ntohs(ipv4->sin_port);
-                family_str = "IPv4";
-            } else if (current->ai_family == AF_INET6) {
-                struct sockaddr_in6 *ipv6 = (struct sockaddr_in6 *)current->ai_addr;
-                inet_ntop(AF_INET6, &ipv6->sin6_addr, addr_str, sizeof(addr_str));
-                port = ntohs(ipv6->sin6_port);
-                family_str = "IPv6";
-            } else {
-                snprintf(addr_str, sizeof(addr_str), "unknown family %d", current->ai_family);
-                family_str = "????";
+    if (mode == GAI_WAIT) {
+        pthread_mutex_lock(&async_lock);
+        for (int i = 0; i < nitems; i++) {
+            while (list[i] && __atomic_load_n(&list[i]->__return, __ATOMIC_ACQUIRE) == EAI_INPROGRESS) {
+                pthread_cond_wait(&async_cond, &async_lock);
             }
-            
-            fprintf(stderr, "[DNS Override]   %d. %s: %s", addr_count, family_str, addr_str);
-            if (port > 0) {
-                fprintf(stderr, ":%d", port);
-            }
-            fprintf(stderr, "\n");
-            
-            current = current->ai_next;
         }
-        fprintf(stderr, "[DNS Override] ===== Total: %d address(es) =====\n", addr_count);
+        pthread_mutex_unlock(&async_lock);
+    }
+    return rc;
+}
+
+int gai_error(struct gaicb *req) {
+    return __atomic_load_n(&req->__return, __ATOMIC_ACQUIRE);
+}
+
+int gai_suspend(const struct gaicb *const list[], int nitems, const struct timespec *timeout) {
+    struct timespec deadline;
+    if (timeout) {
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += timeout->tv_sec;
+        deadline.tv_nsec += timeout->tv_nsec;
+        if (deadline.tv_nsec >= 1000000000) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000;
+        }
+    }
+    
+    pthread_mutex_lock(&async_lock);
+    int rc;
+    for (;;) {
+        int listed = 0, done = 0;
+        for (int i = 0; i < nitems; i++) {
+            if (!list[i]) continue;
+            listed = 1;
+            if (__atomic_load_n(&list[i]->__return, __ATOMIC_ACQUIRE) != EAI_INPROGRESS) done = 1;
+        }
+        if (!listed) {
+            rc = EAI_ALLDONE;
+            break;
+        }
+        if (done) {
+            rc = 0;
+            break;
+        }
+        if (!timeout) {
+            pthread_cond_wait(&async_cond, &async_lock);
+        } else if (pthread_cond_timedwait(&async_cond, &async_lock, &deadline) == ETIMEDOUT) {
+            rc = EAI_AGAIN;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&async_lock);
+    return rc;
+}
+
+// A cancelled request keeps running; its answer is dropped on arrival
+int gai_cancel(struct gaicb *gaicb) {
+    pthread_mutex_lock(&async_lock);
+    struct async_request *req = async_active;
+    while (req && req->gaicb != gaicb) req = req->active_next;
+    if (!req) {
+        pthread_mutex_unlock(&async_lock);
+        return EAI_ALLDONE;
+    }
+    
+    async_active_unlink(req);
+    req->gaicb = NULL;
+    __atomic_store_n(&gaicb->__return, EAI_CANCELED, __ATOMIC_RELEASE);
+    struct async_group *group = async_group_done(req->group);
+    pthread_cond_broadcast(&async_cond);
+    pthread_mutex_unlock(&async_lock);
+    
+    if (group) async_notify(group);
+    return EAI_CANCELED;
+}
+
+// Native API (dns_override.h)
+
+int dns_async_fd(void) {
+    pthread_mutex_lock(&async_lock);
+    if (async_done_fd < 0) {
+        async_done_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
     }
+    int fd = async_done_fd;
+    pthread_mutex_unlock(&async_lock);
+    return fd;
+}
+
+int dns_async_submit(const char *node, const char *service, const struct addrinfo *hints, void *user) {
+    if (dns_async_fd() < 0) return EAI_SYSTEM;
+    struct async_request *req = async_request_new(node, service, hints);
+    if (!req) return EAI_MEMORY;
+    req->native = 1;
+    req->user = user;
+    async_submit(req);
+    return 0;
+}
+
+int dns_async_poll(int timeout_ms) {
+    struct pollfd pfd;
+    pfd.fd = dns_async_fd();
+    pfd.events = POLLIN;
+    if (pfd.fd < 0) return -1;
+    int rc = poll(&pfd, 1, timeout_ms);
+    return rc < 0 ? -1 : rc > 0;
+}
+
+int dns_async_collect(struct dns_async_result *results, int max) {
+    int n = 0;
+    pthread_mutex_lock(&async_lock);
+    while (n < max && async_done_head) {
+        struct async_request *req = async_queue_pop(&async_done_head, &async_done_tail);
+        results[n].user = req->user;
+        results[n].status = req->result;
+        results[n].res = req->res;
+        n++;
+        free(req);
+    }
+    // The descriptor stays readable while results are left
+    if (!async_done_head && async_done_fd >= 0) async_drain_fd(async_done_fd);
+    pthread_mutex_unlock(&async_lock);
+    return n;
+}
+
+void dns_report_connect(const struct sockaddr *addr, socklen_t addrlen, int rtt_us) {
+    if (!addr) return;
+    struct addrinfo ai = { .ai_family = addr->sa_family, .ai_addr = (struct sockaddr *)addr };
+    if (!((addr->sa_family == AF_INET && addrlen >= sizeof(struct sockaddr_in)) ||
+          (addr->sa_family == AF_INET6 && addrlen >= sizeof(struct sockaddr_in6)))) {
+        return;
+    }
+    unsigned char key[16];
+    order_addr16(&ai, key);
+    addr_rtt_report(key, rtt_us);
+}
+
+// ---------------------------------------------------------------------------
+// Interposed functions
+//
+// The blocking libc entry points. Each pins a config snapshot for the whole
+// call and counts itself in the statistics.
+// ---------------------------------------------------------------------------
+
+// Override gethostbyname to use custom DNS servers
+struct hostent *gethostbyname(const char *name) {
+    return lookup_thread_hostent("gethostbyname", name, AF_INET);
+}
+
+struct hostent *gethostbyname2(const char *name, int af) {
+    return lookup_thread_hostent("gethostbyname2", name, af);
+}
+
+// Re-entrant variants: threaded programs often use these, so they must take
+// the same cached path
+int gethostbyname_r(const char *name, struct hostent *ret, char *buf, size_t buflen,
+                    struct hostent **result, int *h_errnop) {
+    return lookup_hostent("gethostbyname_r", name, AF_INET, ret, buf, buflen, result, h_errnop);
+}
+
+int gethostbyname2_r(const char *name, int af, struct hostent *ret, char *buf, size_t buflen,
+                     struct hostent **result, int *h_errnop) {
+    return lookup_hostent("gethostbyname2_r", name, af, ret, buf, buflen, result, h_errnop);
+}
+
+// Override getaddrinfo to use custom DNS servers
+int getaddrinfo(const char *node, const char *service,
+                const struct addrinfo *hints, struct addrinfo **res) {
+    init_original_functions();
+    config_acquire();
+    stat_add(STAT_GETADDRINFO, 1);
     
-    if (config.debug && node) {
+    log_lookup_begin(node);
+    if (node) {
+        log_trace("getaddrinfo called for: %s", node);
+    }
+    
+    int result = lookup_addrinfo(node, service, hints, res);
+    
+    // The writer thread turns the addresses into text
+    if (node && log_enabled(LOG_LEVEL_TRACE)) {
         if (result == 0) {
-            fprintf(stderr, "[DNS Override] getaddrinfo succeeded for %s\n", node);
+            log_trace("===== Final addresses returned for %s =====", node);
+            int addr_count = 0;
+            for (struct addrinfo *current = *res; current; current = current->ai_next) {
+                addr_count++;
+                log_trace_addr(current->ai_addr, "  %d. %s: ", addr_count,
+                               current->ai_family == AF_INET ? "IPv4" : current->ai_family == AF_INET6 ? "IPv6" : "????");
+            }
+            log_trace("===== Total: %d address(es) =====", addr_count);
+            log_trace("getaddrinfo succeeded for %s", node);
         } else {
-            fprintf(stderr, "[DNS Override] getaddrinfo failed for %s: %s\n", node, gai_strerror(result));
+            log_trace("getaddrinfo failed for %s: %s", node, gai_strerror(result));
         }
     }
     
+    config_release();
     return result;
 }
 
-// Constructor to initialize when library is loaded
+// Raw queries go to the name's route instead of /etc/resolv.conf. They are
+// not cached: callers of res_query() parse the records themselves.
+int res_query(const char *dname, int class, int type, unsigned char *answer, int anslen) {
+    init_original_functions();
+    config_acquire();
+    stat_add(STAT_RES_QUERY, 1);
+    
+    log_lookup_begin(dname);
+    log_trace("res_query called for: %s (type %d)", dname, type);
+    int len = route_res_query(dname, class, type, answer, anslen, 0);
+    
+    config_release();
+    return len;
+}
+
+int res_search(const char *dname, int class, int type, unsigned char *answer, int anslen) {
+    init_original_functions();
+    config_acquire();
+    stat_add(STAT_RES_QUERY, 1);
+    
+    log_lookup_begin(dname);
+    log_trace("res_search called for: %s (type %d)", dname, type);
+    int len = route_res_query(dname, class, type, answer, anslen, 1);
+    
+    config_release();
+    return len;
+}
+
+// Older binaries link against the __-prefixed names
+int __res_query(const char *dname, int class, int type, unsigned char *answer, int anslen) {
+    return res_query(dname, class, type, answer, anslen);
+}
+
+int __res_search(const char *dname, int class, int type, unsigned char *answer, int anslen) {
+    return res_search(dname, class, type, answer, anslen);
+}
+
+// Override getnameinfo to ask the custom DNS servers for PTR records
+int getnameinfo(const struct sockaddr *sa, socklen_t salen, char *host, socklen_t hostlen,
+                char *serv, socklen_t servlen, int flags) {
+    init_original_functions();
+    config_acquire();
+    stat_add(STAT_GETNAMEINFO, 1);
+    
+    int result = lookup_nameinfo(sa, salen, host, hostlen, serv, servlen, flags);
+    
+    config_release();
+    return result;
+}
+
+// Override freeaddrinfo: results may contain DNS64 nodes allocated by this
+// library, which glibc's freeaddrinfo() cannot release
+void freeaddrinfo(struct addrinfo *res) {
+    while (res) {
+        struct addrinfo *next = res->ai_next;
+        release_addrinfo_node(res);
+        res = next;
+    }
+}
+
+// Constructor to initialize when library is loaded. It runs in every
+// preloaded process, most of which never resolve a name, so it only
+// registers the fork handlers; the config is read by the first call that
+// needs it (see config_acquire()).
 __attribute__((constructor))
 static void dns_override_init() {
-    const char* config_file = get_config_file_path();
-    fprintf(stderr, "[DNS Override] Upstream DNS resolver override loaded. Config: %s\n", config_file);
-    if (getenv(CONFIG_ENV_VAR)) {
-        fprintf(stderr, "[DNS Override] Using custom config path from %s environment variable\n", CONFIG_ENV_VAR);
-    }
-    load_dns_config();
+    pthread_atfork(cache_atfork_prepare, cache_atfork_parent, cache_atfork_child);
+    pthread_atfork(config_atfork_prepare, config_atfork_release, config_atfork_release);
+    pthread_atfork(flight_atfork_prepare, flight_atfork_parent, flight_atfork_child);
+    pthread_atfork(prefetch_atfork_prepare, prefetch_atfork_parent, prefetch_atfork_child);
+    pthread_atfork(async_atfork_prepare, async_atfork_parent, async_atfork_child);
+    pthread_atfork(log_atfork_prepare, log_atfork_parent, log_atfork_child);
+    pthread_atfork(NULL, NULL, cache_snapshot_atfork_child);
 }
 
 // Destructor to cleanup when library is unloaded
 __attribute__((destructor))
 static void dns_override_cleanup() {
+    // Nothing was set up in a process that never used the library
+    if (!atomic_load(&active_config)) return;
+    
+    // Keep this run's answers for the next one, after any periodic write
+    // still in progress
+    config_acquire();
+    while (atomic_flag_test_and_set(&cache_snapshot_busy)) {
+        sched_yield();
+    }
+    atomic_flag_clear(&cache_snapshot_busy);
+    cache_snapshot_save();
+    config_release();
+    
+    // Print whatever the writer thread has not got to yet
+    if (atomic_load(&log_state) == LOG_STATE_RUNNING) {
+        log_drain();
+    }
     fprintf(stderr, "[DNS Override] Upstream DNS resolver override unloaded.\n");
 }
\ No newline at end of file
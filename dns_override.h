@@ -0,0 +1,55 @@
+// dns_override.h - Native API of dns_override.so
+//
+// Programs that link against dns_override.so (or find these symbols with
+// dlsym() when it is preloaded) can resolve names without blocking a
+// thread. Submit lookups, wait in the event loop for the descriptor from
+// dns_async_fd() to become readable, then collect the finished lookups. A
+// result is exactly what getaddrinfo() would have returned for the same
+// arguments, from the same caches and servers.
+//
+// With "result_order rtt", dns_report_connect() tells the library how long
+// connecting to an address took, and later results put the fastest
+// addresses first.
+
+#ifndef DNS_OVERRIDE_H
+#define DNS_OVERRIDE_H
+
+#include <netdb.h>
+#include <sys/socket.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct dns_async_result {
+    void *user;           // Cookie given to dns_async_submit()
+    int status;           // getaddrinfo() return value
+    struct addrinfo *res; // Addresses on success; release with freeaddrinfo()
+};
+
+// Start resolving node/service. The arguments are copied. Returns 0, or
+// EAI_MEMORY/EAI_SYSTEM if the lookup could not be started.
+int dns_async_submit(const char *node, const char *service,
+                     const struct addrinfo *hints, void *user);
+
+// Descriptor that is readable while finished lookups wait to be collected.
+// It belongs to the library and must not be closed. Returns -1 on failure.
+int dns_async_fd(void);
+
+// Wait up to timeout_ms (-1 waits forever) for finished lookups. Returns 1
+// when some are waiting, 0 on timeout and -1 on error.
+int dns_async_poll(int timeout_ms);
+
+// Move up to max finished lookups into results, oldest first. Never
+// blocks; returns how many were stored.
+int dns_async_collect(struct dns_async_result *results, int max);
+
+// Report that connecting to addr took rtt_us microseconds, or failed when
+// rtt_us is negative. Only the address is used, not the port.
+void dns_report_connect(const struct sockaddr *addr, socklen_t addrlen, int rtt_us);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
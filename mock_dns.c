@@ -0,0 +1,564 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <time.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdatomic.h>
+#include <stdint.h>
+
+// Mock DNS server for local load and correctness tests
+//
+// Answers every A and AAAA question on UDP and TCP with synthetic records,
+// so dns_override.so can be measured without any real resolver. The
+// addresses of a name are derived from a hash of the name, which lets a
+// client check every answer it gets (see dns_load --check):
+//
+//   A    i: 10.<h >> 16 & 255>.<h >> 8 & 255>.<i + 1>     (i < -4 count)
+//   AAAA i: 2001:db8:<h >> 16>:<h & 0xffff>::<i + 1>    (i < -6 count)
+//
+// where h is the 32-bit FNV-1a hash of the lowercased name without the
+// trailing dot. Names whose first label starts with "nx" get NXDOMAIN;
+// other question types get an empty NOERROR answer.
+//
+// Latency, jitter, loss and truncation apply to UDP. A UDP answer larger
+// than the client's EDNS0 payload size (512 without EDNS) is truncated as a
+// real server would, and -t truncates a share of the others, so both push
+// clients to TCP. TCP answers are never dropped or truncated but share the
+// latency.
+
+#define MAX_WORKERS 64
+#define MAX_PENDING 65536  // Delayed UDP replies per worker; more are dropped
+#define MAX_RECORDS 255    // Per type and answer
+#define MOCK_EDNS_SIZE 4096 // Payload size advertised in replies
+
+struct mock_options {
+    const char *bind_addr;
+    int port;
+    int latency_ms;  // Added to every answer
+    int jitter_ms;   // Plus uniformly 0..jitter_ms
+    int loss_pct;    // UDP queries dropped without an answer
+    int truncate_pct; // UDP answers sent with TC set and no records
+    int a_count;
+    int aaaa_count;
+    int ttl;
+    int workers;     // UDP sockets (SO_REUSEPORT), one thread each
+    int background;  // Fork after binding and print the server's pid
+};
+
+// A UDP reply waiting for its send time
+struct delayed {
+    double due_ms;
+    struct sockaddr_storage peer;
+    socklen_t peer_len;
+    int len;
+    unsigned char data[];
+};
+
+struct worker {
+    pthread_t thread;
+    int fd;
+    unsigned seed;
+    struct delayed **heap; // Min-heap on due_ms
+    int pending;
+};
+
+static struct mock_options opts;
+static struct worker workers[MAX_WORKERS];
+
+static _Atomic long stat_queries = 0;
+static _Atomic long stat_tcp = 0;
+static _Atomic long stat_dropped = 0;
+static _Atomic long stat_truncated = 0;
+static _Atomic long stat_nxdomain = 0;
+
+static double now_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+static unsigned next_random(unsigned *seed) {
+    unsigned x = *seed;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    return *seed = x;
+}
+
+static int percent_hit(unsigned *seed, int pct) {
+    return pct > 0 && (int)(next_random(seed) % 100) < pct;
+}
+
+static double answer_delay_ms(unsigned *seed) {
+    double delay = opts.latency_ms;
+    if (opts.jitter_ms > 0) delay += next_random(seed) % (opts.jitter_ms * 1000 + 1) / 1000.0;
+    return delay;
+}
+
+static uint32_t name_hash(const char *name) {
+    uint32_t h = 2166136261u;
+    for (const char *p = name; *p; p++) {
+        h = (h ^ (unsigned char)*p) * 16777619u;
+    }
+    return h;
+}
+
+static void put16(unsigned char *p, unsigned v) {
+    p[0] = v >> 8;
+    p[1] = v & 0xff;
+}
+
+// Build the reply to a query of len bytes into out (at least 65535 bytes).
+// A UDP reply (udp set) must fit the client's payload size; truncate forces
+// TC. Returns the reply length, or 0 to ignore the query.
+static int build_reply(const unsigned char *q, int len, unsigned char *out, int udp, int truncate) {
+    if (len < 12 || (q[2] & 0x80)) return 0;                 // Not a query
+    if (q[4] != 0 || q[5] != 1) return 0;                    // Exactly one question
+
+    // Question name, lowercased and without the trailing dot
+    char name[256];
+    int pos = 12, name_len = 0;
+    while (pos < len && q[pos] != 0) {
+        int label = q[pos];
+        if (label > 63 || pos + 1 + label >= len || name_len + label + 1 >= (int)sizeof(name)) return 0;
+        if (name_len) name[name_len++] = '.';
+        for (int i = 0; i < label; i++) {
+            char c = q[pos + 1 + i];
+            name[name_len++] = (c >= 'A' && c <= 'Z') ? c + 32 : c;
+        }
+        pos += 1 + label;
+    }
+    name[name_len] = '\0';
+    if (pos + 5 > len) return 0;
+    int question_end = pos + 5;
+    int qtype = q[pos + 1] << 8 | q[pos + 2];
+
+    // EDNS0 OPT in the additional section raises the UDP limit
+    int edns = 0, limit = 512;
+    int arcount = q[10] << 8 | q[11];
+    if (arcount > 0 && question_end + 11 <= len && q[question_end] == 0 &&
+        q[question_end + 1] == 0 && q[question_end + 2] == 41) {
+        edns = 1;
+        limit = q[question_end + 3] << 8 | q[question_end + 4];
+        if (limit < 512) limit = 512;
+    }
+
+    int nxdomain = strncmp(name, "nx", 2) == 0;
+    int count = 0, rdlen = 0;
+    if (!nxdomain && qtype == 1) {
+        count = opts.a_count;
+        rdlen = 4;
+    } else if (!nxdomain && qtype == 28) {
+        count = opts.aaaa_count;
+        rdlen = 16;
+    }
+    if (nxdomain) atomic_fetch_add(&stat_nxdomain, 1);
+    int size = question_end + count * (12 + rdlen) + (edns ? 11 : 0);
+    if (udp && (truncate || size > limit)) {
+        atomic_fetch_add(&stat_truncated, 1);
+        count = 0;
+        truncate = 1;
+    } else {
+        truncate = 0;
+    }
+
+    memcpy(out, q, question_end);
+    out[2] = 0x80 | (q[2] & 0x79) | (truncate ? 0x02 : 0); // QR, opcode, RD, TC
+    out[3] = 0x80 | (nxdomain ? 3 : 0);                     // RA, rcode
+    put16(out + 6, count);
+    put16(out + 8, 0);
+    put16(out + 10, edns);
+    pos = question_end;
+
+    uint32_t h = name_hash(name);
+    for (int i = 0; i < count; i++) {
+        unsigned char *rr = out + pos;
+        put16(rr, 0xc00c);                                  // Pointer to the question name
+        put16(rr + 2, qtype);
+        put16(rr + 4, 1);
+        rr[6] = opts.ttl >> 24;
+        rr[7] = opts.ttl >> 16;
+        rr[8] = opts.ttl >> 8;
+        rr[9] = opts.ttl;
+        put16(rr + 10, rdlen);
+        unsigned char *rd = rr + 12;
+        if (rdlen == 4) {
+            rd[0] = 10;
+            rd[1] = h >> 16;
+            rd[2] = h >> 8;
+            rd[3] = i + 1;
+        } else {
+            memset(rd, 0, 16);
+            rd[0] = 0x20;
+            rd[1] = 0x01;
+            rd[2] = 0x0d;
+            rd[3] = 0xb8;
+            put16(rd + 4, h >> 16);
+            put16(rd + 6, h & 0xffff);
+            put16(rd + 14, i + 1);
+        }
+        pos += 12 + rdlen;
+    }
+    if (edns) {
+        unsigned char *opt = out + pos;
+        memset(opt, 0, 11);
+        put16(opt + 1, 41);
+        put16(opt + 3, MOCK_EDNS_SIZE);
+        pos += 11;
+    }
+    return pos;
+}
+
+// UDP worker: delayed replies wait in a heap until their send time
+
+static void heap_push(struct worker *w, struct delayed *d) {
+    int i = w->pending++;
+    while (i > 0 && w->heap[(i - 1) / 2]->due_ms > d->due_ms) {
+        w->heap[i] = w->heap[(i - 1) / 2];
+        i = (i - 1) / 2;
+    }
+    w->heap[i] = d;
+}
+
+static struct delayed *heap_pop(struct worker *w) {
+    struct delayed *top = w->heap[0];
+    struct delayed *last = w->heap[--w->pending];
+    int i = 0;
+    for (;;) {
+        int child = 2 * i + 1;
+        if (child >= w->pending) break;
+        if (child + 1 < w->pending && w->heap[child + 1]->due_ms < w->heap[child]->due_ms) child++;
+        if (w->heap[child]->due_ms >= last->due_ms) break;
+        w->heap[i] = w->heap[child];
+        i = child;
+    }
+    if (w->pending > 0) w->heap[i] = last;
+    return top;
+}
+
+static void udp_handle(struct worker *w, const unsigned char *query, int len,
+                       const struct sockaddr_storage *peer, socklen_t peer_len) {
+    static __thread unsigned char reply[65536];
+    atomic_fetch_add(&stat_queries, 1);
+    if (percent_hit(&w->seed, opts.loss_pct)) {
+        atomic_fetch_add(&stat_dropped, 1);
+        return;
+    }
+    int reply_len = build_reply(query, len, reply, 1, percent_hit(&w->seed, opts.truncate_pct));
+    if (reply_len == 0) return;
+
+    double delay = answer_delay_ms(&w->seed);
+    if (delay <= 0) {
+        sendto(w->fd, reply, reply_len, 0, (const struct sockaddr *)peer, peer_len);
+        return;
+    }
+    struct delayed *d = w->pending < MAX_PENDING ? malloc(sizeof(*d) + reply_len) : NULL;
+    if (!d) {
+        atomic_fetch_add(&stat_dropped, 1);
+        return;
+    }
+    d->due_ms = now_ms() + delay;
+    d->peer = *peer;
+    d->peer_len = peer_len;
+    d->len = reply_len;
+    memcpy(d->data, reply, reply_len);
+    heap_push(w, d);
+}
+
+static void *udp_worker(void *arg) {
+    struct worker *w = arg;
+    unsigned char query[4096];
+    w->heap = malloc(sizeof(*w->heap) * MAX_PENDING);
+    if (!w->heap) return NULL;
+
+    for (;;) {
+        int timeout = -1;
+        if (w->pending > 0) {
+            double wait = w->heap[0]->due_ms - now_ms();
+            timeout = wait <= 0 ? 0 : (int)wait + 1;
+        }
+        struct pollfd pfd = { .fd = w->fd, .events = POLLIN };
+        poll(&pfd, 1, timeout);
+
+        for (int i = 0; i < 64 && (pfd.revents & POLLIN); i++) {
+            struct sockaddr_storage peer;
+            socklen_t peer_len = sizeof(peer);
+            ssize_t n = recvfrom(w->fd, query, sizeof(query), MSG_DONTWAIT,
+                                 (struct sockaddr *)&peer, &peer_len);
+            if (n < 0) break;
+            udp_handle(w, query, (int)n, &peer, peer_len);
+        }
+
+        double now = now_ms();
+        while (w->pending > 0 && w->heap[0]->due_ms <= now) {
+            struct delayed *d = heap_pop(w);
+            sendto(w->fd, d->data, d->len, 0, (struct sockaddr *)&d->peer, d->peer_len);
+            free(d);
+        }
+    }
+    return NULL;
+}
+
+// TCP: one thread per connection, answering length-prefixed queries in order
+
+static int read_full(int fd, unsigned char *buf, int len) {
+    int done = 0;
+    while (done < len) {
+        ssize_t n = read(fd, buf + done, len - done);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+        done += n;
+    }
+    return 0;
+}
+
+static void *tcp_connection(void *arg) {
+    int fd = (int)(intptr_t)arg;
+    unsigned seed = (unsigned)fd * 2654435761u | 1;
+    unsigned char query[65535];
+    unsigned char *reply = malloc(65537);
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    unsigned char prefix[2];
+    while (reply && read_full(fd, prefix, 2) == 0) {
+        int len = prefix[0] << 8 | prefix[1];
+        if (read_full(fd, query, len) < 0) break;
+        atomic_fetch_add(&stat_queries, 1);
+        atomic_fetch_add(&stat_tcp, 1);
+        int reply_len = build_reply(query, len, reply + 2, 0, 0);
+        if (reply_len == 0) continue;
+
+        double delay = answer_delay_ms(&seed);
+        if (delay > 0) {
+            struct timespec ts = { (time_t)(delay / 1e3), (long)((delay - (time_t)(delay / 1e3) * 1e3) * 1e6) };
+            nanosleep(&ts, NULL);
+        }
+        put16(reply, reply_len);
+        if (write(fd, reply, reply_len + 2) != reply_len + 2) break;
+    }
+    free(reply);
+    close(fd);
+    return NULL;
+}
+
+static void *tcp_acceptor(void *arg) {
+    int listener = (int)(intptr_t)arg;
+    for (;;) {
+        int fd = accept4(listener, NULL, NULL, SOCK_CLOEXEC);
+        if (fd < 0) {
+            if (errno == EMFILE || errno == ENFILE) usleep(10000);
+            continue;
+        }
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, tcp_connection, (void *)(intptr_t)fd) != 0) {
+            close(fd);
+            continue;
+        }
+        pthread_detach(thread);
+    }
+    return NULL;
+}
+
+static int bind_socket(int type, const struct sockaddr_storage *addr, socklen_t addr_len) {
+    int fd = socket(addr->ss_family, type | SOCK_CLOEXEC, 0);
+    if (fd < 0) return -1;
+    int one = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    if (type == SOCK_DGRAM) {
+        setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one));
+        int buf = 4 << 20;
+        setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &buf, sizeof(buf));
+    }
+    if (bind(fd, (const struct sockaddr *)addr, addr_len) < 0 ||
+        (type == SOCK_STREAM && listen(fd, 1024) < 0)) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static void print_stats(int sig) {
+    (void)sig;
+    char line[256];
+    int len = snprintf(line, sizeof(line),
+                       "mock_dns: %ld queries (%ld over TCP), %ld dropped, %ld truncated, %ld NXDOMAIN\n",
+                       atomic_load(&stat_queries), atomic_load(&stat_tcp), atomic_load(&stat_dropped),
+                       atomic_load(&stat_truncated), atomic_load(&stat_nxdomain));
+    if (write(STDERR_FILENO, line, len) < 0) _exit(1);
+    _exit(0);
+}
+
+static void usage(const char *prog) {
+    printf("Usage: %s [options]\n", prog);
+    printf("\n");
+    printf("Options:\n");
+    printf("  -b, --bind ADDR        Address to listen on (default: 127.0.0.1)\n");
+    printf("  -p, --port PORT        UDP and TCP port (default: 5300)\n");
+    printf("  -l, --latency MS       Delay before every answer (default: 0)\n");
+    printf("  -J, --jitter MS        Extra delay, uniform from 0 to MS (default: 0)\n");
+    printf("  -L, --loss PCT         Drop PCT%% of UDP queries (default: 0)\n");
+    printf("  -t, --truncate PCT     Answer PCT%% of UDP queries with TC set (default: 0)\n");
+    printf("  -4, --a N              A records per name (default: 2)\n");
+    printf("  -6, --aaaa N           AAAA records per name (default: 1)\n");
+    printf("  -T, --ttl SECONDS      TTL of the records (default: 300)\n");
+    printf("  -w, --workers N        UDP worker threads (default: 1)\n");
+    printf("  -B, --background       Detach once listening and print the server's pid\n");
+    printf("  -h, --help             Show this help\n");
+    printf("\n");
+    printf("Names under any zone resolve; a first label starting with \"nx\" gives NXDOMAIN.\n");
+    printf("SIGINT or SIGTERM prints query counts to stderr and exits.\n");
+}
+
+int main(int argc, char *argv[]) {
+    opts.bind_addr = "127.0.0.1";
+    opts.port = 5300;
+    opts.a_count = 2;
+    opts.aaaa_count = 1;
+    opts.ttl = 300;
+    opts.workers = 1;
+
+    for (int i = 1; i < argc; i++) {
+        const char *arg = argv[i];
+        const char *next = (i + 1 < argc) ? argv[i + 1] : NULL;
+
+        if ((!strcmp(arg, "-b") || !strcmp(arg, "--bind")) && next) {
+            opts.bind_addr = next;
+            i++;
+        } else if ((!strcmp(arg, "-p") || !strcmp(arg, "--port")) && next) {
+            opts.port = atoi(next);
+            i++;
+        } else if ((!strcmp(arg, "-l") || !strcmp(arg, "--latency")) && next) {
+            opts.latency_ms = atoi(next);
+            i++;
+        } else if ((!strcmp(arg, "-J") || !strcmp(arg, "--jitter")) && next) {
+            opts.jitter_ms = atoi(next);
+            i++;
+        } else if ((!strcmp(arg, "-L") || !strcmp(arg, "--loss")) && next) {
+            opts.loss_pct = atoi(next);
+            i++;
+        } else if ((!strcmp(arg, "-t") || !strcmp(arg, "--truncate")) && next) {
+            opts.truncate_pct = atoi(next);
+            i++;
+        } else if ((!strcmp(arg, "-4") || !strcmp(arg, "--a")) && next) {
+            opts.a_count = atoi(next);
+            i++;
+        } else if ((!strcmp(arg, "-6") || !strcmp(arg, "--aaaa")) && next) {
+            opts.aaaa_count = atoi(next);
+            i++;
+        } else if ((!strcmp(arg, "-T") || !strcmp(arg, "--ttl")) && next) {
+            opts.ttl = atoi(next);
+            i++;
+        } else if ((!strcmp(arg, "-w") || !strcmp(arg, "--workers")) && next) {
+            opts.workers = atoi(next);
+            i++;
+        } else if (!strcmp(arg, "-B") || !strcmp(arg, "--background")) {
+            opts.background = 1;
+        } else if (!strcmp(arg, "-h") || !strcmp(arg, "--help")) {
+            usage(argv[0]);
+            return 0;
+        } else {
+            fprintf(stderr, "Unknown option: %s\n", arg);
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (opts.a_count < 0 || opts.a_count > MAX_RECORDS || opts.aaaa_count < 0 ||
+        opts.aaaa_count > MAX_RECORDS) {
+        fprintf(stderr, "Record counts must be 0..%d\n", MAX_RECORDS);
+        return 1;
+    }
+    if (opts.workers < 1) opts.workers = 1;
+    if (opts.workers > MAX_WORKERS) opts.workers = MAX_WORKERS;
+    if (opts.latency_ms < 0) opts.latency_ms = 0;
+    if (opts.jitter_ms < 0) opts.jitter_ms = 0;
+
+    struct sockaddr_storage addr;
+    socklen_t addr_len;
+    memset(&addr, 0, sizeof(addr));
+    struct sockaddr_in *sin = (struct sockaddr_in *)&addr;
+    struct sockaddr_in6 *sin6 = (struct sockaddr_in6 *)&addr;
+    if (inet_pton(AF_INET, opts.bind_addr, &sin->sin_addr) == 1) {
+        sin->sin_family = AF_INET;
+        sin->sin_port = htons(opts.port);
+        addr_len = sizeof(*sin);
+    } else if (inet_pton(AF_INET6, opts.bind_addr, &sin6->sin6_addr) == 1) {
+        sin6->sin6_family = AF_INET6;
+        sin6->sin6_port = htons(opts.port);
+        addr_len = sizeof(*sin6);
+    } else {
+        fprintf(stderr, "Invalid bind address: %s\n", opts.bind_addr);
+        return 1;
+    }
+
+    // Bind everything before detaching, so the caller can query right away
+    int listener = bind_socket(SOCK_STREAM, &addr, addr_len);
+    for (int i = 0; i < opts.workers && listener >= 0; i++) {
+        workers[i].fd = bind_socket(SOCK_DGRAM, &addr, addr_len);
+        workers[i].seed = 2463534242u + i * 2654435761u;
+        if (workers[i].fd < 0) listener = -1;
+    }
+    if (listener < 0) {
+        fprintf(stderr, "Cannot listen on %s port %d: %s\n", opts.bind_addr, opts.port, strerror(errno));
+        return 1;
+    }
+
+    if (opts.background) {
+        fflush(stdout);
+        pid_t pid = fork();
+        if (pid < 0) {
+            fprintf(stderr, "fork failed: %s\n", strerror(errno));
+            return 1;
+        }
+        if (pid > 0) {
+            printf("%d\n", (int)pid);
+            return 0;
+        }
+        setsid();
+        int null = open("/dev/null", O_RDWR);
+        if (null >= 0) {
+            dup2(null, STDIN_FILENO);
+            dup2(null, STDOUT_FILENO);
+        }
+    }
+
+    // Worker threads never take the signals; the main thread reports and exits
+    sigset_t stop_signals, saved;
+    sigemptyset(&stop_signals);
+    sigaddset(&stop_signals, SIGINT);
+    sigaddset(&stop_signals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &stop_signals, &saved);
+    pthread_t acceptor;
+    if (pthread_create(&acceptor, NULL, tcp_acceptor, (void *)(intptr_t)listener) != 0) {
+        fprintf(stderr, "pthread_create failed: %s\n", strerror(errno));
+        return 1;
+    }
+    for (int i = 0; i < opts.workers; i++) {
+        if (pthread_create(&workers[i].thread, NULL, udp_worker, &workers[i]) != 0) {
+            fprintf(stderr, "pthread_create failed: %s\n", strerror(errno));
+            return 1;
+        }
+    }
+
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = print_stats;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    if (!opts.background) {
+        fprintf(stderr, "mock_dns: listening on %s port %d (UDP and TCP)\n", opts.bind_addr, opts.port);
+    }
+    pthread_sigmask(SIG_SETMASK, &saved, NULL);
+    for (;;) pause();
+}
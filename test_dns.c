@@ -8,6 +8,14 @@
 #include <unistd.h>
 #include <time.h>
 
+// Wall-clock milliseconds; clock() only counts CPU time and misses time
+// spent waiting on the network
+static double now_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1e6;
+}
+
 void print_system_dns_info() {
     printf("\n=== System DNS Information ===\n");
     
@@ -33,11 +41,11 @@ void print_system_dns_info() {
 void test_gethostbyname(const char *hostname) {
     printf("\n=== Testing gethostbyname for %s ===\n", hostname);
     
-    clock_t start = clock();
+    double start = now_ms();
     struct hostent *host_entry = gethostbyname(hostname);
-    clock_t end = clock();
+    double end = now_ms();
     
-    double time_taken = ((double)(end - start)) / CLOCKS_PER_SEC * 1000;
+    double time_taken = end - start;
     
     if (host_entry == NULL) {
         printf("gethostbyname failed for %s (%.2f ms)\n", hostname, time_taken);
@@ -90,11 +98,11 @@ void test_getaddrinfo(const char *hostname, const char *port) {
     hints.ai_family = AF_UNSPEC;    // Allow IPv4 or IPv6
     hints.ai_socktype = SOCK_STREAM; // TCP socket
     
-    clock_t start = clock();
+    double start = now_ms();
     int status = getaddrinfo(hostname, port, &hints, &result);
-    clock_t end = clock();
+    double end = now_ms();
     
-    double time_taken = ((double)(end - start)) / CLOCKS_PER_SEC * 1000;
+    double time_taken = end - start;
     
     if (status != 0) {
         printf("getaddrinfo failed (%.2f ms): %s\n", time_taken, gai_strerror(status));
@@ -134,41 +142,6 @@ void test_getaddrinfo(const char *hostname, const char *port) {
     freeaddrinfo(result);
 }
 
-void test_dns_performance(const char *hostname, int iterations) {
-    printf("\n=== DNS Performance Test for %s (%d iterations) ===\n", hostname, iterations);
-    
-    double total_time = 0;
-    int successful_queries = 0;
-    
-    for (int i = 0; i < iterations; i++) {
-        clock_t start = clock();
-        struct hostent *host_entry = gethostbyname(hostname);
-        clock_t end = clock();
-        
-        double time_taken = ((double)(end - start)) / CLOCKS_PER_SEC * 1000;
-        total_time += time_taken;
-        
-        if (host_entry != NULL) {
-            successful_queries++;
-        }
-        
-        if (i < 3) { // Show details for first 3 queries
-            printf("Query %d: %.2f ms (%s)\n", i + 1, time_taken, 
-                   host_entry ? "Success" : "Failed");
-        }
-        
-        // Small delay between queries
-        usleep(100000); // 100ms
-    }
-    
-    printf("Performance Summary:\n");
-    printf("  Total queries: %d\n", iterations);
-    printf("  Successful: %d (%.1f%%)\n", successful_queries, 
-           (successful_queries * 100.0) / iterations);
-    printf("  Average time: %.2f ms\n", total_time / iterations);
-    printf("  Total time: %.2f ms\n", total_time);
-}
-
 void test_multiple_domains() {
     printf("\n=== Testing Multiple Domains ===\n");
     
@@ -185,11 +158,11 @@ void test_multiple_domains() {
     for (int i = 0; test_domains[i] != NULL; i++) {
         printf("\n%d. Testing %s:\n", i + 1, test_domains[i]);
         
-        clock_t start = clock();
+        double start = now_ms();
         struct hostent *host_entry = gethostbyname(test_domains[i]);
-        clock_t end = clock();
+        double end = now_ms();
         
-        double time_taken = ((double)(end - start)) / CLOCKS_PER_SEC * 1000;
+        double time_taken = end - start;
         
         if (host_entry) {
             struct in_addr addr;
@@ -230,8 +203,8 @@ int main(int argc, char *argv[]) {
     
     // Performance test
     printf("\n" "=== Performance Test ===\n");
-    printf("This will help you compare DNS server performance\n");
-    test_dns_performance("google.com", 5);
+    printf("For latency percentiles and throughput run: make benchmark\n");
+    printf("  (or ./dns_bench --compare; see ./dns_bench --help)\n");
     
     // Test IPv6 if available
     printf("\n" "=== IPv6 Test ===\n");